@@ -14,7 +14,6 @@
 
 #include <esp_log.h>
 #include <esp_https_ota.h>
-#include <esp_cloud_storage.h>
 #include <esp_cloud_ota.h>
 #include <cloud_agent.h>
 
@@ -42,7 +41,7 @@ static esp_err_t cloud_agent_ota_perform(esp_cloud_ota_handle_t ota_handle, cons
     if (!url) {
         return ESP_FAIL;
     }
-    char *ota_server_cert = esp_cloud_storage_get("ota_server_cert");
+    const char *ota_server_cert = esp_cloud_ota_get_server_cert(esp_cloud_handle);
     if (!ota_server_cert) {
         esp_cloud_report_ota_status(ota_handle, OTA_STATUS_FAILED, "Server Certificate Absent");
         return ESP_FAIL;
@@ -55,7 +54,7 @@ static esp_err_t cloud_agent_ota_perform(esp_cloud_ota_handle_t ota_handle, cons
     };
 
     esp_err_t err = esp_https_ota(&config);
-    free(ota_server_cert);
+    esp_cloud_ota_release_server_cert(esp_cloud_handle);
 
     if (cloud_agent_cb) {
         (*cloud_agent_cb)(CLOUD_AGENT_OTA_END);
@@ -5,5 +5,5 @@ COMPONENT_PRIV_INCLUDEDIRS := src
 COMPONENT_SRCDIRS += utils/src
 COMPONENT_ADD_INCLUDEDIRS += utils/include
 
-COMPONENT_SRCDIRS += platforms/aws
+COMPONENT_SRCDIRS += platforms/aws platforms/mqtt platforms/loopback
 COMPONENT_PRIV_INCLUDEDIRS += platforms/include
@@ -0,0 +1,221 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_cloud.h>
+#include <esp_cloud_loopback.h>
+#include "host_core.h"
+
+/* Benchmark of the agent core on the loopback backend: the param registry, the
+ * shadow documents generated from it and the work queues. Every document is
+ * checked to hold the params it should.
+ *
+ * Usage: bench_core
+ */
+#define BENCH_STR_SIZE      16
+/* Roughly the same amount of work for every param count */
+#define BENCH_PARAM_OPS     2000000
+#define BENCH_REPORT_OPS    200000
+#define BENCH_WORK_ROUNDS   200000
+
+typedef struct {
+    const char *doc;
+    int params;
+} bench_publish_t;
+
+static double bench_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+static void bench_publish_cb(const char *topic, const char *data, void *priv_data)
+{
+    bench_publish_t *publish = priv_data;
+    publish->doc = data;
+    publish->params = 0;
+    for (const char *p = data; (p = strstr(p, "\"param")); p++) {
+        publish->params++;
+    }
+}
+
+static esp_cloud_internal_handle_t *bench_core_init(int count, char (*names)[16])
+{
+    esp_cloud_config_t config = {
+        .dynamic_cloud_params_count = count,
+    };
+    esp_cloud_internal_handle_t *handle = host_core_init(&config);
+    if (!handle) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        esp_err_t err;
+        snprintf(names[i], sizeof(names[i]), "param%d", i);
+        switch (i % 4) {
+            case 0:
+                err = esp_cloud_add_dynamic_int_param(handle, names[i], i, NULL, NULL);
+                break;
+            case 1:
+                err = esp_cloud_add_dynamic_float_param(handle, names[i], i * 0.5f, NULL, NULL);
+                break;
+            case 2:
+                err = esp_cloud_add_dynamic_bool_param(handle, names[i], i & 1, NULL, NULL);
+                break;
+            default:
+                err = esp_cloud_add_dynamic_string_param(handle, names[i], "value", BENCH_STR_SIZE, NULL, NULL);
+                break;
+        }
+        if (err != ESP_OK) {
+            return NULL;
+        }
+    }
+    if (host_core_connect(handle) != ESP_OK) {
+        return NULL;
+    }
+    return handle;
+}
+
+static int bench_registry(int count)
+{
+    char (*names)[16] = calloc(count, sizeof(*names));
+    bench_publish_t publish = {0};
+    esp_cloud_internal_handle_t *handle = names ? bench_core_init(count, names) : NULL;
+    if (!handle) {
+        printf("FAIL: could not set up %d params\n", count);
+        free(names);
+        return 1;
+    }
+    esp_cloud_loopback_set_publish_cb(handle, bench_publish_cb, &publish);
+    /* Ints are every fourth param */
+    int ints = (count + 3) / 4;
+    int ops = BENCH_PARAM_OPS;
+    double start = bench_time_us();
+    for (int j = 0; j < ops; j++) {
+        if (esp_cloud_get_dynamic_param_id(handle, names[j % count]) != (j % count)) {
+            printf("FAIL: lookup of %s\n", names[j % count]);
+            return 1;
+        }
+    }
+    double lookup_end = bench_time_us();
+    for (int j = 0; j < ops; j++) {
+        esp_cloud_update_int_param_by_id(handle, (j % ints) * 4, j);
+    }
+    double by_id_end = bench_time_us();
+    for (int j = 0; j < ops; j++) {
+        esp_cloud_update_int_param(handle, names[(j % ints) * 4], j);
+    }
+    double by_name_end = bench_time_us();
+
+    /* Full reports, with every param */
+    int reports = (BENCH_REPORT_OPS / count) + 10;
+    for (int j = 0; j < reports; j++) {
+        esp_cloud_shadow_request_full_report(handle);
+        esp_cloud_platform_report_changes(handle);
+    }
+    double full_end = bench_time_us();
+    if (publish.params != count) {
+        printf("FAIL: full report of %d params has %d\n%s\n", count, publish.params, publish.doc);
+        return 1;
+    }
+    size_t full_len = strlen(publish.doc);
+    /* Reports of a single changed param */
+    for (int j = 0; j < reports; j++) {
+        esp_cloud_update_int_param_by_id(handle, (j % ints) * 4, -j);
+        esp_cloud_platform_report_changes(handle);
+    }
+    double delta_end = bench_time_us();
+    if (publish.params != 1) {
+        printf("FAIL: report of one change out of %d params has %d\n%s\n", count, publish.params, publish.doc);
+        return 1;
+    }
+    printf("%8d %10.1f %10.1f %10.1f %12.2f %8zu %12.2f\n", count,
+            (lookup_end - start) * 1e3 / ops, (by_id_end - lookup_end) * 1e3 / ops,
+            (by_name_end - by_id_end) * 1e3 / ops, (full_end - by_name_end) / reports, full_len,
+            (delta_end - full_end) / reports);
+    host_core_deinit(handle);
+    free(names);
+    return 0;
+}
+
+static int work_order[ESP_CLOUD_WORK_PRIO_MAX * 8];
+static int work_done;
+
+static void bench_work_fn(esp_cloud_handle_t handle, void *priv_data)
+{
+    work_order[work_done++] = (intptr_t)priv_data;
+}
+
+static int bench_work_queue(void)
+{
+    char names[1][16];
+    esp_cloud_internal_handle_t *handle = bench_core_init(1, names);
+    if (!handle) {
+        printf("FAIL: could not set up the work queues\n");
+        return 1;
+    }
+    /* Bulk work queued first, to check that it still runs last */
+    static const int batch[ESP_CLOUD_WORK_PRIO_MAX] = {4, 8, 8};
+    int per_round = batch[0] + batch[1] + batch[2];
+    int items = 0;
+    double start = bench_time_us();
+    for (int round = 0; round < BENCH_WORK_ROUNDS; round++) {
+        for (int prio = ESP_CLOUD_WORK_PRIO_MAX - 1; prio >= 0; prio--) {
+            for (int j = 0; j < batch[prio]; j++) {
+                if (esp_cloud_queue_work_with_prio(handle, prio, bench_work_fn, (void *)(intptr_t)prio) != ESP_OK) {
+                    printf("FAIL: queueing work of priority %d\n", prio);
+                    return 1;
+                }
+            }
+        }
+        work_done = 0;
+        while (esp_cloud_handle_work_queue(handle)) {
+        }
+        for (int j = 1; j < work_done; j++) {
+            if (work_order[j] < work_order[j - 1]) {
+                printf("FAIL: work of priority %d ran before %d\n", work_order[j - 1], work_order[j]);
+                return 1;
+            }
+        }
+        items += work_done;
+    }
+    double end = bench_time_us();
+    if (items != BENCH_WORK_ROUNDS * per_round) {
+        printf("FAIL: %d of %d work items ran\n", items, BENCH_WORK_ROUNDS * per_round);
+        return 1;
+    }
+    printf("work queue: %d items, %.1f ns per item queued and run\n", items, (end - start) * 1e3 / items);
+    host_core_deinit(handle);
+    return 0;
+}
+
+int main(void)
+{
+    static const int counts[] = {1, 16, 128, 1024, ESP_CLOUD_MAX_DYNAMIC_PARAMS};
+    printf("%8s %10s %10s %10s %12s %8s %12s\n", "params", "lookup ns", "by id ns", "by name ns",
+            "full us/doc", "bytes", "delta us/doc");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        if (bench_registry(counts[i])) {
+            return 1;
+        }
+    }
+    if (bench_work_queue()) {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
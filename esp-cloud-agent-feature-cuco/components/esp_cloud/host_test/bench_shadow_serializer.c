@@ -0,0 +1,155 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "aws_custom_utils.h"
+
+/* Benchmark of the cursor based shadow serializer in aws_custom_utils.c against the
+ * snprintf based one it replaced, for 1 to 500 params of mixed types. Both must
+ * produce the same document. When the buffer is too small, the new one must fail
+ * and leave a NUL terminated document within the buffer.
+ *
+ * Usage: bench_shadow_serializer
+ */
+IoT_Error_t snprintf_aws_iot_shadow_add_reported(char *pJsonDocument, size_t maxSizeOfJsonDocument,
+        uint16_t count, jsonStruct_t **handler);
+
+#define BENCH_MAX_PARAMS    500
+#define BENCH_DOC_SIZE      (64 * 1024)
+#define BENCH_DOC_START     "{\"state\":{"
+/* Roughly the same amount of work for every param count */
+#define BENCH_PARAM_OPS     200000
+
+static int32_t int_vals[BENCH_MAX_PARAMS];
+static int16_t short_vals[BENCH_MAX_PARAMS];
+static uint8_t byte_vals[BENCH_MAX_PARAMS];
+static float float_vals[BENCH_MAX_PARAMS];
+static bool bool_vals[BENCH_MAX_PARAMS];
+static char str_vals[BENCH_MAX_PARAMS][16];
+static char keys[BENCH_MAX_PARAMS][16];
+static jsonStruct_t params[BENCH_MAX_PARAMS];
+static jsonStruct_t *handlers[BENCH_MAX_PARAMS];
+static char old_doc[BENCH_DOC_SIZE];
+static char new_doc[BENCH_DOC_SIZE];
+
+static double bench_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+static void bench_params_init(void)
+{
+    for (int i = 0; i < BENCH_MAX_PARAMS; i++) {
+        jsonStruct_t *param = &params[i];
+        snprintf(keys[i], sizeof(keys[i]), "param%d", i);
+        param->pKey = keys[i];
+        switch (i % 6) {
+            case 0:
+                /* Includes INT32_MIN, which the cursor negates as unsigned */
+                int_vals[i] = (i % 12) ? (i * 7919) - 100000 : INT32_MIN;
+                param->type = SHADOW_JSON_INT32;
+                param->pData = &int_vals[i];
+                break;
+            case 1:
+                float_vals[i] = (i * 1.25f) - 3;
+                param->type = SHADOW_JSON_FLOAT;
+                param->pData = &float_vals[i];
+                break;
+            case 2:
+                bool_vals[i] = i & 1;
+                param->type = SHADOW_JSON_BOOL;
+                param->pData = &bool_vals[i];
+                break;
+            case 3:
+                snprintf(str_vals[i], sizeof(str_vals[i]), "value%d", i);
+                param->type = SHADOW_JSON_STRING;
+                param->pData = str_vals[i];
+                break;
+            case 4:
+                byte_vals[i] = i;
+                param->type = SHADOW_JSON_UINT8;
+                param->pData = &byte_vals[i];
+                break;
+            default:
+                short_vals[i] = -i;
+                param->type = SHADOW_JSON_INT16;
+                param->pData = &short_vals[i];
+                break;
+        }
+        handlers[i] = param;
+    }
+}
+
+static int bench_check_truncation(void)
+{
+    for (size_t size = sizeof(BENCH_DOC_START) + 1; size < 400; size++) {
+        strcpy(old_doc, BENCH_DOC_START);
+        strcpy(new_doc, BENCH_DOC_START);
+        IoT_Error_t old_ret = snprintf_aws_iot_shadow_add_reported(old_doc, size, 20, handlers);
+        IoT_Error_t new_ret = custom_aws_iot_shadow_add_reported(new_doc, size, 20, handlers);
+        /* The old one returns SUCCESS for some truncated documents, so only its successes are compared */
+        if ((new_ret == SUCCESS) && ((old_ret != SUCCESS) || strcmp(old_doc, new_doc))) {
+            printf("FAIL: buffer of %zu bytes, old returned %d, new %d\n", size, old_ret, new_ret);
+            return 1;
+        }
+        if ((new_ret != SUCCESS) && (strlen(new_doc) >= size)) {
+            printf("FAIL: buffer of %zu bytes overrun\n", size);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const int counts[] = {1, 10, 50, 100, 200, 500};
+    bench_params_init();
+    printf("%8s %8s %12s %12s %8s\n", "params", "bytes", "old us/doc", "new us/doc", "speedup");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        int count = counts[i];
+        strcpy(old_doc, BENCH_DOC_START);
+        strcpy(new_doc, BENCH_DOC_START);
+        IoT_Error_t old_ret = snprintf_aws_iot_shadow_add_reported(old_doc, sizeof(old_doc), count, handlers);
+        IoT_Error_t new_ret = custom_aws_iot_shadow_add_reported(new_doc, sizeof(new_doc), count, handlers);
+        if ((old_ret != SUCCESS) || (new_ret != SUCCESS) || strcmp(old_doc, new_doc)) {
+            printf("FAIL: documents for %d params differ\nold: %s\nnew: %s\n", count, old_doc, new_doc);
+            return 1;
+        }
+        int iterations = (BENCH_PARAM_OPS / count) + 10;
+        double start = bench_time_us();
+        for (int j = 0; j < iterations; j++) {
+            old_doc[sizeof(BENCH_DOC_START) - 1] = '\0';
+            snprintf_aws_iot_shadow_add_reported(old_doc, sizeof(old_doc), count, handlers);
+        }
+        double mid = bench_time_us();
+        for (int j = 0; j < iterations; j++) {
+            new_doc[sizeof(BENCH_DOC_START) - 1] = '\0';
+            custom_aws_iot_shadow_add_reported(new_doc, sizeof(new_doc), count, handlers);
+        }
+        double end = bench_time_us();
+        double old_us = (mid - start) / iterations;
+        double new_us = (end - mid) / iterations;
+        printf("%8d %8zu %12.2f %12.2f %7.1fx\n", count, strlen(new_doc), old_us, new_us, old_us / new_us);
+    }
+    if (bench_check_truncation()) {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
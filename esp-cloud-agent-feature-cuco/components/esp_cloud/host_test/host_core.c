@@ -0,0 +1,54 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdlib.h>
+
+#include "host_core.h"
+
+esp_cloud_internal_handle_t *host_core_init(const esp_cloud_config_t *config)
+{
+    esp_cloud_internal_handle_t *handle = calloc(1, sizeof(esp_cloud_internal_handle_t));
+    if (!handle) {
+        return NULL;
+    }
+    handle->device_id = "host";
+    handle->platform = esp_cloud_platform_loopback();
+    handle->coalesce.min_update_interval_ms = config->min_update_interval_ms;
+    handle->coalesce.max_update_latency_ms = config->max_update_latency_ms;
+    if ((esp_cloud_work_queue_init(handle) != ESP_OK) || (esp_cloud_isr_ring_init(handle) != ESP_OK)) {
+        return NULL;
+    }
+    esp_cloud_timer_init(handle);
+    if ((esp_cloud_platform_init(handle) != ESP_OK) || (esp_cloud_params_init(handle, config) != ESP_OK)) {
+        return NULL;
+    }
+    return handle;
+}
+
+esp_err_t host_core_connect(esp_cloud_internal_handle_t *handle)
+{
+    esp_err_t err = esp_cloud_platform_register_dynamic_params(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return esp_cloud_platform_connect(handle);
+}
+
+void host_core_deinit(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_platform_deinit(handle);
+    esp_cloud_params_deinit(handle);
+    esp_cloud_isr_ring_deinit(handle);
+    esp_cloud_work_queue_deinit(handle);
+    free(handle);
+}
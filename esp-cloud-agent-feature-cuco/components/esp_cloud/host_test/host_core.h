@@ -0,0 +1,30 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <esp_cloud.h>
+#include "esp_cloud_platform.h"
+
+/* A handle set up as esp_cloud_init() does, on the loopback backend, without the
+ * storage and the credentials which only exist on the device. Params are added
+ * between host_core_init() and host_core_connect(). There is no cloud task, the
+ * caller runs its work with esp_cloud_handle_work_queue().
+ */
+esp_cloud_internal_handle_t *host_core_init(const esp_cloud_config_t *config);
+/* Register the params with the loopback and connect */
+esp_err_t host_core_connect(esp_cloud_internal_handle_t *handle);
+void host_core_deinit(esp_cloud_internal_handle_t *handle);
+/* Stops the clock seen by the sources at us, for tests which move time along
+ * themselves. Timeouts of the FreeRTOS stand-ins still use the host's clock.
+ */
+void host_port_set_time(int64_t us);
@@ -0,0 +1,22 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+/* Subset of the AWS IoT SDK error codes used by the shadow serializer */
+typedef enum {
+    SHADOW_JSON_BUFFER_TRUNCATED = -3,
+    SHADOW_JSON_ERROR = -2,
+    NULL_VALUE_ERROR = -1,
+    SUCCESS = 0,
+} IoT_Error_t;
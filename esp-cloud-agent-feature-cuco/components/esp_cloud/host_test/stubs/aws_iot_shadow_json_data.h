@@ -0,0 +1,42 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same layout as the AWS IoT SDK's, for the shadow serializer built on the host */
+typedef enum {
+    SHADOW_JSON_INT32,
+    SHADOW_JSON_INT16,
+    SHADOW_JSON_INT8,
+    SHADOW_JSON_UINT32,
+    SHADOW_JSON_UINT16,
+    SHADOW_JSON_UINT8,
+    SHADOW_JSON_FLOAT,
+    SHADOW_JSON_DOUBLE,
+    SHADOW_JSON_BOOL,
+    SHADOW_JSON_STRING,
+    SHADOW_JSON_OBJECT
+} JsonPrimitiveType;
+
+typedef struct jsonStruct jsonStruct_t;
+typedef void (*jsonStructCallback_t)(const char *pJsonValueBuffer, uint32_t valueLength, jsonStruct_t *pJsonStruct_t);
+
+struct jsonStruct {
+    const char *pKey;
+    void *pData;
+    size_t dataLength;
+    JsonPrimitiveType type;
+    jsonStructCallback_t cb;
+};
@@ -0,0 +1,27 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <stdio.h>
+
+/* Errors and warnings go to stderr. The rest would only get in the way of the numbers */
+#define ESP_LOG_HOST(show, letter, tag, format, ...) do { \
+        if (show) { \
+            fprintf(stderr, letter " %s: " format "\n", tag, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#define ESP_LOGE(tag, format, ...)  ESP_LOG_HOST(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  ESP_LOG_HOST(1, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  ESP_LOG_HOST(0, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  ESP_LOG_HOST(0, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)  ESP_LOG_HOST(0, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,202 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <esp_cloud.h>
+#include <esp_cloud_loopback.h>
+#include "host_core.h"
+
+/* Test of the loopback injections. Messages and deltas must reach their
+ * subscriptions and params only once the cloud task, played here by the test
+ * itself, runs its work, and must be copied so that the caller's buffers can be
+ * reused right away. A second thread then injects while the work is being run.
+ *
+ * Usage: test_loopback_inject
+ */
+#define TEST_THREAD_INJECTIONS  1000
+/* Below the size of the normal work queue, so that nothing gets dropped */
+#define TEST_THREAD_IN_FLIGHT   4
+
+static esp_cloud_internal_handle_t *handle;
+static esp_cloud_param_id_t power_id;
+static int power;
+static char mode[16];
+static int messages;
+static char last_topic[64];
+static char last_payload[64];
+static char last_doc[256];
+static uint32_t handled;
+
+static int test_fail(const char *what)
+{
+    printf("FAIL: %s\n", what);
+    return 1;
+}
+
+static esp_err_t test_power_cb(const char *name, esp_cloud_param_val_t *param, void *priv_data)
+{
+    power = param->val.i;
+    return esp_cloud_update_int_param_by_id(handle, power_id, power);
+}
+
+static esp_err_t test_mode_cb(const char *name, esp_cloud_param_val_t *param, void *priv_data)
+{
+    strlcpy(mode, param->val.s, sizeof(mode));
+    return esp_cloud_update_string_param(handle, "mode", mode);
+}
+
+static void test_message_cb(const char *topic, void *payload, size_t payload_len, void *priv_data)
+{
+    messages++;
+    strlcpy(last_topic, topic, sizeof(last_topic));
+    snprintf(last_payload, sizeof(last_payload), "%.*s", (int)payload_len, (const char *)payload);
+    __atomic_fetch_add(&handled, 1, __ATOMIC_RELEASE);
+}
+
+static void test_publish_cb(const char *topic, const char *data, void *priv_data)
+{
+    strlcpy(last_doc, data, sizeof(last_doc));
+}
+
+static void test_run_work(void)
+{
+    while (esp_cloud_handle_work_queue(handle)) {
+    }
+}
+
+static void *test_inject_thread(void *arg)
+{
+    char payload[16];
+    for (uint32_t i = 0; i < TEST_THREAD_INJECTIONS; i++) {
+        while ((i - __atomic_load_n(&handled, __ATOMIC_ACQUIRE)) >= TEST_THREAD_IN_FLIGHT) {
+            usleep(10);
+        }
+        int len = snprintf(payload, sizeof(payload), "%u", i);
+        if (esp_cloud_loopback_inject(handle, "test/thread/cmd", payload, len) != ESP_OK) {
+            return "inject from a thread failed";
+        }
+    }
+    return NULL;
+}
+
+static int test_messages(void)
+{
+    char payload[] = "hello, world";
+    if (esp_cloud_platform_subscribe(handle, "test/+/cmd", test_message_cb, NULL) != ESP_OK) {
+        return test_fail("subscribe");
+    }
+    /* Only the first five bytes, which need not be NUL terminated */
+    if (esp_cloud_loopback_inject(handle, "test/dev/cmd", payload, 5) != ESP_OK) {
+        return test_fail("inject");
+    }
+    if (messages) {
+        return test_fail("message delivered before the work ran");
+    }
+    memset(payload, 'x', sizeof(payload) - 1);
+    test_run_work();
+    if ((messages != 1) || strcmp(last_topic, "test/dev/cmd") || strcmp(last_payload, "hello")) {
+        return test_fail("message not delivered as injected");
+    }
+    if ((esp_cloud_loopback_inject(handle, "other/dev/cmd", "x", 1) != ESP_OK)) {
+        return test_fail("inject without a subscription");
+    }
+    test_run_work();
+    esp_cloud_loopback_stats_t stats;
+    esp_cloud_loopback_get_stats(handle, &stats);
+    if ((messages != 1) || (stats.messages_injected != 2)) {
+        return test_fail("message without a subscription");
+    }
+    return 0;
+}
+
+static int test_deltas(void)
+{
+    char doc[] = "{\"state\":{\"power\":5,\"mode\":\"eco\"}}";
+    if (esp_cloud_loopback_inject_delta(handle, doc, strlen(doc)) != ESP_OK) {
+        return test_fail("inject delta");
+    }
+    if (power || mode[0]) {
+        return test_fail("delta applied before the work ran");
+    }
+    memset(doc, ' ', sizeof(doc) - 1);
+    test_run_work();
+    if ((power != 5) || strcmp(mode, "eco")) {
+        return test_fail("delta not applied");
+    }
+    /* The accepted values are reported back */
+    esp_cloud_platform_report_changes(handle);
+    if (!strstr(last_doc, "\"power\":5") || !strstr(last_doc, "\"mode\":\"eco\"")) {
+        printf("%s\n", last_doc);
+        return test_fail("delta not reported back");
+    }
+    if (esp_cloud_loopback_inject_delta(handle, "{\"power\":", 9) != ESP_OK) {
+        return test_fail("inject of a broken delta");
+    }
+    test_run_work();
+    esp_cloud_loopback_stats_t stats;
+    esp_cloud_loopback_get_stats(handle, &stats);
+    if ((power != 5) || (stats.deltas_injected != 1)) {
+        return test_fail("broken delta applied");
+    }
+    return 0;
+}
+
+static int test_thread(void)
+{
+    pthread_t thread;
+    void *thread_err;
+    /* The producer counts from here */
+    __atomic_store_n(&handled, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&thread, NULL, test_inject_thread, NULL)) {
+        return test_fail("thread create");
+    }
+    while (__atomic_load_n(&handled, __ATOMIC_ACQUIRE) < TEST_THREAD_INJECTIONS) {
+        esp_cloud_platform_wait(handle, 10);
+        test_run_work();
+    }
+    pthread_join(thread, &thread_err);
+    if (thread_err) {
+        return test_fail(thread_err);
+    }
+    if (strcmp(last_topic, "test/thread/cmd") || (atoi(last_payload) != TEST_THREAD_INJECTIONS - 1)) {
+        return test_fail("messages from a thread out of order");
+    }
+    return 0;
+}
+
+int main(void)
+{
+    esp_cloud_config_t config = {
+        .dynamic_cloud_params_count = 2,
+    };
+    handle = host_core_init(&config);
+    if (!handle
+            || (esp_cloud_add_dynamic_int_param(handle, "power", 0, test_power_cb, NULL) != ESP_OK)
+            || (esp_cloud_add_dynamic_string_param(handle, "mode", "", sizeof(mode), test_mode_cb, NULL) != ESP_OK)
+            || (host_core_connect(handle) != ESP_OK)) {
+        return test_fail("set up");
+    }
+    power_id = esp_cloud_get_dynamic_param_id(handle, "power");
+    esp_cloud_loopback_set_publish_cb(handle, test_publish_cb, NULL);
+    if (test_messages() || test_deltas() || test_thread()) {
+        return 1;
+    }
+    host_core_deinit(handle);
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_cloud_outbox.h"
+
+/* Soak test of the outbox log on the file stand-in. Random appends, pops and
+ * reopens (standing in for reboots) are run against a small file, so that the
+ * log wraps and drops records many times over. After every step the state
+ * picked up from the file must match the one in RAM, records must come out in
+ * the order they went in, and every record appended must have been delivered,
+ * dropped or still be pending.
+ *
+ * Usage: test_outbox_soak [iterations] [seed]
+ */
+#define SOAK_FILE           "outbox_soak.bin"
+#define SOAK_FILE_SIZE      (16 * 1024)
+#define SOAK_TOPIC          "test/outbox"
+#define SOAK_MAX_PAYLOAD    500
+
+static int soak_fail(int it, const char *what)
+{
+    printf("FAIL at iteration %d: %s\n", it, what);
+    return 1;
+}
+
+static int soak_check_disk(esp_cloud_outbox_log_t *log, int it)
+{
+    esp_cloud_outbox_log_t disk;
+    if (esp_cloud_outbox_log_open(&disk, &log->storage) != ESP_OK) {
+        return soak_fail(it, "could not scan the file");
+    }
+    /* write_off may differ, a scan skips the end of a sector too short for a header */
+    if ((disk.pending != log->pending) || (disk.head_off != log->head_off)) {
+        printf("file: pending %u head %zu write %zu, RAM: pending %u head %zu write %zu\n",
+                disk.pending, disk.head_off, disk.write_off, log->pending, log->head_off, log->write_off);
+        return soak_fail(it, "file and RAM state differ");
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+    unsigned int seed = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1;
+    esp_cloud_outbox_storage_t storage;
+    esp_cloud_outbox_log_t log;
+    char data[SOAK_MAX_PAYLOAD + 16];
+    uint32_t appended = 0, delivered = 0, dropped = 0, reopens = 0, next_expected = 0;
+
+    srand(seed);
+    remove(SOAK_FILE);
+    if ((esp_cloud_outbox_file_storage(SOAK_FILE, SOAK_FILE_SIZE, &storage) != ESP_OK)
+            || (esp_cloud_outbox_log_open(&log, &storage) != ESP_OK)) {
+        printf("Could not create %s\n", SOAK_FILE);
+        return 1;
+    }
+    for (int it = 0; it < iterations; it++) {
+        int op = rand() % 100;
+        if (op < 55) {
+            /* Payloads carry their append number, to check the ordering */
+            int len = sprintf(data, "%u:", appended);
+            int pad = rand() % SOAK_MAX_PAYLOAD;
+            memset(data + len, 'x', pad);
+            len += pad;
+            data[len] = '\0';
+            if (esp_cloud_outbox_log_append(&log, SOAK_TOPIC, data, len, 0, 0) != ESP_OK) {
+                return soak_fail(it, "append failed");
+            }
+            appended++;
+        } else if (op < 95) {
+            esp_cloud_outbox_msg_t msg;
+            esp_err_t err = esp_cloud_outbox_log_peek(&log, &msg);
+            if (err == ESP_ERR_NOT_FOUND) {
+                if (log.pending) {
+                    return soak_fail(it, "nothing to read with records pending");
+                }
+                continue;
+            } else if (err != ESP_OK) {
+                return soak_fail(it, "peek failed");
+            }
+            uint32_t num = strtoul(msg.data, NULL, 10);
+            if ((num < next_expected) || strcmp(msg.topic, SOAK_TOPIC)
+                    || (msg.data_len != strlen(msg.data))) {
+                esp_cloud_outbox_msg_free(&msg);
+                return soak_fail(it, "record out of order or damaged");
+            }
+            next_expected = num + 1;
+            if (esp_cloud_outbox_log_pop(&log, msg.seq) != ESP_OK) {
+                esp_cloud_outbox_msg_free(&msg);
+                return soak_fail(it, "pop failed");
+            }
+            esp_cloud_outbox_msg_free(&msg);
+            delivered++;
+        } else {
+            /* A reboot. The drop count only covers the current session */
+            uint32_t pending = log.pending;
+            dropped += log.dropped;
+            esp_cloud_outbox_file_storage_close(&log.storage);
+            if ((esp_cloud_outbox_file_storage(SOAK_FILE, SOAK_FILE_SIZE, &storage) != ESP_OK)
+                    || (esp_cloud_outbox_log_open(&log, &storage) != ESP_OK)) {
+                return soak_fail(it, "reopen failed");
+            }
+            if (log.pending != pending) {
+                return soak_fail(it, "records lost across a reopen");
+            }
+            reopens++;
+        }
+        if (soak_check_disk(&log, it)) {
+            return 1;
+        }
+        if (appended != delivered + dropped + log.dropped + log.pending) {
+            printf("appended %u delivered %u dropped %u pending %u\n", appended, delivered,
+                    dropped + log.dropped, log.pending);
+            return soak_fail(it, "records unaccounted for");
+        }
+    }
+    dropped += log.dropped;
+    printf("PASS: %d iterations, %u appended, %u delivered, %u dropped, %u pending, %u reopens\n",
+            iterations, appended, delivered, dropped, log.pending, reopens);
+    esp_cloud_outbox_file_storage_close(&log.storage);
+    remove(SOAK_FILE);
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_cloud.h>
+#include <esp_cloud_loopback.h>
+#include "host_core.h"
+
+/* Test of the shadow resync on connection. Once the GET sent by reporting the
+ * state is answered, only the params whose value differs from the cloud's copy
+ * may be reported. A rejected or unanswered GET makes all of them get reported.
+ * The test plays the cloud task and moves the stopped clock along itself.
+ *
+ * Usage: test_shadow_resync
+ */
+/* As LOOPBACK_GET_TIMEOUT_MS in loopback_cloud.c */
+#define TEST_GET_TIMEOUT_MS     4000
+
+static const char *test_params[] = { "power", "mode", "on", "temp", "level" };
+#define TEST_PARAMS             ((int)(sizeof(test_params) / sizeof(test_params[0])))
+
+static esp_cloud_internal_handle_t *handle;
+static int64_t now_ms;
+static int publishes;
+static char last_topic[64];
+static char last_doc[256];
+
+static int test_fail(const char *what)
+{
+    printf("FAIL: %s\n", what);
+    if (last_doc[0]) {
+        printf("%s\n", last_doc);
+    }
+    return 1;
+}
+
+static void test_set_time(int64_t ms)
+{
+    now_ms = ms;
+    host_port_set_time(ms * 1000);
+}
+
+static void test_publish_cb(const char *topic, const char *data, void *priv_data)
+{
+    publishes++;
+    strlcpy(last_topic, topic, sizeof(last_topic));
+    strlcpy(last_doc, data, sizeof(last_doc));
+}
+
+static void test_run_work(void)
+{
+    while (esp_cloud_handle_work_queue(handle)) {
+    }
+}
+
+/* Sends the GET, which must go out instead of any report */
+static int test_get(void)
+{
+    int before = publishes;
+    esp_cloud_platform_report_state(handle);
+    esp_cloud_platform_report_changes(handle);
+    if ((publishes != before + 1) || !strstr(last_topic, "/shadow/get")) {
+        return test_fail("no shadow get sent");
+    }
+    return 0;
+}
+
+/* Reports the changes and checks which of the params went out, as a bitmap of test_params */
+static int test_report(uint32_t expected, const char *what)
+{
+    int before = publishes;
+    last_doc[0] = '\0';
+    esp_cloud_platform_report_changes(handle);
+    uint32_t reported = 0;
+    if (publishes != before) {
+        int i;
+        for (i = 0; i < TEST_PARAMS; i++) {
+            char key[16];
+            snprintf(key, sizeof(key), "\"%s\":", test_params[i]);
+            if (strstr(last_doc, key)) {
+                reported |= 1 << i;
+            }
+        }
+    }
+    if (reported != expected) {
+        printf("reported 0x%x instead of 0x%x\n", reported, expected);
+        return test_fail(what);
+    }
+    return 0;
+}
+
+static int test_diff(void)
+{
+    /* power, on and temp are as in the cloud's copy. mode and level are not */
+    static const char doc[] = "{\"state\":{\"reported\":{\"power\":5,\"mode\":\"old\",\"on\":true,"
+            "\"temp\":21.5,\"level\":4}},\"version\":3}";
+    if (test_get() || test_report(0, "report before the get was answered")) {
+        return 1;
+    }
+    if (esp_cloud_loopback_answer_get(handle, doc, strlen(doc)) != ESP_OK) {
+        return test_fail("answer get");
+    }
+    test_run_work();
+    if (test_report((1 << 1) | (1 << 4), "params reported after the get")) {
+        return 1;
+    }
+    /* Missing from the cloud's copy counts as different */
+    static const char partial[] = "{\"state\":{\"reported\":{\"power\":5,\"mode\":\"eco\"}},\"version\":4}";
+    if (test_get()) {
+        return 1;
+    }
+    esp_cloud_loopback_answer_get(handle, partial, strlen(partial));
+    test_run_work();
+    return test_report((1 << 2) | (1 << 3) | (1 << 4), "params reported after a partial get");
+}
+
+static int test_rejected(void)
+{
+    if (test_get()) {
+        return 1;
+    }
+    esp_cloud_loopback_answer_get(handle, NULL, 0);
+    test_run_work();
+    if (test_report((1 << TEST_PARAMS) - 1, "params reported after a rejected get")) {
+        return 1;
+    }
+    static const char broken[] = "{\"state\":{\"reported\":";
+    if (test_get()) {
+        return 1;
+    }
+    esp_cloud_loopback_answer_get(handle, broken, strlen(broken));
+    test_run_work();
+    return test_report((1 << TEST_PARAMS) - 1, "params reported after a broken get");
+}
+
+static int test_timeout(void)
+{
+    static const char doc[] = "{\"state\":{\"reported\":{\"power\":1}},\"version\":5}";
+    if (test_get()) {
+        return 1;
+    }
+    test_set_time(now_ms + TEST_GET_TIMEOUT_MS - 1);
+    esp_cloud_platform_wait(handle, 0);
+    if (test_report(0, "report before the get timed out")) {
+        return 1;
+    }
+    test_set_time(now_ms + 1);
+    esp_cloud_platform_wait(handle, 0);
+    if (test_report((1 << TEST_PARAMS) - 1, "params reported after the get timed out")) {
+        return 1;
+    }
+    /* Too late, and ignored */
+    esp_cloud_loopback_answer_get(handle, doc, strlen(doc));
+    test_run_work();
+    return test_report(0, "report after a late answer");
+}
+
+int main(void)
+{
+    esp_cloud_config_t config = {
+        .dynamic_cloud_params_count = TEST_PARAMS,
+    };
+    test_set_time(1000);
+    handle = host_core_init(&config);
+    if (!handle
+            || (esp_cloud_add_dynamic_int_param(handle, "power", 5, NULL, NULL) != ESP_OK)
+            || (esp_cloud_add_dynamic_string_param(handle, "mode", "eco", 16, NULL, NULL) != ESP_OK)
+            || (esp_cloud_add_dynamic_bool_param(handle, "on", true, NULL, NULL) != ESP_OK)
+            || (esp_cloud_add_dynamic_float_param(handle, "temp", 21.5, NULL, NULL) != ESP_OK)
+            || (esp_cloud_add_dynamic_int_param(handle, "level", 3, NULL, NULL) != ESP_OK)
+            || (host_core_connect(handle) != ESP_OK)) {
+        return test_fail("set up");
+    }
+    esp_cloud_loopback_set_publish_cb(handle, test_publish_cb, NULL);
+    /* Whatever adding the params left to report */
+    esp_cloud_platform_report_changes(handle);
+    if (test_diff() || test_rejected() || test_timeout()) {
+        return 1;
+    }
+    esp_cloud_loopback_stats_t stats;
+    esp_cloud_loopback_get_stats(handle, &stats);
+    if (stats.shadow_gets != 5) {
+        return test_fail("shadow gets not counted");
+    }
+    host_core_deinit(handle);
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,281 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_cloud.h>
+#include "host_core.h"
+
+/* Test of the timer wheel, with the clock stopped and moved along by the test,
+ * which also plays the cloud task. Time jumps straight to the expiry reported by
+ * esp_cloud_timer_process(), so a timer filed in the wrong slot or level, or an
+ * expiry reported too late, shows up as a timer firing late. Timers may fire up
+ * to the grouping window early, never late, and exactly once.
+ *
+ * Usage: test_timer_wheel
+ */
+/* As in esp_cloud_timer.c */
+#define TEST_TICK_MS            100
+#define TEST_GROUP_MS           2000
+/* As ESP_CLOUD_TASK_POLL_MS in esp_cloud.c */
+#define TEST_POLL_MS            1000
+#define TEST_LEVEL1_TICKS       ESP_CLOUD_TIMER_WHEEL_SLOTS
+#define TEST_LEVEL2_TICKS       (ESP_CLOUD_TIMER_WHEEL_SLOTS * ESP_CLOUD_TIMER_WHEEL_SLOTS)
+/* Past the range of the wheel, which parks such timers in its farthest slot */
+#define TEST_BEYOND_TICKS       (TEST_LEVEL2_TICKS * ESP_CLOUD_TIMER_WHEEL_SLOTS + 1000)
+/* Ticks past a level 1 wrap at which the timers cancelled around a cascade are due */
+#define TEST_CANCEL_TICKS       30
+
+typedef struct test_timer {
+    /* Of the next run */
+    int64_t due_ms;
+    uint32_t period_ms;
+    int fired;
+    /* Runs outside of the allowed window */
+    int mistimed;
+    /* Runs left before a periodic timer cancels itself, or re-arms left for a one shot one */
+    int runs_left;
+    uint32_t rearm_ms;
+    esp_cloud_timer_handle_t timer;
+    /* Timer cancelled from this one's callback */
+    struct test_timer *cancel;
+} test_timer_t;
+
+static esp_cloud_internal_handle_t *handle;
+static int64_t now_ms;
+
+static int test_fail(const char *what)
+{
+    printf("FAIL at %lld ms: %s\n", (long long)now_ms, what);
+    return 1;
+}
+
+static void test_set_time(int64_t ms)
+{
+    now_ms = ms;
+    host_port_set_time(ms * 1000);
+}
+
+/* One iteration of the cloud task loop, sleeping until the reported expiry */
+static void test_loop(void)
+{
+    uint32_t timeout_ms = TEST_POLL_MS;
+    esp_cloud_timer_process(handle, &timeout_ms);
+    while (esp_cloud_handle_work_queue(handle)) {
+    }
+    test_set_time(now_ms + (timeout_ms ? timeout_ms : 1));
+}
+
+static void test_run_until(int64_t ms)
+{
+    while (now_ms < ms) {
+        test_loop();
+    }
+}
+
+/* Moves the clock to ticks before the next multiple of boundary ticks */
+static void test_align(uint32_t boundary, uint32_t ticks)
+{
+    int64_t span_ms = (int64_t)boundary * TEST_TICK_MS;
+    test_run_until(((now_ms / span_ms) + 2) * span_ms - (int64_t)ticks * TEST_TICK_MS);
+}
+
+static int test_check_fired(test_timer_t *t, int times)
+{
+    if (t->fired != times) {
+        return test_fail("timer fired the wrong number of times");
+    }
+    if (t->mistimed) {
+        return test_fail("timer fired late or too early");
+    }
+    return 0;
+}
+
+static void test_timer_cb(esp_cloud_handle_t handle, void *priv_data)
+{
+    test_timer_t *t = priv_data;
+    t->fired++;
+    if ((now_ms > t->due_ms) || (now_ms < t->due_ms - TEST_GROUP_MS)) {
+        printf("due at %lld ms, fired at %lld ms\n", (long long)t->due_ms, (long long)now_ms);
+        t->mistimed++;
+    }
+    /* Periods are counted from the deadline */
+    t->due_ms += t->period_ms;
+    if (t->cancel) {
+        esp_cloud_cancel_periodic(handle, t->cancel->timer);
+    }
+}
+
+static void test_once_cb(esp_cloud_handle_t handle, void *priv_data)
+{
+    test_timer_t *t = priv_data;
+    test_timer_cb(handle, t);
+    if (t->runs_left) {
+        t->runs_left--;
+        t->due_ms = now_ms + t->rearm_ms;
+        esp_cloud_schedule_once(handle, t->rearm_ms, test_once_cb, t);
+    }
+}
+
+static void test_periodic_cb(esp_cloud_handle_t handle, void *priv_data)
+{
+    test_timer_t *t = priv_data;
+    test_timer_cb(handle, t);
+    if (t->runs_left && (--t->runs_left == 0)) {
+        esp_cloud_cancel_periodic(handle, t->timer);
+    }
+}
+
+static int test_schedule_once(test_timer_t *t, uint32_t delay_ms)
+{
+    memset(t, 0, sizeof(*t));
+    t->due_ms = now_ms + delay_ms;
+    return esp_cloud_schedule_once(handle, delay_ms, test_once_cb, t) != ESP_OK;
+}
+
+static int test_schedule_periodic(test_timer_t *t, uint32_t period_ms)
+{
+    memset(t, 0, sizeof(*t));
+    t->due_ms = now_ms + period_ms;
+    t->period_ms = period_ms;
+    return esp_cloud_schedule_periodic(handle, period_ms, test_periodic_cb, t, &t->timer) != ESP_OK;
+}
+
+/* One shot timers filed in every level, on both sides of every level boundary
+ * and beyond the range of the wheel, starting just before a level 2 wrap
+ */
+static int test_levels(void)
+{
+    static const uint32_t delays[] = {
+        3, 10, TEST_LEVEL1_TICKS - 1, TEST_LEVEL1_TICKS, TEST_LEVEL1_TICKS + 1, 3 * TEST_LEVEL1_TICKS + 7,
+        TEST_LEVEL2_TICKS - 1, TEST_LEVEL2_TICKS, TEST_LEVEL2_TICKS + 1, 5 * TEST_LEVEL2_TICKS + 100,
+        TEST_BEYOND_TICKS,
+    };
+    test_timer_t timers[sizeof(delays) / sizeof(delays[0])];
+    int i, count = sizeof(delays) / sizeof(delays[0]);
+    test_align(TEST_LEVEL2_TICKS, 5);
+    for (i = 0; i < count; i++) {
+        if (test_schedule_once(&timers[i], delays[i] * TEST_TICK_MS)) {
+            return test_fail("schedule");
+        }
+    }
+    test_run_until(timers[count - 1].due_ms + TEST_POLL_MS);
+    for (i = 0; i < count; i++) {
+        if (test_check_fired(&timers[i], 1)) {
+            printf("timer %d, %u ticks\n", i, delays[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Cancellation of timers about to be cascaded, just cascaded and already queued */
+static int test_cancel(void)
+{
+    test_timer_t before, after, kept, trigger, pair[2];
+    /* Due well past the grouping window after the level 1 wrap which cascades them */
+    test_align(TEST_LEVEL1_TICKS, TEST_LEVEL1_TICKS - TEST_CANCEL_TICKS);
+    uint32_t period_ms = 2 * TEST_LEVEL1_TICKS * TEST_TICK_MS;
+    if (test_schedule_periodic(&before, period_ms) || test_schedule_periodic(&after, period_ms)
+            || test_schedule_periodic(&kept, period_ms)) {
+        return test_fail("schedule");
+    }
+    /* Fires on the tick which cascades the others, and cancels one of them from its callback */
+    uint32_t cascade_ms = (2 * TEST_LEVEL1_TICKS - TEST_CANCEL_TICKS) * TEST_TICK_MS;
+    if (test_schedule_periodic(&trigger, cascade_ms)) {
+        return test_fail("schedule");
+    }
+    trigger.cancel = &after;
+    trigger.runs_left = 1;
+    /* Cancelled in the slot which is about to cascade */
+    test_run_until(trigger.due_ms - TEST_TICK_MS);
+    esp_cloud_cancel_periodic(handle, before.timer);
+    test_run_until(kept.due_ms + TEST_POLL_MS);
+    if (test_check_fired(&trigger, 1) || test_check_fired(&before, 0) || test_check_fired(&after, 0)
+            || test_check_fired(&kept, 1)) {
+        return 1;
+    }
+    esp_cloud_cancel_periodic(handle, kept.timer);
+
+    /* Expiring together, so that the one run first cancels the other, which is already queued */
+    if (test_schedule_periodic(&pair[0], 1000) || test_schedule_periodic(&pair[1], 1000)) {
+        return test_fail("schedule");
+    }
+    pair[0].cancel = &pair[1];
+    pair[1].cancel = &pair[0];
+    pair[0].runs_left = pair[1].runs_left = 1;
+    test_run_until(pair[0].due_ms + 10 * TEST_POLL_MS);
+    if ((pair[0].fired + pair[1].fired) != 1) {
+        return test_fail("queued timer run after being cancelled");
+    }
+    return 0;
+}
+
+/* Timers armed again from their own callbacks, across level boundaries */
+static int test_rearm(void)
+{
+    test_timer_t once, periodic;
+    test_align(TEST_LEVEL2_TICKS, 3);
+    if (test_schedule_once(&once, 2 * TEST_TICK_MS)) {
+        return test_fail("schedule");
+    }
+    /* Each run re-arms it to cross the next level 1 wrap, the last one a level 2 wrap */
+    once.rearm_ms = (TEST_LEVEL1_TICKS + 5) * TEST_TICK_MS;
+    once.runs_left = 3;
+    int i;
+    for (i = 0; i <= 3; i++) {
+        test_run_until(once.due_ms + TEST_POLL_MS);
+        if (test_check_fired(&once, i + 1)) {
+            return 1;
+        }
+        if (i == 2) {
+            once.rearm_ms = TEST_LEVEL2_TICKS * TEST_TICK_MS;
+        }
+    }
+    /* Re-linked after every run, at the same period without drift, until it cancels itself */
+    if (test_schedule_periodic(&periodic, (TEST_LEVEL1_TICKS + 1) * TEST_TICK_MS)) {
+        return test_fail("schedule");
+    }
+    periodic.runs_left = 5;
+    for (i = 0; i < 5; i++) {
+        test_run_until(periodic.due_ms + TEST_TICK_MS);
+        if (test_check_fired(&periodic, i + 1)) {
+            return 1;
+        }
+    }
+    test_run_until(now_ms + 10 * (TEST_LEVEL1_TICKS + 1) * TEST_TICK_MS);
+    if (periodic.fired != 5) {
+        return test_fail("periodic timer run after cancelling itself");
+    }
+    return 0;
+}
+
+int main(void)
+{
+    esp_cloud_config_t config = { 0 };
+    test_set_time(1000);
+    handle = host_core_init(&config);
+    if (!handle) {
+        return test_fail("set up");
+    }
+    if (test_levels() || test_cancel() || test_rearm()) {
+        return 1;
+    }
+    if (handle->timer_wheel.count) {
+        return test_fail("timers left in the wheel");
+    }
+    host_core_deinit(handle);
+    printf("PASS\n");
+    return 0;
+}
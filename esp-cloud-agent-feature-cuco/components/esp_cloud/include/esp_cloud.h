@@ -27,6 +27,11 @@ typedef struct {
 
 extern char *ota_vertion;
 
+/** Cloud platform backend. Opaque. Obtained using esp_cloud_platform_aws(),
+ * esp_cloud_platform_mqtt() or esp_cloud_platform_loopback()
+ */
+typedef struct esp_cloud_platform_ops esp_cloud_platform_ops_t;
+
 /** Cloud configuration required during initialization */
 typedef struct {
     esp_cloud_identifier_t id;
@@ -37,17 +42,140 @@ typedef struct {
     /* Maximum number of static parameters that the application wants to add.
      * Must be set to zero if there are no static parameters.
      */
-    uint8_t static_cloud_params_count;
-    /* Maximum number of static parameters that the application wants to add.
-     * Must be set to zero if there are no dynamic parameters.
+    uint16_t static_cloud_params_count;
+    /* Maximum number of dynamic parameters that the application wants to add.
+     * Must be set to zero if there are no dynamic parameters. Can be at most
+     * ESP_CLOUD_MAX_DYNAMIC_PARAMS.
      */
-    uint8_t dynamic_cloud_params_count;
-    /* Maximum number of times the device will attempt to connect to the
-     * ESP Cloud
+    uint16_t dynamic_cloud_params_count;
+    /* Maximum number of consecutive failed attempts to connect to the ESP Cloud,
+     * after which the agent stops. Attempts which fail because the device itself
+     * is offline are not counted. Set to zero to keep trying forever.
      */
     uint16_t reconnect_attempts;
+    /* Minimum time between two shadow updates. Changes made within this window
+     * are merged into a single update. Set to zero to report changes immediately.
+     */
+    uint32_t min_update_interval_ms;
+    /* Maximum time a change may wait before it is reported, even if
+     * min_update_interval_ms has not yet elapsed. Set to zero for no limit.
+     */
+    uint32_t max_update_latency_ms;
+    /* Platform backend to be used. NULL selects esp_cloud_platform_aws() */
+    const esp_cloud_platform_ops_t *platform;
 } esp_cloud_config_t;
 
+/** AWS IoT platform backend. This is the default
+ *
+ * @return Pointer to the backend, to be set in esp_cloud_config_t.platform
+ */
+const esp_cloud_platform_ops_t *esp_cloud_platform_aws(void);
+
+/** esp-mqtt platform backend
+ *
+ * Talks to the AWS IoT device shadow over plain MQTT using the esp-mqtt client, instead of the
+ * AWS IoT SDK. Publishes and shadow updates do not block for the acknowledgement, so several can
+ * be in flight at a time. The broker can be overridden using CONFIG_ESP_CLOUD_MQTT_BROKER_URI.
+ *
+ * @return Pointer to the backend, to be set in esp_cloud_config_t.platform
+ */
+const esp_cloud_platform_ops_t *esp_cloud_platform_mqtt(void);
+
+/** In-memory loopback platform backend
+ *
+ * Needs no network. Publishes are recorded instead of being sent, and subscription messages and
+ * shadow deltas can be injected using the APIs in esp_cloud_loopback.h.
+ *
+ * @return Pointer to the backend, to be set in esp_cloud_config_t.platform
+ */
+const esp_cloud_platform_ops_t *esp_cloud_platform_loopback(void);
+
+/** Shadow update statistics */
+typedef struct {
+    /** Number of shadow update documents published. A flush of a large parameter set
+     * can take more than one document
+     */
+    uint32_t updates_published;
+    /** Number of published updates acknowledged by the cloud */
+    uint32_t updates_accepted;
+    /** Number of published updates rejected or timed out */
+    uint32_t updates_failed;
+    /** Number of params carried by the published updates */
+    uint32_t params_reported;
+    /** Number of param changes recorded (local and remote). Compare with
+     * params_reported to see how many changes were coalesced
+     */
+    uint32_t changes_recorded;
+    /** Time the changes in the last update waited before being published */
+    uint32_t last_latency_ms;
+    /** Average of last_latency_ms over all updates */
+    uint32_t avg_latency_ms;
+    /** Maximum of last_latency_ms over all updates */
+    uint32_t max_latency_ms;
+    /** Average time between publishing an update and the cloud accepting it */
+    uint32_t avg_ack_ms;
+    /** Maximum time between publishing an update and the cloud accepting it */
+    uint32_t max_ack_ms;
+    /** Number of times the cloud's copy of the shadow was fetched to be compared against, on connection */
+    uint32_t resyncs;
+    /** Number of params found to differ from the cloud's copy, and so reported, over all resyncs */
+    uint32_t resync_params;
+} esp_cloud_shadow_stats_t;
+
+/** Connection statistics */
+typedef struct {
+    /** Successful connections, including the first one */
+    uint32_t connects;
+    /** Established connections which were lost */
+    uint32_t disconnects;
+    /** Connection attempts, successful or not */
+    uint32_t attempts;
+    /** Attempts which failed as the device had no network */
+    uint32_t network_failures;
+    /** Attempts which failed for other transient reasons, eg. the broker being unavailable */
+    uint32_t transient_failures;
+    /** Attempts refused because of the device credentials */
+    uint32_t auth_failures;
+    /** Time from losing the connection (or from start) to being connected again, for the last outage */
+    uint32_t last_connect_ms;
+    /** Average of last_connect_ms */
+    uint32_t avg_connect_ms;
+    /** Maximum of last_connect_ms */
+    uint32_t max_connect_ms;
+    /** Duration of the successful attempt itself, for the last connection: TCP connect, TLS handshake
+     * and MQTT CONNECT. The TLS session is not resumed, so this is a full handshake every time.
+     */
+    uint32_t last_handshake_ms;
+    /** Average of last_handshake_ms */
+    uint32_t avg_handshake_ms;
+    /** Maximum of last_handshake_ms */
+    uint32_t max_handshake_ms;
+    /** Time from reconnecting to being operational again, ie. the changes made while
+     * offline being accepted by the cloud, for the last reconnection
+     */
+    uint32_t last_resume_ms;
+    /** Maximum of last_resume_ms */
+    uint32_t max_resume_ms;
+} esp_cloud_reconnect_stats_t;
+
+/** Outbox statistics. The outbox keeps messages whose publish failed, eg. while offline,
+ * in flash and replays them in order once publishing works again
+ */
+typedef struct {
+    /** Messages waiting to be replayed */
+    uint32_t pending;
+    /** Messages queued since boot */
+    uint32_t queued;
+    /** Messages replayed successfully since boot */
+    uint32_t replayed;
+    /** Messages dropped to make room for newer ones */
+    uint32_t dropped_full;
+    /** Messages dropped as their time to live passed before they could be replayed */
+    uint32_t dropped_expired;
+    /** Messages dropped as they were found corrupt */
+    uint32_t dropped_corrupt;
+} esp_cloud_outbox_stats_t;
+
 /** ESP Cloud Parameter Value type */
 typedef enum {
     /** Invalid */
@@ -82,6 +210,20 @@ typedef struct {
 /** Cloud handle to be used for all ESP Cloud APIs */
 typedef void * esp_cloud_handle_t;
 
+/** Dynamic parameter identifier
+ *
+ * Opaque identifier assigned to a dynamic parameter when it is added. It can be fetched once
+ * using esp_cloud_get_dynamic_param_id() and then used with the esp_cloud_update_*_param_by_id()
+ * APIs, which skip the name lookup completely.
+ */
+typedef int16_t esp_cloud_param_id_t;
+
+/** Invalid dynamic parameter identifier */
+#define ESP_CLOUD_PARAM_ID_INVALID  ((esp_cloud_param_id_t) -1)
+
+/** Maximum value of dynamic_cloud_params_count in esp_cloud_config_t */
+#define ESP_CLOUD_MAX_DYNAMIC_PARAMS    4096
+
 /** Initialize ESP Cloud Agent
  *
  * This initializes the internal data required by ESP Cloud agent and allocates memory as required.
@@ -286,13 +428,15 @@ esp_err_t esp_cloud_add_dynamic_float_param(esp_cloud_handle_t handle, const cha
  * @param[in] val Pointer to a null terminated string Value of the parameter. The ESP Cloud agent
  * will internally make a copy of this.
  * @param[in] val_size Maximum expected size (including null terminating byte) required to hold the
- * string throughout its lifetime.
+ * string throughout its lifetime. This much memory is reserved for the value when the parameter is
+ * added, so updates do not allocate memory.
  * @param[in] cb (Optional) Callback to be called if a change is requested from cloud. Can be left NULL
  * for parameters like sensor readings, which cannot be changed from cloud.
  * @param[in] priv_data (Optional) Private data that will be passed to the callback. This should stay
  * allocated throughout the lifetime of the parameter
  *
  * @return ESP_OK if the parameter was added successfully.
+ * @return ESP_ERR_INVALID_SIZE if val does not fit in val_size.
  * @return error in case of failures. Check the dynamic_cloud_params_count in esp_cloud_config_t once.
  */
 esp_err_t esp_cloud_add_dynamic_string_param(esp_cloud_handle_t handle, const char *name,
@@ -350,10 +494,77 @@ esp_err_t esp_cloud_update_float_param(esp_cloud_handle_t handle, const char *na
  * @param[in] val New null terminated string value of the parameter
  *
  * @return ESP_OK if the parameter was updated successfully.
+ * @return ESP_ERR_INVALID_SIZE if val does not fit in the val_size given while adding the parameter.
  * @return error in case of failures.
  */
 esp_err_t esp_cloud_update_string_param(esp_cloud_handle_t handle, const char *name, char *val);
 
+/** Get the identifier of a Dynamic parameter
+ *
+ * The identifier stays valid for the lifetime of the ESP Cloud Handle. Applications updating
+ * a parameter frequently should fetch it once and use the esp_cloud_update_*_param_by_id() APIs.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] name Name of the parameter used while adding it
+ *
+ * @return Identifier of the parameter on success.
+ * @return ESP_CLOUD_PARAM_ID_INVALID if no such parameter exists.
+ */
+esp_cloud_param_id_t esp_cloud_get_dynamic_param_id(esp_cloud_handle_t handle, const char *name);
+
+/** Update a Boolean parameter using its identifier
+ *
+ * Same as esp_cloud_update_bool_param(), but without any name lookup.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier returned by esp_cloud_get_dynamic_param_id()
+ * @param[in] val New value of the parameter
+ *
+ * @return ESP_OK if the parameter was updated successfully.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_update_bool_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, bool val);
+
+/** Update an Integer parameter using its identifier
+ *
+ * Same as esp_cloud_update_int_param(), but without any name lookup.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier returned by esp_cloud_get_dynamic_param_id()
+ * @param[in] val New value of the parameter
+ *
+ * @return ESP_OK if the parameter was updated successfully.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_update_int_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, int val);
+
+/** Update a Float parameter using its identifier
+ *
+ * Same as esp_cloud_update_float_param(), but without any name lookup.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier returned by esp_cloud_get_dynamic_param_id()
+ * @param[in] val New value of the parameter
+ *
+ * @return ESP_OK if the parameter was updated successfully.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_update_float_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, float val);
+
+/** Update a String parameter using its identifier
+ *
+ * Same as esp_cloud_update_string_param(), but without any name lookup.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier returned by esp_cloud_get_dynamic_param_id()
+ * @param[in] val New null terminated string value of the parameter
+ *
+ * @return ESP_OK if the parameter was updated successfully.
+ * @return ESP_ERR_INVALID_SIZE if val does not fit in the val_size given while adding the parameter.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_update_string_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, char *val);
+
 /** Prototype for ESP Cloud Work Queue Function
  *
  * @param[in] handle The ESP Cloud Handle
@@ -374,10 +585,321 @@ typedef void (*esp_cloud_work_fn_t)(esp_cloud_handle_t handle, void *priv_data);
  */
 esp_err_t esp_cloud_queue_work(esp_cloud_handle_t handle, esp_cloud_work_fn_t work_fn, void *priv_data);
 
+/** Work Priority. Queued work of a higher priority always runs before lower priority work */
+typedef enum {
+    /** Responses to commands, OTA status and other latency sensitive work */
+    ESP_CLOUD_WORK_PRIO_URGENT = 0,
+    /** Default priority, used by esp_cloud_queue_work() */
+    ESP_CLOUD_WORK_PRIO_NORMAL,
+    /** Diagnostics and other bulk work */
+    ESP_CLOUD_WORK_PRIO_BULK,
+    ESP_CLOUD_WORK_PRIO_MAX,
+} esp_cloud_work_prio_t;
+
+/** Queue execution of a function in ESP Cloud's context, with a priority
+ *
+ * Same as esp_cloud_queue_work(), but with an explicit priority.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] prio Priority of the work
+ * @param[in] work_fn The Work function to be queued
+ * @param[in] priv_data Private data to be passed to the work function
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NO_MEM if the queue for this priority is full. The work is dropped.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_queue_work_with_prio(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio,
+        esp_cloud_work_fn_t work_fn, void *priv_data);
+
+/** Work queue statistics of one priority */
+typedef struct {
+    /** Number of work items queued */
+    uint32_t enqueued;
+    /** Number of work items dropped because the queue was full */
+    uint32_t dropped;
+    /** Number of work items executed */
+    uint32_t executed;
+    /** Average time the executed items waited in the queue */
+    uint32_t avg_wait_ms;
+    /** Maximum time an executed item waited in the queue */
+    uint32_t max_wait_ms;
+} esp_cloud_work_stats_t;
+
+/** Get work queue statistics
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] prio Priority for which the statistics are required
+ * @param[out] stats Pointer to a structure which will be filled with the statistics
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_get_work_stats(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio,
+        esp_cloud_work_stats_t *stats);
+
+/** Queue execution of a function in ESP Cloud's context, from an ISR
+ *
+ * Same as esp_cloud_queue_work(), but lock-free and safe to call from an interrupt handler.
+ * Entries submitted from ISRs are run before any other queued work.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] work_fn The Work function to be queued
+ * @param[in] priv_data Private data to be passed to the work function
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NO_MEM if the ISR ring (CONFIG_ESP_CLOUD_ISR_RING_SIZE) is full. The work is dropped.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_queue_work_from_isr(esp_cloud_handle_t handle, esp_cloud_work_fn_t work_fn, void *priv_data);
+
+/** Update a Boolean parameter from an ISR
+ *
+ * Same as esp_cloud_update_bool_param_by_id(), but safe to call from an interrupt handler.
+ * The new value is applied by the ESP Cloud Task.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier returned by esp_cloud_get_dynamic_param_id()
+ * @param[in] val New value of the parameter
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NO_MEM if the ISR ring is full. The update is dropped.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_update_bool_param_from_isr(esp_cloud_handle_t handle, esp_cloud_param_id_t id, bool val);
+
+/** Update an Integer parameter from an ISR
+ *
+ * Same as esp_cloud_update_bool_param_from_isr(), for integer parameters.
+ *
+ * @note There is no float variant, since the FPU cannot be used in interrupt handlers.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier returned by esp_cloud_get_dynamic_param_id()
+ * @param[in] val New value of the parameter
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NO_MEM if the ISR ring is full. The update is dropped.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_update_int_param_from_isr(esp_cloud_handle_t handle, esp_cloud_param_id_t id, int val);
+
+/** Handle of a timer scheduled using esp_cloud_schedule_periodic() */
+typedef struct esp_cloud_timer *esp_cloud_timer_handle_t;
+
+/** Schedule a function to be run once in ESP Cloud's context
+ *
+ * The function is queued to the ESP Cloud Task after the given delay, at normal priority. To
+ * save wakeups, timers that are due within a short while of each other are queued together, so
+ * the function may run up to 2 seconds early.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] delay_ms Delay in milliseconds
+ * @param[in] work_fn The function to be run
+ * @param[in] priv_data Private data to be passed to the function
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_schedule_once(esp_cloud_handle_t handle, uint32_t delay_ms,
+        esp_cloud_work_fn_t work_fn, void *priv_data);
+
+/** Schedule a function to be run periodically in ESP Cloud's context
+ *
+ * Same as esp_cloud_schedule_once(), but the function is run every period_ms. The first run
+ * is period_ms after this call. Grouping with other timers does not make the period drift.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] period_ms Period in milliseconds. Value of 0 is not allowed.
+ * @param[in] work_fn The function to be run
+ * @param[in] priv_data Private data to be passed to the function
+ * @param[out] timer Handle of the timer, required for cancelling it. Can be NULL.
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_schedule_periodic(esp_cloud_handle_t handle, uint32_t period_ms,
+        esp_cloud_work_fn_t work_fn, void *priv_data, esp_cloud_timer_handle_t *timer);
+
+/** Schedule a function to be run periodically, at the given priority
+ *
+ * Same as esp_cloud_schedule_periodic(), but every run is queued with an explicit priority.
+ * Use ESP_CLOUD_WORK_PRIO_BULK for periodic reports that can wait behind other work.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] prio Priority of every run
+ * @param[in] period_ms Period in milliseconds. Value of 0 is not allowed.
+ * @param[in] work_fn The function to be run
+ * @param[in] priv_data Private data to be passed to the function
+ * @param[out] timer Handle of the timer, required for cancelling it. Can be NULL.
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_schedule_periodic_with_prio(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio,
+        uint32_t period_ms, esp_cloud_work_fn_t work_fn, void *priv_data, esp_cloud_timer_handle_t *timer);
+
+/** Cancel a periodic timer
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] timer Handle returned by esp_cloud_schedule_periodic(). Invalid after this call.
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_cancel_periodic(esp_cloud_handle_t handle, esp_cloud_timer_handle_t timer);
+
+/** Reporting policy for a numeric dynamic parameter */
+typedef struct {
+    /** Changes smaller than this, compared with the last value acknowledged by
+     * the cloud, are not reported. 0 to disable
+     */
+    float abs_deadband;
+    /** Same as abs_deadband, but as a fraction of the last acknowledged value
+     * (eg. 0.05 for 5%). 0 to disable
+     */
+    float rel_deadband;
+    /** Minimum time between two reports of this parameter. Changes made earlier
+     * are held back and reported once this has elapsed. 0 to disable
+     */
+    uint32_t min_interval_ms;
+    /** The parameter is reported at least this often, even if it has not changed
+     * significantly. 0 to disable
+     */
+    uint32_t heartbeat_ms;
+} esp_cloud_report_policy_t;
+
+/** Begin a Parameter Update Transaction
+ *
+ * Updates made by the calling task using the esp_cloud_update_*_param() APIs after this
+ * are held back until esp_cloud_param_txn_commit(), and then reported together in a single
+ * shadow update. Updates from other tasks are not affected. Only one transaction can be open
+ * at a time, so this blocks if another task has one open.
+ *
+ * @note The new values are stored right away. Only their reporting is deferred.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if the calling task already has a transaction open.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_param_txn_begin(esp_cloud_handle_t handle);
+
+/** Begin a Parameter Update Transaction, waiting a limited time
+ *
+ * Same as esp_cloud_param_txn_begin(), but gives up if another task keeps its transaction
+ * open for longer than timeout_ms. Updates made after a failure are reported as usual.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] timeout_ms Time to wait for another task's transaction to be committed. 0 to not wait.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_TIMEOUT if another task's transaction is still open.
+ * @return ESP_ERR_INVALID_STATE if the calling task already has a transaction open.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_param_txn_try_begin(esp_cloud_handle_t handle, uint32_t timeout_ms);
+
+/** Commit a Parameter Update Transaction
+ *
+ * Reports all the updates made since esp_cloud_param_txn_begin() in a single shadow update.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if the calling task has no transaction open.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_param_txn_commit(esp_cloud_handle_t handle);
+
+/** Set the Reporting Policy of a Dynamic Parameter
+ *
+ * Filters the updates made using the esp_cloud_update_int_param() and esp_cloud_update_float_param()
+ * family of APIs, so that noisy values do not generate a report for every update.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] id Identifier of an integer or float dynamic parameter
+ * @param[in] policy Pointer to the policy. NULL removes an existing policy.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_SUPPORTED if the parameter is not an integer or float.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_set_param_report_policy(esp_cloud_handle_t handle, esp_cloud_param_id_t id,
+        const esp_cloud_report_policy_t *policy);
+
+/** Get shadow update statistics
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[out] stats Pointer to a structure which will be filled with the statistics
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_get_shadow_stats(esp_cloud_handle_t handle, esp_cloud_shadow_stats_t *stats);
+
+/** Reset shadow update statistics
+ *
+ * @param[in] handle The ESP Cloud Handle
+ */
+void esp_cloud_reset_shadow_stats(esp_cloud_handle_t handle);
+
+/** Get connection statistics
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[out] stats Pointer to the structure to be filled in
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_get_reconnect_stats(esp_cloud_handle_t handle, esp_cloud_reconnect_stats_t *stats);
+
+/** Get outbox statistics
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[out] stats Pointer to the structure to be filled in
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_INVALID_STATE if there is no outbox storage.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_get_outbox_stats(esp_cloud_handle_t handle, esp_cloud_outbox_stats_t *stats);
+
+/** Wake up the ESP Cloud Task
+ *
+ * The ESP Cloud Task sleeps until there is inbound data, a parameter update or queued work.
+ * Call this after changing application state which the task acts upon (for example,
+ * the Alexa login state or an RSSI report request), so that it is handled immediately
+ * instead of on the next periodic poll.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ */
+void esp_cloud_notify(esp_cloud_handle_t handle);
+
+/** Indicate that the App Topic has Changed
+ *
+ * The "app_topic" is read from storage once and kept, rather than for every message sent to
+ * the app. Call this after writing a new one, so that the ESP Cloud Task reads it again and
+ * moves the subscription over to it. A failed app topic subscription is retried with backoff,
+ * reading the topic again, so setting dev_config.app_topic_sub_states to APP_TOPIC_SUB_FAIL
+ * does the same once any backoff is over.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ */
+void esp_cloud_app_topic_changed(esp_cloud_handle_t handle);
+
 // void ota_report_progress_val_to_app(int progress_val);
 
 
 
 
 // void ota_report_msg_status_val_to_app(int result);
+
+/** Reload the cloud credentials
+ *
+ * To be called after the credentials are provisioned again. The platform is disconnected, brought
+ * up again with the new credentials and reconnected. This is done later, from the ESP Cloud Task,
+ * so it can be called from any task.
+ */
 void esp_cloud_platform_deinit_cb(void);
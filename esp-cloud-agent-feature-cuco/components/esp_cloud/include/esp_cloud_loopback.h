@@ -0,0 +1,121 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include <esp_cloud.h>
+
+/* APIs of the loopback platform backend, selected by setting esp_cloud_config_t.platform
+ * to esp_cloud_platform_loopback(). These fail if some other backend is in use.
+ */
+
+/** Loopback statistics */
+typedef struct {
+    /** Number of messages published, including shadow updates */
+    uint32_t publishes;
+    /** Total size of the published messages */
+    uint32_t publish_bytes;
+    /** Number of shadow update documents generated */
+    uint32_t shadow_updates;
+    /** Number of messages injected using esp_cloud_loopback_inject() and handled */
+    uint32_t messages_injected;
+    /** Number of deltas injected using esp_cloud_loopback_inject_delta() and applied */
+    uint32_t deltas_injected;
+    /** Number of shadow GETs sent, see esp_cloud_loopback_answer_get() */
+    uint32_t shadow_gets;
+} esp_cloud_loopback_stats_t;
+
+/** Prototype of the callback invoked for every recorded publish
+ *
+ * @param[in] topic Topic of the message
+ * @param[in] data NULL terminated message. Valid only during the callback
+ * @param[in] priv_data Private data passed to esp_cloud_loopback_set_publish_cb()
+ */
+typedef void (*esp_cloud_loopback_publish_cb_t)(const char *topic, const char *data, void *priv_data);
+
+/** Set a callback to be invoked for every message published by the agent
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] cb The callback. NULL to remove an existing one.
+ * @param[in] priv_data Private data to be passed to the callback
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_loopback_set_publish_cb(esp_cloud_handle_t handle, esp_cloud_loopback_publish_cb_t cb,
+        void *priv_data);
+
+/** Inject a message on a topic
+ *
+ * The message is copied and queued. The callbacks of the matching subscriptions are invoked later,
+ * from the ESP Cloud Task, which logs a message matching no subscription.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] topic Topic of the message
+ * @param[in] payload The message
+ * @param[in] payload_len Length of the message
+ *
+ * @return ESP_OK if the message was queued.
+ * @return ESP_ERR_NO_MEM if it could not be copied or the work queue is full.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_loopback_inject(esp_cloud_handle_t handle, const char *topic, const void *payload,
+        size_t payload_len);
+
+/** Inject a shadow delta
+ *
+ * The document can be either {"state":{"name":value,...}} or just {"name":value,...}. It is copied
+ * and queued. The callbacks of the matching dynamic params are invoked later, from the ESP Cloud
+ * Task, and the accepted values get reported back, as with a delta received from the cloud.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] doc The delta document
+ * @param[in] doc_len Length of the document
+ *
+ * @return ESP_OK if the delta was queued.
+ * @return ESP_ERR_NO_MEM if it could not be copied or the work queue is full.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_loopback_inject_delta(esp_cloud_handle_t handle, const char *doc, size_t doc_len);
+
+/** Answer the pending shadow GET
+ *
+ * As with the other backends, reporting the state once connected first sends a GET for the
+ * cloud's copy of the shadow, recorded as a publish to $aws/things/<device_id>/shadow/get. Only
+ * the params whose reported value differs from the answer are then reported, and its pending
+ * desired values are applied. A GET rejected, not answered within 4 seconds or answered with a
+ * document which cannot be parsed makes all the params get reported instead.
+ *
+ * The document is copied and queued, and handled later from the ESP Cloud Task.
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[in] doc The shadow document, eg. {"state":{"reported":{...}},"version":1}. NULL to reject the GET.
+ * @param[in] doc_len Length of the document
+ *
+ * @return ESP_OK if the answer was queued.
+ * @return ESP_ERR_NO_MEM if it could not be copied or the work queue is full.
+ * @return error in case of other failures.
+ */
+esp_err_t esp_cloud_loopback_answer_get(esp_cloud_handle_t handle, const char *doc, size_t doc_len);
+
+/** Get loopback statistics
+ *
+ * @param[in] handle The ESP Cloud Handle
+ * @param[out] stats Pointer to a structure which will be filled with the statistics
+ *
+ * @return ESP_OK on success.
+ * @return error in case of failures.
+ */
+esp_err_t esp_cloud_loopback_get_stats(esp_cloud_handle_t handle, esp_cloud_loopback_stats_t *stats);
@@ -17,8 +17,11 @@
 #include <freertos/task.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <json_parser.h>
 #include <nvs_flash.h>
 #include <nvs.h>
+#include <lwip/sockets.h>
 
 #include <aws_iot_config.h>
 #include <aws_iot_log.h>
@@ -28,7 +31,6 @@
 
 #include <esp_cloud_mem.h>
 #include <esp_cloud.h>
-#include <esp_cloud_storage.h>
 
 #include "esp_cloud_platform.h"
 #include "aws_custom_utils.h"
@@ -37,113 +39,206 @@
 #include "app_prov_handlers.h"
 #include "app_main.h"
 // #include "production_test.h"
-#define MAX_LENGTH_OF_UPDATE_JSON_BUFFER 200
+/* Size of the shadow update document. It has to fit in the MQTT TX buffer along
+ * with the topic and the packet header.
+ */
+#ifdef AWS_IOT_MQTT_TX_BUF_LEN
+#define MAX_LENGTH_OF_UPDATE_JSON_BUFFER (AWS_IOT_MQTT_TX_BUF_LEN - 128)
+#else
+#define MAX_LENGTH_OF_UPDATE_JSON_BUFFER 512
+#endif
+/* {"state":{"reported":{},"desired":{}}, "clientToken":""} and some slack */
+#define AWS_SHADOW_DOC_OVERHEAD     (64 + MAX_SIZE_CLIENT_TOKEN_CLIENT_SEQUENCE)
+/* Time spent reading once the MQTT socket is readable */
+#define AWS_YIELD_TIMEOUT_MS        5
+/* Maximum time between yields, so that keepalives and shadow ack timeouts are serviced */
+#define AWS_IDLE_YIELD_INTERVAL_MS  1000
 #define AWS_TASK_STACK  12 * 1024
+/* Longest topic AWS IoT accepts, in bytes */
+#define AWS_TOPIC_MAX_LEN           256
 static const char *TAG = "aws_cloud";
 
 
 #define MFG_PARTITION_NAME "fctry"
-#define MAX_MQTT_SUBSCRIPTIONS      3
-
+/* Shadow updates which may await an ack at the same time. Must not exceed
+ * MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME from aws_iot_config.h
+ */
+#define AWS_SHADOW_MAX_IN_FLIGHT    4
+#define AWS_SHADOW_UPDATE_TIMEOUT_S 4
+#define AWS_SHADOW_VERSION_CONFLICT 409
+#if defined(MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME) && (AWS_SHADOW_MAX_IN_FLIGHT > MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME)
+#error "AWS_SHADOW_MAX_IN_FLIGHT exceeds MAX_ACKS_TO_COMEIN_AT_ANY_GIVEN_TIME"
+#endif
+
+/* One in-flight shadow update and the params it carried, so that a failure
+ * re-marks only those params
+ */
 typedef struct {
-    char *topic;
-    esp_cloud_platform_subscribe_cb_t cb;
-    void *priv;
-} aws_cloud_subscription_t;
+    bool in_use;
+    bool full_report;
+    uint32_t *local_params;
+    uint32_t *remote_params;
+    char client_token[MAX_SIZE_CLIENT_TOKEN_CLIENT_SEQUENCE];
+    uint32_t sent_ms;
+} aws_shadow_update_t;
 
 typedef struct {
     AWS_IoT_Client mqttClient;
-    char *mqtt_host;
-    char *client_cert;
-    char *client_key;
-    char *server_cert;
-    char *ota_cert;
     jsonStruct_t *dynamic_params;
     jsonStruct_t **desired_handles;
     jsonStruct_t **reported_handles;
     size_t reported_count;
     size_t desired_count;
-    bool shadowUpdateInProgress;
-    aws_cloud_subscription_t *subscriptions[MAX_MQTT_SUBSCRIPTIONS];
+    aws_shadow_update_t updates[AWS_SHADOW_MAX_IN_FLIGHT];
+    uint8_t updates_in_flight;
+    uint32_t shadow_version;
+    /* Params are split into shards of consecutive ids, each of which fits in one
+     * update document. Shard i holds ids shard_start[i] to shard_start[i + 1] - 1.
+     */
+    uint16_t *shard_start;
+    uint16_t shard_count;
+    char *doc_buf;
+    /* Changes taken out of the core bitmaps for the current flush */
+    uint32_t *pending_local;
+    uint32_t *pending_remote;
+    esp_cloud_topic_router_t router;
+    /* Loopback UDP socket used to wake up the cloud task from select() */
+    int ctrl_fd;
+    struct sockaddr_in ctrl_addr;
+    bool wakeup_pending;
+    uint32_t last_yield_ms;
+    bool shadow_inited;
 } aws_cloud_platform_data_t;
 
+static uint32_t aws_time_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static esp_err_t aws_ctrl_socket_create(aws_cloud_platform_data_t *platform_data)
+{
+    if (platform_data->ctrl_fd >= 0) {
+        return ESP_OK;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to create control socket");
+        return ESP_FAIL;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = 0,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+            (getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0)) {
+        ESP_LOGE(TAG, "Failed to bind control socket");
+        close(fd);
+        return ESP_FAIL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    platform_data->ctrl_addr = addr;
+    platform_data->ctrl_fd = fd;
+    return ESP_OK;
+}
+
+static void aws_ctrl_socket_drain(aws_cloud_platform_data_t *platform_data)
+{
+    char buf[8];
+    while (recv(platform_data->ctrl_fd, buf, sizeof(buf), 0) > 0) {
+    }
+    /* Cleared only after draining, so that a wakeup racing with this is never lost */
+    __atomic_store_n(&platform_data->wakeup_pending, false, __ATOMIC_SEQ_CST);
+}
+
+static void aws_platform_wakeup(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->cloud_platform_priv) {
+        return;
+    }
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (platform_data->ctrl_fd < 0) {
+        return;
+    }
+    /* Only one wakeup datagram needs to be outstanding at a time */
+    if (!__atomic_exchange_n(&platform_data->wakeup_pending, true, __ATOMIC_SEQ_CST)) {
+        char c = 0;
+        sendto(platform_data->ctrl_fd, &c, sizeof(c), 0,
+                (struct sockaddr *)&platform_data->ctrl_addr, sizeof(platform_data->ctrl_addr));
+    }
+}
+
+/* The SDK does the matching itself and calls this once for every subscribed filter
+ * matching the topic, with that filter's router node
+ */
 static void aws_common_subscribe_callback(AWS_IoT_Client *pClient, char *pTopicName, uint16_t topicNameLen, IoT_Publish_Message_Params *params, void *pClientData)
 {
     if (!pClientData) {
         return;
     }
-    aws_cloud_subscription_t **subscriptions = (aws_cloud_subscription_t **)pClientData;
-    int i;
-    for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-        if (subscriptions[i]) {
-            if (strncmp(pTopicName, subscriptions[i]->topic, topicNameLen) == 0) {
-                subscriptions[i]->cb(pTopicName, params->payload, params->payloadLen, subscriptions[i]->priv);
-            }
-        }
+    /* The topic is not NULL terminated in the receive buffer */
+    char topic[AWS_TOPIC_MAX_LEN + 1];
+    if (topicNameLen > AWS_TOPIC_MAX_LEN) {
+        ESP_LOGW(TAG, "Dropping message on a topic longer than %d", AWS_TOPIC_MAX_LEN);
+        return;
     }
+    memcpy(topic, pTopicName, topicNameLen);
+    topic[topicNameLen] = '\0';
+    esp_cloud_topic_router_deliver((esp_cloud_topic_node_t *)pClientData, topic, params->payload, params->payloadLen);
 }
 
-esp_err_t esp_cloud_platform_subscribe(esp_cloud_internal_handle_t *handle, const char *topic, esp_cloud_platform_subscribe_cb_t cb, void *priv_data)
+static esp_err_t aws_platform_subscribe(esp_cloud_internal_handle_t *handle, const char *topic, esp_cloud_platform_subscribe_cb_t cb, void *priv_data)
 {
     if (!handle || !topic || !cb || !handle->cloud_platform_priv) {
         return ESP_FAIL;
     }
     aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
-    int i;
-    for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-        if (!platform_data->subscriptions[i]) {
-            aws_cloud_subscription_t *subscription = esp_cloud_mem_calloc(1, sizeof(aws_cloud_subscription_t));
-            if (!subscription) {
-                return ESP_FAIL;
-            }
-            subscription->topic = strdup(topic);
-            if (!subscription->topic) {
-                free(subscription);
-                return ESP_FAIL;
-            }
-            IoT_Error_t rc = aws_iot_mqtt_subscribe(&platform_data->mqttClient, subscription->topic, strlen(subscription->topic),
-                        QOS1, aws_common_subscribe_callback, platform_data->subscriptions);
-            if (rc != SUCCESS) {
-                free(subscription->topic);
-                free(subscription);
-                return ESP_FAIL;
-            }
-            subscription->priv = priv_data;
-            subscription->cb = cb;
-            platform_data->subscriptions[i] = subscription;
-            ESP_LOGI(TAG, "Subscribed to topic: %s", topic);
-            return ESP_OK;
+    esp_cloud_topic_node_t *node = NULL;
+    bool new_filter = false;
+    esp_err_t err = esp_cloud_topic_router_add(&platform_data->router, topic, cb, priv_data, &node, &new_filter);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (new_filter) {
+        /* The SDK keeps the topic pointer, so pass the router's copy */
+        const char *filter = esp_cloud_topic_router_node_filter(node);
+        IoT_Error_t rc = aws_iot_mqtt_subscribe(&platform_data->mqttClient, filter, strlen(filter),
+                    QOS1, aws_common_subscribe_callback, node);
+        if (rc != SUCCESS) {
+            ESP_LOGE(TAG, "Failed to subscribe to topic: %s, %d", topic, rc);
+            esp_cloud_topic_router_remove(&platform_data->router, topic);
+            return ESP_FAIL;
         }
     }
-    return ESP_FAIL;
+    ESP_LOGI(TAG, "Subscribed to topic: %s", topic);
+    return ESP_OK;
 }
 
-esp_err_t esp_cloud_platform_unsubscribe(esp_cloud_internal_handle_t *handle, const char *topic)
+static esp_err_t aws_platform_unsubscribe(esp_cloud_internal_handle_t *handle, const char *topic)
 {
     if (!handle || !topic || !handle->cloud_platform_priv) {
         return ESP_FAIL;
     }
     aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
     IoT_Error_t rc = aws_iot_mqtt_unsubscribe(&platform_data->mqttClient, topic, strlen(topic));
-    if (rc == SUCCESS) {
-        ESP_LOGW(TAG, "Could not unsubscribe from topic: %s", topic);
+    if (rc != SUCCESS) {
+        /* The SDK still holds the router's copy of the topic and its node, and
+         * may resubscribe with them. Only the callbacks go.
+         */
+        ESP_LOGW(TAG, "Could not unsubscribe from topic: %s, %d", topic, rc);
+        esp_cloud_topic_router_retire(&platform_data->router, topic);
+        return ESP_FAIL;
     }
-    aws_cloud_subscription_t **subscriptions = platform_data->subscriptions;
-    int i;
-    for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-        if (subscriptions[i]) {
-            if (strncmp(topic, subscriptions[i]->topic, strlen(topic)) == 0) {
-                free(subscriptions[i]->topic);
-                free(subscriptions[i]);
-                subscriptions[i] = NULL;
-                return ESP_OK;
-            }
-        }
+    /* Only after the SDK has let go of the router's copy of the topic */
+    if (esp_cloud_topic_router_remove(&platform_data->router, topic) != ESP_OK) {
+        return ESP_FAIL;
     }
-    return ESP_FAIL;
+    return ESP_OK;
 }
 
-esp_err_t esp_cloud_platform_publish(esp_cloud_internal_handle_t *handle, const char *topic, const char *data)
+static esp_err_t aws_platform_publish(esp_cloud_internal_handle_t *handle, const char *topic, const char *data,
+        size_t data_len)
 {
     if (!handle || !topic || !data || !handle->cloud_platform_priv) {
         return ESP_FAIL;
@@ -152,10 +247,10 @@ esp_err_t esp_cloud_platform_publish(esp_cloud_internal_handle_t *handle, const
     IoT_Publish_Message_Params publish_msg;
     publish_msg.qos = QOS1;
     publish_msg.payload = (void *) data;
-    publish_msg.payloadLen = strlen(data);
+    publish_msg.payloadLen = data_len;
     publish_msg.isRetained = 0;
     ESP_LOGI(TAG, "Publishing to: %s", topic);
-    ESP_LOGI(TAG, "Publish Data: %s", data);
+    ESP_LOGI(TAG, "Publish Data: %.*s", data_len, data);
     IoT_Error_t rc = aws_iot_mqtt_publish(&platform_data->mqttClient, topic, strlen(topic), &publish_msg);
 
     if (SUCCESS != rc) {
@@ -192,7 +287,16 @@ static void aws_common_delta_callback(const char* pJsonValueBuffer, uint32_t val
     if(pContext == NULL) {
         return;
     }
-    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_name(pContext->pKey);
+    /* The delta handles are registered in the same order as the dynamic params,
+     * so the position of the context in the array is the param identifier.
+     */
+    esp_cloud_internal_handle_t *handle = (esp_cloud_internal_handle_t *)esp_cloud_get_handle();
+    if (!handle || !handle->cloud_platform_priv) {
+        return;
+    }
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    esp_cloud_param_id_t id = pContext - platform_data->dynamic_params;
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id(handle, id);
     if (param) {
         if (param->cb) {
             esp_cloud_param_val_t new_val;
@@ -200,34 +304,110 @@ static void aws_common_delta_callback(const char* pJsonValueBuffer, uint32_t val
             new_val.val_size = param->val.val_size;
             aws_get_new_param_val(&new_val, pContext);
             if (param->cb(pContext->pKey, &new_val, param->priv_data) == ESP_OK) {
-                param->flags |= CLOUD_PARAM_FLAG_REMOTE_CHANGE;
+                esp_cloud_mark_param_changed(handle, id, CLOUD_PARAM_FLAG_REMOTE_CHANGE);
             }
         }
     }
 }
 
+static int aws_shadow_get_doc_int(const char *doc, char *name, int *val)
+{
+    jparse_ctx_t jctx;
+    if (!doc || json_parse_start(&jctx, (char *)doc, strlen(doc)) != OS_SUCCESS) {
+        return OS_FAIL;
+    }
+    int ret = json_obj_get_int(&jctx, name, val);
+    json_parse_end(&jctx);
+    return ret;
+}
+
+/* Put the params of a failed update back into the change bitmaps */
+static void aws_shadow_update_retry(esp_cloud_internal_handle_t *handle, aws_shadow_update_t *update)
+{
+    esp_cloud_shadow_requeue(handle, update->local_params, update->remote_params, 0);
+    if (update->full_report) {
+        esp_cloud_shadow_request_full_report(handle);
+    }
+}
+
 static void update_status_callback(const char *pThingName, ShadowActions_t action, Shadow_Ack_Status_t status,
                                    const char *pReceivedJsonDocument, void *pContextData)
 {
     IOT_UNUSED(pThingName);
     IOT_UNUSED(action);
-    IOT_UNUSED(pReceivedJsonDocument);
-    aws_cloud_platform_data_t *platform_data = (aws_cloud_platform_data_t *) pContextData;
+    aws_shadow_update_t *update = (aws_shadow_update_t *) pContextData;
+    esp_cloud_internal_handle_t *handle = (esp_cloud_internal_handle_t *)esp_cloud_get_handle();
+    if (!update || !update->in_use || !handle || !handle->cloud_platform_priv) {
+        return;
+    }
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    uint32_t rtt = aws_time_ms() - update->sent_ms;
+
+    if (SHADOW_ACK_ACCEPTED == status) {
+        int version = 0;
+        if (aws_shadow_get_doc_int(pReceivedJsonDocument, "version", &version) == OS_SUCCESS &&
+                (uint32_t)version > platform_data->shadow_version) {
+            platform_data->shadow_version = version;
+        }
+        esp_cloud_shadow_set_version(handle, platform_data->shadow_version);
+        ESP_LOGI(TAG, "Update %s accepted, version %u, %u ms", update->client_token,
+                platform_data->shadow_version, rtt);
+        int i;
+        for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+            if ((update->local_params[i / 32] | update->remote_params[i / 32]) & ((uint32_t)1 << (i % 32))) {
+                esp_cloud_param_report_acked(handle, i);
+            }
+        }
+    } else {
+        int code = 0;
+        if (SHADOW_ACK_REJECTED == status) {
+            aws_shadow_get_doc_int(pReceivedJsonDocument, "code", &code);
+            ESP_LOGE(TAG, "Update %s rejected, code %d", update->client_token, code);
+        } else {
+            ESP_LOGE(TAG, "Update %s timed out", update->client_token);
+        }
+        /* Other rejections mean the document itself is bad, so sending it again would not help */
+        if ((SHADOW_ACK_TIMEOUT == status) || (code == AWS_SHADOW_VERSION_CONFLICT)) {
+            aws_shadow_update_retry(handle, update);
+        }
+    }
+    esp_cloud_shadow_update_done(handle, SHADOW_ACK_ACCEPTED == status, rtt);
+    update->in_use = false;
+    platform_data->updates_in_flight--;
+}
 
-    if (platform_data) {
-        platform_data->shadowUpdateInProgress = false;
+static void aws_shadow_get_callback(const char *pThingName, ShadowActions_t action, Shadow_Ack_Status_t status,
+                                    const char *pReceivedJsonDocument, void *pContextData)
+{
+    IOT_UNUSED(pThingName);
+    IOT_UNUSED(action);
+    IOT_UNUSED(pContextData);
+    esp_cloud_internal_handle_t *handle = (esp_cloud_internal_handle_t *)esp_cloud_get_handle();
+    if (!handle || !handle->cloud_platform_priv) {
+        return;
+    }
+    if ((SHADOW_ACK_ACCEPTED != status) || !pReceivedJsonDocument ||
+            (esp_cloud_shadow_resync(handle, (char *)pReceivedJsonDocument, strlen(pReceivedJsonDocument)) != ESP_OK)) {
+        /* Eg. rejected with 404 as nothing was ever reported, or too large for the receive buffer */
+        ESP_LOGW(TAG, "Shadow get %s. Reporting all the params",
+                (SHADOW_ACK_REJECTED == status) ? "rejected" : "failed");
+        esp_cloud_shadow_request_full_report(handle);
     }
+    aws_platform_wakeup(handle);
+}
 
-    if (SHADOW_ACK_TIMEOUT == status) {
-        ESP_LOGE(TAG, "Update timed out-1");
-    } else if (SHADOW_ACK_REJECTED == status) {
-        ESP_LOGE(TAG, "Update rejected");
-    } else if (SHADOW_ACK_ACCEPTED == status) {
-        ESP_LOGI(TAG, "Update accepted");
+static aws_shadow_update_t *aws_shadow_update_get_free(aws_cloud_platform_data_t *platform_data)
+{
+    int i;
+    for (i = 0; i < AWS_SHADOW_MAX_IN_FLIGHT; i++) {
+        if (!platform_data->updates[i].in_use && platform_data->updates[i].local_params) {
+            return &platform_data->updates[i];
+        }
     }
+    return NULL;
 }
 
-static IoT_Error_t shadow_update(esp_cloud_internal_handle_t *handle)
+static IoT_Error_t shadow_update(esp_cloud_internal_handle_t *handle, aws_shadow_update_t *update)
 {
     if (!handle || !handle->cloud_platform_priv) {
         return ESP_FAIL;
@@ -235,8 +415,8 @@ static IoT_Error_t shadow_update(esp_cloud_internal_handle_t *handle)
     aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
     IoT_Error_t rc = FAILURE;
 
-    char JsonDocumentBuffer[MAX_LENGTH_OF_UPDATE_JSON_BUFFER];
-    size_t sizeOfJsonDocumentBuffer = sizeof(JsonDocumentBuffer) / sizeof(JsonDocumentBuffer[0]);
+    char *JsonDocumentBuffer = platform_data->doc_buf;
+    size_t sizeOfJsonDocumentBuffer = MAX_LENGTH_OF_UPDATE_JSON_BUFFER;
     rc = aws_iot_shadow_init_json_document(JsonDocumentBuffer, sizeOfJsonDocumentBuffer);
     if (rc != SUCCESS) {
         return rc;
@@ -267,20 +447,36 @@ static IoT_Error_t shadow_update(esp_cloud_internal_handle_t *handle)
         return rc;
     }
     ESP_LOGI(TAG, "Update Shadow: %s", JsonDocumentBuffer);
+    /* The SDK matches the ack to this update through the client token added by
+     * aws_iot_finalize_json_document(). Keep a copy for logging.
+     */
+    jparse_ctx_t jctx;
+    update->client_token[0] = '\0';
+    if (json_parse_start(&jctx, JsonDocumentBuffer, strlen(JsonDocumentBuffer)) == OS_SUCCESS) {
+        json_obj_get_string(&jctx, "clientToken", update->client_token, sizeof(update->client_token));
+        json_parse_end(&jctx);
+    }
     rc = aws_iot_shadow_update(&platform_data->mqttClient, handle->device_id, JsonDocumentBuffer,
-                               update_status_callback, platform_data, 4, true);           
-    platform_data->shadowUpdateInProgress = true;
+                               update_status_callback, update, AWS_SHADOW_UPDATE_TIMEOUT_S, true);
+    if (rc == SUCCESS) {
+        update->in_use = true;
+        update->sent_ms = aws_time_ms();
+        platform_data->updates_in_flight++;
+    }
     return rc;
 }
 
-static esp_err_t esp_cloud_param_map_to_aws(esp_cloud_dynamic_param_t *cloud_param, jsonStruct_t *aws_param)
+static esp_err_t esp_cloud_param_map_to_aws(esp_cloud_mem_arena_t *arena, esp_cloud_dynamic_param_t *cloud_param, jsonStruct_t *aws_param)
 {
     if (!cloud_param || !aws_param) {
         return ESP_FAIL;
     }
     switch(cloud_param->val.type) {
         case CLOUD_PARAM_TYPE_BOOLEAN: {
-                aws_param->pData = esp_cloud_mem_malloc(sizeof(bool));
+                aws_param->pData = esp_cloud_mem_arena_alloc(arena, sizeof(bool));
+                if (!aws_param->pData) {
+                    return ESP_ERR_NO_MEM;
+                }
                 *(bool *)aws_param->pData = cloud_param->val.val.b;
                 aws_param->dataLength = cloud_param->val.val_size;
                 aws_param->pKey = cloud_param->name;
@@ -288,7 +484,10 @@ static esp_err_t esp_cloud_param_map_to_aws(esp_cloud_dynamic_param_t *cloud_par
             }
             break;
         case CLOUD_PARAM_TYPE_INTEGER: {
-                aws_param->pData = esp_cloud_mem_malloc(sizeof(int));
+                aws_param->pData = esp_cloud_mem_arena_alloc(arena, sizeof(int));
+                if (!aws_param->pData) {
+                    return ESP_ERR_NO_MEM;
+                }
                 *(int *)aws_param->pData = cloud_param->val.val.i;
                 aws_param->dataLength = cloud_param->val.val_size;
                 aws_param->pKey = cloud_param->name;
@@ -296,7 +495,10 @@ static esp_err_t esp_cloud_param_map_to_aws(esp_cloud_dynamic_param_t *cloud_par
             }
             break;
         case CLOUD_PARAM_TYPE_FLOAT: {
-                aws_param->pData = esp_cloud_mem_malloc(sizeof(float));
+                aws_param->pData = esp_cloud_mem_arena_alloc(arena, sizeof(float));
+                if (!aws_param->pData) {
+                    return ESP_ERR_NO_MEM;
+                }
                 *(float *)aws_param->pData = cloud_param->val.val.f;
                 aws_param->dataLength = cloud_param->val.val_size;
                 aws_param->pKey = cloud_param->name;
@@ -304,64 +506,83 @@ static esp_err_t esp_cloud_param_map_to_aws(esp_cloud_dynamic_param_t *cloud_par
             }
             break;
         case CLOUD_PARAM_TYPE_STRING: {
-                aws_param->pData = esp_cloud_mem_calloc(1, cloud_param->val.val_size);
-                strncpy((char *)aws_param->pData, cloud_param->val.val.s, cloud_param->val.val_size);
+                aws_param->pData = cloud_param->platform_buf;
+                strlcpy((char *)aws_param->pData, cloud_param->val.val.s, cloud_param->val.val_size);
                 aws_param->dataLength = cloud_param->val.val_size;
                 aws_param->pKey = cloud_param->name;
                 aws_param->type = SHADOW_JSON_STRING;
             }
             break;
         default :
-            ESP_LOGW(TAG, "Invalid Cloud param value type. Skipping...");
-            return ESP_FAIL;
+            return ESP_ERR_NOT_SUPPORTED;
     }
     return ESP_OK;
 }
 
 void disconnectCallbackHandler(AWS_IoT_Client *pClient, void *data)
 {
+    /* The SDK's own reconnection is disabled. aws_platform_wait() reconnects as per esp_cloud_reconnect_due() */
     ESP_LOGW(TAG, "MQTT Disconnect");
-    IoT_Error_t rc = FAILURE;
-    if(NULL == pClient) {
-        return;
-    }
+}
 
-    if(aws_iot_is_autoreconnect_enabled(pClient)) {
-        ESP_LOGI(TAG, "Auto Reconnect is enabled, Reconnecting attempt will start now");
-    } else {
-        ESP_LOGW(TAG, "Auto Reconnect not enabled. Starting manual reconnect...");
-        rc = aws_iot_mqtt_attempt_reconnect(pClient);
-        if(NETWORK_RECONNECTED == rc) {
-            ESP_LOGW(TAG, "Manual Reconnect Successful");
-        } else {
-            ESP_LOGW(TAG, "Manual Reconnect Failed - %d", rc);
-        }
+/* Which backoff to apply after a failed connection attempt */
+static esp_cloud_conn_err_t aws_conn_err(IoT_Error_t rc)
+{
+    switch (rc) {
+        case TCP_CONNECTION_ERROR:
+        case TCP_SETUP_ERROR:
+        case NETWORK_PHYSICAL_LAYER_DISCONNECTED:
+        case NETWORK_ERR_NET_SOCKET_FAILED:
+        case NETWORK_ERR_NET_UNKNOWN_HOST:
+        case NETWORK_ERR_NET_CONNECT_FAILED:
+            return ESP_CLOUD_CONN_ERR_NETWORK;
+        case NETWORK_SSL_CERT_ERROR:
+        case NETWORK_X509_ROOT_CRT_PARSE_ERROR:
+        case NETWORK_X509_DEVICE_CRT_PARSE_ERROR:
+        case NETWORK_PK_PRIVATE_KEY_PARSE_ERROR:
+        case MQTT_CONNACK_IDENTIFIER_REJECTED_ERROR:
+        case MQTT_CONNACK_BAD_USERDATA_ERROR:
+        case MQTT_CONNACK_NOT_AUTHORIZED_ERROR:
+            return ESP_CLOUD_CONN_ERR_AUTH;
+        default:
+            return ESP_CLOUD_CONN_ERR_TRANSIENT;
     }
 }
 
-esp_err_t esp_cloud_platform_connect(esp_cloud_internal_handle_t *handle)
+/* A single attempt. Retries are paced by the core, see esp_cloud_reconnect_failed() */
+static esp_err_t aws_platform_connect(esp_cloud_internal_handle_t *handle)
 {
     if (!handle || !handle->cloud_platform_priv) {
         return ESP_FAIL;
     }
     aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (platform_data->shadow_inited && aws_iot_mqtt_is_client_connected(&platform_data->mqttClient)) {
+        return ESP_OK;
+    }
     IoT_Error_t rc = FAILURE;
-    uint8_t num = 0;
-    ShadowInitParameters_t sp = ShadowInitParametersDefault;
-    sp.pHost = platform_data->mqtt_host;
-    sp.port = AWS_IOT_MQTT_PORT;
-    sp.pClientCRT = (const char *)platform_data->client_cert;
-    sp.pClientKey = (const char *)platform_data->client_key;
-    sp.pRootCA = (const char *)platform_data->server_cert;
-    sp.enableAutoReconnect = true;
-    sp.disconnectHandler = disconnectCallbackHandler;
-
-    ESP_LOGI(TAG, "Shadow Init");
-    rc = aws_iot_shadow_init(&platform_data->mqttClient, &sp);
-    while (SUCCESS != rc) {
+    aws_ctrl_socket_create(platform_data);
+
+    if (!platform_data->shadow_inited) {
+        /* The SDK keeps these pointers and parses the PEMs again on every connect */
+        const esp_cloud_creds_t *creds = esp_cloud_get_creds(handle);
+        ShadowInitParameters_t sp = ShadowInitParametersDefault;
+        sp.pHost = creds->mqtt_host;
+        sp.port = AWS_IOT_MQTT_PORT;
+        sp.pClientCRT = creds->client_cert;
+        sp.pClientKey = creds->client_key;
+        sp.pRootCA = creds->server_cert;
+        /* The SDK would retry on a fixed schedule, the same on every device */
+        sp.enableAutoReconnect = false;
+        sp.disconnectHandler = disconnectCallbackHandler;
+
+        ESP_LOGI(TAG, "Shadow Init");
         rc = aws_iot_shadow_init(&platform_data->mqttClient, &sp);
-        ESP_LOGE(TAG, "aws_iot_shadow_init returned error %d, aborting...", rc);
-        vTaskDelay(500 / portTICK_PERIOD_MS);
+        if (SUCCESS != rc) {
+            ESP_LOGE(TAG, "aws_iot_shadow_init returned error %d", rc);
+            esp_cloud_reconnect_failed(handle, ESP_CLOUD_CONN_ERR_TRANSIENT);
+            return ESP_FAIL;
+        }
+        platform_data->shadow_inited = true;
     }
 
     ShadowConnectParameters_t scp = ShadowConnectParametersDefault;
@@ -370,65 +591,52 @@ esp_err_t esp_cloud_platform_connect(esp_cloud_internal_handle_t *handle)
     scp.mqttClientIdLen = (uint16_t) strlen(handle->device_id);
 
     ESP_LOGI(TAG, "Connecting to AWS.....");
-    do {
-        rc = aws_iot_shadow_connect(&platform_data->mqttClient, &scp);
-        if(SUCCESS != rc) {
-            ESP_LOGE(TAG, "Error(%d) connecting to %s:%d", rc, sp.pHost, sp.port);
-            
-            num++;
-            if(num>=2){
-
-                // dev_config.dev_states = IOT_FAIL;
-                // dev_config.iot_err = rc;
-            }else{
-               dev_config.dev_states = IOT_ING;
-            }
-             ESP_LOGE(TAG, "reconnecting to %s:%d %d",sp.pHost, sp.port,num);
-            vTaskDelay(500 / portTICK_RATE_MS);
-        }else{
-            dev_config.dev_states = IOT_OK;
-            num = 0;
-            ESP_LOGI(TAG, "connecting to %s:%d",sp.pHost, sp.port);
-        }
-    } while(SUCCESS != rc);
+    dev_config.dev_states = IOT_ING;
+    esp_cloud_reconnect_attempt_started(handle);
+    rc = aws_iot_shadow_connect(&platform_data->mqttClient, &scp);
+    if (SUCCESS != rc) {
+        ESP_LOGE(TAG, "Error(%d) connecting to %s:%d", rc, esp_cloud_get_creds(handle)->mqtt_host, AWS_IOT_MQTT_PORT);
+        esp_cloud_reconnect_failed(handle, aws_conn_err(rc));
+        return ESP_FAIL;
+    }
+    dev_config.dev_states = IOT_OK;
+    ESP_LOGI(TAG, "connecting to %s:%d", esp_cloud_get_creds(handle)->mqtt_host, AWS_IOT_MQTT_PORT);
+    /* The shadow library always asks for a clean session. Reconnections reuse the
+     * stored options, so from here on the broker keeps the session for us.
+     */
+    if (ESP_CLOUD_PERSISTENT_SESSION) {
+        platform_data->mqttClient.clientData.options.isCleanSession = false;
+    }
+    esp_cloud_reconnect_succeeded(handle);
     return ESP_OK;
 }
 
+static void aws_unsubscribe_one(const char *filter, esp_cloud_topic_node_t *node, void *priv_data)
+{
+    aws_cloud_platform_data_t *platform_data = priv_data;
+    aws_iot_mqtt_unsubscribe(&platform_data->mqttClient, filter, strlen(filter));
+}
+
+/* Whatever the SDK fails to let go of here is forgotten when the client is
+ * initialised again on the next connect, before it can be used
+ */
 static void aws_unsubscribe_all(esp_cloud_internal_handle_t *handle)
 {
     aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
-    int i;
-    for (i = 0; i < MAX_MQTT_SUBSCRIPTIONS; i++) {
-        if (platform_data->subscriptions[i]) {
-            esp_cloud_platform_unsubscribe(handle, platform_data->subscriptions[i]->topic);
-        }
-    }
+    esp_cloud_topic_router_foreach(&platform_data->router, aws_unsubscribe_one, platform_data);
+    esp_cloud_topic_router_clear(&platform_data->router);
 }
 
 
+/* The mirrors live in the handle's arena, so they are only dropped here */
 static void aws_remove_all_dynamic_params(esp_cloud_internal_handle_t *handle)
 {
     aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
-    int i;
-    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
-        if (platform_data->dynamic_params[i].type == SHADOW_JSON_STRING) {
-            free(platform_data->dynamic_params[i].pData);
-        }
-    }
-    if (platform_data->dynamic_params) {
-        free(platform_data->dynamic_params);
-        platform_data->dynamic_params = NULL;
-    }
-    if (platform_data->desired_handles) {
-        free(platform_data->desired_handles);
-        platform_data->desired_handles = NULL;
-    }
-    if (platform_data->reported_handles) {
-        free(platform_data->reported_handles);
-        platform_data->reported_handles = NULL;
-    }
+    platform_data->dynamic_params = NULL;
+    platform_data->desired_handles = NULL;
+    platform_data->reported_handles = NULL;
 }
-esp_err_t esp_cloud_platform_disconnect(esp_cloud_internal_handle_t *handle)
+static esp_err_t aws_platform_disconnect(esp_cloud_internal_handle_t *handle)
 {
     if (!handle || !handle->cloud_platform_priv) {
         return ESP_FAIL;
@@ -445,7 +653,52 @@ esp_err_t esp_cloud_platform_disconnect(esp_cloud_internal_handle_t *handle)
     return ESP_OK;
 }
 
-esp_err_t esp_cloud_platform_register_dynamic_params(esp_cloud_internal_handle_t *handle)
+/* A param left out of the shadow. It gets no delta callback and is never reported */
+static void aws_skip_param(esp_cloud_internal_handle_t *handle, jsonStruct_t *aws_param, int id, const char *why)
+{
+    ESP_LOGE(TAG, "Param %s %s. It will not be reported", handle->dynamic_cloud_params[id].name, why);
+    aws_param->pKey = NULL;
+    aws_param->cb = NULL;
+}
+
+/* Group consecutive params into shards whose worst case document fits in the buffer */
+static esp_err_t aws_shadow_create_shards(esp_cloud_internal_handle_t *handle, jsonStruct_t *dynamic_params)
+{
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    size_t capacity = MAX_LENGTH_OF_UPDATE_JSON_BUFFER - AWS_SHADOW_DOC_OVERHEAD;
+    /* At most one shard per param, plus the end marker */
+    uint16_t *shard_start = esp_cloud_mem_arena_alloc(handle->arena,
+            (handle->cur_dynamic_params_count + 1) * sizeof(uint16_t));
+    if (!shard_start) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint16_t shard_count = 0;
+    size_t shard_size = capacity;
+    int i;
+    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+        if (!dynamic_params[i].pKey) {
+            continue;
+        }
+        /* Reported and desired */
+        size_t size = 2 * esp_cloud_shadow_param_max_len(handle, i);
+        if (size > capacity) {
+            aws_skip_param(handle, &dynamic_params[i], i, "does not fit in a shadow update");
+            continue;
+        }
+        if (shard_size + size > capacity) {
+            shard_start[shard_count++] = i;
+            shard_size = 0;
+        }
+        shard_size += size;
+    }
+    shard_start[shard_count] = handle->cur_dynamic_params_count;
+    platform_data->shard_start = shard_start;
+    platform_data->shard_count = shard_count;
+    ESP_LOGI(TAG, "%d params in %d shadow shard(s)", handle->cur_dynamic_params_count, shard_count);
+    return ESP_OK;
+}
+
+static esp_err_t aws_platform_register_dynamic_params(esp_cloud_internal_handle_t *handle)
 {
     if (!handle || !handle->cloud_platform_priv) {
         return ESP_FAIL;
@@ -456,285 +709,422 @@ esp_err_t esp_cloud_platform_register_dynamic_params(esp_cloud_internal_handle_t
     if (handle->cur_dynamic_params_count == 0) {
         return ESP_OK;
     }
-    jsonStruct_t *dynamic_params = esp_cloud_mem_calloc(handle->cur_dynamic_params_count, sizeof(jsonStruct_t));
+    esp_cloud_mem_arena_t *arena = handle->arena;
+    size_t count = handle->cur_dynamic_params_count;
+    size_t bitmap_words = ESP_CLOUD_BITMAP_WORDS(count);
+    jsonStruct_t *dynamic_params = esp_cloud_mem_arena_alloc(arena, count * sizeof(jsonStruct_t));
+    jsonStruct_t **desired_handles = esp_cloud_mem_arena_alloc(arena, count * sizeof(jsonStruct_t *));
+    jsonStruct_t **reported_handles = esp_cloud_mem_arena_alloc(arena, count * sizeof(jsonStruct_t *));
+    uint32_t *update_params = esp_cloud_mem_arena_alloc(arena,
+            (AWS_SHADOW_MAX_IN_FLIGHT + 1) * 2 * bitmap_words * sizeof(uint32_t));
+    platform_data->doc_buf = esp_cloud_mem_arena_alloc(arena, MAX_LENGTH_OF_UPDATE_JSON_BUFFER);
+    if (!dynamic_params || !desired_handles || !reported_handles || !update_params || !platform_data->doc_buf) {
+        ESP_LOGE(TAG, "Failed to allocate memory");
+        return ESP_FAIL;
+    }
 
     int i;
-    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+    for (i = 0; i < count; i++) {
         dynamic_params[i].cb = aws_common_delta_callback;
-        esp_err_t err = esp_cloud_param_map_to_aws(&handle->dynamic_cloud_params[i], &dynamic_params[i]);
-        if (err == ESP_OK && dynamic_params[i].cb) {
+        esp_err_t err = esp_cloud_param_map_to_aws(arena, &handle->dynamic_cloud_params[i], &dynamic_params[i]);
+        if (err == ESP_ERR_NOT_SUPPORTED) {
+            /* One bad param should not take the others' reports down with it */
+            aws_skip_param(handle, &dynamic_params[i], i, "has no shadow type");
+        } else if (err != ESP_OK) {
+            return err;
+        }
+    }
+    esp_err_t err = aws_shadow_create_shards(handle, dynamic_params);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (i = 0; i < count; i++) {
+        if (dynamic_params[i].cb) {
             rc = aws_iot_shadow_register_delta(&platform_data->mqttClient, &dynamic_params[i]);
             if(SUCCESS != rc) {
                 ESP_LOGE(TAG, "Shadow Register Delta Error %d", rc);
-                free(dynamic_params);
                 return ESP_FAIL;
             }
         }
     }
-    jsonStruct_t **desired_handles = esp_cloud_mem_calloc(handle->cur_dynamic_params_count, sizeof(jsonStruct_t *));
-    if (desired_handles == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory");
-        free(dynamic_params);
-        return ESP_FAIL;
-    }
-
-    jsonStruct_t **reported_handles = esp_cloud_mem_calloc(handle->cur_dynamic_params_count, sizeof(jsonStruct_t *));
-    if (reported_handles == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory");
-        free(desired_handles);
-        free(dynamic_params);
-        return ESP_FAIL;
+    for (i = 0; i < AWS_SHADOW_MAX_IN_FLIGHT; i++) {
+        platform_data->updates[i].local_params = update_params;
+        platform_data->updates[i].remote_params = update_params + bitmap_words;
+        update_params += 2 * bitmap_words;
     }
+    platform_data->pending_local = update_params;
+    platform_data->pending_remote = update_params + bitmap_words;
     platform_data->dynamic_params = dynamic_params;
     platform_data->desired_handles = desired_handles;
     platform_data->reported_handles = reported_handles;
     return ESP_OK;
 }
 
-esp_err_t esp_cloud_platform_report_state(esp_cloud_internal_handle_t *handle)
+static esp_err_t aws_platform_report_state(esp_cloud_internal_handle_t *handle)
 {
     if (!handle || !handle->cloud_platform_priv) {
         return ESP_FAIL;
     }
-    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
     if (handle->cur_dynamic_params_count == 0) {
         return ESP_OK;
     }
-    // Report the initial values once
-    platform_data->reported_count = 0;
-    int i;
-    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
-        platform_data->reported_handles[platform_data->reported_count++] =
-                &platform_data->dynamic_params[i];
-    }
-    shadow_update(handle);  
-    while(platform_data->shadowUpdateInProgress) {
-        aws_iot_shadow_yield(&platform_data->mqttClient, 1000);
-        vTaskDelay(pdMS_TO_TICKS(500));
+    /* Fetch the cloud's copy first, so that only what differs is reported. The
+     * answer is handled in aws_shadow_get_callback() instead of waiting for it here.
+     */
+    if (dev_config.iot_reconnect != IOT_RECONNECT) {
+        aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+        IoT_Error_t rc = aws_iot_shadow_get(&platform_data->mqttClient, handle->device_id,
+                aws_shadow_get_callback, NULL, AWS_SHADOW_UPDATE_TIMEOUT_S, true);
+        if (SUCCESS == rc) {
+            return ESP_OK;
+        }
+        ESP_LOGW(TAG, "Shadow get failed %d", rc);
     }
+    /* Report all the values once, with the next update */
+    esp_cloud_shadow_request_full_report(handle);
+    aws_platform_wakeup(handle);
     return ESP_OK;
 }
-void get_new_value(esp_cloud_param_val_t *param_val, jsonStruct_t *dynamic_params)
+/* Copy the latest local value of a param into its AWS mirror */
+static esp_err_t aws_copy_param_value(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, jsonStruct_t *aws_param)
 {
-    switch(param_val->type) {
+    esp_cloud_param_val_t val = {
+        .type = handle->dynamic_cloud_params[id].val.type,
+        .val_size = handle->dynamic_cloud_params[id].val.val_size,
+    };
+    if (val.type == CLOUD_PARAM_TYPE_STRING) {
+        val.val.s = (char *)aws_param->pData;
+    }
+    esp_err_t err = esp_cloud_read_param_value(handle, id, &val);
+    if (err != ESP_OK) {
+        return err;
+    }
+    switch (val.type) {
         case CLOUD_PARAM_TYPE_BOOLEAN:
-            * (bool *)dynamic_params->pData = param_val->val.b;
-        break;
-
-         case CLOUD_PARAM_TYPE_STRING:
-            * (char *)dynamic_params->pData = param_val->val.s;
-        break;
-
-        case CLOUD_PARAM_TYPE_FLOAT:
-            * (float *)dynamic_params->pData = param_val->val.f;
-        break;
+            *(bool *)aws_param->pData = val.val.b;
+            break;
         case CLOUD_PARAM_TYPE_INTEGER:
-            * (int *)dynamic_params->pData = param_val->val.i;
-        break;
-
+            *(int *)aws_param->pData = val.val.i;
+            break;
+        case CLOUD_PARAM_TYPE_FLOAT:
+            *(float *)aws_param->pData = val.val.f;
+            break;
         default:
-            ESP_LOGE(TAG, "aws_get_new_param_val got invalid value type");
-        break;
+            break;
     }
+    return ESP_OK;
 }
-esp_err_t esp_cloud_platform_wait(esp_cloud_internal_handle_t *handle)
+
+/* Block on the control socket alone, as there is no MQTT socket while disconnected */
+static void aws_ctrl_socket_wait(aws_cloud_platform_data_t *platform_data, uint32_t timeout_ms)
 {
-    if (!handle || !handle->cloud_platform_priv) {
-        return ESP_FAIL;
+    if (platform_data->ctrl_fd < 0) {
+        vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+        return;
     }
-    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
-    IoT_Error_t rc = SUCCESS;
-    while (1) {
-        rc = aws_iot_shadow_yield(&platform_data->mqttClient, 5);
-        if (NETWORK_ATTEMPTING_RECONNECT == rc || platform_data->shadowUpdateInProgress) {
-           aws_iot_shadow_yield(&platform_data->mqttClient, 5);
-           if (NETWORK_ATTEMPTING_RECONNECT == rc ){
-               ESP_LOGW(TAG, "iot reconnect");
-               dev_config.iot_reconnect=IOT_RECONNECT;
-            //    led_timer_start();
-               net_disconnect_scan_start();
-               vTaskDelay(pdMS_TO_TICKS(500));
-           }
-            continue;
-        }
-
-        if (dev_config.iot_reconnect == IOT_RECONNECT ){
-               ESP_LOGW(TAG, "iot connected");
-               dev_config.iot_reconnect=IOT_RECONNECT_FINISH;
-               net_disconnect_scan_stop();
-               va_led_set(LED_OFF);
-            //    led_timer_stop();
-           }   
-
-        break;
-    }   
-
-    platform_data->desired_count = 0;
-    platform_data->reported_count = 0;
-    int i;
-    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
-        if (handle->dynamic_cloud_params[i].flags & CLOUD_PARAM_FLAG_LOCAL_CHANGE) {
-            get_new_value(&handle->dynamic_cloud_params[i].val, &platform_data->dynamic_params[i]);
-            platform_data->reported_handles[platform_data->reported_count++] =
-                &platform_data->dynamic_params[i];
-            platform_data->desired_handles[platform_data->desired_count++] =
-                &platform_data->dynamic_params[i];
-        } else if (handle->dynamic_cloud_params[i].flags & CLOUD_PARAM_FLAG_REMOTE_CHANGE) {
-            platform_data->reported_handles[platform_data->reported_count++] =
-                &platform_data->dynamic_params[i];
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(platform_data->ctrl_fd, &read_set);
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    if (select(platform_data->ctrl_fd + 1, &read_set, NULL, NULL, &tv) > 0) {
+        aws_ctrl_socket_drain(platform_data);
+    }
+}
 
-            platform_data->desired_handles[platform_data->desired_count++] =                //lin 2019-9-19
-                &platform_data->dynamic_params[i];
+static void aws_reconnect_wait(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms)
+{
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!esp_cloud_reconnect_due(handle, &timeout_ms)) {
+        aws_ctrl_socket_wait(platform_data, timeout_ms);
+        return;
+    }
+    /* Same as aws_iot_mqtt_attempt_reconnect(), with the attempt timed and classified */
+    esp_cloud_reconnect_attempt_started(handle);
+    IoT_Error_t rc = aws_iot_mqtt_connect(&platform_data->mqttClient, NULL);
+    if (SUCCESS == rc) {
+        rc = aws_iot_mqtt_resubscribe(&platform_data->mqttClient);
+        if (SUCCESS != rc) {
+            aws_iot_mqtt_disconnect(&platform_data->mqttClient);
         }
-        handle->dynamic_cloud_params[i].flags = 0;
     }
-
-    if (platform_data->reported_count > 0 || platform_data->desired_count > 0) {
-        rc = shadow_update(handle);
+    if (SUCCESS != rc && NETWORK_ALREADY_CONNECTED_ERROR != rc) {
+        ESP_LOGW(TAG, "iot reconnect failed %d", rc);
+        esp_cloud_reconnect_failed(handle, aws_conn_err(rc));
+        return;
     }
-    return ESP_OK;
+    ESP_LOGW(TAG, "iot connected");
+    esp_cloud_reconnect_succeeded(handle);
+    dev_config.iot_reconnect=IOT_RECONNECT_FINISH;
+    net_disconnect_scan_stop();
+    va_led_set(LED_OFF);
+    platform_data->last_yield_ms = aws_time_ms();
 }
 
-
-esp_err_t esp_cloud_platform_init(esp_cloud_internal_handle_t *handle)
+static esp_err_t aws_platform_wait(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms)
 {
-    if (handle->cloud_platform_priv) {
-        return ESP_FAIL;
-    }
-    ESP_LOGI(TAG, "Initialising Cloud");
-    aws_cloud_platform_data_t *platform_data = esp_cloud_mem_calloc(1, sizeof(aws_cloud_platform_data_t));
-
-    if (!platform_data) {
+    if (!handle || !handle->cloud_platform_priv) {
         return ESP_FAIL;
     }
-    if ((platform_data->mqtt_host = esp_cloud_storage_get("mqtt_host")) == NULL) {   
-        goto init_err;
-    }
-    ESP_LOGI(TAG, "platform_data->mqtt_host:%s",platform_data->mqtt_host);
-    int64_t crc = 0;
-    prov_config.dev_config.dev_crc = 0;
-    crc = crc32_le(0, (uint8_t*)platform_data->mqtt_host,strlen(platform_data->mqtt_host));
-    prov_config.dev_config.dev_crc  += crc;
-    
-    if ((platform_data->client_cert = esp_cloud_storage_get("client_cert")) == NULL) {
-        goto init_err;
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (dev_config.iot_reconnect == IOT_RECONNECT) {
+        aws_reconnect_wait(handle, timeout_ms);
+        return ESP_OK;
     }
-    crc = crc32_le(0, (uint8_t*)platform_data->client_cert,strlen(platform_data->client_cert));
-    prov_config.dev_config.dev_crc  += crc;
-
-    if ((platform_data->client_key = esp_cloud_storage_get("client_key")) == NULL) {
-        goto init_err;
+    uint32_t since_yield = aws_time_ms() - platform_data->last_yield_ms;
+    bool yield_due = (since_yield >= AWS_IDLE_YIELD_INTERVAL_MS);
+    if (!yield_due && (AWS_IDLE_YIELD_INTERVAL_MS - since_yield < timeout_ms)) {
+        timeout_ms = AWS_IDLE_YIELD_INTERVAL_MS - since_yield;
+    }
+
+    TLSDataParams *tls = &platform_data->mqttClient.networkStack.tlsDataParams;
+    int mqtt_fd = tls->server_fd.fd;
+    /* mbedTLS may already hold decrypted data which select() cannot see */
+    bool readable = (mqtt_fd >= 0) && (mbedtls_ssl_get_bytes_avail(&tls->ssl) > 0);
+    if (!readable && !yield_due) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        int max_fd = -1;
+        if (platform_data->ctrl_fd >= 0) {
+            FD_SET(platform_data->ctrl_fd, &read_set);
+            max_fd = platform_data->ctrl_fd;
+        }
+        if (mqtt_fd >= 0) {
+            FD_SET(mqtt_fd, &read_set);
+            max_fd = (mqtt_fd > max_fd) ? mqtt_fd : max_fd;
+        }
+        struct timeval tv = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_usec = (timeout_ms % 1000) * 1000,
+        };
+        int ret = select(max_fd + 1, &read_set, NULL, NULL, &tv);
+        if (ret > 0) {
+            if ((platform_data->ctrl_fd >= 0) && FD_ISSET(platform_data->ctrl_fd, &read_set)) {
+                aws_ctrl_socket_drain(platform_data);
+            }
+            readable = (mqtt_fd >= 0) && FD_ISSET(mqtt_fd, &read_set);
+        }
+        yield_due = (aws_time_ms() - platform_data->last_yield_ms) >= AWS_IDLE_YIELD_INTERVAL_MS;
     }
-    crc = crc32_le(0, (uint8_t*)platform_data->client_key,strlen(platform_data->client_key));
-    prov_config.dev_config.dev_crc  += crc;
-
-    if ((platform_data->server_cert = esp_cloud_storage_get("server_cert")) == NULL) {
-        goto init_err;
+    if (!readable && !yield_due) {
+        return ESP_OK;
     }
-    crc = crc32_le(0, (uint8_t*)platform_data->server_cert,strlen(platform_data->server_cert));
-    prov_config.dev_config.dev_crc  += crc;
 
-    if ((platform_data->ota_cert = esp_cloud_storage_get("ota_server_cert")) == NULL) {
-        goto init_err;
+    IoT_Error_t rc = aws_iot_shadow_yield(&platform_data->mqttClient, AWS_YIELD_TIMEOUT_MS);
+    platform_data->last_yield_ms = aws_time_ms();
+    if (NETWORK_DISCONNECTED_ERROR == rc || !aws_iot_mqtt_is_client_connected(&platform_data->mqttClient)) {
+        ESP_LOGW(TAG, "iot reconnect");
+        dev_config.iot_reconnect=IOT_RECONNECT;
+        net_disconnect_scan_start();
+        esp_cloud_reconnect_lost(handle);
     }
-    crc = crc32_le(0, (uint8_t*)platform_data->ota_cert,strlen(platform_data->ota_cert));
-    prov_config.dev_config.dev_crc  += crc;
-    
-    handle->cloud_platform_priv = platform_data;
     return ESP_OK;
+}
 
-init_err:
-    if (platform_data->server_cert) {
-        free(platform_data->server_cert);
-    }
-    if (platform_data->client_key) {
-        free(platform_data->client_key);
-    }
-    if (platform_data->client_cert) {
-        free(platform_data->client_cert);
-    }
-    if (platform_data->mqtt_host) {
-        free(platform_data->mqtt_host);
+/* Bits of a bitmap word which fall in the id range [start, end) */
+static uint32_t aws_range_mask(int word, int start, int end)
+{
+    int lo = (start > word * 32) ? (start - word * 32) : 0;
+    int hi = (end < (word + 1) * 32) ? (end - word * 32) : 32;
+    if (lo >= hi) {
+        return 0;
     }
+    uint32_t mask = (hi == 32) ? UINT32_MAX : (((uint32_t)1 << hi) - 1);
+    return mask & ~(((uint32_t)1 << lo) - 1);
+}
 
-     if (platform_data->ota_cert) {
-        free(platform_data->ota_cert);
+static bool aws_range_changed(uint32_t *local, uint32_t *remote, int start, int end)
+{
+    int word;
+    for (word = start / 32; word <= (end - 1) / 32; word++) {
+        if ((local[word] | remote[word]) & aws_range_mask(word, start, end)) {
+            return true;
+        }
     }
-    free(platform_data);
-    return ESP_FAIL;
+    return false;
 }
 
-
-esp_err_t esp_cloud_platform_deinit(esp_cloud_internal_handle_t *handle)
+/* Fill in the update slot and the reported/desired handles for the params of one shard */
+static void aws_shadow_fill_update(esp_cloud_internal_handle_t *handle, aws_shadow_update_t *update,
+        int start, int end, bool full_report)
 {
-    if (handle->cloud_platform_priv) {
-        free(handle->cloud_platform_priv);
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    int words = ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count);
+    memset(update->local_params, 0, words * sizeof(uint32_t));
+    memset(update->remote_params, 0, words * sizeof(uint32_t));
+    update->full_report = full_report;
+    platform_data->desired_count = 0;
+    platform_data->reported_count = 0;
+    int word;
+    for (word = start / 32; word <= (end - 1) / 32; word++) {
+        uint32_t range = aws_range_mask(word, start, end);
+        uint32_t local = platform_data->pending_local[word] & range;
+        uint32_t remote = platform_data->pending_remote[word] & range & ~local;
+        uint32_t changed = local | remote;
+        update->local_params[word] = local;
+        update->remote_params[word] = remote;
+        uint32_t report = full_report ? range : changed;
+        /* Visit only the params whose bits are set */
+        while (report) {
+            int bit = __builtin_ctz(report);
+            uint32_t mask = (uint32_t)1 << bit;
+            report &= report - 1;
+            int i = (word * 32) + bit;
+            if (!platform_data->dynamic_params[i].pKey) {
+                /* Skipped at registration. Its changes are dropped */
+                update->local_params[word] &= ~mask;
+                update->remote_params[word] &= ~mask;
+                continue;
+            }
+            if (local & mask) {
+                aws_copy_param_value(handle, i, &platform_data->dynamic_params[i]);
+            }
+            platform_data->reported_handles[platform_data->reported_count++] =
+                &platform_data->dynamic_params[i];
+            /* A full report only refreshes the reported state */
+            if (changed & mask) {
+                platform_data->desired_handles[platform_data->desired_count++] =                //lin 2019-9-19
+                    &platform_data->dynamic_params[i];
+            }
+        }
     }
-    ESP_LOGI(TAG, "Initialising Cloud again");
-    aws_cloud_platform_data_t *platform_data = esp_cloud_mem_calloc(1, sizeof(aws_cloud_platform_data_t));
+}
 
-    if (platform_data->server_cert) {
-        free(platform_data->server_cert);
+static esp_err_t aws_platform_report_changes(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->cloud_platform_priv) {
+        return ESP_FAIL;
     }
-    if (platform_data->client_key) {
-        free(platform_data->client_key);
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data->dynamic_params || (dev_config.iot_reconnect == IOT_RECONNECT)) {
+        return ESP_OK;
     }
-    if (platform_data->client_cert) {
-        free(platform_data->client_cert);
+    /* Changes stay in the bitmaps until an update slot frees up */
+    if (!aws_shadow_update_get_free(platform_data)) {
+        return ESP_ERR_NO_MEM;
+    }
+    bool full_report = esp_cloud_shadow_take_full_report(handle);
+    uint32_t *local = platform_data->pending_local;
+    uint32_t *remote = platform_data->pending_remote;
+    /* Snapshot all the words at once, so that a committed transaction is never split */
+    esp_cloud_fetch_changed_params(handle, local, remote);
+
+    int docs = 0;
+    int params = 0;
+    esp_err_t err = ESP_OK;
+    int shard;
+    for (shard = 0; shard < platform_data->shard_count; shard++) {
+        int start = platform_data->shard_start[shard];
+        int end = platform_data->shard_start[shard + 1];
+        /* Shards without changes are not touched */
+        if (!full_report && !aws_range_changed(local, remote, start, end)) {
+            continue;
+        }
+        aws_shadow_update_t *update = aws_shadow_update_get_free(platform_data);
+        if (!update) {
+            /* The rest goes out once an ack frees up a slot */
+            esp_cloud_shadow_requeue(handle, local, remote, start);
+            if (full_report) {
+                esp_cloud_shadow_request_full_report(handle);
+            }
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+        aws_shadow_fill_update(handle, update, start, end, full_report);
+        if (platform_data->reported_count == 0) {
+            /* Only skipped params changed */
+            continue;
+        }
+        IoT_Error_t rc = shadow_update(handle, update);
+        if (rc != SUCCESS) {
+            ESP_LOGE(TAG, "Shadow update failed %d", rc);
+            aws_shadow_update_retry(handle, update);
+            err = ESP_FAIL;
+            continue;
+        }
+        /* Only now that the document is out do the params count as reported */
+        int i;
+        for (i = 0; i < platform_data->reported_count; i++) {
+            esp_cloud_param_report_sent(handle, platform_data->reported_handles[i] - platform_data->dynamic_params);
+        }
+        docs++;
+        params += platform_data->reported_count;
     }
-    if (platform_data->mqtt_host) {
-        free(platform_data->mqtt_host);
+    if (docs) {
+        esp_cloud_shadow_update_sent(handle, docs, params);
     }
+    return err;
+}
 
-     if (platform_data->ota_cert) {
-        free(platform_data->ota_cert);
-    }
 
-   
-    if (!platform_data) {
+static esp_err_t aws_platform_init(esp_cloud_internal_handle_t *handle)
+{
+    if (handle->cloud_platform_priv) {
         return ESP_FAIL;
     }
-    if ((platform_data->mqtt_host = esp_cloud_storage_get("mqtt_host")) == NULL) {
-        goto init_err;
-    }
-    ESP_LOGI(TAG, "replace platform_data->mqtt_host:%s",platform_data->mqtt_host);
-    if ((platform_data->client_cert = esp_cloud_storage_get("client_cert")) == NULL) {
-        goto init_err;
-    }
-
-    if ((platform_data->client_key = esp_cloud_storage_get("client_key")) == NULL) {
-        goto init_err;
-    }
-
-    if ((platform_data->server_cert = esp_cloud_storage_get("server_cert")) == NULL) {
-        goto init_err;
+    ESP_LOGI(TAG, "Initialising Cloud");
+    const esp_cloud_creds_t *creds = esp_cloud_get_creds(handle);
+    const char *entries[] = {creds->mqtt_host, creds->client_cert, creds->client_key,
+            creds->server_cert, creds->ota_server_cert};
+    prov_config.dev_config.dev_crc = 0;
+    for (int i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+        if (!entries[i]) {
+            ESP_LOGE(TAG, "Cloud credentials not found");
+            return ESP_FAIL;
+        }
+        prov_config.dev_config.dev_crc += crc32_le(0, (uint8_t *)entries[i], strlen(entries[i]));
     }
+    ESP_LOGI(TAG, "mqtt_host:%s", creds->mqtt_host);
 
-    if ((platform_data->ota_cert = esp_cloud_storage_get("ota_server_cert")) == NULL) {
-        goto init_err;
+    aws_cloud_platform_data_t *platform_data = esp_cloud_mem_calloc(1, sizeof(aws_cloud_platform_data_t));
+    if (!platform_data) {
+        return ESP_FAIL;
     }
-    
+    platform_data->ctrl_fd = -1;
     handle->cloud_platform_priv = platform_data;
     return ESP_OK;
+}
 
-init_err:
-    if (platform_data->server_cert) {
-        free(platform_data->server_cert);
-    }
-    if (platform_data->client_key) {
-        free(platform_data->client_key);
-    }
-    if (platform_data->client_cert) {
-        free(platform_data->client_cert);
+
+static esp_err_t aws_platform_deinit(esp_cloud_internal_handle_t *handle)
+{
+    aws_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
     }
-    if (platform_data->mqtt_host) {
-        free(platform_data->mqtt_host);
+    /* Tear down the TLS session, which refers to the credentials, before they can be freed */
+    if (platform_data->shadow_inited && aws_iot_mqtt_is_client_connected(&platform_data->mqttClient)) {
+        aws_iot_mqtt_disconnect(&platform_data->mqttClient);
     }
-
-     if (platform_data->ota_cert) {
-        free(platform_data->ota_cert);
+    if (platform_data->ctrl_fd >= 0) {
+        close(platform_data->ctrl_fd);
     }
+    esp_cloud_topic_router_clear(&platform_data->router);
     free(platform_data);
-    return ESP_FAIL;
+    handle->cloud_platform_priv = NULL;
+    return ESP_OK;
 }
 
+
+static const esp_cloud_platform_ops_t aws_platform_ops = {
+    .name = "aws",
+    .init = aws_platform_init,
+    .deinit = aws_platform_deinit,
+    .connect = aws_platform_connect,
+    .disconnect = aws_platform_disconnect,
+    .wait = aws_platform_wait,
+    .wakeup = aws_platform_wakeup,
+    .report_changes = aws_platform_report_changes,
+    .report_state = aws_platform_report_state,
+    .register_dynamic_params = aws_platform_register_dynamic_params,
+    .publish = aws_platform_publish,
+    .subscribe = aws_platform_subscribe,
+    .unsubscribe = aws_platform_unsubscribe,
+};
+
+const esp_cloud_platform_ops_t *esp_cloud_platform_aws(void)
+{
+    return &aws_platform_ops;
+}
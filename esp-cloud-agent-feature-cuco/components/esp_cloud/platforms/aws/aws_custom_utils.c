@@ -16,120 +16,133 @@
 #include "aws_custom_utils.h"
 #include "string.h"
 
-#define OBJECT_NAME_STRING "\"%s\":{"
+/* Write position in the document. len always has a '\0' after it, so that
+ * the SDK can carry on from where this left off.
+ */
+typedef struct {
+	char *buf;
+	size_t size;
+	size_t len;
+} json_cursor_t;
 
-static inline IoT_Error_t check_snprintf_ret_val(int32_t snPrintfReturn, size_t maxSizeOfJsonDocument) {
-	if(snPrintfReturn < 0) {
-		return SHADOW_JSON_ERROR;
-	} else if((size_t) snPrintfReturn >= maxSizeOfJsonDocument) {
-		return SHADOW_JSON_BUFFER_TRUNCATED;
+static inline bool cursor_put(json_cursor_t *cur, const char *str, size_t str_len) {
+	if(str_len >= cur->size - cur->len) {
+		return false;
 	}
-	return SUCCESS;
+	memcpy(cur->buf + cur->len, str, str_len);
+	cur->len += str_len;
+	cur->buf[cur->len] = '\0';
+	return true;
 }
 
-static IoT_Error_t convert_data_to_string(char *pStringBuffer, size_t maxSizeofStringBuffer, JsonPrimitiveType type,
-									   void *pData) {
-	int32_t snPrintfReturn = 0;
-	IoT_Error_t ret_val = SUCCESS;
-
-	if(maxSizeofStringBuffer == 0) {
-		return SHADOW_JSON_ERROR;
+static bool cursor_put_uint(json_cursor_t *cur, uint32_t val, bool negative) {
+	char digits[11];
+	char *p = digits + sizeof(digits);
+	do {
+		*--p = '0' + (val % 10);
+		val /= 10;
+	} while(val);
+	if(negative) {
+		*--p = '-';
 	}
+	return cursor_put(cur, p, digits + sizeof(digits) - p);
+}
 
-	if(type == SHADOW_JSON_INT32) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%i,", *(int32_t *) (pData));
-	} else if(type == SHADOW_JSON_INT16) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hi,", *(int16_t *) (pData));
-	} else if(type == SHADOW_JSON_INT8) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hhi,", *(int8_t *) (pData));
-	} else if(type == SHADOW_JSON_UINT32) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%u,", *(uint32_t *) (pData));
-	} else if(type == SHADOW_JSON_UINT16) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hu,", *(uint16_t *) (pData));
-	} else if(type == SHADOW_JSON_UINT8) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%hhu,", *(uint8_t *) (pData));
-	} else if(type == SHADOW_JSON_DOUBLE) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%f,", *(double *) (pData));
-	} else if(type == SHADOW_JSON_FLOAT) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%f,", *(float *) (pData));
-	} else if(type == SHADOW_JSON_BOOL) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%s,", *(bool *) (pData) ? "true" : "false");
-	} else if(type == SHADOW_JSON_STRING) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "\"%s\",", (char *) (pData));
-	} else if(type == SHADOW_JSON_OBJECT) {
-		snPrintfReturn = snprintf(pStringBuffer, maxSizeofStringBuffer, "%s,", (char *) (pData));
-	}
+static bool cursor_put_int(json_cursor_t *cur, int32_t val) {
+	/* Negate as unsigned, so that INT32_MIN does not overflow */
+	return cursor_put_uint(cur, val < 0 ? 0 - (uint32_t)val : (uint32_t)val, val < 0);
+}
 
-	ret_val = check_snprintf_ret_val(snPrintfReturn, maxSizeofStringBuffer);
+static bool cursor_put_double(json_cursor_t *cur, double val) {
+	size_t rem = cur->size - cur->len;
+	int ret = snprintf(cur->buf + cur->len, rem, "%f", val);
+	if(ret < 0 || (size_t)ret >= rem) {
+		cur->buf[cur->len] = '\0';
+		return false;
+	}
+	cur->len += ret;
+	return true;
+}
 
-	return ret_val;
+static bool convert_data_to_string(json_cursor_t *cur, JsonPrimitiveType type, void *pData) {
+	switch(type) {
+		case SHADOW_JSON_INT32:
+			return cursor_put_int(cur, *(int32_t *) (pData));
+		case SHADOW_JSON_INT16:
+			return cursor_put_int(cur, *(int16_t *) (pData));
+		case SHADOW_JSON_INT8:
+			return cursor_put_int(cur, *(int8_t *) (pData));
+		case SHADOW_JSON_UINT32:
+			return cursor_put_uint(cur, *(uint32_t *) (pData), false);
+		case SHADOW_JSON_UINT16:
+			return cursor_put_uint(cur, *(uint16_t *) (pData), false);
+		case SHADOW_JSON_UINT8:
+			return cursor_put_uint(cur, *(uint8_t *) (pData), false);
+		case SHADOW_JSON_DOUBLE:
+			return cursor_put_double(cur, *(double *) (pData));
+		case SHADOW_JSON_FLOAT:
+			return cursor_put_double(cur, *(float *) (pData));
+		case SHADOW_JSON_BOOL:
+			return *(bool *) (pData) ? cursor_put(cur, "true", 4) : cursor_put(cur, "false", 5);
+		case SHADOW_JSON_STRING:
+			return cursor_put(cur, "\"", 1) && cursor_put(cur, pData, strlen(pData)) && cursor_put(cur, "\"", 1);
+		case SHADOW_JSON_OBJECT:
+			return cursor_put(cur, pData, strlen(pData));
+		default:
+			/* Written as nothing, as the snprintf() based version did */
+			return true;
+	}
 }
 
-static IoT_Error_t generate_json_object(char *object_name, char *pJsonDocument, size_t maxSizeOfJsonDocument, uint8_t count, jsonStruct_t **handler) {
-	IoT_Error_t ret_val = SUCCESS;
-	size_t tempSize = 0;
-	int8_t i;
+/* The document is measured once on entry and then written at the cursor, so
+ * the cost is linear in the number of params.
+ */
+static IoT_Error_t generate_json_object(const char *object_name, char *pJsonDocument, size_t maxSizeOfJsonDocument, uint16_t count, jsonStruct_t **handler) {
+	int i;
 	jsonStruct_t *pTemporary = NULL;
-	size_t remSizeOfJsonBuffer = maxSizeOfJsonDocument;
-	int32_t snPrintfReturn = 0;
 
 	if(pJsonDocument == NULL) {
 		return NULL_VALUE_ERROR;
 	}
 
-	tempSize = maxSizeOfJsonDocument - strlen(pJsonDocument);
-	if(tempSize <= 1) {
+	json_cursor_t cur = {
+		.buf = pJsonDocument,
+		.size = maxSizeOfJsonDocument,
+		.len = strlen(pJsonDocument),
+	};
+	if(cur.size - cur.len <= 1) {
 		return SHADOW_JSON_ERROR;
 	}
-	remSizeOfJsonBuffer = tempSize;
 
-	snPrintfReturn = snprintf(pJsonDocument + strlen(pJsonDocument), remSizeOfJsonBuffer, OBJECT_NAME_STRING, object_name);
-	ret_val = check_snprintf_ret_val(snPrintfReturn, maxSizeOfJsonDocument);
-	if (ret_val != SUCCESS) {
-		return ret_val;
+	if(!cursor_put(&cur, "\"", 1) || !cursor_put(&cur, object_name, strlen(object_name))
+			|| !cursor_put(&cur, "\":{", 3)) {
+		return SHADOW_JSON_BUFFER_TRUNCATED;
 	}
 	for(i = 0; i < count; i++) {
-		tempSize = maxSizeOfJsonDocument - strlen(pJsonDocument);
-		if(tempSize <= 1) {
-			return SHADOW_JSON_ERROR;
-		}
-		remSizeOfJsonBuffer = tempSize;
 		pTemporary = (jsonStruct_t *)handler[i];
-		if(pTemporary != NULL) {
-			snPrintfReturn = snprintf(pJsonDocument + strlen(pJsonDocument), remSizeOfJsonBuffer, "\"%s\":",
-									  pTemporary->pKey);
-			if (snPrintfReturn < 0) {
-				return NULL_VALUE_ERROR;
-			}
-			if(ret_val != SUCCESS) {
-				return ret_val;
-			}
-			if(pTemporary->pKey != NULL && pTemporary->pData != NULL) {				
-                ret_val = convert_data_to_string(pJsonDocument + strlen(pJsonDocument), remSizeOfJsonBuffer,
-											  pTemporary->type, pTemporary->pData);
-			} else {
-				return NULL_VALUE_ERROR;
-			}
-			if(ret_val != SUCCESS) {
-				return ret_val;
-			}
-		} else {
+		if(pTemporary == NULL || pTemporary->pKey == NULL || pTemporary->pData == NULL) {
 			return NULL_VALUE_ERROR;
 		}
+		if(!cursor_put(&cur, "\"", 1) || !cursor_put(&cur, pTemporary->pKey, strlen(pTemporary->pKey))
+				|| !cursor_put(&cur, "\":", 2)
+				|| !convert_data_to_string(&cur, pTemporary->type, pTemporary->pData)
+				|| !cursor_put(&cur, ",", 1)) {
+			return SHADOW_JSON_BUFFER_TRUNCATED;
+		}
 	}
 
-	snPrintfReturn = snprintf(pJsonDocument + strlen(pJsonDocument) - 1, remSizeOfJsonBuffer, "},");
-	ret_val = check_snprintf_ret_val(snPrintfReturn, maxSizeOfJsonDocument);
-	if (ret_val != SUCCESS) {
-		return ret_val;
-	}	
+	/* The closing brace takes the place of the last comma */
+	cur.len--;
+	if(!cursor_put(&cur, "},", 2)) {
+		return SHADOW_JSON_BUFFER_TRUNCATED;
+	}
 
-	return ret_val;
+	return SUCCESS;
 }
 
 IoT_Error_t custom_aws_iot_shadow_add_desired(char *pJsonDocument,
 											  size_t maxSizeOfJsonDocument,
-											  uint8_t count,
+											  uint16_t count,
 											  jsonStruct_t **handler)
 {
 	return generate_json_object("desired", pJsonDocument, maxSizeOfJsonDocument, count, handler);
@@ -137,7 +150,7 @@ IoT_Error_t custom_aws_iot_shadow_add_desired(char *pJsonDocument,
 
 IoT_Error_t custom_aws_iot_shadow_add_reported(char *pJsonDocument,
 					     size_t maxSizeOfJsonDocument,
-						 uint8_t count, 
+						 uint16_t count, 
 						 jsonStruct_t **handler)
 {
 	return generate_json_object("reported", pJsonDocument, maxSizeOfJsonDocument, count, handler);
@@ -16,16 +16,136 @@
 #include <esp_cloud_internal.h>
 typedef void (*esp_cloud_platform_subscribe_cb_t) (const char *topic, void *payload, size_t payload_len, void *priv_data);
 
+/* Operations of a cloud platform backend. The backend is picked at esp_cloud_init()
+ * time using esp_cloud_config_t.platform and the rest of the agent reaches it only
+ * through the esp_cloud_platform_*() wrappers below.
+ */
+struct esp_cloud_platform_ops {
+    const char *name;
+    esp_err_t (*init)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*deinit)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*connect)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*disconnect)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*wait)(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms);
+    void (*wakeup)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*report_changes)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*report_state)(esp_cloud_internal_handle_t *handle);
+    esp_err_t (*register_dynamic_params)(esp_cloud_internal_handle_t *handle);
+    /* data need not be NUL terminated */
+    esp_err_t (*publish)(esp_cloud_internal_handle_t *handle, const char *topic, const char *data, size_t data_len);
+    esp_err_t (*subscribe)(esp_cloud_internal_handle_t *handle, const char *topic,
+            esp_cloud_platform_subscribe_cb_t cb, void *priv_data);
+    esp_err_t (*unsubscribe)(esp_cloud_internal_handle_t *handle, const char *topic);
+};
+
+/* Why a connection attempt failed, which decides how soon the next one is made */
+typedef enum {
+    /* No network on the device's side, eg. DNS or TCP connect failing */
+    ESP_CLOUD_CONN_ERR_NETWORK,
+    /* Anything else which may go away by itself, eg. TLS or MQTT level failures */
+    ESP_CLOUD_CONN_ERR_TRANSIENT,
+    /* The cloud refused the device's credentials */
+    ESP_CLOUD_CONN_ERR_AUTH,
+} esp_cloud_conn_err_t;
+
+#define ESP_CLOUD_RECONNECT_GIVE_UP     UINT32_MAX
+
+#ifdef CONFIG_ESP_CLOUD_PERSISTENT_SESSION
+#define ESP_CLOUD_PERSISTENT_SESSION    true
+#else
+#define ESP_CLOUD_PERSISTENT_SESSION    false
+#endif
+
+/* Connection policy shared by the platforms. connect() makes a single attempt and
+ * reports its outcome through esp_cloud_reconnect_succeeded() or _failed(). After
+ * a connection loss, reported using esp_cloud_reconnect_lost(), the platform makes
+ * further attempts from wait(), whenever esp_cloud_reconnect_due() allows.
+ */
+void esp_cloud_reconnect_lost(esp_cloud_internal_handle_t *handle);
+bool esp_cloud_reconnect_due(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms);
+uint32_t esp_cloud_reconnect_failed(esp_cloud_internal_handle_t *handle, esp_cloud_conn_err_t err);
+/* Jittered wait before retry number attempt, also used for retries other than connecting */
+uint32_t esp_cloud_backoff_delay(esp_cloud_conn_err_t err, uint16_t attempt);
+/* Marks the start of an attempt, which times the handshake of a successful one */
+void esp_cloud_reconnect_attempt_started(esp_cloud_internal_handle_t *handle);
+/* Neither the AWS SDK nor esp-mqtt passes on the CONNACK session present flag, so a
+ * platform cannot tell whether the broker kept the session. It subscribes again after
+ * every connection, which a broker still holding the subscriptions simply replaces.
+ */
+void esp_cloud_reconnect_succeeded(esp_cloud_internal_handle_t *handle);
+
+/* Credentials loaded by esp_cloud_init(). Platforms borrow these for as long as the
+ * handle lives instead of reading their own copies from storage.
+ */
+const esp_cloud_creds_t *esp_cloud_get_creds(esp_cloud_internal_handle_t *handle);
+
 esp_err_t esp_cloud_platform_init(esp_cloud_internal_handle_t *handle);
 esp_err_t esp_cloud_platform_deinit(esp_cloud_internal_handle_t *handle);
 esp_err_t esp_cloud_platform_connect(esp_cloud_internal_handle_t *handle);
-esp_err_t esp_cloud_platform_wait(esp_cloud_internal_handle_t *handle);
+/* Block until inbound data arrives, esp_cloud_platform_wakeup() is called or the timeout expires */
+esp_err_t esp_cloud_platform_wait(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms);
+/* Wake up a cloud task blocked in esp_cloud_platform_wait(). Can be called from any task */
+void esp_cloud_platform_wakeup(esp_cloud_internal_handle_t *handle);
+/* Report the dynamic params changed since the last call */
+esp_err_t esp_cloud_platform_report_changes(esp_cloud_internal_handle_t *handle);
 esp_err_t esp_cloud_platform_disconnect(esp_cloud_internal_handle_t *handle);
 
 esp_err_t esp_cloud_platform_report_state(esp_cloud_internal_handle_t *handle);
 esp_err_t esp_cloud_platform_register_dynamic_params(esp_cloud_internal_handle_t *handle);
 
-esp_err_t esp_cloud_platform_publish(esp_cloud_internal_handle_t *handle, const char *topic, const char *data);
+/* Publishes to one of the agent's own topics. Messages which cannot be published right
+ * away go to the outbox, if there is one, and are replayed later, unless still queued
+ * after the default time to live. data need not be NUL terminated.
+ */
+esp_err_t esp_cloud_platform_publish_id(esp_cloud_internal_handle_t *handle, esp_cloud_topic_id_t id,
+        const char *data, size_t data_len);
+/* Called by a platform for a message it accepted but could not deliver, such as a
+ * QoS1 publish whose PUBACK never came. Puts it in the outbox with the default time
+ * to live. Without an outbox, the message is lost.
+ */
+void esp_cloud_platform_publish_failed(esp_cloud_internal_handle_t *handle, const char *topic, const char *data,
+        size_t data_len);
 esp_err_t esp_cloud_platform_subscribe(esp_cloud_internal_handle_t *handle, const char *topic, esp_cloud_platform_subscribe_cb_t cb, void *priv_data);
 esp_err_t esp_cloud_platform_unsubscribe(esp_cloud_internal_handle_t *handle, const char *topic);
 
+/* Topic router shared by the platforms. Subscriptions are kept in a trie of topic
+ * levels, so dispatching a message costs O(topic depth) rather than a scan of all
+ * subscriptions, and any number of them can be held. Filters may use the MQTT '+'
+ * and '#' wildcards. A zero initialised router is empty.
+ *
+ * The router does not lock. Use it only from the cloud task, and do not add or
+ * remove subscriptions from the callbacks it invokes.
+ */
+typedef struct esp_cloud_topic_node esp_cloud_topic_node_t;
+typedef struct {
+    esp_cloud_topic_node_t *root;
+    uint16_t filter_count;
+    bool dispatching;
+} esp_cloud_topic_router_t;
+typedef void (*esp_cloud_topic_router_foreach_cb_t)(const char *filter, esp_cloud_topic_node_t *node, void *priv_data);
+
+bool esp_cloud_topic_filter_is_valid(const char *filter);
+/* Add a callback for a filter. *new_filter is set if the filter had no callbacks yet,
+ * ie. the platform has to subscribe to it. *node is the filter's node, which stays
+ * valid until the filter is removed.
+ */
+esp_err_t esp_cloud_topic_router_add(esp_cloud_topic_router_t *router, const char *filter,
+        esp_cloud_platform_subscribe_cb_t cb, void *priv_data, esp_cloud_topic_node_t **node, bool *new_filter);
+/* Remove all the callbacks of a filter */
+esp_err_t esp_cloud_topic_router_remove(esp_cloud_topic_router_t *router, const char *filter);
+/* Remove all the callbacks of a filter, but keep its node and filter string for a
+ * platform which still refers to them. Messages for it then reach nobody. Adding
+ * the filter again reuses the node without *new_filter, and removing it frees it.
+ */
+esp_err_t esp_cloud_topic_router_retire(esp_cloud_topic_router_t *router, const char *filter);
+/* Invoke the callbacks of all filters matching the topic. Returns the number invoked */
+int esp_cloud_topic_router_dispatch(esp_cloud_topic_router_t *router, const char *topic, void *payload,
+        size_t payload_len);
+/* Invoke the callbacks of one filter, for platforms which match filters themselves */
+int esp_cloud_topic_router_deliver(esp_cloud_topic_node_t *node, const char *topic, void *payload,
+        size_t payload_len);
+const char *esp_cloud_topic_router_node_filter(const esp_cloud_topic_node_t *node);
+void esp_cloud_topic_router_foreach(esp_cloud_topic_router_t *router, esp_cloud_topic_router_foreach_cb_t fn,
+        void *priv_data);
+void esp_cloud_topic_router_clear(esp_cloud_topic_router_t *router);
+
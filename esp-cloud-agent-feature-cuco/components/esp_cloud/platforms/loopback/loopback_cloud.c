@@ -0,0 +1,478 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <json_generator.h>
+
+#include <esp_cloud_mem.h>
+#include <esp_cloud.h>
+#include <esp_cloud_loopback.h>
+
+#include "esp_cloud_platform.h"
+
+/* In-memory platform backend. Nothing leaves the device: publishes are recorded,
+ * shadow updates are generated and acknowledged right away, and messages, deltas
+ * and shadow GET answers injected through esp_cloud_loopback.h are handled by the
+ * cloud task. Used to exercise the core agent without a broker.
+ */
+
+static const char *TAG = "loopback_cloud";
+
+#define LOOPBACK_SHADOW_TOPIC_FMT   "$aws/things/%s/shadow/update"
+#define LOOPBACK_GET_TOPIC_FMT      "$aws/things/%s/shadow/get"
+/* As for the MQTT backend. Unanswered GETs fall back to a full report after this */
+#define LOOPBACK_GET_TIMEOUT_MS     4000
+/* {"state":{"reported":{}}} and some slack */
+#define LOOPBACK_DOC_OVERHEAD       64
+
+typedef struct {
+    SemaphoreHandle_t wakeup_sem;
+    esp_cloud_topic_router_t router;
+    esp_cloud_loopback_publish_cb_t publish_cb;
+    void *publish_priv;
+    esp_cloud_loopback_stats_t stats;
+    char shadow_topic[64];
+    char get_topic[64];
+    /* A shadow GET for resync is awaiting its answer since get_sent_ms */
+    bool get_pending;
+    uint32_t get_sent_ms;
+    char *doc_buf;
+    size_t doc_size;
+    uint32_t *pending_local;
+    uint32_t *pending_remote;
+    bool connected;
+} loopback_platform_data_t;
+
+static loopback_platform_data_t *loopback_get_data(esp_cloud_handle_t handle)
+{
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (!int_handle || (int_handle->platform != esp_cloud_platform_loopback())) {
+        return NULL;
+    }
+    return int_handle->cloud_platform_priv;
+}
+
+static esp_err_t loopback_init(esp_cloud_internal_handle_t *handle)
+{
+    if (handle->cloud_platform_priv) {
+        return ESP_FAIL;
+    }
+    loopback_platform_data_t *platform_data = esp_cloud_mem_calloc(1, sizeof(loopback_platform_data_t));
+    if (!platform_data) {
+        return ESP_ERR_NO_MEM;
+    }
+    platform_data->wakeup_sem = xSemaphoreCreateBinary();
+    if (!platform_data->wakeup_sem) {
+        free(platform_data);
+        return ESP_ERR_NO_MEM;
+    }
+    snprintf(platform_data->shadow_topic, sizeof(platform_data->shadow_topic), LOOPBACK_SHADOW_TOPIC_FMT,
+            handle->device_id ? handle->device_id : "");
+    snprintf(platform_data->get_topic, sizeof(platform_data->get_topic), LOOPBACK_GET_TOPIC_FMT,
+            handle->device_id ? handle->device_id : "");
+    handle->cloud_platform_priv = platform_data;
+    ESP_LOGI(TAG, "Using loopback platform. Nothing will be sent to the cloud");
+    return ESP_OK;
+}
+
+static esp_err_t loopback_deinit(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    esp_cloud_topic_router_clear(&platform_data->router);
+    vSemaphoreDelete(platform_data->wakeup_sem);
+    free(platform_data);
+    handle->cloud_platform_priv = NULL;
+    return ESP_OK;
+}
+
+static esp_err_t loopback_connect(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    esp_cloud_reconnect_attempt_started(handle);
+    platform_data->connected = true;
+    esp_cloud_reconnect_succeeded(handle);
+    return ESP_OK;
+}
+
+static esp_err_t loopback_disconnect(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    platform_data->connected = false;
+    /* A new resync is made on reconnection */
+    platform_data->get_pending = false;
+    return ESP_OK;
+}
+
+static void loopback_wakeup(esp_cloud_internal_handle_t *handle);
+
+/* Answer to the GET sent by loopback_report_state(). doc is NULL if there was none */
+static void loopback_handle_get(esp_cloud_internal_handle_t *handle, char *doc, int doc_len)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data->get_pending) {
+        return;
+    }
+    platform_data->get_pending = false;
+    if (!doc || (esp_cloud_shadow_resync(handle, doc, doc_len) != ESP_OK)) {
+        ESP_LOGW(TAG, "Shadow get failed. Reporting all the params");
+        esp_cloud_shadow_request_full_report(handle);
+    }
+    loopback_wakeup(handle);
+}
+
+static esp_err_t loopback_wait(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if (platform_data->get_pending) {
+        uint32_t age = esp_cloud_time_ms() - platform_data->get_sent_ms;
+        if (age >= LOOPBACK_GET_TIMEOUT_MS) {
+            ESP_LOGE(TAG, "Shadow get timed out");
+            loopback_handle_get(handle, NULL, 0);
+        } else if (LOOPBACK_GET_TIMEOUT_MS - age < timeout_ms) {
+            timeout_ms = LOOPBACK_GET_TIMEOUT_MS - age;
+        }
+    }
+    xSemaphoreTake(platform_data->wakeup_sem, pdMS_TO_TICKS(timeout_ms));
+    return ESP_OK;
+}
+
+static void loopback_wakeup(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (platform_data) {
+        xSemaphoreGive(platform_data->wakeup_sem);
+    }
+}
+
+static void loopback_record_publish(loopback_platform_data_t *platform_data, const char *topic, const char *data,
+        size_t data_len)
+{
+    platform_data->stats.publishes++;
+    platform_data->stats.publish_bytes += data_len;
+    if (platform_data->publish_cb) {
+        platform_data->publish_cb(topic, data, platform_data->publish_priv);
+    }
+}
+
+static esp_err_t loopback_publish(esp_cloud_internal_handle_t *handle, const char *topic, const char *data,
+        size_t data_len)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !topic || !data) {
+        return ESP_FAIL;
+    }
+    /* The callback takes a string, which data need not be */
+    char *str = strndup(data, data_len);
+    if (!str) {
+        return ESP_ERR_NO_MEM;
+    }
+    loopback_record_publish(platform_data, topic, str, data_len);
+    free(str);
+    return ESP_OK;
+}
+
+static esp_err_t loopback_subscribe(esp_cloud_internal_handle_t *handle, const char *topic,
+        esp_cloud_platform_subscribe_cb_t cb, void *priv_data)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !topic || !cb) {
+        return ESP_FAIL;
+    }
+    return esp_cloud_topic_router_add(&platform_data->router, topic, cb, priv_data, NULL, NULL);
+}
+
+static esp_err_t loopback_unsubscribe(esp_cloud_internal_handle_t *handle, const char *topic)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !topic) {
+        return ESP_FAIL;
+    }
+    return esp_cloud_topic_router_remove(&platform_data->router, topic);
+}
+
+static esp_err_t loopback_register_dynamic_params(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if (handle->cur_dynamic_params_count == 0) {
+        return ESP_OK;
+    }
+    /* Everything in one document, so that a full report is a single publish */
+    size_t doc_size = LOOPBACK_DOC_OVERHEAD;
+    int i;
+    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+        doc_size += esp_cloud_shadow_param_max_len(handle, i);
+    }
+    size_t bitmap_words = ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count);
+    platform_data->doc_buf = esp_cloud_mem_arena_alloc(handle->arena, doc_size);
+    platform_data->pending_local = esp_cloud_mem_arena_alloc(handle->arena, 2 * bitmap_words * sizeof(uint32_t));
+    if (!platform_data->doc_buf || !platform_data->pending_local) {
+        ESP_LOGE(TAG, "Failed to allocate memory");
+        return ESP_ERR_NO_MEM;
+    }
+    platform_data->pending_remote = platform_data->pending_local + bitmap_words;
+    platform_data->doc_size = doc_size;
+    return ESP_OK;
+}
+
+static esp_err_t loopback_report_state(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if ((handle->cur_dynamic_params_count == 0) || platform_data->get_pending) {
+        return ESP_OK;
+    }
+    /* Fetch the cloud's copy first, as the MQTT backend does. The GET is recorded as a
+     * publish and answered using esp_cloud_loopback_answer_get(), see loopback_handle_get()
+     */
+    if (platform_data->connected) {
+        platform_data->get_pending = true;
+        platform_data->get_sent_ms = esp_cloud_time_ms();
+        platform_data->stats.shadow_gets++;
+        loopback_record_publish(platform_data, platform_data->get_topic, "{}", 2);
+        return ESP_OK;
+    }
+    esp_cloud_shadow_request_full_report(handle);
+    loopback_wakeup(handle);
+    return ESP_OK;
+}
+
+static esp_err_t loopback_report_changes(esp_cloud_internal_handle_t *handle)
+{
+    loopback_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !platform_data->doc_buf || !platform_data->connected) {
+        return ESP_OK;
+    }
+    bool full_report = esp_cloud_shadow_take_full_report(handle);
+    uint32_t *local = platform_data->pending_local;
+    uint32_t *remote = platform_data->pending_remote;
+    esp_cloud_fetch_changed_params(handle, local, remote);
+
+    json_str_t jstr;
+    json_str_start(&jstr, platform_data->doc_buf, platform_data->doc_size, NULL, NULL);
+    json_start_object(&jstr);
+    json_push_object(&jstr, "state");
+    json_push_object(&jstr, "reported");
+    int params = 0;
+    int word;
+    for (word = 0; word < ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count); word++) {
+        uint32_t report = local[word] | remote[word];
+        if (full_report) {
+            int remaining = handle->cur_dynamic_params_count - (word * 32);
+            report = (remaining >= 32) ? UINT32_MAX : (((uint32_t)1 << remaining) - 1);
+        }
+        while (report) {
+            int i = (word * 32) + __builtin_ctz(report);
+            report &= report - 1;
+            esp_cloud_shadow_add_param(handle, &jstr, i);
+            esp_cloud_param_report_sent(handle, i);
+            params++;
+        }
+    }
+    json_pop_object(&jstr);
+    json_pop_object(&jstr);
+    json_end_object(&jstr);
+    json_str_end(&jstr);
+    if (params == 0) {
+        return ESP_OK;
+    }
+
+    platform_data->stats.shadow_updates++;
+    loopback_record_publish(platform_data, platform_data->shadow_topic, platform_data->doc_buf,
+            strlen(platform_data->doc_buf));
+    esp_cloud_shadow_update_sent(handle, 1, params);
+    /* Accepted right away */
+    for (word = 0; word < ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count); word++) {
+        uint32_t acked = local[word] | remote[word];
+        while (acked) {
+            esp_cloud_param_report_acked(handle, (word * 32) + __builtin_ctz(acked));
+            acked &= acked - 1;
+        }
+    }
+    esp_cloud_shadow_update_done(handle, true, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_loopback_set_publish_cb(esp_cloud_handle_t handle, esp_cloud_loopback_publish_cb_t cb,
+        void *priv_data)
+{
+    loopback_platform_data_t *platform_data = loopback_get_data(handle);
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    platform_data->publish_cb = cb;
+    platform_data->publish_priv = priv_data;
+    return ESP_OK;
+}
+
+/* An injected message or delta, with its topic and payload in the same block */
+typedef struct {
+    size_t payload_len;
+    char *topic;
+    char payload[];
+} loopback_injection_t;
+
+static loopback_injection_t *loopback_injection_create(const char *topic, const void *payload, size_t payload_len)
+{
+    size_t topic_len = topic ? strlen(topic) + 1 : 0;
+    /* NUL terminated too, for the JSON parser */
+    loopback_injection_t *injection = esp_cloud_mem_calloc(1, sizeof(loopback_injection_t) + payload_len + 1 + topic_len);
+    if (!injection) {
+        return NULL;
+    }
+    injection->payload_len = payload_len;
+    if (payload_len) {
+        memcpy(injection->payload, payload, payload_len);
+    }
+    if (topic) {
+        injection->topic = injection->payload + payload_len + 1;
+        memcpy(injection->topic, topic, topic_len);
+    }
+    return injection;
+}
+
+/* The router and the params' platform buffers belong to the cloud task, so
+ * injections are queued and handled there
+ */
+static esp_err_t loopback_injection_queue(esp_cloud_handle_t handle, esp_cloud_work_fn_t work_fn,
+        loopback_injection_t *injection)
+{
+    if (!injection) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = esp_cloud_queue_work(handle, work_fn, injection);
+    if (err != ESP_OK) {
+        free(injection);
+    }
+    return err;
+}
+
+static void loopback_inject_work(esp_cloud_handle_t handle, void *priv_data)
+{
+    loopback_injection_t *injection = priv_data;
+    loopback_platform_data_t *platform_data = loopback_get_data(handle);
+    if (platform_data) {
+        platform_data->stats.messages_injected++;
+        if (esp_cloud_topic_router_dispatch(&platform_data->router, injection->topic, injection->payload,
+                    injection->payload_len) == 0) {
+            ESP_LOGW(TAG, "No subscription for injected message on %s", injection->topic);
+        }
+    }
+    free(injection);
+}
+
+static void loopback_inject_delta_work(esp_cloud_handle_t handle, void *priv_data)
+{
+    loopback_injection_t *injection = priv_data;
+    loopback_platform_data_t *platform_data = loopback_get_data(handle);
+    if (platform_data) {
+        esp_err_t err = esp_cloud_shadow_apply_delta((esp_cloud_internal_handle_t *)handle, injection->payload,
+                injection->payload_len);
+        if (err == ESP_OK) {
+            platform_data->stats.deltas_injected++;
+        } else {
+            ESP_LOGW(TAG, "Injected delta not applied, %d", err);
+        }
+    }
+    free(injection);
+}
+
+esp_err_t esp_cloud_loopback_inject(esp_cloud_handle_t handle, const char *topic, const void *payload,
+        size_t payload_len)
+{
+    if (!loopback_get_data(handle) || !topic || (!payload && payload_len)) {
+        return ESP_FAIL;
+    }
+    return loopback_injection_queue(handle, loopback_inject_work,
+            loopback_injection_create(topic, payload, payload_len));
+}
+
+esp_err_t esp_cloud_loopback_inject_delta(esp_cloud_handle_t handle, const char *doc, size_t doc_len)
+{
+    if (!loopback_get_data(handle) || !doc) {
+        return ESP_FAIL;
+    }
+    return loopback_injection_queue(handle, loopback_inject_delta_work,
+            loopback_injection_create(NULL, doc, doc_len));
+}
+
+static void loopback_answer_get_work(esp_cloud_handle_t handle, void *priv_data)
+{
+    loopback_injection_t *injection = priv_data;
+    if (loopback_get_data(handle)) {
+        loopback_handle_get((esp_cloud_internal_handle_t *)handle, injection->payload_len ? injection->payload : NULL,
+                injection->payload_len);
+    }
+    free(injection);
+}
+
+esp_err_t esp_cloud_loopback_answer_get(esp_cloud_handle_t handle, const char *doc, size_t doc_len)
+{
+    if (!loopback_get_data(handle) || (!doc && doc_len)) {
+        return ESP_FAIL;
+    }
+    return loopback_injection_queue(handle, loopback_answer_get_work,
+            loopback_injection_create(NULL, doc, doc ? doc_len : 0));
+}
+
+esp_err_t esp_cloud_loopback_get_stats(esp_cloud_handle_t handle, esp_cloud_loopback_stats_t *stats)
+{
+    loopback_platform_data_t *platform_data = loopback_get_data(handle);
+    if (!platform_data || !stats) {
+        return ESP_FAIL;
+    }
+    memcpy(stats, &platform_data->stats, sizeof(esp_cloud_loopback_stats_t));
+    return ESP_OK;
+}
+
+static const esp_cloud_platform_ops_t loopback_platform_ops = {
+    .name = "loopback",
+    .init = loopback_init,
+    .deinit = loopback_deinit,
+    .connect = loopback_connect,
+    .disconnect = loopback_disconnect,
+    .wait = loopback_wait,
+    .wakeup = loopback_wakeup,
+    .report_changes = loopback_report_changes,
+    .report_state = loopback_report_state,
+    .register_dynamic_params = loopback_register_dynamic_params,
+    .publish = loopback_publish,
+    .subscribe = loopback_subscribe,
+    .unsubscribe = loopback_unsubscribe,
+};
+
+const esp_cloud_platform_ops_t *esp_cloud_platform_loopback(void)
+{
+    return &loopback_platform_ops;
+}
@@ -0,0 +1,1033 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <json_parser.h>
+#include <json_generator.h>
+#include <mqtt_client.h>
+
+#include <esp_cloud_mem.h>
+#include <esp_cloud.h>
+
+#include "esp_cloud_platform.h"
+#include "app_prov_handlers.h"
+#include "app_main.h"
+
+/* Platform backend on the event driven esp-mqtt client. Publishes return as soon
+ * as the message is queued, and the client's events are handed over to the cloud
+ * task through a queue, which is also what the task sleeps on. The device shadow
+ * is driven over its plain MQTT topics.
+ */
+
+static const char *TAG = "mqtt_cloud";
+
+#ifdef CONFIG_ESP_CLOUD_MQTT_BUFFER_SIZE
+#define MQTT_CLOUD_BUFFER_SIZE          CONFIG_ESP_CLOUD_MQTT_BUFFER_SIZE
+#else
+#define MQTT_CLOUD_BUFFER_SIZE          2048
+#endif
+#ifdef CONFIG_ESP_CLOUD_MQTT_BROKER_URI
+#define MQTT_CLOUD_BROKER_URI           CONFIG_ESP_CLOUD_MQTT_BROKER_URI
+#else
+#define MQTT_CLOUD_BROKER_URI           ""
+#endif
+#define MQTT_CLOUD_PORT                 8883
+#define MQTT_CLOUD_EVENT_QUEUE_SIZE     16
+#define MQTT_CLOUD_CONNECT_TIMEOUT_MS   10000
+/* QoS1 publishes which may await a PUBACK at the same time */
+#define MQTT_CLOUD_INFLIGHT_SIZE        8
+#define MQTT_CLOUD_PUBACK_TIMEOUT_MS    10000
+#define MQTT_SHADOW_MAX_IN_FLIGHT       4
+#define MQTT_SHADOW_UPDATE_TIMEOUT_MS   4000
+#define MQTT_SHADOW_VERSION_CONFLICT    409
+#define MQTT_SHADOW_TOPIC_LEN           96
+#define MQTT_SHADOW_TOKEN_LEN           64
+/* Topic and MQTT header, out of the buffer */
+#define MQTT_SHADOW_DOC_SIZE            (MQTT_CLOUD_BUFFER_SIZE - MQTT_SHADOW_TOPIC_LEN - 16)
+/* {"state":{"reported":{},"desired":{}},"clientToken":""} and some slack */
+#define MQTT_SHADOW_DOC_OVERHEAD        (64 + MQTT_SHADOW_TOKEN_LEN)
+
+typedef enum {
+    MQTT_CLOUD_EVT_WAKEUP,
+    MQTT_CLOUD_EVT_CONNECTED,
+    MQTT_CLOUD_EVT_DISCONNECTED,
+    MQTT_CLOUD_EVT_PUBLISHED,
+    MQTT_CLOUD_EVT_DATA,
+} mqtt_cloud_event_type_t;
+
+/* Event handed over from the esp-mqtt task. topic and data are owned by the event */
+typedef struct {
+    mqtt_cloud_event_type_t type;
+    /* Client which raised the event. Events of a destroyed client are stale */
+    uint32_t client_gen;
+    int msg_id;
+    char *topic;
+    char *data;
+    int data_len;
+} mqtt_cloud_event_t;
+
+/* QoS1 publish waiting for its PUBACK */
+typedef struct {
+    int msg_id;
+    uint32_t sent_ms;
+    /* Copy handed to the outbox if the PUBACK never comes. NULL for shadow
+     * updates, which the shadow code sends again by itself
+     */
+    char *topic;
+    char *data;
+    size_t data_len;
+} mqtt_cloud_inflight_entry_t;
+
+/* Same as the AWS backend: one in-flight shadow update and the params it carried */
+typedef struct {
+    bool in_use;
+    bool full_report;
+    uint32_t *local_params;
+    uint32_t *remote_params;
+    char client_token[MQTT_SHADOW_TOKEN_LEN];
+    uint32_t sent_ms;
+} mqtt_shadow_update_t;
+
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    QueueHandle_t event_queue;
+    bool wakeup_pending;
+    bool connected;
+    /* A connection attempt is in progress since attempt_ms */
+    bool attempting;
+    uint32_t attempt_ms;
+    /* Connected at least once since connect(). Lost connections are then re-established from wait() */
+    bool online;
+    uint32_t client_gen;
+    /* Message being reassembled by the esp-mqtt task */
+    char *rx_topic;
+    char *rx_data;
+    int rx_len;
+    esp_cloud_topic_router_t router;
+    mqtt_cloud_inflight_entry_t inflight[MQTT_CLOUD_INFLIGHT_SIZE];
+    uint8_t inflight_count;
+    mqtt_shadow_update_t updates[MQTT_SHADOW_MAX_IN_FLIGHT];
+    uint32_t token_seq;
+    uint32_t shadow_version;
+    char update_topic[MQTT_SHADOW_TOPIC_LEN];
+    char accepted_topic[MQTT_SHADOW_TOPIC_LEN];
+    char rejected_topic[MQTT_SHADOW_TOPIC_LEN];
+    char delta_topic[MQTT_SHADOW_TOPIC_LEN];
+    char get_topic[MQTT_SHADOW_TOPIC_LEN];
+    char get_accepted_topic[MQTT_SHADOW_TOPIC_LEN];
+    char get_rejected_topic[MQTT_SHADOW_TOPIC_LEN];
+    /* A shadow GET for resync is awaiting its answer since get_sent_ms */
+    bool get_pending;
+    uint32_t get_sent_ms;
+    char *doc_buf;
+    uint32_t *pending_local;
+    uint32_t *pending_remote;
+} mqtt_cloud_platform_data_t;
+
+static uint32_t mqtt_cloud_time_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void mqtt_cloud_post_event(mqtt_cloud_platform_data_t *platform_data, mqtt_cloud_event_t *event)
+{
+    if (xQueueSend(platform_data->event_queue, event, 0) != pdTRUE) {
+        /* Lost PUBACKs and shadow acks are covered by the timeouts */
+        ESP_LOGW(TAG, "Event queue full. Dropping event %d", event->type);
+        free(event->topic);
+        free(event->data);
+    }
+}
+
+/* Runs in the esp-mqtt task. Copies whatever the cloud task needs and queues it */
+static esp_err_t mqtt_cloud_event_handler(esp_mqtt_event_handle_t event)
+{
+    mqtt_cloud_platform_data_t *platform_data = event->user_context;
+    mqtt_cloud_event_t cloud_event = {
+        .client_gen = platform_data->client_gen,
+        .msg_id = event->msg_id,
+    };
+    switch (event->event_id) {
+        case MQTT_EVENT_CONNECTED:
+            cloud_event.type = MQTT_CLOUD_EVT_CONNECTED;
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            cloud_event.type = MQTT_CLOUD_EVT_DISCONNECTED;
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            cloud_event.type = MQTT_CLOUD_EVT_PUBLISHED;
+            break;
+        case MQTT_EVENT_DATA:
+            /* Large messages arrive in pieces. Only the first one has the topic */
+            if (event->current_data_offset == 0) {
+                free(platform_data->rx_topic);
+                free(platform_data->rx_data);
+                platform_data->rx_topic = esp_cloud_mem_calloc(1, event->topic_len + 1);
+                platform_data->rx_data = esp_cloud_mem_malloc(event->total_data_len + 1);
+                if (!platform_data->rx_topic || !platform_data->rx_data) {
+                    ESP_LOGE(TAG, "No memory for %d byte message", event->total_data_len);
+                    free(platform_data->rx_topic);
+                    free(platform_data->rx_data);
+                    platform_data->rx_topic = platform_data->rx_data = NULL;
+                    return ESP_OK;
+                }
+                memcpy(platform_data->rx_topic, event->topic, event->topic_len);
+                platform_data->rx_len = event->total_data_len;
+            }
+            if (!platform_data->rx_data ||
+                    (event->current_data_offset + event->data_len > platform_data->rx_len)) {
+                return ESP_OK;
+            }
+            memcpy(platform_data->rx_data + event->current_data_offset, event->data, event->data_len);
+            if (event->current_data_offset + event->data_len < platform_data->rx_len) {
+                return ESP_OK;
+            }
+            platform_data->rx_data[platform_data->rx_len] = '\0';
+            cloud_event.type = MQTT_CLOUD_EVT_DATA;
+            cloud_event.topic = platform_data->rx_topic;
+            cloud_event.data = platform_data->rx_data;
+            cloud_event.data_len = platform_data->rx_len;
+            platform_data->rx_topic = platform_data->rx_data = NULL;
+            break;
+        default:
+            return ESP_OK;
+    }
+    mqtt_cloud_post_event(platform_data, &cloud_event);
+    return ESP_OK;
+}
+
+static void mqtt_cloud_wakeup(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !platform_data->event_queue) {
+        return;
+    }
+    /* Only one wakeup needs to be queued at a time */
+    if (!__atomic_exchange_n(&platform_data->wakeup_pending, true, __ATOMIC_SEQ_CST)) {
+        mqtt_cloud_event_t event = {
+            .type = MQTT_CLOUD_EVT_WAKEUP,
+        };
+        if (xQueueSend(platform_data->event_queue, &event, 0) != pdTRUE) {
+            /* The queue is not empty, so the task wakes up anyway */
+            __atomic_store_n(&platform_data->wakeup_pending, false, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+static void mqtt_cloud_inflight_remove(mqtt_cloud_platform_data_t *platform_data, int index)
+{
+    free(platform_data->inflight[index].topic);
+    free(platform_data->inflight[index].data);
+    platform_data->inflight[index] = platform_data->inflight[--platform_data->inflight_count];
+}
+
+/* The message may or may not have reached the broker. Sending it again from the
+ * outbox can only make a duplicate, which QoS1 allows anyway.
+ */
+static void mqtt_cloud_inflight_requeue(esp_cloud_internal_handle_t *handle, int index)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    mqtt_cloud_inflight_entry_t *entry = &platform_data->inflight[index];
+    ESP_LOGW(TAG, "Message %d not acked", entry->msg_id);
+    if (entry->topic) {
+        esp_cloud_platform_publish_failed(handle, entry->topic, entry->data, entry->data_len);
+    }
+    mqtt_cloud_inflight_remove(platform_data, index);
+}
+
+static void mqtt_cloud_inflight_requeue_all(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    while (platform_data->inflight_count) {
+        mqtt_cloud_inflight_requeue(handle, platform_data->inflight_count - 1);
+    }
+}
+
+static void mqtt_cloud_inflight_acked(mqtt_cloud_platform_data_t *platform_data, int msg_id)
+{
+    int i;
+    for (i = 0; i < platform_data->inflight_count; i++) {
+        if (platform_data->inflight[i].msg_id == msg_id) {
+            ESP_LOGD(TAG, "Message %d acked in %u ms", msg_id, mqtt_cloud_time_ms() - platform_data->inflight[i].sent_ms);
+            mqtt_cloud_inflight_remove(platform_data, i);
+            return;
+        }
+    }
+}
+
+/* Publish with QoS1 without waiting for the PUBACK. Fails with ESP_ERR_NO_MEM while
+ * MQTT_CLOUD_INFLIGHT_SIZE messages are already in flight. With keep_copy, the
+ * message goes to the outbox if it is not acked.
+ */
+static esp_err_t mqtt_cloud_publish_qos1(mqtt_cloud_platform_data_t *platform_data, const char *topic,
+        const char *data, int len, bool keep_copy)
+{
+    if (!platform_data->connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (platform_data->inflight_count >= MQTT_CLOUD_INFLIGHT_SIZE) {
+        return ESP_ERR_NO_MEM;
+    }
+    mqtt_cloud_inflight_entry_t *entry = &platform_data->inflight[platform_data->inflight_count];
+    memset(entry, 0, sizeof(*entry));
+    if (keep_copy) {
+        entry->topic = strdup(topic);
+        entry->data = esp_cloud_mem_malloc(len + 1);
+        if (!entry->topic || !entry->data) {
+            free(entry->topic);
+            free(entry->data);
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(entry->data, data, len);
+        entry->data[len] = '\0';
+        entry->data_len = len;
+    }
+    int msg_id = esp_mqtt_client_publish(platform_data->client, topic, data, len, 1, 0);
+    if (msg_id < 0) {
+        ESP_LOGE(TAG, "Failed to publish to %s", topic);
+        free(entry->topic);
+        free(entry->data);
+        return ESP_FAIL;
+    }
+    entry->msg_id = msg_id;
+    entry->sent_ms = mqtt_cloud_time_ms();
+    platform_data->inflight_count++;
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_cloud_publish(esp_cloud_internal_handle_t *handle, const char *topic, const char *data,
+        size_t data_len)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !topic || !data) {
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Publishing to: %s", topic);
+    return mqtt_cloud_publish_qos1(platform_data, topic, data, data_len, true);
+}
+
+static esp_err_t mqtt_cloud_subscribe(esp_cloud_internal_handle_t *handle, const char *topic,
+        esp_cloud_platform_subscribe_cb_t cb, void *priv_data)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !topic || !cb) {
+        return ESP_FAIL;
+    }
+    bool new_filter = false;
+    esp_err_t err = esp_cloud_topic_router_add(&platform_data->router, topic, cb, priv_data, NULL, &new_filter);
+    if (err != ESP_OK) {
+        return err;
+    }
+    /* Otherwise this is done on connection */
+    if (new_filter && platform_data->connected && (esp_mqtt_client_subscribe(platform_data->client, topic, 1) < 0)) {
+        esp_cloud_topic_router_remove(&platform_data->router, topic);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Subscribed to topic: %s", topic);
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_cloud_unsubscribe(esp_cloud_internal_handle_t *handle, const char *topic)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !topic) {
+        return ESP_FAIL;
+    }
+    if (esp_cloud_topic_router_remove(&platform_data->router, topic) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (platform_data->connected) {
+        esp_mqtt_client_unsubscribe(platform_data->client, topic);
+    }
+    return ESP_OK;
+}
+
+static void mqtt_shadow_update_retry(esp_cloud_internal_handle_t *handle, mqtt_shadow_update_t *update)
+{
+    esp_cloud_shadow_requeue(handle, update->local_params, update->remote_params, 0);
+    if (update->full_report) {
+        esp_cloud_shadow_request_full_report(handle);
+    }
+}
+
+static mqtt_shadow_update_t *mqtt_shadow_update_get_free(mqtt_cloud_platform_data_t *platform_data)
+{
+    int i;
+    for (i = 0; i < MQTT_SHADOW_MAX_IN_FLIGHT; i++) {
+        if (!platform_data->updates[i].in_use && platform_data->updates[i].local_params) {
+            return &platform_data->updates[i];
+        }
+    }
+    return NULL;
+}
+
+static void mqtt_shadow_update_finish(esp_cloud_internal_handle_t *handle, mqtt_shadow_update_t *update,
+        bool accepted, bool retry)
+{
+    uint32_t ack_ms = mqtt_cloud_time_ms() - update->sent_ms;
+    if (accepted) {
+        int i;
+        for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+            if ((update->local_params[i / 32] | update->remote_params[i / 32]) & ((uint32_t)1 << (i % 32))) {
+                esp_cloud_param_report_acked(handle, i);
+            }
+        }
+    } else if (retry) {
+        mqtt_shadow_update_retry(handle, update);
+    }
+    esp_cloud_shadow_update_done(handle, accepted, ack_ms);
+    update->in_use = false;
+}
+
+/* Response on the update/accepted or update/rejected topic */
+static void mqtt_shadow_handle_response(esp_cloud_internal_handle_t *handle, char *doc, int doc_len, bool accepted)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    char client_token[MQTT_SHADOW_TOKEN_LEN] = {0};
+    int version = 0;
+    int code = 0;
+    jparse_ctx_t jctx;
+    if (json_parse_start(&jctx, doc, doc_len) != OS_SUCCESS) {
+        return;
+    }
+    json_obj_get_string(&jctx, "clientToken", client_token, sizeof(client_token));
+    json_obj_get_int(&jctx, "version", &version);
+    json_obj_get_int(&jctx, "code", &code);
+    json_parse_end(&jctx);
+
+    int i;
+    for (i = 0; i < MQTT_SHADOW_MAX_IN_FLIGHT; i++) {
+        mqtt_shadow_update_t *update = &platform_data->updates[i];
+        if (!update->in_use || (strcmp(update->client_token, client_token) != 0)) {
+            continue;
+        }
+        if (accepted) {
+            if ((uint32_t)version > platform_data->shadow_version) {
+                platform_data->shadow_version = version;
+            }
+            esp_cloud_shadow_set_version(handle, platform_data->shadow_version);
+            ESP_LOGI(TAG, "Update %s accepted, version %u, %u ms", client_token,
+                    platform_data->shadow_version, mqtt_cloud_time_ms() - update->sent_ms);
+        } else {
+            ESP_LOGE(TAG, "Update %s rejected, code %d", client_token, code);
+        }
+        /* Other rejections mean the document itself is bad, so sending it again would not help */
+        mqtt_shadow_update_finish(handle, update, accepted, code == MQTT_SHADOW_VERSION_CONFLICT);
+        return;
+    }
+}
+
+/* Answer to the GET sent by mqtt_cloud_report_state(). doc is NULL if there was none */
+static void mqtt_shadow_handle_get(esp_cloud_internal_handle_t *handle, char *doc, int doc_len)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data->get_pending) {
+        return;
+    }
+    platform_data->get_pending = false;
+    if (!doc || (esp_cloud_shadow_resync(handle, doc, doc_len) != ESP_OK)) {
+        /* Eg. rejected with 404 as nothing was ever reported */
+        ESP_LOGW(TAG, "Shadow get failed. Reporting all the params");
+        esp_cloud_shadow_request_full_report(handle);
+    }
+    mqtt_cloud_wakeup(handle);
+}
+
+static void mqtt_cloud_handle_data(esp_cloud_internal_handle_t *handle, mqtt_cloud_event_t *event)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (strcmp(event->topic, platform_data->accepted_topic) == 0) {
+        mqtt_shadow_handle_response(handle, event->data, event->data_len, true);
+    } else if (strcmp(event->topic, platform_data->rejected_topic) == 0) {
+        mqtt_shadow_handle_response(handle, event->data, event->data_len, false);
+    } else if (strcmp(event->topic, platform_data->delta_topic) == 0) {
+        esp_cloud_shadow_apply_delta(handle, event->data, event->data_len);
+    } else if (strcmp(event->topic, platform_data->get_accepted_topic) == 0) {
+        mqtt_shadow_handle_get(handle, event->data, event->data_len);
+    } else if (strcmp(event->topic, platform_data->get_rejected_topic) == 0) {
+        mqtt_shadow_handle_get(handle, NULL, 0);
+    } else {
+        esp_cloud_topic_router_dispatch(&platform_data->router, event->topic, event->data, event->data_len);
+    }
+}
+
+static void mqtt_cloud_resubscribe(const char *filter, esp_cloud_topic_node_t *node, void *priv_data)
+{
+    mqtt_cloud_platform_data_t *platform_data = priv_data;
+    esp_mqtt_client_subscribe(platform_data->client, filter, 1);
+}
+
+static void mqtt_cloud_subscribe_all(mqtt_cloud_platform_data_t *platform_data)
+{
+    /* The session may have expired on the broker, and esp-mqtt does not say if it did */
+    esp_mqtt_client_subscribe(platform_data->client, platform_data->accepted_topic, 1);
+    esp_mqtt_client_subscribe(platform_data->client, platform_data->rejected_topic, 1);
+    esp_mqtt_client_subscribe(platform_data->client, platform_data->delta_topic, 1);
+    esp_mqtt_client_subscribe(platform_data->client, platform_data->get_accepted_topic, 1);
+    esp_mqtt_client_subscribe(platform_data->client, platform_data->get_rejected_topic, 1);
+    esp_cloud_topic_router_foreach(&platform_data->router, mqtt_cloud_resubscribe, platform_data);
+}
+
+static void mqtt_cloud_handle_event(esp_cloud_internal_handle_t *handle, mqtt_cloud_event_t *event)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    int i;
+    switch (event->type) {
+        case MQTT_CLOUD_EVT_WAKEUP:
+            __atomic_store_n(&platform_data->wakeup_pending, false, __ATOMIC_SEQ_CST);
+            break;
+        case MQTT_CLOUD_EVT_CONNECTED:
+            if (event->client_gen != platform_data->client_gen) {
+                break;
+            }
+            ESP_LOGI(TAG, "MQTT Connected");
+            platform_data->connected = true;
+            platform_data->attempting = false;
+            platform_data->online = true;
+            esp_cloud_reconnect_succeeded(handle);
+            mqtt_cloud_subscribe_all(platform_data);
+            if (dev_config.iot_reconnect == IOT_RECONNECT) {
+                dev_config.iot_reconnect = IOT_RECONNECT_FINISH;
+                net_disconnect_scan_stop();
+                va_led_set(LED_OFF);
+            }
+            break;
+        case MQTT_CLOUD_EVT_DISCONNECTED:
+            if (event->client_gen != platform_data->client_gen) {
+                break;
+            }
+            ESP_LOGW(TAG, "MQTT Disconnected");
+            /* A new resync is made on reconnection */
+            platform_data->get_pending = false;
+            if (platform_data->attempting) {
+                /* esp-mqtt v3.3 does not say why, so no finer backoff is possible */
+                platform_data->attempting = false;
+                esp_cloud_reconnect_failed(handle, ESP_CLOUD_CONN_ERR_TRANSIENT);
+                break;
+            }
+            if (!platform_data->connected) {
+                break;
+            }
+            platform_data->connected = false;
+            /* Acks for these will not reach the next client. Shadow updates go out
+             * again after reconnection, other messages through the outbox.
+             */
+            mqtt_cloud_inflight_requeue_all(handle);
+            for (i = 0; i < MQTT_SHADOW_MAX_IN_FLIGHT; i++) {
+                if (platform_data->updates[i].in_use) {
+                    mqtt_shadow_update_finish(handle, &platform_data->updates[i], false, true);
+                }
+            }
+            dev_config.iot_reconnect = IOT_RECONNECT;
+            net_disconnect_scan_start();
+            esp_cloud_reconnect_lost(handle);
+            break;
+        case MQTT_CLOUD_EVT_PUBLISHED:
+            mqtt_cloud_inflight_acked(platform_data, event->msg_id);
+            break;
+        case MQTT_CLOUD_EVT_DATA:
+            mqtt_cloud_handle_data(handle, event);
+            break;
+        default:
+            break;
+    }
+    free(event->topic);
+    free(event->data);
+}
+
+/* Expire PUBACKs and shadow acks which did not come in time. Returns the time until the next expiry */
+static uint32_t mqtt_cloud_check_timeouts(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    uint32_t now = mqtt_cloud_time_ms();
+    uint32_t next_ms = UINT32_MAX;
+    int i = 0;
+    while (i < platform_data->inflight_count) {
+        uint32_t age = now - platform_data->inflight[i].sent_ms;
+        if (age >= MQTT_CLOUD_PUBACK_TIMEOUT_MS) {
+            mqtt_cloud_inflight_requeue(handle, i);
+            continue;
+        }
+        if (MQTT_CLOUD_PUBACK_TIMEOUT_MS - age < next_ms) {
+            next_ms = MQTT_CLOUD_PUBACK_TIMEOUT_MS - age;
+        }
+        i++;
+    }
+    if (platform_data->get_pending) {
+        uint32_t age = now - platform_data->get_sent_ms;
+        if (age >= MQTT_SHADOW_UPDATE_TIMEOUT_MS) {
+            ESP_LOGE(TAG, "Shadow get timed out");
+            mqtt_shadow_handle_get(handle, NULL, 0);
+        } else if (MQTT_SHADOW_UPDATE_TIMEOUT_MS - age < next_ms) {
+            next_ms = MQTT_SHADOW_UPDATE_TIMEOUT_MS - age;
+        }
+    }
+    for (i = 0; i < MQTT_SHADOW_MAX_IN_FLIGHT; i++) {
+        mqtt_shadow_update_t *update = &platform_data->updates[i];
+        if (!update->in_use) {
+            continue;
+        }
+        uint32_t age = now - update->sent_ms;
+        if (age >= MQTT_SHADOW_UPDATE_TIMEOUT_MS) {
+            ESP_LOGE(TAG, "Update %s timed out", update->client_token);
+            mqtt_shadow_update_finish(handle, update, false, true);
+            continue;
+        }
+        if (MQTT_SHADOW_UPDATE_TIMEOUT_MS - age < next_ms) {
+            next_ms = MQTT_SHADOW_UPDATE_TIMEOUT_MS - age;
+        }
+    }
+    return next_ms;
+}
+
+static void mqtt_cloud_client_destroy(mqtt_cloud_platform_data_t *platform_data)
+{
+    if (platform_data->client) {
+        esp_mqtt_client_destroy(platform_data->client);
+        platform_data->client = NULL;
+    }
+    platform_data->attempting = false;
+    /* Whatever the old client still has queued is ignored from now on */
+    platform_data->client_gen++;
+}
+
+/* Start a single connection attempt on a fresh client. esp-mqtt v3.3 cannot
+ * restart a client once its connection is aborted, so each attempt needs its own.
+ */
+static esp_err_t mqtt_cloud_attempt(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    mqtt_cloud_client_destroy(platform_data);
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .event_handle = mqtt_cloud_event_handler,
+        .user_context = platform_data,
+        .client_id = handle->device_id,
+        .buffer_size = MQTT_CLOUD_BUFFER_SIZE,
+        /* Retries are paced by the core, see esp_cloud_reconnect_failed() */
+        .disable_auto_reconnect = true,
+        /* The first connection starts afresh, later ones pick up its session */
+        .disable_clean_session = ESP_CLOUD_PERSISTENT_SESSION && platform_data->online,
+    };
+    if (strlen(MQTT_CLOUD_BROKER_URI)) {
+        /* Eg. a local broker for testing */
+        mqtt_cfg.uri = MQTT_CLOUD_BROKER_URI;
+    } else {
+        /* The client keeps these pointers and parses the PEMs again on every connect */
+        const esp_cloud_creds_t *creds = esp_cloud_get_creds(handle);
+        mqtt_cfg.host = creds->mqtt_host;
+        mqtt_cfg.port = MQTT_CLOUD_PORT;
+        mqtt_cfg.transport = MQTT_TRANSPORT_OVER_SSL;
+        mqtt_cfg.cert_pem = creds->server_cert;
+        mqtt_cfg.client_cert_pem = creds->client_cert;
+        mqtt_cfg.client_key_pem = creds->client_key;
+    }
+    platform_data->client = esp_mqtt_client_init(&mqtt_cfg);
+    if (!platform_data->client) {
+        ESP_LOGE(TAG, "Failed to create MQTT client");
+        esp_cloud_reconnect_failed(handle, ESP_CLOUD_CONN_ERR_TRANSIENT);
+        return ESP_FAIL;
+    }
+    esp_cloud_reconnect_attempt_started(handle);
+    if (esp_mqtt_client_start(platform_data->client) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start MQTT client");
+        mqtt_cloud_client_destroy(platform_data);
+        esp_cloud_reconnect_failed(handle, ESP_CLOUD_CONN_ERR_TRANSIENT);
+        return ESP_FAIL;
+    }
+    platform_data->attempting = true;
+    platform_data->attempt_ms = mqtt_cloud_time_ms();
+    return ESP_OK;
+}
+
+/* Abandon an attempt which got no answer in time */
+static bool mqtt_cloud_attempt_timed_out(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    uint32_t waited = mqtt_cloud_time_ms() - platform_data->attempt_ms;
+    if (waited < MQTT_CLOUD_CONNECT_TIMEOUT_MS) {
+        if (MQTT_CLOUD_CONNECT_TIMEOUT_MS - waited < *timeout_ms) {
+            *timeout_ms = MQTT_CLOUD_CONNECT_TIMEOUT_MS - waited;
+        }
+        return false;
+    }
+    ESP_LOGE(TAG, "Timed out connecting to the MQTT broker");
+    mqtt_cloud_client_destroy(platform_data);
+    esp_cloud_reconnect_failed(handle, ESP_CLOUD_CONN_ERR_TRANSIENT);
+    return true;
+}
+
+/* While the connection is down, start attempts as the core allows and expire them */
+static void mqtt_cloud_reconnect_check(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (platform_data->attempting) {
+        if (!mqtt_cloud_attempt_timed_out(handle, timeout_ms)) {
+            return;
+        }
+    }
+    if (esp_cloud_reconnect_due(handle, timeout_ms)) {
+        mqtt_cloud_attempt(handle);
+        if (platform_data->attempting && (MQTT_CLOUD_CONNECT_TIMEOUT_MS < *timeout_ms)) {
+            *timeout_ms = MQTT_CLOUD_CONNECT_TIMEOUT_MS;
+        }
+    }
+}
+
+static esp_err_t mqtt_cloud_wait(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    uint32_t expiry_ms = mqtt_cloud_check_timeouts(handle);
+    if (expiry_ms < timeout_ms) {
+        timeout_ms = expiry_ms;
+    }
+    if (platform_data->online && !platform_data->connected) {
+        mqtt_cloud_reconnect_check(handle, &timeout_ms);
+    }
+    mqtt_cloud_event_t event;
+    if (xQueueReceive(platform_data->event_queue, &event, pdMS_TO_TICKS(timeout_ms)) == pdTRUE) {
+        do {
+            mqtt_cloud_handle_event(handle, &event);
+        } while (xQueueReceive(platform_data->event_queue, &event, 0) == pdTRUE);
+    }
+    mqtt_cloud_check_timeouts(handle);
+    return ESP_OK;
+}
+
+/* A single attempt. Retries are paced by the core, see esp_cloud_reconnect_failed() */
+static esp_err_t mqtt_cloud_connect(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if (platform_data->connected) {
+        return ESP_OK;
+    }
+    if (!platform_data->attempting && (mqtt_cloud_attempt(handle) != ESP_OK)) {
+        return ESP_FAIL;
+    }
+    dev_config.dev_states = IOT_ING;
+    /* The event handler clears attempting once the outcome is known */
+    while (platform_data->attempting) {
+        uint32_t timeout_ms = UINT32_MAX;
+        if (mqtt_cloud_attempt_timed_out(handle, &timeout_ms)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        mqtt_cloud_wait(handle, timeout_ms);
+    }
+    if (!platform_data->connected) {
+        return ESP_FAIL;
+    }
+    dev_config.dev_states = IOT_OK;
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_cloud_disconnect(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !platform_data->client) {
+        return ESP_FAIL;
+    }
+    /* Same as the AWS backend, subscriptions are dropped on disconnection */
+    esp_cloud_topic_router_clear(&platform_data->router);
+    mqtt_cloud_client_destroy(platform_data);
+    platform_data->online = false;
+    platform_data->connected = false;
+    mqtt_cloud_inflight_requeue_all(handle);
+    ESP_LOGI(TAG, "MQTT Disconnected.");
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_cloud_register_dynamic_params(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if (handle->cur_dynamic_params_count == 0) {
+        return ESP_OK;
+    }
+    size_t bitmap_words = ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count);
+    uint32_t *update_params = esp_cloud_mem_arena_alloc(handle->arena,
+            (MQTT_SHADOW_MAX_IN_FLIGHT + 1) * 2 * bitmap_words * sizeof(uint32_t));
+    platform_data->doc_buf = esp_cloud_mem_arena_alloc(handle->arena, MQTT_SHADOW_DOC_SIZE);
+    if (!update_params || !platform_data->doc_buf) {
+        ESP_LOGE(TAG, "Failed to allocate memory");
+        return ESP_ERR_NO_MEM;
+    }
+    int i;
+    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+        /* Reported and desired */
+        if (MQTT_SHADOW_DOC_OVERHEAD + 2 * esp_cloud_shadow_param_max_len(handle, i) > MQTT_SHADOW_DOC_SIZE) {
+            ESP_LOGE(TAG, "Param %s does not fit in a shadow update", handle->dynamic_cloud_params[i].name);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    for (i = 0; i < MQTT_SHADOW_MAX_IN_FLIGHT; i++) {
+        platform_data->updates[i].local_params = update_params;
+        platform_data->updates[i].remote_params = update_params + bitmap_words;
+        update_params += 2 * bitmap_words;
+    }
+    platform_data->pending_local = update_params;
+    platform_data->pending_remote = update_params + bitmap_words;
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_cloud_report_state(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if (handle->cur_dynamic_params_count == 0 || platform_data->get_pending) {
+        return ESP_OK;
+    }
+    /* Fetch the cloud's copy first, so that only what differs is reported, see mqtt_shadow_handle_get() */
+    if (platform_data->connected &&
+            (esp_mqtt_client_publish(platform_data->client, platform_data->get_topic, "{}", 2, 0, 0) >= 0)) {
+        platform_data->get_pending = true;
+        platform_data->get_sent_ms = mqtt_cloud_time_ms();
+        return ESP_OK;
+    }
+    esp_cloud_shadow_request_full_report(handle);
+    mqtt_cloud_wakeup(handle);
+    return ESP_OK;
+}
+
+static bool mqtt_shadow_param_pending(mqtt_cloud_platform_data_t *platform_data, int id, bool full_report)
+{
+    uint32_t mask = (uint32_t)1 << (id % 32);
+    return full_report || ((platform_data->pending_local[id / 32] | platform_data->pending_remote[id / 32]) & mask);
+}
+
+/* Generate and publish one update document for the pending params from start onwards,
+ * taking as many as fit. Returns the id after the last one taken.
+ */
+static int mqtt_shadow_send_update(esp_cloud_internal_handle_t *handle, mqtt_shadow_update_t *update,
+        int start, bool full_report, int *param_count)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    int count = handle->cur_dynamic_params_count;
+    int words = ESP_CLOUD_BITMAP_WORDS(count);
+    size_t size = MQTT_SHADOW_DOC_OVERHEAD;
+    int end;
+    for (end = start; end < count; end++) {
+        if (!mqtt_shadow_param_pending(platform_data, end, full_report)) {
+            continue;
+        }
+        size_t len = 2 * esp_cloud_shadow_param_max_len(handle, end);
+        if (size + len > MQTT_SHADOW_DOC_SIZE) {
+            break;
+        }
+        size += len;
+    }
+    memset(update->local_params, 0, words * sizeof(uint32_t));
+    memset(update->remote_params, 0, words * sizeof(uint32_t));
+    update->full_report = full_report;
+    snprintf(update->client_token, sizeof(update->client_token), "%s-%u", handle->device_id,
+            ++platform_data->token_seq);
+
+    json_str_t jstr;
+    json_str_start(&jstr, platform_data->doc_buf, MQTT_SHADOW_DOC_SIZE, NULL, NULL);
+    json_start_object(&jstr);
+    json_push_object(&jstr, "state");
+    json_push_object(&jstr, "reported");
+    int reported = 0;
+    int i;
+    for (i = start; i < end; i++) {
+        if (!mqtt_shadow_param_pending(platform_data, i, full_report)) {
+            continue;
+        }
+        uint32_t mask = (uint32_t)1 << (i % 32);
+        uint32_t local = platform_data->pending_local[i / 32] & mask;
+        update->local_params[i / 32] |= local;
+        update->remote_params[i / 32] |= platform_data->pending_remote[i / 32] & mask & ~local;
+        esp_cloud_shadow_add_param(handle, &jstr, i);
+        reported++;
+    }
+    json_pop_object(&jstr);
+    /* Clear the deltas of the changed params. A full report only refreshes the reported state */
+    json_push_object(&jstr, "desired");
+    for (i = start; i < end; i++) {
+        if ((update->local_params[i / 32] | update->remote_params[i / 32]) & ((uint32_t)1 << (i % 32))) {
+            esp_cloud_shadow_add_param(handle, &jstr, i);
+        }
+    }
+    json_pop_object(&jstr);
+    json_pop_object(&jstr);
+    json_obj_set_string(&jstr, "clientToken", update->client_token);
+    json_end_object(&jstr);
+    json_str_end(&jstr);
+
+    ESP_LOGI(TAG, "Update Shadow: %s", platform_data->doc_buf);
+    esp_err_t err = mqtt_cloud_publish_qos1(platform_data, platform_data->update_topic, platform_data->doc_buf,
+            strlen(platform_data->doc_buf), false);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Shadow update failed %d", err);
+        mqtt_shadow_update_retry(handle, update);
+        return -1;
+    }
+    /* Only now that the document is out do the params count as reported */
+    for (i = start; i < end; i++) {
+        if (mqtt_shadow_param_pending(platform_data, i, full_report)) {
+            esp_cloud_param_report_sent(handle, i);
+        }
+    }
+    update->in_use = true;
+    update->sent_ms = mqtt_cloud_time_ms();
+    *param_count += reported;
+    return end;
+}
+
+static esp_err_t mqtt_cloud_report_changes(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data || !platform_data->pending_local || !platform_data->connected) {
+        return ESP_OK;
+    }
+    /* Changes stay in the bitmaps until an update slot frees up */
+    if (!mqtt_shadow_update_get_free(platform_data)) {
+        return ESP_ERR_NO_MEM;
+    }
+    bool full_report = esp_cloud_shadow_take_full_report(handle);
+    uint32_t *local = platform_data->pending_local;
+    uint32_t *remote = platform_data->pending_remote;
+    esp_cloud_fetch_changed_params(handle, local, remote);
+
+    int docs = 0;
+    int params = 0;
+    esp_err_t err = ESP_OK;
+    int start = 0;
+    while (1) {
+        while ((start < handle->cur_dynamic_params_count) &&
+                !mqtt_shadow_param_pending(platform_data, start, full_report)) {
+            start++;
+        }
+        if (start >= handle->cur_dynamic_params_count) {
+            break;
+        }
+        mqtt_shadow_update_t *update = mqtt_shadow_update_get_free(platform_data);
+        if (!update) {
+            /* The rest goes out once an ack frees up a slot */
+            esp_cloud_shadow_requeue(handle, local, remote, start);
+            if (full_report) {
+                esp_cloud_shadow_request_full_report(handle);
+            }
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+        int end = mqtt_shadow_send_update(handle, update, start, full_report, &params);
+        if (end < 0) {
+            /* This one was re-queued. The rest is too, since the connection is likely down */
+            esp_cloud_shadow_requeue(handle, local, remote, start);
+            err = ESP_FAIL;
+            break;
+        }
+        docs++;
+        start = end;
+    }
+    if (docs) {
+        esp_cloud_shadow_update_sent(handle, docs, params);
+    }
+    return err;
+}
+
+static esp_err_t mqtt_cloud_init(esp_cloud_internal_handle_t *handle)
+{
+    if (handle->cloud_platform_priv) {
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Initialising Cloud");
+    const esp_cloud_creds_t *creds = esp_cloud_get_creds(handle);
+    /* Credentials are not needed for a plain broker */
+    if (!strlen(MQTT_CLOUD_BROKER_URI) && (!creds->mqtt_host || !creds->client_cert ||
+                !creds->client_key || !creds->server_cert)) {
+        ESP_LOGE(TAG, "Cloud credentials not found");
+        return ESP_FAIL;
+    }
+    mqtt_cloud_platform_data_t *platform_data = esp_cloud_mem_calloc(1, sizeof(mqtt_cloud_platform_data_t));
+    if (!platform_data) {
+        return ESP_ERR_NO_MEM;
+    }
+    platform_data->event_queue = xQueueCreate(MQTT_CLOUD_EVENT_QUEUE_SIZE, sizeof(mqtt_cloud_event_t));
+    if (!platform_data->event_queue) {
+        goto init_err;
+    }
+    snprintf(platform_data->update_topic, MQTT_SHADOW_TOPIC_LEN, "$aws/things/%s/shadow/update", handle->device_id);
+    snprintf(platform_data->accepted_topic, MQTT_SHADOW_TOPIC_LEN, "%s/accepted", platform_data->update_topic);
+    snprintf(platform_data->rejected_topic, MQTT_SHADOW_TOPIC_LEN, "%s/rejected", platform_data->update_topic);
+    snprintf(platform_data->delta_topic, MQTT_SHADOW_TOPIC_LEN, "%s/delta", platform_data->update_topic);
+    snprintf(platform_data->get_topic, MQTT_SHADOW_TOPIC_LEN, "$aws/things/%s/shadow/get", handle->device_id);
+    snprintf(platform_data->get_accepted_topic, MQTT_SHADOW_TOPIC_LEN, "%s/accepted", platform_data->get_topic);
+    snprintf(platform_data->get_rejected_topic, MQTT_SHADOW_TOPIC_LEN, "%s/rejected", platform_data->get_topic);
+    handle->cloud_platform_priv = platform_data;
+    return ESP_OK;
+
+init_err:
+    free(platform_data);
+    return ESP_FAIL;
+}
+
+static esp_err_t mqtt_cloud_deinit(esp_cloud_internal_handle_t *handle)
+{
+    mqtt_cloud_platform_data_t *platform_data = handle->cloud_platform_priv;
+    if (!platform_data) {
+        return ESP_FAIL;
+    }
+    if (platform_data->client) {
+        esp_mqtt_client_destroy(platform_data->client);
+    }
+    mqtt_cloud_inflight_requeue_all(handle);
+    mqtt_cloud_event_t event;
+    while (xQueueReceive(platform_data->event_queue, &event, 0) == pdTRUE) {
+        free(event.topic);
+        free(event.data);
+    }
+    vQueueDelete(platform_data->event_queue);
+    esp_cloud_topic_router_clear(&platform_data->router);
+    free(platform_data->rx_topic);
+    free(platform_data->rx_data);
+    free(platform_data);
+    handle->cloud_platform_priv = NULL;
+    return ESP_OK;
+}
+
+static const esp_cloud_platform_ops_t mqtt_platform_ops = {
+    .name = "mqtt",
+    .init = mqtt_cloud_init,
+    .deinit = mqtt_cloud_deinit,
+    .connect = mqtt_cloud_connect,
+    .disconnect = mqtt_cloud_disconnect,
+    .wait = mqtt_cloud_wait,
+    .wakeup = mqtt_cloud_wakeup,
+    .report_changes = mqtt_cloud_report_changes,
+    .report_state = mqtt_cloud_report_state,
+    .register_dynamic_params = mqtt_cloud_register_dynamic_params,
+    .publish = mqtt_cloud_publish,
+    .subscribe = mqtt_cloud_subscribe,
+    .unsubscribe = mqtt_cloud_unsubscribe,
+};
+
+const esp_cloud_platform_ops_t *esp_cloud_platform_mqtt(void)
+{
+    return &mqtt_platform_ops;
+}
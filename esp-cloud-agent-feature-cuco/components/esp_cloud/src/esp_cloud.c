@@ -42,11 +42,11 @@
 #include "app_main.h"
 static const char *TAG = "esp_cloud";
 
-#define INFO_TOPIC_SUFFIX       "device/info"
-
-#define DEFAULT_STATIC_PARAMS_COUNT         4
-#define DEFAULT_DYNAMIC_PARAMS_COUNT        3
-#define ESP_CLOUD_TASK_QUEUE_SIZE           8
+/* Upper bound on how long the cloud task sleeps. The application sets the state flags
+ * which the task acts upon, such as the Alexa login state, without waking it up, so
+ * they are picked up within this.
+ */
+#define ESP_CLOUD_TASK_POLL_MS              1000
 
 #define DEV_FAMILY  "Outlets"
 #define DEV_MODEL   "ESP-Outlet-1"
@@ -62,6 +62,10 @@ esp_err_t esp_cloud_init(esp_cloud_config_t *config, esp_cloud_handle_t *handle)
     if (g_cloud_handle) {
         return ESP_FAIL;
     }
+    if (config->dynamic_cloud_params_count > ESP_CLOUD_MAX_DYNAMIC_PARAMS) {
+        ESP_LOGE(TAG, "At most %d dynamic params are supported", ESP_CLOUD_MAX_DYNAMIC_PARAMS);
+        return ESP_ERR_INVALID_ARG;
+    }
     if (esp_cloud_storage_init() != ESP_OK) {
         return ESP_FAIL;
     }
@@ -103,274 +107,71 @@ esp_err_t esp_cloud_init(esp_cloud_config_t *config, esp_cloud_handle_t *handle)
     }
     ESP_LOGI(TAG, "pkind_code %s", prov_config.dev_config.pkind_code);
 
-    g_cloud_handle->work_queue = xQueueCreate(ESP_CLOUD_TASK_QUEUE_SIZE, sizeof(esp_cloud_work_queue_entry_t));
-    if (!g_cloud_handle->work_queue) {
+    if (esp_cloud_work_queue_init(g_cloud_handle) != ESP_OK) {
         free(g_cloud_handle);
         g_cloud_handle = NULL;
         ESP_LOGE(TAG, "ESP Cloud Task Queue Creation Failed");
         return ESP_FAIL;
     }
+    esp_cloud_timer_init(g_cloud_handle);
+    if (esp_cloud_isr_ring_init(g_cloud_handle) != ESP_OK) {
+        esp_cloud_work_queue_deinit(g_cloud_handle);
+        free(g_cloud_handle);
+        g_cloud_handle = NULL;
+        ESP_LOGE(TAG, "ESP Cloud ISR Ring Allocation Failed");
+        return ESP_FAIL;
+    }
 
+    g_cloud_handle->platform = config->platform ? config->platform : esp_cloud_platform_aws();
+    esp_cloud_creds_load(g_cloud_handle);
     if (esp_cloud_platform_init(g_cloud_handle) != ESP_OK) {
-        vQueueDelete(g_cloud_handle->work_queue);
+        esp_cloud_creds_free(g_cloud_handle);
+        esp_cloud_work_queue_deinit(g_cloud_handle);
+        esp_cloud_isr_ring_deinit(g_cloud_handle);
         free(g_cloud_handle);
         g_cloud_handle = NULL;
         return ESP_FAIL;
     }
     
-    g_cloud_handle->max_dynamic_params_count = config->dynamic_cloud_params_count + DEFAULT_DYNAMIC_PARAMS_COUNT;
-    g_cloud_handle->max_static_params_count = config->static_cloud_params_count + DEFAULT_STATIC_PARAMS_COUNT;
+    esp_err_t err = esp_cloud_params_init(g_cloud_handle, config);
+    if (err != ESP_OK) {
+        esp_cloud_platform_deinit(g_cloud_handle);
+        esp_cloud_creds_free(g_cloud_handle);
+        esp_cloud_work_queue_deinit(g_cloud_handle);
+        esp_cloud_isr_ring_deinit(g_cloud_handle);
+        free(g_cloud_handle);
+        g_cloud_handle = NULL;
+        return err;
+    }
     g_cloud_handle->enable_time_sync = config->enable_time_sync;
     g_cloud_handle->reconnect_attempts = config->reconnect_attempts;
-    g_cloud_handle->dynamic_cloud_params = esp_cloud_mem_calloc(g_cloud_handle->max_dynamic_params_count, sizeof(esp_cloud_dynamic_param_t));
-    g_cloud_handle->static_cloud_params = esp_cloud_mem_calloc(g_cloud_handle->max_static_params_count, sizeof(esp_cloud_static_param_t));
+    g_cloud_handle->coalesce.min_update_interval_ms = config->min_update_interval_ms;
+    g_cloud_handle->coalesce.max_update_latency_ms = config->max_update_latency_ms;
+    if (esp_cloud_topics_init(g_cloud_handle) != ESP_OK) {
+        esp_cloud_params_deinit(g_cloud_handle);
+        esp_cloud_platform_deinit(g_cloud_handle);
+        esp_cloud_creds_free(g_cloud_handle);
+        esp_cloud_work_queue_deinit(g_cloud_handle);
+        esp_cloud_isr_ring_deinit(g_cloud_handle);
+        free(g_cloud_handle);
+        g_cloud_handle = NULL;
+        ESP_LOGE(TAG, "Failed to allocate the topics");
+        return ESP_ERR_NO_MEM;
+    }
     *handle = (esp_cloud_handle_t)g_cloud_handle;
     esp_cloud_add_static_string_param(*handle, "name", config->id.name);
     esp_cloud_add_static_string_param(*handle, "type", config->id.type);
     esp_cloud_add_static_string_param(*handle, "model", config->id.model);
     esp_cloud_add_static_string_param(*handle, "fw_version", config->id.fw_version);
-    g_cloud_handle->fw_version = strdup(config->id.fw_version);
-    return ESP_OK;
-}
-
-/* Internal. Add a generic new Dynamic Cloud Parameter */
-static esp_cloud_static_param_t *esp_cloud_add_static_param(esp_cloud_handle_t handle, const char *name)
-{
-    if (!handle) {
-        return NULL;
-    }
-    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
-    if (int_handle->cur_static_params_count == int_handle->max_static_params_count) {
-        return NULL;
-    }
-    int i;
-    esp_cloud_static_param_t *param = &int_handle->static_cloud_params[0];
-    for (i = 0; i < int_handle->cur_static_params_count; i++, param++) {
-        if (strcmp(name, param->name) == 0) {
-            return NULL;
-        }
-    }
-    param->name = strdup(name);
-    int_handle->cur_static_params_count++;
-    return param;
-}
-
-/* Add a Dynamic String Paramter */
-esp_err_t esp_cloud_add_static_string_param(esp_cloud_handle_t handle, const char *name, const char *val)
-{
-    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_STRING;
-    param->val.val.s = strdup(val);
-    if (!param->val.val.s) {
-        return ESP_ERR_NO_MEM;
-    }
-    param->val.val_size = strlen(val);
-    return ESP_OK;
-}
-
-/* Add a Dynamic Integer Parameter */
-esp_err_t esp_cloud_add_static_int_param(esp_cloud_handle_t handle, const char *name, int val)
-{
-    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_INTEGER;
-    param->val.val.i = val;
-    param->val.val_size = sizeof(int);
-    return ESP_OK;
-}
-
-/* Add a Dynamic Float Parameter */
-esp_err_t esp_cloud_add_static_float_param(esp_cloud_handle_t handle, const char *name, float val)
-{
-    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_FLOAT;
-    param->val.val.f = val;
-    param->val.val_size = sizeof(float);
-    return ESP_OK;
-}
-
-/* Add a Dynamic Boolean Parameter */
-esp_err_t esp_cloud_add_static_bool_param(esp_cloud_handle_t handle, const char *name, bool val)
-{
-    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_BOOLEAN;
-    param->val.val.b = val;
-    param->val.val_size = sizeof(bool);
-    return ESP_OK;
-}
-/* Internal. Add a generic new Dynamic Cloud Parameter */
-static esp_cloud_dynamic_param_t *esp_cloud_add_dynamic_param(esp_cloud_handle_t handle, const char *name, esp_cloud_param_callback_t cb, void *priv_data)
-{
-    if (!handle) {
-        return NULL;
-    }
-    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
-    if (int_handle->cur_dynamic_params_count == int_handle->max_dynamic_params_count) {
-        return NULL;
-    }
-    int i;
-    esp_cloud_dynamic_param_t *param = &int_handle->dynamic_cloud_params[0];
-    for (i = 0; i < int_handle->cur_dynamic_params_count; i++, param++) {
-        if (strcmp(name, param->name) == 0) {
-            return NULL;
-        }
-    }
-    param->name = strdup(name);
-    param->cb = cb;
-    param->priv_data = priv_data;
-    int_handle->cur_dynamic_params_count++;
-    return param;
-}
-
-/* Add a Dynamic String Paramter */
-esp_err_t esp_cloud_add_dynamic_string_param(esp_cloud_handle_t handle, const char *name, const char *val, size_t val_size, esp_cloud_param_callback_t cb, void *priv_data)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_add_dynamic_param(handle, name, cb, priv_data);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_STRING;
-    param->val.val.s = strdup(val);
-    if (!param->val.val.s) {
-        return ESP_ERR_NO_MEM;
-    }
-    param->val.val_size = val_size;
-    return ESP_OK;
-}
-
-/* Add a Dynamic Integer Parameter */
-esp_err_t esp_cloud_add_dynamic_int_param(esp_cloud_handle_t handle, const char *name, int val, esp_cloud_param_callback_t cb, void *priv_data)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_add_dynamic_param(handle, name, cb, priv_data);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_INTEGER;
-    param->val.val.i = val;
-    param->val.val_size = sizeof(int);
-    return ESP_OK;
-}
-
-/* Add a Dynamic Float Parameter */
-esp_err_t esp_cloud_add_dynamic_float_param(esp_cloud_handle_t handle, const char *name, float val, esp_cloud_param_callback_t cb, void *priv_data)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_add_dynamic_param(handle, name, cb, priv_data);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_FLOAT;
-    param->val.val.f = val;
-    param->val.val_size = sizeof(float);
-    return ESP_OK;
-}
-
-/* Add a Dynamic Boolean Parameter */
-esp_err_t esp_cloud_add_dynamic_bool_param(esp_cloud_handle_t handle, const char *name, bool val, esp_cloud_param_callback_t cb, void *priv_data)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_add_dynamic_param(handle, name, cb, priv_data);
-    if (!param) {
-        return ESP_FAIL;
-    }
-    param->val.type = CLOUD_PARAM_TYPE_BOOLEAN;
-    param->val.val.b = val;
-    param->val.val_size = sizeof(bool);
+    g_cloud_handle->fw_version = esp_cloud_mem_arena_strdup(g_cloud_handle->arena, config->id.fw_version);
     return ESP_OK;
 }
 
 /* Get dynamic cloud param from name */
 esp_cloud_dynamic_param_t *esp_cloud_get_dynamic_param_by_name(const char *name)
 {
-    if (!name) {
-        return NULL;
-    }
-    int i;
-    esp_cloud_dynamic_param_t *param = &g_cloud_handle->dynamic_cloud_params[0];
-    for (i = 0; i < g_cloud_handle->cur_dynamic_params_count; i++, param++) {
-        if (strcmp(name, param->name) == 0) {
-            return param;
-        }
-    }
-    return NULL;
-}
-
-static esp_cloud_dynamic_param_t *esp_cloud_get_dynamic_param_by_name_and_type(const char *name, esp_cloud_param_val_type_t param_type)
-{
-    if (!name) {
-        return NULL;
-    }
-    int i;
-    esp_cloud_dynamic_param_t *param = &g_cloud_handle->dynamic_cloud_params[0];
-    for (i = 0; i < g_cloud_handle->cur_dynamic_params_count; i++, param++) {
-        if (strcmp(name, param->name) == 0) {
-            if (param->val.type == param_type) {
-                return param;
-            }
-        }
-    }
-    return NULL;
-}
-
-
-/* TODO: Use Handle */
-esp_err_t esp_cloud_update_bool_param(esp_cloud_handle_t handle, const char *name, bool val)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_name_and_type(name, CLOUD_PARAM_TYPE_BOOLEAN);
-    if (param) {
-        param->val.val.b = val;
-        param->flags |= CLOUD_PARAM_FLAG_LOCAL_CHANGE;
-        return ESP_OK;
-    }
-    return ESP_FAIL;
-}
-
-esp_err_t esp_cloud_update_int_param(esp_cloud_handle_t handle, const char *name, int val)
-{
-
-    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_name_and_type(name, CLOUD_PARAM_TYPE_INTEGER);
-    if (param) {
-        param->val.val.i = val;
-        param->flags |= CLOUD_PARAM_FLAG_LOCAL_CHANGE;
-        return ESP_OK;
-    }
-    return ESP_FAIL;
-}
-
-esp_err_t esp_cloud_update_float_param(esp_cloud_handle_t handle, const char *name, float val)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_name_and_type(name, CLOUD_PARAM_TYPE_FLOAT);
-    if (param) {
-        param->val.val.f = val;
-        param->flags |= CLOUD_PARAM_FLAG_LOCAL_CHANGE;
-        return ESP_OK;
-    }
-    return ESP_FAIL;
-}
-
-esp_err_t esp_cloud_update_string_param(esp_cloud_handle_t handle, const char *name, char *val)
-{
-    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_name_and_type(name, CLOUD_PARAM_TYPE_STRING);
-    if (param) {
-        if (param->val.val.s) {
-            free(param->val.val.s);
-        }
-        param->val.val.s = strdup(val);
-        if (param->val.val.s) {
-            param->flags |= CLOUD_PARAM_FLAG_LOCAL_CHANGE;
-            return ESP_OK;
-        }
-    }
-    return ESP_FAIL;
+    esp_cloud_param_id_t id = esp_cloud_get_dynamic_param_id(g_cloud_handle, name);
+    return esp_cloud_get_dynamic_param_by_id(g_cloud_handle, id);
 }
 
 static void esp_cloud_report_static_params(esp_cloud_internal_handle_t *handle, json_str_t *jptr)
@@ -411,10 +212,8 @@ static esp_err_t esp_cloud_report_device_info(esp_cloud_internal_handle_t *handl
     esp_cloud_report_static_params(handle, &jstr);
     json_end_object(&jstr);
     json_str_end(&jstr);
-    char publish_topic[100];
-    snprintf(publish_topic, sizeof(publish_topic), "%s/%s", handle->device_id, INFO_TOPIC_SUFFIX);
 
-    return esp_cloud_platform_publish(handle, publish_topic, publish_payload);
+    return esp_cloud_platform_publish_id(handle, ESP_CLOUD_TOPIC_INFO, publish_payload, strlen(publish_payload));
 
 }
 
@@ -439,14 +238,7 @@ static esp_err_t esp_cloud_report_user_bind_info(esp_cloud_internal_handle_t *ha
     json_end_object(&jstr);
     json_str_end(&jstr);
 
-    char *app_topic = custom_config_storage_get("app_topic");
-    if (!app_topic) {
-        ESP_LOGE(TAG, "app_topic: fail");
-        return ESP_FAIL;
-    }
-    esp_err_t err = esp_cloud_platform_publish(handle, app_topic,publish_payload);
-    free(app_topic);
-    return err;
+    return esp_cloud_platform_publish_id(handle, ESP_CLOUD_TOPIC_APP, publish_payload, strlen(publish_payload));
 }
 
 // esp_err_t ota_report_progress_val_info(esp_cloud_internal_handle_t *handle,int progress_val)
@@ -519,19 +311,6 @@ esp_err_t esp_cloud_report_device_state(esp_cloud_internal_handle_t *handle)
     return esp_cloud_platform_report_state(handle);
 }
 
-void esp_cloud_handle_work_queue(esp_cloud_internal_handle_t *handle)
-{
-    if (!handle) {
-        return;
-    }
-    esp_cloud_work_queue_entry_t work_queue_entry;
-    BaseType_t ret = xQueueReceive(handle->work_queue, &work_queue_entry, 0);
-    while (ret == pdTRUE) {
-        work_queue_entry.work_fn((esp_cloud_handle_t)handle, work_queue_entry.priv_data);
-        ret = xQueueReceive(handle->work_queue, &work_queue_entry, 0);
-    }
-}
-
 esp_err_t esp_cloud_report_alexa_sign_in_status(esp_cloud_internal_handle_t *handle,int code, char *additional_info)
 {
     if (!handle) {
@@ -552,13 +331,8 @@ esp_err_t esp_cloud_report_alexa_sign_in_status(esp_cloud_internal_handle_t *han
     json_end_object(&jstr);
     json_str_end(&jstr);
 
-    char *app_topic = custom_config_storage_get("app_topic");
-    if (!app_topic) {
-        ESP_LOGE(TAG, "app_topic: fail");
-        return ESP_FAIL;
-    }
-    esp_err_t err = esp_cloud_platform_publish(handle, app_topic,publish_payload);
-    free(app_topic);
+    esp_err_t err = esp_cloud_platform_publish_id(handle, ESP_CLOUD_TOPIC_APP, publish_payload,
+            strlen(publish_payload));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_cloud_platform_publish_data returned error %d",err);
         return ESP_FAIL;
@@ -586,13 +360,8 @@ esp_err_t esp_cloud_report_alexa_sign_out_status(esp_cloud_internal_handle_t *ha
     json_end_object(&jstr);
     json_str_end(&jstr);
 
-    char *app_topic = custom_config_storage_get("app_topic");
-    if (!app_topic) {
-        ESP_LOGE(TAG, "app_topic: fail");
-        return ESP_FAIL;
-    }
-    esp_err_t err = esp_cloud_platform_publish(handle, app_topic,publish_payload);
-    free(app_topic);
+    esp_err_t err = esp_cloud_platform_publish_id(handle, ESP_CLOUD_TOPIC_APP, publish_payload,
+            strlen(publish_payload));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_cloud_platform_publish_data returned error %d",err);
         return ESP_FAIL;
@@ -756,24 +525,94 @@ void test_alexa_sign_in(void){
 static esp_err_t esp_cloud_alexa_sign_in_topic(esp_cloud_handle_t handle, void *priv_data)
 {
     esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
-    char *app_topic = custom_config_storage_get("app_topic");
-    if (!app_topic) {
+    char *old_topic;
+    if (esp_cloud_topics_load_app(int_handle, &old_topic) != ESP_OK) {
         ESP_LOGE(TAG, "app_topic: fail");
         return ESP_FAIL;
     }
-
-    /* First unsubscribing, in case there is a stale subscription */
-    esp_cloud_platform_unsubscribe(int_handle, app_topic);
+    /* The new topic first, so that no message is missed while moving over. Subscribing
+     * again to the same topic only replaces the subscription. The old topic is no longer
+     * the app's, so it goes even if the new subscription failed and is to be retried.
+     */
+    const char *app_topic = int_handle->topics[ESP_CLOUD_TOPIC_APP].str;
     esp_err_t err = esp_cloud_platform_subscribe(int_handle, app_topic, alexa_sign_in_handler, priv_data);
-
-    free(app_topic);
+    if (old_topic && strcmp(old_topic, app_topic)) {
+        esp_cloud_platform_unsubscribe(int_handle, old_topic);
+    }
+    free(old_topic);
     return err;
 }
 
+/* Subscribes to the app topic, and on failure sets up the next attempt with backoff.
+ * If given, *timeout_ms is reduced to the time until that attempt.
+ */
+static void esp_cloud_app_topic_subscribe(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    if (esp_cloud_alexa_sign_in_topic(handle, handle) == ESP_OK) {
+        dev_config.app_topic_sub_states = APP_TOPIC_SUB_OK;
+        handle->app_topic_retries = 0;
+        return;
+    }
+    dev_config.app_topic_sub_states = APP_TOPIC_SUB_FAIL;
+    uint32_t delay_ms = esp_cloud_backoff_delay(ESP_CLOUD_CONN_ERR_TRANSIENT, handle->app_topic_retries);
+    if (handle->app_topic_retries < UINT16_MAX) {
+        handle->app_topic_retries++;
+    }
+    handle->app_topic_retry_ms = esp_cloud_time_ms() + delay_ms;
+    if (timeout_ms && (delay_ms < *timeout_ms)) {
+        *timeout_ms = delay_ms;
+    }
+    ESP_LOGW(TAG, "App topic subscription failed. Retrying in %u ms", delay_ms);
+}
+
+/* Moves the subscription over to a changed app topic, and retries a failed one once
+ * its backoff is over. *timeout_ms is reduced to the time left until the retry.
+ */
+static void esp_cloud_app_topic_poll(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    if ((dev_config.app_topic_sub_states == APP_TOPIC_SUB_FAIL) && !handle->app_topic_stale) {
+        int32_t wait_ms = (int32_t)(handle->app_topic_retry_ms - esp_cloud_time_ms());
+        if (wait_ms > 0) {
+            if ((uint32_t)wait_ms < *timeout_ms) {
+                *timeout_ms = wait_ms;
+            }
+            return;
+        }
+        esp_cloud_platform_connect(handle);
+        /* The app may have failed it after writing a new topic, so the topic is read again */
+        handle->app_topic_stale = true;
+    }
+    if (handle->app_topic_stale) {
+        esp_cloud_app_topic_subscribe(handle, timeout_ms);
+    }
+}
+
 
 extern void aws_iot_done_cb();
 extern const int AWS_IOT_DONE_BIT;
 extern void test_alexa_mem(void);
+
+/* Connect and register the params, which the platforms drop on a disconnect. Done
+ * when the task starts and again after the platform is replaced by a credentials reload.
+ */
+static esp_err_t esp_cloud_bring_up(esp_cloud_internal_handle_t *handle)
+{
+    /* Retries with backoff, up to the reconnect_attempts budget */
+    esp_err_t err = esp_cloud_reconnect_first(handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not connect to the cloud");
+        return err;
+    }
+    /* Params the platform cannot take are skipped there. Anything else leaves nothing to report */
+    err = esp_cloud_platform_register_dynamic_params(handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not register the params with the cloud, %d", err);
+        esp_cloud_platform_disconnect(handle);
+        return err;
+    }
+    return ESP_OK;
+}
+
 static void esp_cloud_task(void *param)
 {
     if (!param) {
@@ -781,32 +620,38 @@ static void esp_cloud_task(void *param)
     }
     esp_cloud_internal_handle_t *handle = (esp_cloud_internal_handle_t *) param;
 
-    esp_err_t err = esp_cloud_platform_connect(handle);
-    while (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_cloud_platform_connect() err %d. Aborting", err);
-        err = esp_cloud_platform_connect(handle);
+    esp_err_t err = esp_cloud_bring_up(handle);
+    if (err != ESP_OK) {
+        dev_config.dev_states = IOT_FAIL;
+        vTaskDelete(NULL);
+        return;
     }
+    ESP_LOGI(TAG, "Arena: %d of %d bytes used, %d chunk(s)", esp_cloud_mem_arena_used(handle->arena),
+            esp_cloud_mem_arena_size(handle->arena), esp_cloud_mem_arena_chunks(handle->arena));
 
-    esp_cloud_platform_register_dynamic_params(handle);
-
-    err = esp_cloud_alexa_sign_in_topic(handle,handle);
-    if(err == ESP_OK){
-        dev_config.app_topic_sub_states = APP_TOPIC_SUB_OK;
-    }
+    esp_cloud_app_topic_subscribe(handle, NULL);
+    /* Only the params which differ from the cloud's copy go out */
+    esp_cloud_platform_report_state(handle);
 
     bit_hal.app_aws_done_cb(); 
     net_disconnect_scan_stop();
     // led_timer_stop();
     while (!handle->cloud_stop) {
-        esp_cloud_handle_work_queue(handle);
-        esp_cloud_platform_wait(handle);
+        esp_cloud_isr_ring_drain(handle);
+        bool work_pending = esp_cloud_handle_work_queue(handle);
 
         if(dev_config.iot_reconnect==IOT_RECONNECT_FINISH){
+            /* Picks up desired values set while offline, as deltas may not have been queued for us */
+            esp_cloud_platform_report_state(handle);
             esp_cloud_update_bool_param(esp_cloud_get_handle(), "connected", true);
             dev_config.iot_reconnect=IOT_RECONNECT_INIT;
         }
 
         if((dev_config.Wait_for_alexa_in == LOGED_IN2)){
+            /* Login state and volume go out in the same shadow update. The cloud task does
+             * not wait for another task's transaction, and reports them separately instead.
+             */
+            bool txn = (esp_cloud_param_txn_try_begin(handle, 0) == ESP_OK);
             esp_cloud_update_bool_param(esp_cloud_get_handle(), "alexa", true);
             if(volume_get(&n_v.volume)>=0){
                 // volume_set(n_v.volume);
@@ -814,6 +659,9 @@ static void esp_cloud_task(void *param)
                 n_v.volume = 100;
             }
             esp_cloud_update_int_param(esp_cloud_get_handle(),"alexa_volume",n_v.volume);
+            if (txn) {
+                esp_cloud_param_txn_commit(handle);
+            }
             dev_config.Wait_for_alexa_in = LOGED_IN_FINISH;
         }
 
@@ -823,14 +671,6 @@ static void esp_cloud_task(void *param)
             dev_config.Wait_for_alexa_in = NOT_LOG_IN;
         }
 
-        if(dev_config.app_topic_sub_states == APP_TOPIC_SUB_FAIL){
-            esp_cloud_platform_connect(handle);
-            err = esp_cloud_alexa_sign_in_topic(handle,handle);
-            if(err == ESP_OK){
-                dev_config.app_topic_sub_states = APP_TOPIC_SUB_OK;
-            }
-        }
-
         if((dev_config.user_bind_flag == NOTICE_BINDED)||(dev_config.user_bind_flag == BINDED)){
             esp_cloud_platform_report_state(handle);
             dev_config.user_bind_flag = NOTICE_FINISH;
@@ -846,23 +686,31 @@ static void esp_cloud_task(void *param)
             prov_config.report_rssi = false;
             esp_cloud_update_int_param(esp_cloud_get_handle(),"network",prov_config.rssi);
         }
-    }
-}
 
-esp_err_t esp_cloud_queue_work(esp_cloud_handle_t handle, esp_cloud_work_fn_t work_fn, void *priv_data)
-{
-    if (!handle) {
-        return ESP_FAIL;
+        uint32_t timeout_ms = ESP_CLOUD_TASK_POLL_MS;
+        /* Flushed first, so that the deadlines below can only lower the timeout */
+        if (esp_cloud_shadow_flush_due(handle, &timeout_ms)) {
+            esp_cloud_platform_report_changes(handle);
+            /* If an update is still in flight, its ack will wake the task up */
+            timeout_ms = ESP_CLOUD_TASK_POLL_MS;
+        }
+        /* Expired timers are only queued here, and run with the rest of the work */
+        esp_cloud_timer_process(handle, &timeout_ms);
+        esp_cloud_outbox_replay(handle, &timeout_ms);
+        esp_cloud_param_report_poll(handle, &timeout_ms);
+        esp_cloud_app_topic_poll(handle, &timeout_ms);
+        /* Work left over after the time budget only waits for a quick MQTT yield */
+        if (work_pending) {
+            timeout_ms = 0;
+        }
+        /* Sleeps until inbound MQTT data, a local change, queued work, a timer or a stop */
+        esp_cloud_platform_wait(handle, timeout_ms);
     }
-    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *) handle;
-    esp_cloud_work_queue_entry_t work_queue_entry = {
-        .work_fn = work_fn,
-        .priv_data = priv_data,
-    };
-    if (xQueueSend(int_handle->work_queue, &work_queue_entry, 0) == pdTRUE) {
-        return ESP_OK;
+    if (esp_cloud_reconnect_gave_up(handle)) {
+        ESP_LOGE(TAG, "Could not reconnect to the cloud. Stopping");
+        dev_config.dev_states = IOT_FAIL;
     }
-    return ESP_FAIL;
+    vTaskDelete(NULL);
 }
 
 /* Start the Cloud */
@@ -880,6 +728,8 @@ esp_err_t esp_cloud_start(esp_cloud_handle_t handle)
         esp_cloud_time_sync_uninit();
     }
 
+    /* After the time sync, so that messages queued from now on get a usable timestamp */
+    esp_cloud_outbox_init(int_handle);
     if (xTaskCreate(&esp_cloud_task, "esp_cloud_task", ESP_CLOUD_TASK_STACK, int_handle, 5, NULL) != pdPASS) {
         ESP_LOGE(TAG, "Couldn't create cloud task");
         return ESP_FAIL;
@@ -895,6 +745,8 @@ esp_err_t esp_cloud_stop(esp_cloud_handle_t handle)
     }
     esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
     int_handle->cloud_stop = true;
+    /* Rather than when the task next wakes up by itself */
+    esp_cloud_platform_wakeup(int_handle);
     return ESP_OK;
 }
 
@@ -923,6 +775,43 @@ char *esp_cloud_get_device_id(esp_cloud_handle_t handle)
 // }
 
 
+/* The credentials may have been provisioned again. Bring the platform back up with
+ * the new ones, once its client is stopped and no longer holds the old ones. Runs
+ * on the cloud task, so that nothing is waiting on or reporting through the
+ * platform data while it is freed.
+ */
+static void esp_cloud_creds_reload_work(esp_cloud_handle_t handle, void *priv_data)
+{
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (int_handle->reconnect.connected) {
+        esp_cloud_platform_disconnect(int_handle);
+    }
+    esp_cloud_platform_deinit(int_handle);
+    if (esp_cloud_creds_reload(int_handle) != ESP_OK) {
+        ESP_LOGW(TAG, "Keeping the old credentials");
+    }
+    if ((esp_cloud_platform_init(int_handle) != ESP_OK) || (esp_cloud_bring_up(int_handle) != ESP_OK)) {
+        ESP_LOGE(TAG, "Could not come back up after reloading the credentials. Stopping");
+        dev_config.dev_states = IOT_FAIL;
+        int_handle->cloud_stop = true;
+        return;
+    }
+    /* The subscriptions went with the old platform data */
+    int_handle->app_topic_stale = true;
+    if (dev_config.iot_reconnect == IOT_RECONNECT) {
+        /* Finishes the reconnection which was in progress, which reports the state */
+        dev_config.iot_reconnect = IOT_RECONNECT_FINISH;
+    } else {
+        esp_cloud_platform_report_state(int_handle);
+    }
+}
+
 void esp_cloud_platform_deinit_cb(void){
-    esp_cloud_platform_deinit(g_cloud_handle);
+    if (!g_cloud_handle) {
+        return;
+    }
+    if (esp_cloud_queue_work_with_prio(g_cloud_handle, ESP_CLOUD_WORK_PRIO_URGENT,
+                esp_cloud_creds_reload_work, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Could not queue the credentials reload");
+    }
 }
\ No newline at end of file
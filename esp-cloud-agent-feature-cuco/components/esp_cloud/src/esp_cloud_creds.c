@@ -0,0 +1,95 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+
+#include "esp_cloud.h"
+#include "esp_cloud_storage.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_creds";
+
+/* Absent entries are left NULL. Which ones are mandatory is up to the backend */
+void esp_cloud_creds_load(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_creds_t *creds = &handle->creds;
+    creds->mqtt_host = esp_cloud_storage_get("mqtt_host");
+    creds->client_cert = esp_cloud_storage_get("client_cert");
+    creds->client_key = esp_cloud_storage_get("client_key");
+    creds->server_cert = esp_cloud_storage_get("server_cert");
+    creds->ota_server_cert = esp_cloud_storage_get("ota_server_cert");
+    size_t size = 0;
+    const char *entries[] = {creds->mqtt_host, creds->client_cert, creds->client_key,
+            creds->server_cert, creds->ota_server_cert};
+    for (int i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+        if (entries[i]) {
+            size += strlen(entries[i]) + 1;
+        }
+    }
+    ESP_LOGI(TAG, "Loaded %d bytes of credentials", size);
+}
+
+void esp_cloud_creds_free(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_creds_t *creds = &handle->creds;
+    free(creds->mqtt_host);
+    free(creds->client_cert);
+    free(creds->client_key);
+    free(creds->server_cert);
+    free(creds->ota_server_cert);
+    memset(creds, 0, sizeof(*creds));
+}
+
+/* Keep the old copy if the entry did not change, so that a pointer held elsewhere stays valid */
+static void esp_cloud_creds_swap(char **cur, char *fresh)
+{
+    if (*cur && fresh && (strcmp(*cur, fresh) == 0)) {
+        free(fresh);
+        return;
+    }
+    free(*cur);
+    *cur = fresh;
+}
+
+/* Read the credentials from storage again, eg. after provisioning. The platform
+ * must have been deinitialised, as the ones which changed are freed. Fails if an
+ * OTA still holds an OTA server certificate which would have to go.
+ */
+esp_err_t esp_cloud_creds_reload(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_creds_t *creds = &handle->creds;
+    esp_cloud_creds_t old = *creds;
+    esp_cloud_creds_load(handle);
+    if (__atomic_load_n(&handle->ota_cert_users, __ATOMIC_SEQ_CST) && old.ota_server_cert
+            && (!creds->ota_server_cert || strcmp(old.ota_server_cert, creds->ota_server_cert))) {
+        ESP_LOGE(TAG, "OTA server certificate in use by an OTA. Not reloading the credentials");
+        esp_cloud_creds_free(handle);
+        *creds = old;
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_cloud_creds_t fresh = *creds;
+    *creds = old;
+    esp_cloud_creds_swap(&creds->mqtt_host, fresh.mqtt_host);
+    esp_cloud_creds_swap(&creds->client_cert, fresh.client_cert);
+    esp_cloud_creds_swap(&creds->client_key, fresh.client_key);
+    esp_cloud_creds_swap(&creds->server_cert, fresh.server_cert);
+    esp_cloud_creds_swap(&creds->ota_server_cert, fresh.ota_server_cert);
+    return ESP_OK;
+}
+
+const esp_cloud_creds_t *esp_cloud_get_creds(esp_cloud_internal_handle_t *handle)
+{
+    return &handle->creds;
+}
@@ -15,14 +15,36 @@
 #include <stdint.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <json_generator.h>
+#include "esp_cloud_mem.h"
+
+/* Reporting policy of a numeric param, and the state needed to apply it */
+typedef struct {
+    esp_cloud_report_policy_t policy;
+    /* Value sent with the latest update, and the latest one the cloud acknowledged */
+    float sent_val;
+    float acked_val;
+    bool acked_valid;
+    uint32_t last_report_ms;
+    bool reported;
+    /* A significant change is waiting for min_interval_ms to elapse */
+    bool held;
+} esp_cloud_param_report_t;
 
 typedef struct {
-    uint8_t flags;
     bool read_write;
     char *name;
+    uint32_t name_hash;
     void *priv_data;
     esp_cloud_param_val_t val;
+    /* For strings, a second val_size buffer allocated along with val.val.s,
+     * for the platform to keep its own copy of the value in
+     */
+    char *platform_buf;
     esp_cloud_param_callback_t cb;
+    esp_cloud_param_report_t *report;
 } esp_cloud_dynamic_param_t;
 
 typedef struct {
@@ -30,28 +52,243 @@ typedef struct {
     esp_cloud_param_val_t val;
 } esp_cloud_static_param_t;
 
+/* Coalescing state for shadow updates. Owned by the cloud task, except for
+ * stats.changes_recorded which is incremented atomically by producers.
+ */
+typedef struct {
+    uint32_t min_update_interval_ms;
+    uint32_t max_update_latency_ms;
+    uint32_t last_update_ms;
+    uint32_t pending_since_ms;
+    bool pending;
+    bool published;
+    /* Report all the params with the next update */
+    bool full_report;
+    uint64_t total_latency_ms;
+    uint32_t flush_count;
+    uint64_t total_ack_ms;
+    esp_cloud_shadow_stats_t stats;
+} esp_cloud_shadow_coalesce_t;
+
+/* Hashes of the values last sent and last acknowledged by the cloud, per param,
+ * and the shadow version of the latest acknowledgement. 0 stands for no value.
+ */
+typedef struct {
+    uint32_t *sent_hash;
+    uint32_t *acked_hash;
+    uint32_t version;
+} esp_cloud_shadow_snapshot_t;
+
+/* Connection credentials, read from storage once and shared by the backend and OTA.
+ * Both the AWS IoT SDK and esp-mqtt hold on to these PEM buffers and parse them again
+ * on every TLS connect, so they are only replaced by esp_cloud_creds_reload() once the
+ * platform is down.
+ */
+typedef struct {
+    char *mqtt_host;
+    char *client_cert;
+    char *client_key;
+    char *server_cert;
+    char *ota_server_cert;
+} esp_cloud_creds_t;
+
+/* Topics the agent publishes to, see esp_cloud_platform_publish_id() */
+typedef enum {
+    /* "<device_id>/<suffix>", fixed for the life of the handle */
+    ESP_CLOUD_TOPIC_INFO,
+    ESP_CLOUD_TOPIC_OTA_STATUS,
+    ESP_CLOUD_TOPIC_DIAGNOSTICS,
+    ESP_CLOUD_TOPIC_USER_ASSOC,
+    /* From storage. Read again after esp_cloud_app_topic_changed() */
+    ESP_CLOUD_TOPIC_APP,
+    ESP_CLOUD_TOPIC_MAX,
+} esp_cloud_topic_id_t;
+
+typedef struct {
+    char *str;
+    size_t len;
+} esp_cloud_topic_t;
+
+#define ESP_CLOUD_TIMER_WHEEL_LEVELS    3
+#define ESP_CLOUD_TIMER_WHEEL_BITS      6
+#define ESP_CLOUD_TIMER_WHEEL_SLOTS     (1 << ESP_CLOUD_TIMER_WHEEL_BITS)
+
+/* Hierarchical timer wheel run by the cloud task. Level 0 slots are one tick
+ * each and every higher level slot spans a full wheel of the level below it.
+ */
+typedef struct {
+    portMUX_TYPE lock;
+    /* Next tick to be processed */
+    uint32_t cur_tick;
+    uint32_t count;
+    struct esp_cloud_timer *slots[ESP_CLOUD_TIMER_WHEEL_LEVELS][ESP_CLOUD_TIMER_WHEEL_SLOTS];
+} esp_cloud_timer_wheel_t;
+
+/* Entry of the ring used for submissions from ISRs. work_fn is NULL for param updates */
+typedef struct {
+    uint32_t seq;
+    esp_cloud_work_fn_t work_fn;
+    void *priv_data;
+    esp_cloud_param_id_t id;
+    esp_cloud_param_val_type_t type;
+    union {
+        bool b;
+        int i;
+    } val;
+} esp_cloud_isr_cell_t;
+
+typedef struct esp_cloud_outbox esp_cloud_outbox_t;
+
+/* Connection state and backoff, driven by the platform through esp_cloud_reconnect_*() */
+typedef struct {
+    bool connected;
+    bool gave_up;
+    /* Consecutive failures counted against reconnect_attempts */
+    uint16_t failures;
+    /* Consecutive failures of any kind, which set the backoff */
+    uint16_t attempt;
+    uint32_t next_attempt_ms;
+    uint32_t outage_start_ms;
+    uint64_t total_connect_ms;
+    uint32_t attempt_start_ms;
+    uint64_t total_handshake_ms;
+    /* Reconnected at connected_ms, but the offline changes are not accepted yet */
+    bool resume_pending;
+    uint32_t connected_ms;
+    esp_cloud_reconnect_stats_t stats;
+} esp_cloud_reconnect_t;
+
 /* Handle to maintain internal information (will move to an internal file) */
 typedef struct {
     char *device_id;
+    /* Holds the param tables, names and values, which live as long as the handle */
+    esp_cloud_mem_arena_t *arena;
     char *fw_version;
     bool enable_time_sync;
-    uint8_t max_dynamic_params_count;
-    uint8_t cur_dynamic_params_count;
+    uint16_t max_dynamic_params_count;
+    uint16_t cur_dynamic_params_count;
     esp_cloud_dynamic_param_t *dynamic_cloud_params;
-    uint8_t max_static_params_count;
-    uint8_t cur_static_params_count;
+    /* Open addressing index of dynamic params, keyed on name hash. Slots hold id + 1, 0 is empty */
+    uint16_t *dynamic_params_index;
+    uint16_t dynamic_params_index_mask;
+    /* Change bitmaps, one bit per dynamic param. Producers set bits atomically from any task
+     * and the cloud task swaps each word out in one operation.
+     */
+    uint32_t *local_change_bitmap;
+    uint32_t *remote_change_bitmap;
+    /* Guards string values while they are being replaced or copied */
+    portMUX_TYPE param_lock;
+    esp_cloud_shadow_coalesce_t coalesce;
+    esp_cloud_shadow_snapshot_t snapshot;
+    /* Open transaction. Changes made by txn_owner are staged in txn_bitmap and
+     * merged into local_change_bitmap under txn_lock on commit.
+     */
+    SemaphoreHandle_t txn_mutex;
+    TaskHandle_t txn_owner;
+    uint32_t *txn_bitmap;
+    portMUX_TYPE txn_lock;
+    /* Number of dynamic params with a reporting policy */
+    uint16_t report_policy_count;
+    uint16_t max_static_params_count;
+    uint16_t cur_static_params_count;
     esp_cloud_static_param_t *static_cloud_params;
     uint16_t reconnect_attempts;
+    esp_cloud_reconnect_t reconnect;
+    esp_cloud_creds_t creds;
+    /* OTAs holding creds.ota_server_cert, see esp_cloud_ota_get_server_cert() */
+    uint8_t ota_cert_users;
+    /* Device topics live in the arena. The app topic is on the heap, replaced only
+     * by the cloud task and read by others under param_lock.
+     */
+    esp_cloud_topic_t topics[ESP_CLOUD_TOPIC_MAX];
+    bool app_topic_stale;
+    /* Failed app topic subscriptions in a row, and when the next retry is due */
+    uint16_t app_topic_retries;
+    uint32_t app_topic_retry_ms;
+    const esp_cloud_platform_ops_t *platform;
     void *cloud_platform_priv;
     bool cloud_stop;
-    QueueHandle_t work_queue;
+    /* One queue per esp_cloud_work_prio_t */
+    QueueHandle_t work_queues[ESP_CLOUD_WORK_PRIO_MAX];
+    esp_cloud_work_stats_t work_stats[ESP_CLOUD_WORK_PRIO_MAX];
+    uint64_t work_total_wait_ms[ESP_CLOUD_WORK_PRIO_MAX];
+    esp_cloud_timer_wheel_t timer_wheel;
+    /* Lock-free ring written from ISRs and drained by the cloud task */
+    esp_cloud_isr_cell_t *isr_ring;
+    uint32_t isr_ring_mask;
+    uint32_t isr_enqueue_pos;
+    uint32_t isr_dequeue_pos;
+    uint32_t isr_dropped;
+    uint32_t isr_dropped_logged;
+    bool isr_wakeup_pending;
+    /* Flash backed queue of messages whose publish failed. NULL without outbox storage */
+    esp_cloud_outbox_t *outbox;
 } esp_cloud_internal_handle_t;
 
 typedef struct {
     esp_cloud_work_fn_t work_fn;
     void *priv_data;
+    uint32_t queued_ms;
 } esp_cloud_work_queue_entry_t;
 
+esp_err_t esp_cloud_work_queue_init(esp_cloud_internal_handle_t *handle);
+void esp_cloud_work_queue_deinit(esp_cloud_internal_handle_t *handle);
+bool esp_cloud_handle_work_queue(esp_cloud_internal_handle_t *handle);
+void esp_cloud_timer_init(esp_cloud_internal_handle_t *handle);
+esp_err_t esp_cloud_isr_ring_init(esp_cloud_internal_handle_t *handle);
+void esp_cloud_isr_ring_deinit(esp_cloud_internal_handle_t *handle);
+void esp_cloud_isr_ring_drain(esp_cloud_internal_handle_t *handle);
+void esp_cloud_timer_process(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms);
+esp_err_t esp_cloud_outbox_init(esp_cloud_internal_handle_t *handle);
+bool esp_cloud_outbox_has_pending(esp_cloud_internal_handle_t *handle);
+esp_err_t esp_cloud_outbox_add(esp_cloud_internal_handle_t *handle, const char *topic, const char *data, size_t data_len,
+        uint32_t ttl_s);
+void esp_cloud_outbox_replay(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms);
+esp_err_t esp_cloud_reconnect_first(esp_cloud_internal_handle_t *handle);
+bool esp_cloud_reconnect_gave_up(esp_cloud_internal_handle_t *handle);
+void esp_cloud_reconnect_operational(esp_cloud_internal_handle_t *handle);
+void esp_cloud_creds_load(esp_cloud_internal_handle_t *handle);
+void esp_cloud_creds_free(esp_cloud_internal_handle_t *handle);
+esp_err_t esp_cloud_creds_reload(esp_cloud_internal_handle_t *handle);
+esp_err_t esp_cloud_topics_init(esp_cloud_internal_handle_t *handle);
+esp_err_t esp_cloud_topics_load_app(esp_cloud_internal_handle_t *handle, char **old_topic);
+const char *esp_cloud_topic_get(esp_cloud_internal_handle_t *handle, esp_cloud_topic_id_t id, char *buf,
+        size_t buf_size);
+
+esp_err_t esp_cloud_params_init(esp_cloud_internal_handle_t *handle, const esp_cloud_config_t *config);
+void esp_cloud_params_deinit(esp_cloud_internal_handle_t *handle);
 esp_cloud_dynamic_param_t *esp_cloud_get_dynamic_param_by_name(const char *name);
+esp_cloud_dynamic_param_t *esp_cloud_get_dynamic_param_by_id(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id);
 #define CLOUD_PARAM_FLAG_LOCAL_CHANGE   0x01
 #define CLOUD_PARAM_FLAG_REMOTE_CHANGE  0x02
+
+#define ESP_CLOUD_BITMAP_WORDS(count)   (((count) + 31) / 32)
+/* "%f" of the largest float */
+#define ESP_CLOUD_SHADOW_FLOAT_MAX_LEN  48
+
+void esp_cloud_mark_param_changed(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, uint8_t change_flag);
+void esp_cloud_fetch_changed_params(esp_cloud_internal_handle_t *handle, uint32_t *local, uint32_t *remote);
+esp_err_t esp_cloud_read_param_value(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, esp_cloud_param_val_t *val);
+esp_err_t esp_cloud_write_param_value(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id,
+        const esp_cloud_param_val_t *val);
+
+uint32_t esp_cloud_time_ms(void);
+bool esp_cloud_shadow_flush_due(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms);
+void esp_cloud_shadow_update_sent(esp_cloud_internal_handle_t *handle, int doc_count, int param_count);
+void esp_cloud_shadow_update_done(esp_cloud_internal_handle_t *handle, bool accepted, uint32_t ack_ms);
+void esp_cloud_shadow_requeue(esp_cloud_internal_handle_t *handle, const uint32_t *local, const uint32_t *remote,
+        int start);
+size_t esp_cloud_shadow_param_max_len(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id);
+esp_err_t esp_cloud_shadow_add_param(esp_cloud_internal_handle_t *handle, json_str_t *jstr, esp_cloud_param_id_t id);
+esp_err_t esp_cloud_shadow_apply_delta(esp_cloud_internal_handle_t *handle, char *doc, int doc_len);
+void esp_cloud_shadow_request_full_report(esp_cloud_internal_handle_t *handle);
+bool esp_cloud_shadow_take_full_report(esp_cloud_internal_handle_t *handle);
+bool esp_cloud_shadow_changes_pending(esp_cloud_internal_handle_t *handle);
+void esp_cloud_shadow_snapshot_sent(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id);
+void esp_cloud_shadow_snapshot_acked(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id);
+void esp_cloud_shadow_set_version(esp_cloud_internal_handle_t *handle, uint32_t version);
+esp_err_t esp_cloud_shadow_resync(esp_cloud_internal_handle_t *handle, char *doc, int doc_len);
+bool esp_cloud_param_report_filter(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, float val);
+void esp_cloud_param_report_poll(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms);
+void esp_cloud_param_report_sent(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id);
+void esp_cloud_param_report_acked(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id);
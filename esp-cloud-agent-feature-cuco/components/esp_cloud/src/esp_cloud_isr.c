@@ -0,0 +1,199 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_isr";
+
+#ifdef CONFIG_ESP_CLOUD_ISR_RING_SIZE
+#define ESP_CLOUD_ISR_RING_SIZE     CONFIG_ESP_CLOUD_ISR_RING_SIZE
+#else
+#define ESP_CLOUD_ISR_RING_SIZE     16
+#endif
+
+/* Bounded MPSC ring, as described by Dmitry Vyukov. Producers claim a cell by
+ * moving isr_enqueue_pos with a CAS and publish it by advancing the cell's
+ * sequence number, so an ISR that interrupts a producer half way through never
+ * waits for it. Only the cloud task consumes.
+ */
+esp_err_t esp_cloud_isr_ring_init(esp_cloud_internal_handle_t *handle)
+{
+    uint32_t size = 2;
+    while (size < ESP_CLOUD_ISR_RING_SIZE) {
+        size <<= 1;
+    }
+    /* Written from ISRs, so always in internal RAM */
+    handle->isr_ring = heap_caps_calloc(size, sizeof(esp_cloud_isr_cell_t),
+            MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!handle->isr_ring) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        handle->isr_ring[i].seq = i;
+    }
+    handle->isr_ring_mask = size - 1;
+    return ESP_OK;
+}
+
+void esp_cloud_isr_ring_deinit(esp_cloud_internal_handle_t *handle)
+{
+    heap_caps_free(handle->isr_ring);
+    handle->isr_ring = NULL;
+}
+
+/* Runs in the timer daemon task, where waking the cloud task up is allowed */
+static void esp_cloud_isr_wakeup_cb(void *arg, uint32_t unused)
+{
+    esp_cloud_internal_handle_t *handle = (esp_cloud_internal_handle_t *)arg;
+    __atomic_store_n(&handle->isr_wakeup_pending, false, __ATOMIC_SEQ_CST);
+    esp_cloud_platform_wakeup(handle);
+}
+
+static void esp_cloud_isr_wakeup(esp_cloud_internal_handle_t *handle)
+{
+    if (!xPortInIsrContext()) {
+        esp_cloud_platform_wakeup(handle);
+        return;
+    }
+    if (__atomic_exchange_n(&handle->isr_wakeup_pending, true, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    BaseType_t higher_prio_task_woken = pdFALSE;
+    if (xTimerPendFunctionCallFromISR(esp_cloud_isr_wakeup_cb, handle, 0,
+                &higher_prio_task_woken) != pdPASS) {
+        /* Timer queue full. The entry gets picked up at the cloud task's next poll */
+        __atomic_store_n(&handle->isr_wakeup_pending, false, __ATOMIC_SEQ_CST);
+        return;
+    }
+    if (higher_prio_task_woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static esp_err_t esp_cloud_isr_ring_push(esp_cloud_internal_handle_t *handle, const esp_cloud_isr_cell_t *entry)
+{
+    if (!handle->isr_ring) {
+        return ESP_FAIL;
+    }
+    esp_cloud_isr_cell_t *cell;
+    uint32_t pos = __atomic_load_n(&handle->isr_enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &handle->isr_ring[pos & handle->isr_ring_mask];
+        uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&handle->isr_enqueue_pos, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* pos now holds the current value. Retry with it */
+        } else if (diff < 0) {
+            __atomic_fetch_add(&handle->isr_dropped, 1, __ATOMIC_RELAXED);
+            return ESP_ERR_NO_MEM;
+        } else {
+            pos = __atomic_load_n(&handle->isr_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->work_fn = entry->work_fn;
+    cell->priv_data = entry->priv_data;
+    cell->id = entry->id;
+    cell->type = entry->type;
+    cell->val = entry->val;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    esp_cloud_isr_wakeup(handle);
+    return ESP_OK;
+}
+
+static bool esp_cloud_isr_ring_pop(esp_cloud_internal_handle_t *handle, esp_cloud_isr_cell_t *entry)
+{
+    uint32_t pos = handle->isr_dequeue_pos;
+    esp_cloud_isr_cell_t *cell = &handle->isr_ring[pos & handle->isr_ring_mask];
+    uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq != pos + 1) {
+        return false;
+    }
+    memcpy(entry, cell, sizeof(esp_cloud_isr_cell_t));
+    /* Hand the cell back to the producers for the next lap */
+    __atomic_store_n(&cell->seq, pos + handle->isr_ring_mask + 1, __ATOMIC_RELEASE);
+    handle->isr_dequeue_pos = pos + 1;
+    return true;
+}
+
+/* Apply everything submitted from ISRs. Called only from the cloud task */
+void esp_cloud_isr_ring_drain(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle->isr_ring) {
+        return;
+    }
+    esp_cloud_isr_cell_t entry;
+    while (esp_cloud_isr_ring_pop(handle, &entry)) {
+        if (entry.work_fn) {
+            entry.work_fn((esp_cloud_handle_t)handle, entry.priv_data);
+        } else if (entry.type == CLOUD_PARAM_TYPE_BOOLEAN) {
+            esp_cloud_update_bool_param_by_id(handle, entry.id, entry.val.b);
+        } else if (entry.type == CLOUD_PARAM_TYPE_INTEGER) {
+            esp_cloud_update_int_param_by_id(handle, entry.id, entry.val.i);
+        }
+    }
+    uint32_t dropped = __atomic_load_n(&handle->isr_dropped, __ATOMIC_RELAXED);
+    if (dropped != handle->isr_dropped_logged) {
+        ESP_LOGW(TAG, "ISR ring full. %u entries dropped so far", dropped);
+        handle->isr_dropped_logged = dropped;
+    }
+}
+
+esp_err_t esp_cloud_queue_work_from_isr(esp_cloud_handle_t handle, esp_cloud_work_fn_t work_fn, void *priv_data)
+{
+    if (!handle || !work_fn) {
+        return ESP_FAIL;
+    }
+    esp_cloud_isr_cell_t entry = {
+        .work_fn = work_fn,
+        .priv_data = priv_data,
+    };
+    return esp_cloud_isr_ring_push((esp_cloud_internal_handle_t *)handle, &entry);
+}
+
+esp_err_t esp_cloud_update_bool_param_from_isr(esp_cloud_handle_t handle, esp_cloud_param_id_t id, bool val)
+{
+    if (!handle || (id == ESP_CLOUD_PARAM_ID_INVALID)) {
+        return ESP_FAIL;
+    }
+    esp_cloud_isr_cell_t entry = {
+        .id = id,
+        .type = CLOUD_PARAM_TYPE_BOOLEAN,
+        .val.b = val,
+    };
+    return esp_cloud_isr_ring_push((esp_cloud_internal_handle_t *)handle, &entry);
+}
+
+esp_err_t esp_cloud_update_int_param_from_isr(esp_cloud_handle_t handle, esp_cloud_param_id_t id, int val)
+{
+    if (!handle || (id == ESP_CLOUD_PARAM_ID_INVALID)) {
+        return ESP_FAIL;
+    }
+    esp_cloud_isr_cell_t entry = {
+        .id = id,
+        .type = CLOUD_PARAM_TYPE_INTEGER,
+        .val.i = val,
+    };
+    return esp_cloud_isr_ring_push((esp_cloud_internal_handle_t *)handle, &entry);
+}
@@ -0,0 +1,275 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+
+#include <esp_cloud_mem.h>
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+#include "esp_cloud_outbox.h"
+
+static const char *TAG = "esp_cloud_outbox";
+
+#ifdef CONFIG_ESP_CLOUD_OUTBOX_PARTITION
+#define ESP_CLOUD_OUTBOX_PARTITION          CONFIG_ESP_CLOUD_OUTBOX_PARTITION
+#else
+#define ESP_CLOUD_OUTBOX_PARTITION          "cloud_outbox"
+#endif
+#ifdef CONFIG_ESP_CLOUD_OUTBOX_FILE
+#define ESP_CLOUD_OUTBOX_FILE               CONFIG_ESP_CLOUD_OUTBOX_FILE
+#else
+#define ESP_CLOUD_OUTBOX_FILE               ""
+#endif
+#ifdef CONFIG_ESP_CLOUD_OUTBOX_FILE_SIZE
+#define ESP_CLOUD_OUTBOX_FILE_SIZE          CONFIG_ESP_CLOUD_OUTBOX_FILE_SIZE
+#else
+#define ESP_CLOUD_OUTBOX_FILE_SIZE          16384
+#endif
+#ifdef CONFIG_ESP_CLOUD_OUTBOX_BUSY_RETRY_MS
+#define ESP_CLOUD_OUTBOX_BUSY_RETRY_MS      CONFIG_ESP_CLOUD_OUTBOX_BUSY_RETRY_MS
+#else
+#define ESP_CLOUD_OUTBOX_BUSY_RETRY_MS      200
+#endif
+/* Wait after a failed replay, as the connection is most likely still down */
+#define ESP_CLOUD_OUTBOX_RETRY_MS           2000
+/* Time spent replaying in one go, after which the cloud task services MQTT again */
+#define ESP_CLOUD_OUTBOX_REPLAY_BUDGET_MS   20
+/* Times before this (2019-01-01) mean the clock has not been set yet */
+#define ESP_CLOUD_OUTBOX_TIME_VALID         1546300800
+
+struct esp_cloud_outbox {
+    esp_cloud_outbox_log_t log;
+    /* Publishes come from any task, replay only from the cloud task */
+    SemaphoreHandle_t lock;
+    uint32_t next_replay_ms;
+    esp_cloud_outbox_stats_t stats;
+};
+
+static esp_err_t esp_cloud_outbox_partition_read(void *ctx, size_t offset, void *buf, size_t len)
+{
+    return esp_partition_read(ctx, offset, buf, len);
+}
+
+static esp_err_t esp_cloud_outbox_partition_write(void *ctx, size_t offset, const void *buf, size_t len)
+{
+    return esp_partition_write(ctx, offset, buf, len);
+}
+
+static esp_err_t esp_cloud_outbox_partition_erase(void *ctx, size_t offset, size_t len)
+{
+    return esp_partition_erase_range(ctx, offset, len);
+}
+
+esp_err_t esp_cloud_outbox_partition_storage(const char *label, esp_cloud_outbox_storage_t *storage)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+            ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!partition) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    storage->read = esp_cloud_outbox_partition_read;
+    storage->write = esp_cloud_outbox_partition_write;
+    storage->erase = esp_cloud_outbox_partition_erase;
+    storage->size = partition->size;
+    storage->sector_size = SPI_FLASH_SEC_SIZE;
+    storage->ctx = (void *)partition;
+    return ESP_OK;
+}
+
+static uint32_t esp_cloud_outbox_now(void)
+{
+    time_t now = time(NULL);
+    return (now >= ESP_CLOUD_OUTBOX_TIME_VALID) ? (uint32_t)now : 0;
+}
+
+/* Messages queued before the clock was set never expire, as their age is unknown */
+static bool esp_cloud_outbox_expired(const esp_cloud_outbox_msg_t *msg, uint32_t now)
+{
+    return msg->ttl_s && msg->created && now && ((now - msg->created) > msg->ttl_s);
+}
+
+esp_err_t esp_cloud_outbox_init(esp_cloud_internal_handle_t *handle)
+{
+    if (handle->outbox) {
+        return ESP_OK;
+    }
+    esp_cloud_outbox_storage_t storage;
+    esp_err_t err;
+    if (strlen(ESP_CLOUD_OUTBOX_FILE)) {
+        err = esp_cloud_outbox_file_storage(ESP_CLOUD_OUTBOX_FILE, ESP_CLOUD_OUTBOX_FILE_SIZE, &storage);
+    } else {
+        err = esp_cloud_outbox_partition_storage(ESP_CLOUD_OUTBOX_PARTITION, &storage);
+    }
+    if (err != ESP_OK) {
+        /* Not fatal. Publishes made while offline are then lost, as before */
+        ESP_LOGW(TAG, "No outbox storage, %d. Offline publishes will not be kept", err);
+        return err;
+    }
+    esp_cloud_outbox_t *outbox = esp_cloud_mem_calloc(1, sizeof(esp_cloud_outbox_t));
+    if (!outbox) {
+        return ESP_ERR_NO_MEM;
+    }
+    outbox->lock = xSemaphoreCreateMutex();
+    if (!outbox->lock) {
+        free(outbox);
+        return ESP_ERR_NO_MEM;
+    }
+    err = esp_cloud_outbox_log_open(&outbox->log, &storage);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open the outbox, %d", err);
+        vSemaphoreDelete(outbox->lock);
+        free(outbox);
+        return err;
+    }
+    if (outbox->log.pending) {
+        ESP_LOGI(TAG, "%u message(s) left from before", outbox->log.pending);
+    }
+    handle->outbox = outbox;
+    return ESP_OK;
+}
+
+bool esp_cloud_outbox_has_pending(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_outbox_t *outbox = handle->outbox;
+    if (!outbox) {
+        return false;
+    }
+    xSemaphoreTake(outbox->lock, portMAX_DELAY);
+    bool pending = outbox->log.pending > 0;
+    xSemaphoreGive(outbox->lock);
+    return pending;
+}
+
+esp_err_t esp_cloud_outbox_add(esp_cloud_internal_handle_t *handle, const char *topic, const char *data, size_t data_len,
+        uint32_t ttl_s)
+{
+    esp_cloud_outbox_t *outbox = handle->outbox;
+    if (!outbox) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(outbox->lock, portMAX_DELAY);
+    esp_err_t err = esp_cloud_outbox_log_append(&outbox->log, topic, data, data_len, esp_cloud_outbox_now(), ttl_s);
+    if (err == ESP_OK) {
+        outbox->stats.queued++;
+    }
+    xSemaphoreGive(outbox->lock);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to queue message for %s, %d", topic, err);
+    }
+    return err;
+}
+
+/* Drop the expired and corrupt messages at the head, and read the first one left */
+static esp_err_t esp_cloud_outbox_peek_valid(esp_cloud_outbox_t *outbox, uint32_t now, esp_cloud_outbox_msg_t *msg)
+{
+    esp_err_t err;
+    while ((err = esp_cloud_outbox_log_peek(&outbox->log, msg)) != ESP_ERR_NOT_FOUND) {
+        if (err == ESP_ERR_INVALID_CRC) {
+            ESP_LOGE(TAG, "Dropping corrupt message");
+            esp_cloud_outbox_log_pop(&outbox->log, outbox->log.head_seq);
+            outbox->stats.dropped_corrupt++;
+            continue;
+        }
+        if ((err != ESP_OK) || !esp_cloud_outbox_expired(msg, now)) {
+            break;
+        }
+        ESP_LOGW(TAG, "Dropping expired message for %s", msg->topic);
+        esp_cloud_outbox_log_pop(&outbox->log, msg->seq);
+        esp_cloud_outbox_msg_free(msg);
+        outbox->stats.dropped_expired++;
+    }
+    return err;
+}
+
+/* Send the queued messages, oldest first, for as long as the platform takes them
+ * and the time budget lasts. Only after a failure is there a wait before trying
+ * again: a short one if the platform merely had no room for more messages in
+ * flight, a longer one otherwise. Called only from the cloud task.
+ */
+void esp_cloud_outbox_replay(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    esp_cloud_outbox_t *outbox = handle->outbox;
+    if (!outbox || !outbox->log.pending) {
+        return;
+    }
+    uint32_t start_ms = esp_cloud_time_ms();
+    int32_t wait_ms = (int32_t)(outbox->next_replay_ms - start_ms);
+    if (wait_ms > 0) {
+        if ((uint32_t)wait_ms < *timeout_ms) {
+            *timeout_ms = wait_ms;
+        }
+        return;
+    }
+    uint32_t now = esp_cloud_outbox_now();
+    while (1) {
+        esp_cloud_outbox_msg_t msg;
+        xSemaphoreTake(outbox->lock, portMAX_DELAY);
+        esp_err_t err = esp_cloud_outbox_peek_valid(outbox, now, &msg);
+        xSemaphoreGive(outbox->lock);
+        if (err == ESP_ERR_NOT_FOUND) {
+            return;
+        }
+        if (err == ESP_OK) {
+            /* Without the lock, since this can block */
+            err = handle->platform->publish(handle, msg.topic, msg.data, msg.data_len);
+            xSemaphoreTake(outbox->lock, portMAX_DELAY);
+            if (err == ESP_OK) {
+                esp_cloud_outbox_log_pop(&outbox->log, msg.seq);
+                outbox->stats.replayed++;
+            }
+            bool pending = outbox->log.pending > 0;
+            xSemaphoreGive(outbox->lock);
+            esp_cloud_outbox_msg_free(&msg);
+            if ((err == ESP_OK) && !pending) {
+                return;
+            }
+        }
+        uint32_t now_ms = esp_cloud_time_ms();
+        if (err != ESP_OK) {
+            uint32_t retry_ms = (err == ESP_ERR_NO_MEM) ? ESP_CLOUD_OUTBOX_BUSY_RETRY_MS : ESP_CLOUD_OUTBOX_RETRY_MS;
+            outbox->next_replay_ms = now_ms + retry_ms;
+            if (retry_ms < *timeout_ms) {
+                *timeout_ms = retry_ms;
+            }
+            return;
+        }
+        if ((now_ms - start_ms) >= ESP_CLOUD_OUTBOX_REPLAY_BUDGET_MS) {
+            /* The rest right after a quick MQTT yield */
+            *timeout_ms = 0;
+            return;
+        }
+    }
+}
+
+esp_err_t esp_cloud_get_outbox_stats(esp_cloud_handle_t handle, esp_cloud_outbox_stats_t *stats)
+{
+    if (!handle || !stats) {
+        return ESP_FAIL;
+    }
+    esp_cloud_outbox_t *outbox = ((esp_cloud_internal_handle_t *)handle)->outbox;
+    if (!outbox) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(outbox->lock, portMAX_DELAY);
+    memcpy(stats, &outbox->stats, sizeof(esp_cloud_outbox_stats_t));
+    stats->pending = outbox->log.pending;
+    stats->dropped_full = outbox->log.dropped;
+    xSemaphoreGive(outbox->lock);
+    return ESP_OK;
+}
@@ -0,0 +1,73 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+/* Storage holding the outbox log. Behaves like NOR flash: erase sets a whole
+ * sector to 0xFF and writes may only clear bits.
+ */
+typedef struct {
+    esp_err_t (*read)(void *ctx, size_t offset, void *buf, size_t len);
+    esp_err_t (*write)(void *ctx, size_t offset, const void *buf, size_t len);
+    esp_err_t (*erase)(void *ctx, size_t offset, size_t len);
+    size_t size;
+    size_t sector_size;
+    void *ctx;
+} esp_cloud_outbox_storage_t;
+
+/* Data partition with the given label */
+esp_err_t esp_cloud_outbox_partition_storage(const char *label, esp_cloud_outbox_storage_t *storage);
+/* Plain file of the given size, standing in for the partition. Needs only stdio,
+ * so it works on Linux as well as on a mounted filesystem.
+ */
+esp_err_t esp_cloud_outbox_file_storage(const char *path, size_t size, esp_cloud_outbox_storage_t *storage);
+void esp_cloud_outbox_file_storage_close(esp_cloud_outbox_storage_t *storage);
+
+/* Ring log of CRC protected records on the storage. Appending into a sector
+ * which still holds pending records drops those, oldest first. Records are
+ * handed out in the order they were appended. Not thread safe.
+ */
+typedef struct {
+    esp_cloud_outbox_storage_t storage;
+    size_t write_off;
+    size_t head_off;
+    uint32_t head_seq;
+    uint32_t next_seq;
+    uint32_t pending;
+    uint32_t dropped;
+} esp_cloud_outbox_log_t;
+
+typedef struct {
+    uint32_t seq;
+    /* Unix time of the append, 0 if the time was not set then */
+    uint32_t created;
+    uint32_t ttl_s;
+    /* NUL terminated. Owned by the caller once read */
+    char *topic;
+    char *data;
+    size_t data_len;
+} esp_cloud_outbox_msg_t;
+
+/* Scan the storage and pick up the records left pending before a reboot */
+esp_err_t esp_cloud_outbox_log_open(esp_cloud_outbox_log_t *log, const esp_cloud_outbox_storage_t *storage);
+esp_err_t esp_cloud_outbox_log_append(esp_cloud_outbox_log_t *log, const char *topic, const char *data,
+        size_t data_len, uint32_t created, uint32_t ttl_s);
+/* Read the oldest pending record. ESP_ERR_NOT_FOUND if there is none */
+esp_err_t esp_cloud_outbox_log_peek(esp_cloud_outbox_log_t *log, esp_cloud_outbox_msg_t *msg);
+/* Mark the oldest pending record done, if it still is the one with this seq */
+esp_err_t esp_cloud_outbox_log_pop(esp_cloud_outbox_log_t *log, uint32_t seq);
+void esp_cloud_outbox_msg_free(esp_cloud_outbox_msg_t *msg);
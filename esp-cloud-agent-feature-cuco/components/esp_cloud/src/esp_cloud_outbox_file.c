@@ -0,0 +1,118 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_cloud_outbox.h"
+
+/* File standing in for the outbox partition. Writes are ANDed into the existing
+ * contents, the way NOR flash only clears bits, so the log behaves the same on it.
+ */
+#define OUTBOX_FILE_SECTOR_SIZE     4096
+#define OUTBOX_FILE_CHUNK           64
+
+static esp_err_t esp_cloud_outbox_file_read(void *ctx, size_t offset, void *buf, size_t len)
+{
+    FILE *fp = ctx;
+    if ((fseek(fp, offset, SEEK_SET) != 0) || (fread(buf, 1, len, fp) != len)) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t esp_cloud_outbox_file_write(void *ctx, size_t offset, const void *buf, size_t len)
+{
+    FILE *fp = ctx;
+    const uint8_t *src = buf;
+    uint8_t chunk[OUTBOX_FILE_CHUNK];
+    while (len) {
+        size_t n = (len < sizeof(chunk)) ? len : sizeof(chunk);
+        if (esp_cloud_outbox_file_read(fp, offset, chunk, n) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        size_t i;
+        for (i = 0; i < n; i++) {
+            chunk[i] &= src[i];
+        }
+        if ((fseek(fp, offset, SEEK_SET) != 0) || (fwrite(chunk, 1, n, fp) != n)) {
+            return ESP_FAIL;
+        }
+        offset += n;
+        src += n;
+        len -= n;
+    }
+    return (fflush(fp) == 0) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t esp_cloud_outbox_file_fill(FILE *fp, size_t offset, size_t len)
+{
+    uint8_t chunk[OUTBOX_FILE_CHUNK];
+    memset(chunk, 0xff, sizeof(chunk));
+    if (fseek(fp, offset, SEEK_SET) != 0) {
+        return ESP_FAIL;
+    }
+    while (len) {
+        size_t n = (len < sizeof(chunk)) ? len : sizeof(chunk);
+        if (fwrite(chunk, 1, n, fp) != n) {
+            return ESP_FAIL;
+        }
+        len -= n;
+    }
+    return (fflush(fp) == 0) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t esp_cloud_outbox_file_erase(void *ctx, size_t offset, size_t len)
+{
+    return esp_cloud_outbox_file_fill(ctx, offset, len);
+}
+
+esp_err_t esp_cloud_outbox_file_storage(const char *path, size_t size, esp_cloud_outbox_storage_t *storage)
+{
+    if (!path || !storage) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    FILE *fp = fopen(path, "r+b");
+    if (!fp) {
+        fp = fopen(path, "w+b");
+        if (!fp) {
+            return ESP_FAIL;
+        }
+    }
+    /* A new or shorter file is extended with erased sectors */
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    long cur_size = ftell(fp);
+    if ((cur_size >= 0) && ((size_t)cur_size < size) &&
+            (esp_cloud_outbox_file_fill(fp, cur_size, size - cur_size) != ESP_OK)) {
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    storage->read = esp_cloud_outbox_file_read;
+    storage->write = esp_cloud_outbox_file_write;
+    storage->erase = esp_cloud_outbox_file_erase;
+    storage->size = size;
+    storage->sector_size = OUTBOX_FILE_SECTOR_SIZE;
+    storage->ctx = fp;
+    return ESP_OK;
+}
+
+void esp_cloud_outbox_file_storage_close(esp_cloud_outbox_storage_t *storage)
+{
+    if (storage && storage->ctx) {
+        fclose(storage->ctx);
+        storage->ctx = NULL;
+    }
+}
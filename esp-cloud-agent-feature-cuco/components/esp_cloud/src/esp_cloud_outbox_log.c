@@ -0,0 +1,341 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_cloud_outbox.h"
+
+/* Only the storage and libc are used here, so that the log can be exercised on a
+ * host against esp_cloud_outbox_file_storage().
+ *
+ * Records are written back to back and never span sectors. Erased storage reads
+ * as 0xFF, so a 0xFFFF magic marks the end of a sector's records. The state word
+ * is outside the CRC and is cleared in place once the record has been sent.
+ */
+#define OUTBOX_REC_MAGIC        0x0B5A
+#define OUTBOX_REC_ERASED       0xFFFF
+#define OUTBOX_REC_PENDING      0xFFFFFFFF
+#define OUTBOX_REC_DONE         0x00000000
+#define OUTBOX_ALIGN(len)       (((len) + 3) & ~3)
+#define OUTBOX_CRC_CHUNK        64
+
+typedef struct {
+    uint16_t magic;
+    uint16_t topic_len;
+    uint32_t data_len;
+    uint32_t seq;
+    uint32_t created;
+    uint32_t ttl_s;
+    uint32_t crc;
+    uint32_t state;
+} esp_cloud_outbox_rec_hdr_t;
+
+#define OUTBOX_CRC_HDR_LEN      offsetof(esp_cloud_outbox_rec_hdr_t, crc)
+
+static uint32_t esp_cloud_outbox_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+static bool esp_cloud_outbox_seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+static size_t esp_cloud_outbox_rec_size(const esp_cloud_outbox_rec_hdr_t *hdr)
+{
+    return sizeof(esp_cloud_outbox_rec_hdr_t) + OUTBOX_ALIGN(hdr->topic_len + hdr->data_len);
+}
+
+static size_t esp_cloud_outbox_sector_end(esp_cloud_outbox_log_t *log, size_t off)
+{
+    return (off / log->storage.sector_size + 1) * log->storage.sector_size;
+}
+
+static size_t esp_cloud_outbox_wrap(esp_cloud_outbox_log_t *log, size_t off)
+{
+    return (off >= log->storage.size) ? 0 : off;
+}
+
+/* Read the header at off. False if there is no record there */
+static bool esp_cloud_outbox_read_hdr(esp_cloud_outbox_log_t *log, size_t off, esp_cloud_outbox_rec_hdr_t *hdr)
+{
+    if (off + sizeof(esp_cloud_outbox_rec_hdr_t) > esp_cloud_outbox_sector_end(log, off)) {
+        return false;
+    }
+    if (log->storage.read(log->storage.ctx, off, hdr, sizeof(esp_cloud_outbox_rec_hdr_t)) != ESP_OK) {
+        return false;
+    }
+    return (hdr->magic == OUTBOX_REC_MAGIC) &&
+            (off + esp_cloud_outbox_rec_size(hdr) <= esp_cloud_outbox_sector_end(log, off));
+}
+
+static bool esp_cloud_outbox_check_crc(esp_cloud_outbox_log_t *log, size_t off, const esp_cloud_outbox_rec_hdr_t *hdr)
+{
+    uint8_t chunk[OUTBOX_CRC_CHUNK];
+    uint32_t crc = esp_cloud_outbox_crc32(0, (const uint8_t *)hdr, OUTBOX_CRC_HDR_LEN);
+    size_t body_off = off + sizeof(esp_cloud_outbox_rec_hdr_t);
+    size_t left = hdr->topic_len + hdr->data_len;
+    while (left) {
+        size_t len = (left < sizeof(chunk)) ? left : sizeof(chunk);
+        if (log->storage.read(log->storage.ctx, body_off, chunk, len) != ESP_OK) {
+            return false;
+        }
+        crc = esp_cloud_outbox_crc32(crc, chunk, len);
+        body_off += len;
+        left -= len;
+    }
+    return crc == hdr->crc;
+}
+
+/* Point the head at the first pending record from off onwards, or at the write
+ * offset if there is none
+ */
+static void esp_cloud_outbox_find_head(esp_cloud_outbox_log_t *log, size_t off)
+{
+    size_t sectors = log->storage.size / log->storage.sector_size;
+    size_t visited = 0;
+    esp_cloud_outbox_rec_hdr_t hdr;
+    off = esp_cloud_outbox_wrap(log, off);
+    while (visited <= sectors) {
+        if (off == log->write_off) {
+            break;
+        }
+        if (!esp_cloud_outbox_read_hdr(log, off, &hdr)) {
+            size_t next = esp_cloud_outbox_sector_end(log, off);
+            /* The rest of this sector is empty or torn. Do not jump over the write offset */
+            if ((log->write_off > off) && (log->write_off < next)) {
+                break;
+            }
+            off = esp_cloud_outbox_wrap(log, next);
+            visited++;
+            continue;
+        }
+        if (hdr.state == OUTBOX_REC_PENDING) {
+            log->head_off = off;
+            log->head_seq = hdr.seq;
+            return;
+        }
+        off = esp_cloud_outbox_wrap(log, off + esp_cloud_outbox_rec_size(&hdr));
+    }
+    log->head_off = log->write_off;
+    log->pending = 0;
+}
+
+esp_err_t esp_cloud_outbox_log_open(esp_cloud_outbox_log_t *log, const esp_cloud_outbox_storage_t *storage)
+{
+    if (!log || !storage || !storage->sector_size || (storage->size / storage->sector_size < 2)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(log, 0, sizeof(esp_cloud_outbox_log_t));
+    log->storage = *storage;
+    log->storage.size -= log->storage.size % log->storage.sector_size;
+
+    bool have_tail = false, have_head = false;
+    uint32_t tail_seq = 0;
+    size_t tail_end = 0;
+    size_t sector;
+    for (sector = 0; sector < log->storage.size; sector += log->storage.sector_size) {
+        size_t off = sector;
+        esp_cloud_outbox_rec_hdr_t hdr;
+        while ((off < sector + log->storage.sector_size) && esp_cloud_outbox_read_hdr(log, off, &hdr) &&
+                esp_cloud_outbox_check_crc(log, off, &hdr)) {
+            if (!have_tail || esp_cloud_outbox_seq_before(tail_seq, hdr.seq)) {
+                have_tail = true;
+                tail_seq = hdr.seq;
+                tail_end = off + esp_cloud_outbox_rec_size(&hdr);
+            }
+            if (hdr.state == OUTBOX_REC_PENDING) {
+                log->pending++;
+                if (!have_head || esp_cloud_outbox_seq_before(hdr.seq, log->head_seq)) {
+                    have_head = true;
+                    log->head_seq = hdr.seq;
+                    log->head_off = off;
+                }
+            }
+            off += esp_cloud_outbox_rec_size(&hdr);
+        }
+    }
+    log->next_seq = have_tail ? tail_seq + 1 : 0;
+    log->write_off = esp_cloud_outbox_wrap(log, tail_end);
+    if (log->write_off % log->storage.sector_size) {
+        /* A torn record after the last good one leaves the rest of the sector unusable */
+        esp_cloud_outbox_rec_hdr_t hdr;
+        if ((log->write_off + sizeof(hdr) > esp_cloud_outbox_sector_end(log, log->write_off)) ||
+                (log->storage.read(log->storage.ctx, log->write_off, &hdr, sizeof(hdr)) != ESP_OK) ||
+                (hdr.magic != OUTBOX_REC_ERASED)) {
+            log->write_off = esp_cloud_outbox_wrap(log, esp_cloud_outbox_sector_end(log, log->write_off));
+        }
+    }
+    if (!have_head) {
+        log->head_off = log->write_off;
+    }
+    return ESP_OK;
+}
+
+/* Make the sector at the write offset ready, dropping whatever is still pending in it */
+static esp_err_t esp_cloud_outbox_prepare_sector(esp_cloud_outbox_log_t *log)
+{
+    size_t sector = log->write_off;
+    size_t sector_end = sector + log->storage.sector_size;
+    if (log->pending && (log->head_off >= sector) && (log->head_off < sector_end)) {
+        size_t off = log->head_off;
+        esp_cloud_outbox_rec_hdr_t hdr;
+        while ((off < sector_end) && esp_cloud_outbox_read_hdr(log, off, &hdr)) {
+            if (hdr.state == OUTBOX_REC_PENDING) {
+                log->pending--;
+                log->dropped++;
+            }
+            off += esp_cloud_outbox_rec_size(&hdr);
+        }
+        if (log->pending) {
+            esp_cloud_outbox_find_head(log, sector_end);
+        }
+    }
+    return log->storage.erase(log->storage.ctx, sector, log->storage.sector_size);
+}
+
+esp_err_t esp_cloud_outbox_log_append(esp_cloud_outbox_log_t *log, const char *topic, const char *data,
+        size_t data_len, uint32_t created, uint32_t ttl_s)
+{
+    if (!log || !topic || !data) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_cloud_outbox_rec_hdr_t hdr = {
+        .magic = OUTBOX_REC_MAGIC,
+        .topic_len = strlen(topic),
+        .data_len = data_len,
+        .seq = log->next_seq,
+        .created = created,
+        .ttl_s = ttl_s,
+        .state = OUTBOX_REC_PENDING,
+    };
+    size_t size = esp_cloud_outbox_rec_size(&hdr);
+    if (size > log->storage.sector_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t *buf = malloc(size);
+    if (!buf) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(buf, 0xff, size);
+    memcpy(buf + sizeof(hdr), topic, hdr.topic_len);
+    memcpy(buf + sizeof(hdr) + hdr.topic_len, data, hdr.data_len);
+    hdr.crc = esp_cloud_outbox_crc32(esp_cloud_outbox_crc32(0, (const uint8_t *)&hdr, OUTBOX_CRC_HDR_LEN),
+            buf + sizeof(hdr), hdr.topic_len + hdr.data_len);
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    esp_err_t err = ESP_OK;
+    if (log->write_off + size > esp_cloud_outbox_sector_end(log, log->write_off)) {
+        log->write_off = esp_cloud_outbox_wrap(log, esp_cloud_outbox_sector_end(log, log->write_off));
+    }
+    if ((log->write_off % log->storage.sector_size) == 0) {
+        err = esp_cloud_outbox_prepare_sector(log);
+    }
+    if (err == ESP_OK) {
+        err = log->storage.write(log->storage.ctx, log->write_off, buf, size);
+    }
+    free(buf);
+    if (err != ESP_OK) {
+        /* Whatever got written is caught by the CRC. Carry on in the next sector */
+        log->write_off = esp_cloud_outbox_wrap(log, esp_cloud_outbox_sector_end(log, log->write_off));
+        return err;
+    }
+    if (!log->pending) {
+        log->head_off = log->write_off;
+        log->head_seq = hdr.seq;
+    }
+    log->pending++;
+    log->next_seq++;
+    log->write_off = esp_cloud_outbox_wrap(log, log->write_off + size);
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_outbox_log_peek(esp_cloud_outbox_log_t *log, esp_cloud_outbox_msg_t *msg)
+{
+    if (!log || !msg) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!log->pending) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_cloud_outbox_rec_hdr_t hdr;
+    if (!esp_cloud_outbox_read_hdr(log, log->head_off, &hdr) ||
+            !esp_cloud_outbox_check_crc(log, log->head_off, &hdr)) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    memset(msg, 0, sizeof(esp_cloud_outbox_msg_t));
+    msg->topic = malloc(hdr.topic_len + 1);
+    msg->data = malloc(hdr.data_len + 1);
+    if (!msg->topic || !msg->data) {
+        esp_cloud_outbox_msg_free(msg);
+        return ESP_ERR_NO_MEM;
+    }
+    size_t body_off = log->head_off + sizeof(hdr);
+    if ((log->storage.read(log->storage.ctx, body_off, msg->topic, hdr.topic_len) != ESP_OK) ||
+            (log->storage.read(log->storage.ctx, body_off + hdr.topic_len, msg->data, hdr.data_len) != ESP_OK)) {
+        esp_cloud_outbox_msg_free(msg);
+        return ESP_FAIL;
+    }
+    msg->topic[hdr.topic_len] = '\0';
+    msg->data[hdr.data_len] = '\0';
+    msg->data_len = hdr.data_len;
+    msg->seq = hdr.seq;
+    msg->created = hdr.created;
+    msg->ttl_s = hdr.ttl_s;
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_outbox_log_pop(esp_cloud_outbox_log_t *log, uint32_t seq)
+{
+    if (!log) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    /* It may have been dropped to make room meanwhile */
+    if (!log->pending || (log->head_seq != seq)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_cloud_outbox_rec_hdr_t hdr;
+    bool valid = esp_cloud_outbox_read_hdr(log, log->head_off, &hdr);
+    uint32_t state = OUTBOX_REC_DONE;
+    esp_err_t err = log->storage.write(log->storage.ctx,
+            log->head_off + offsetof(esp_cloud_outbox_rec_hdr_t, state), &state, sizeof(state));
+    log->pending--;
+    if (!log->pending) {
+        log->head_off = log->write_off;
+    } else if (valid) {
+        esp_cloud_outbox_find_head(log, log->head_off + esp_cloud_outbox_rec_size(&hdr));
+    } else {
+        esp_cloud_outbox_find_head(log, esp_cloud_outbox_sector_end(log, log->head_off));
+    }
+    return err;
+}
+
+void esp_cloud_outbox_msg_free(esp_cloud_outbox_msg_t *msg)
+{
+    free(msg->topic);
+    free(msg->data);
+    msg->topic = NULL;
+    msg->data = NULL;
+}
@@ -0,0 +1,584 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+
+#include "esp_cloud_mem.h"
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+/* Registry of the static and dynamic params. Kept apart from esp_cloud.c, which
+ * also has the cloud task and its application hooks, so that it builds on its own.
+ */
+static const char *TAG = "esp_cloud_params";
+
+#define DEFAULT_STATIC_PARAMS_COUNT         4
+#define DEFAULT_DYNAMIC_PARAMS_COUNT        3
+/* Per param estimates used to size the arena at init. Names and string values
+ * beyond these just make the arena grow by another chunk.
+ */
+#define ESP_CLOUD_ARENA_NAME_ESTIMATE       16
+#define ESP_CLOUD_ARENA_VALUE_ESTIMATE      16
+#define ESP_CLOUD_ARENA_PLATFORM_ESTIMATE   64
+/* The "<device_id>/<suffix>" topics, which esp_cloud_topics_init() puts in the arena too */
+#define ESP_CLOUD_ARENA_TOPICS_ESTIMATE     256
+
+/* Set up the parameter registry: the arena, the name index and the change bitmaps,
+ * sized for the params in the config plus the agent's own.
+ */
+esp_err_t esp_cloud_params_init(esp_cloud_internal_handle_t *handle, const esp_cloud_config_t *config)
+{
+    handle->max_dynamic_params_count = config->dynamic_cloud_params_count + DEFAULT_DYNAMIC_PARAMS_COUNT;
+    handle->max_static_params_count = config->static_cloud_params_count + DEFAULT_STATIC_PARAMS_COUNT;
+    /* Keep the index at most half full so that probe sequences stay short */
+    size_t index_size = 1;
+    while (index_size < (2 * handle->max_dynamic_params_count)) {
+        index_size <<= 1;
+    }
+    size_t bitmap_words = ESP_CLOUD_BITMAP_WORDS(handle->max_dynamic_params_count);
+    size_t arena_size = (handle->max_dynamic_params_count *
+                (sizeof(esp_cloud_dynamic_param_t) + ESP_CLOUD_ARENA_NAME_ESTIMATE + ESP_CLOUD_ARENA_PLATFORM_ESTIMATE))
+            + (handle->max_static_params_count *
+                (sizeof(esp_cloud_static_param_t) + ESP_CLOUD_ARENA_NAME_ESTIMATE + ESP_CLOUD_ARENA_VALUE_ESTIMATE))
+            + (index_size * sizeof(uint16_t)) + (3 * bitmap_words * sizeof(uint32_t))
+            + (2 * handle->max_dynamic_params_count * sizeof(uint32_t))
+            + ESP_CLOUD_ARENA_TOPICS_ESTIMATE;
+    handle->arena = esp_cloud_mem_arena_create(arena_size);
+    if (!handle->arena) {
+        ESP_LOGE(TAG, "Failed to allocate %d bytes for the arena", arena_size);
+        return ESP_ERR_NO_MEM;
+    }
+    handle->txn_mutex = xSemaphoreCreateMutex();
+    if (!handle->txn_mutex) {
+        esp_cloud_params_deinit(handle);
+        ESP_LOGE(TAG, "ESP Cloud Transaction Mutex Creation Failed");
+        return ESP_FAIL;
+    }
+    esp_cloud_mem_arena_t *arena = handle->arena;
+    handle->dynamic_cloud_params = esp_cloud_mem_arena_alloc(arena, handle->max_dynamic_params_count * sizeof(esp_cloud_dynamic_param_t));
+    handle->dynamic_params_index = esp_cloud_mem_arena_alloc(arena, index_size * sizeof(uint16_t));
+    handle->dynamic_params_index_mask = index_size - 1;
+    handle->local_change_bitmap = esp_cloud_mem_arena_alloc(arena, bitmap_words * sizeof(uint32_t));
+    handle->remote_change_bitmap = esp_cloud_mem_arena_alloc(arena, bitmap_words * sizeof(uint32_t));
+    handle->txn_bitmap = esp_cloud_mem_arena_alloc(arena, bitmap_words * sizeof(uint32_t));
+    handle->snapshot.sent_hash = esp_cloud_mem_arena_alloc(arena, handle->max_dynamic_params_count * sizeof(uint32_t));
+    handle->snapshot.acked_hash = esp_cloud_mem_arena_alloc(arena, handle->max_dynamic_params_count * sizeof(uint32_t));
+    handle->static_cloud_params = esp_cloud_mem_arena_alloc(arena, handle->max_static_params_count * sizeof(esp_cloud_static_param_t));
+    if (!handle->dynamic_cloud_params || !handle->dynamic_params_index || !handle->local_change_bitmap ||
+            !handle->remote_change_bitmap || !handle->txn_bitmap || !handle->snapshot.sent_hash ||
+            !handle->snapshot.acked_hash || !handle->static_cloud_params) {
+        esp_cloud_params_deinit(handle);
+        ESP_LOGE(TAG, "Failed to allocate the parameter registry");
+        return ESP_ERR_NO_MEM;
+    }
+    vPortCPUInitializeMutex(&handle->param_lock);
+    vPortCPUInitializeMutex(&handle->txn_lock);
+    return ESP_OK;
+}
+
+void esp_cloud_params_deinit(esp_cloud_internal_handle_t *handle)
+{
+    if (handle->txn_mutex) {
+        vSemaphoreDelete(handle->txn_mutex);
+        handle->txn_mutex = NULL;
+    }
+    /* Everything else of the registry lives in the arena */
+    esp_cloud_mem_arena_destroy(handle->arena);
+    handle->arena = NULL;
+    handle->dynamic_cloud_params = NULL;
+    handle->dynamic_params_index = NULL;
+    handle->static_cloud_params = NULL;
+}
+
+/* Internal. Add a generic new Dynamic Cloud Parameter */
+static esp_cloud_static_param_t *esp_cloud_add_static_param(esp_cloud_handle_t handle, const char *name)
+{
+    if (!handle) {
+        return NULL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (int_handle->cur_static_params_count == int_handle->max_static_params_count) {
+        return NULL;
+    }
+    int i;
+    esp_cloud_static_param_t *param = &int_handle->static_cloud_params[0];
+    for (i = 0; i < int_handle->cur_static_params_count; i++, param++) {
+        if (strcmp(name, param->name) == 0) {
+            return NULL;
+        }
+    }
+    param->name = esp_cloud_mem_arena_strdup(int_handle->arena, name);
+    if (!param->name) {
+        return NULL;
+    }
+    int_handle->cur_static_params_count++;
+    return param;
+}
+
+/* Add a Dynamic String Paramter */
+esp_err_t esp_cloud_add_static_string_param(esp_cloud_handle_t handle, const char *name, const char *val)
+{
+    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
+    if (!param) {
+        return ESP_FAIL;
+    }
+    param->val.type = CLOUD_PARAM_TYPE_STRING;
+    param->val.val.s = esp_cloud_mem_arena_strdup(((esp_cloud_internal_handle_t *)handle)->arena, val);
+    if (!param->val.val.s) {
+        return ESP_ERR_NO_MEM;
+    }
+    param->val.val_size = strlen(val);
+    return ESP_OK;
+}
+
+/* Add a Dynamic Integer Parameter */
+esp_err_t esp_cloud_add_static_int_param(esp_cloud_handle_t handle, const char *name, int val)
+{
+    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
+    if (!param) {
+        return ESP_FAIL;
+    }
+    param->val.type = CLOUD_PARAM_TYPE_INTEGER;
+    param->val.val.i = val;
+    param->val.val_size = sizeof(int);
+    return ESP_OK;
+}
+
+/* Add a Dynamic Float Parameter */
+esp_err_t esp_cloud_add_static_float_param(esp_cloud_handle_t handle, const char *name, float val)
+{
+    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
+    if (!param) {
+        return ESP_FAIL;
+    }
+    param->val.type = CLOUD_PARAM_TYPE_FLOAT;
+    param->val.val.f = val;
+    param->val.val_size = sizeof(float);
+    return ESP_OK;
+}
+
+/* Add a Dynamic Boolean Parameter */
+esp_err_t esp_cloud_add_static_bool_param(esp_cloud_handle_t handle, const char *name, bool val)
+{
+    esp_cloud_static_param_t *param = esp_cloud_add_static_param(handle, name);
+    if (!param) {
+        return ESP_FAIL;
+    }
+    param->val.type = CLOUD_PARAM_TYPE_BOOLEAN;
+    param->val.val.b = val;
+    param->val.val_size = sizeof(bool);
+    return ESP_OK;
+}
+/* Internal. FNV-1a hash of a parameter name */
+static uint32_t esp_cloud_param_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+    while (*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Internal. Find the index slot holding the given name, or the empty slot where it should be inserted */
+static uint16_t *esp_cloud_find_index_slot(esp_cloud_internal_handle_t *handle, const char *name, uint32_t hash)
+{
+    uint16_t mask = handle->dynamic_params_index_mask;
+    uint16_t pos = hash & mask;
+    while (handle->dynamic_params_index[pos]) {
+        esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[handle->dynamic_params_index[pos] - 1];
+        if ((param->name_hash == hash) && (strcmp(name, param->name) == 0)) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return &handle->dynamic_params_index[pos];
+}
+
+/* Internal. Add a generic new Dynamic Cloud Parameter. A string value is copied into
+ * buffers allocated here. Everything that can fail is done before the slot is taken,
+ * so a failed add leaves no trace of the param.
+ */
+static esp_err_t esp_cloud_add_dynamic_param(esp_cloud_handle_t handle, const char *name,
+        const esp_cloud_param_val_t *val, esp_cloud_param_callback_t cb, void *priv_data)
+{
+    if (!handle || !name) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (!int_handle->dynamic_params_index ||
+            (int_handle->cur_dynamic_params_count == int_handle->max_dynamic_params_count)) {
+        return ESP_FAIL;
+    }
+    if ((val->type == CLOUD_PARAM_TYPE_STRING) && (strlen(val->val.s) >= val->val_size)) {
+        ESP_LOGE(TAG, "Value of %s does not fit in %d bytes", name, val->val_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t hash = esp_cloud_param_name_hash(name);
+    uint16_t *slot = esp_cloud_find_index_slot(int_handle, name, hash);
+    if (*slot) {
+        /* A parameter with the same name already exists */
+        return ESP_FAIL;
+    }
+    esp_cloud_dynamic_param_t *param = &int_handle->dynamic_cloud_params[int_handle->cur_dynamic_params_count];
+    char *param_name = esp_cloud_mem_arena_strdup(int_handle->arena, name);
+    if (!param_name) {
+        return ESP_ERR_NO_MEM;
+    }
+    char *str_buf = NULL;
+    if (val->type == CLOUD_PARAM_TYPE_STRING) {
+        /* Both buffers are allocated once here, so that updates never touch the heap */
+        str_buf = esp_cloud_mem_arena_alloc(int_handle->arena, 2 * val->val_size);
+        if (!str_buf) {
+            return ESP_ERR_NO_MEM;
+        }
+        strlcpy(str_buf, val->val.s, val->val_size);
+    }
+    param->name = param_name;
+    param->name_hash = hash;
+    param->cb = cb;
+    param->priv_data = priv_data;
+    param->val = *val;
+    if (str_buf) {
+        param->val.val.s = str_buf;
+        param->platform_buf = str_buf + val->val_size;
+    }
+    int_handle->cur_dynamic_params_count++;
+    *slot = int_handle->cur_dynamic_params_count;
+    return ESP_OK;
+}
+
+/* Add a Dynamic String Paramter */
+esp_err_t esp_cloud_add_dynamic_string_param(esp_cloud_handle_t handle, const char *name, const char *val, size_t val_size, esp_cloud_param_callback_t cb, void *priv_data)
+{
+    esp_cloud_param_val_t param_val = {
+        .type = CLOUD_PARAM_TYPE_STRING,
+        .val.s = (char *)(val ? val : ""),
+        .val_size = val_size,
+    };
+    return esp_cloud_add_dynamic_param(handle, name, &param_val, cb, priv_data);
+}
+
+/* Add a Dynamic Integer Parameter */
+esp_err_t esp_cloud_add_dynamic_int_param(esp_cloud_handle_t handle, const char *name, int val, esp_cloud_param_callback_t cb, void *priv_data)
+{
+    esp_cloud_param_val_t param_val = {
+        .type = CLOUD_PARAM_TYPE_INTEGER,
+        .val.i = val,
+        .val_size = sizeof(int),
+    };
+    return esp_cloud_add_dynamic_param(handle, name, &param_val, cb, priv_data);
+}
+
+/* Add a Dynamic Float Parameter */
+esp_err_t esp_cloud_add_dynamic_float_param(esp_cloud_handle_t handle, const char *name, float val, esp_cloud_param_callback_t cb, void *priv_data)
+{
+    esp_cloud_param_val_t param_val = {
+        .type = CLOUD_PARAM_TYPE_FLOAT,
+        .val.f = val,
+        .val_size = sizeof(float),
+    };
+    return esp_cloud_add_dynamic_param(handle, name, &param_val, cb, priv_data);
+}
+
+/* Add a Dynamic Boolean Parameter */
+esp_err_t esp_cloud_add_dynamic_bool_param(esp_cloud_handle_t handle, const char *name, bool val, esp_cloud_param_callback_t cb, void *priv_data)
+{
+    esp_cloud_param_val_t param_val = {
+        .type = CLOUD_PARAM_TYPE_BOOLEAN,
+        .val.b = val,
+        .val_size = sizeof(bool),
+    };
+    return esp_cloud_add_dynamic_param(handle, name, &param_val, cb, priv_data);
+}
+
+esp_cloud_dynamic_param_t *esp_cloud_get_dynamic_param_by_id(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    if (!handle || (id < 0) || (id >= handle->cur_dynamic_params_count)) {
+        return NULL;
+    }
+    return &handle->dynamic_cloud_params[id];
+}
+
+esp_cloud_param_id_t esp_cloud_get_dynamic_param_id(esp_cloud_handle_t handle, const char *name)
+{
+    if (!handle || !name) {
+        return ESP_CLOUD_PARAM_ID_INVALID;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (!int_handle->dynamic_params_index) {
+        return ESP_CLOUD_PARAM_ID_INVALID;
+    }
+    uint16_t *slot = esp_cloud_find_index_slot(int_handle, name, esp_cloud_param_name_hash(name));
+    return (esp_cloud_param_id_t)(*slot) - 1;
+}
+
+static esp_cloud_dynamic_param_t *esp_cloud_get_dynamic_param_by_id_and_type(esp_cloud_handle_t handle,
+        esp_cloud_param_id_t id, esp_cloud_param_val_type_t param_type)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id((esp_cloud_internal_handle_t *)handle, id);
+    if (param && (param->val.type == param_type)) {
+        return param;
+    }
+    return NULL;
+}
+
+static uint32_t *esp_cloud_get_change_bitmap(esp_cloud_internal_handle_t *handle, uint8_t change_flag)
+{
+    return (change_flag == CLOUD_PARAM_FLAG_REMOTE_CHANGE) ?
+            handle->remote_change_bitmap : handle->local_change_bitmap;
+}
+
+/* Can be called from any task. The value must be written before the bit is set */
+void esp_cloud_mark_param_changed(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, uint8_t change_flag)
+{
+    uint32_t *bitmap = esp_cloud_get_change_bitmap(handle, change_flag);
+    if (!bitmap) {
+        return;
+    }
+    __atomic_fetch_or(&bitmap[id / 32], (uint32_t)1 << (id % 32), __ATOMIC_RELEASE);
+    __atomic_fetch_add(&handle->coalesce.stats.changes_recorded, 1, __ATOMIC_RELAXED);
+}
+
+/* Swap out both change bitmaps into the given arrays. Done under txn_lock, so
+ * that the bits of a committed transaction are taken all together.
+ */
+void esp_cloud_fetch_changed_params(esp_cloud_internal_handle_t *handle, uint32_t *local, uint32_t *remote)
+{
+    int word;
+    int words = ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count);
+    portENTER_CRITICAL(&handle->txn_lock);
+    for (word = 0; word < words; word++) {
+        local[word] = __atomic_exchange_n(&handle->local_change_bitmap[word], 0, __ATOMIC_ACQUIRE);
+        remote[word] = __atomic_exchange_n(&handle->remote_change_bitmap[word], 0, __ATOMIC_ACQUIRE);
+    }
+    portEXIT_CRITICAL(&handle->txn_lock);
+}
+
+/* Internal. Record a local change, or stage it if the calling task has a transaction open */
+static void esp_cloud_param_local_change(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    if (handle->txn_owner && (handle->txn_owner == xTaskGetCurrentTaskHandle())) {
+        handle->txn_bitmap[id / 32] |= (uint32_t)1 << (id % 32);
+        return;
+    }
+    esp_cloud_mark_param_changed(handle, id, CLOUD_PARAM_FLAG_LOCAL_CHANGE);
+    esp_cloud_platform_wakeup(handle);
+}
+
+static esp_err_t esp_cloud_param_txn_open(esp_cloud_handle_t handle, TickType_t wait_ticks)
+{
+    if (!handle) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (int_handle->txn_owner == xTaskGetCurrentTaskHandle()) {
+        ESP_LOGE(TAG, "Transaction already open");
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* One transaction at a time. Other tasks wait here for the open one to be committed */
+    if (xSemaphoreTake(int_handle->txn_mutex, wait_ticks) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    int_handle->txn_owner = xTaskGetCurrentTaskHandle();
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_param_txn_begin(esp_cloud_handle_t handle)
+{
+    return esp_cloud_param_txn_open(handle, portMAX_DELAY);
+}
+
+esp_err_t esp_cloud_param_txn_try_begin(esp_cloud_handle_t handle, uint32_t timeout_ms)
+{
+    return esp_cloud_param_txn_open(handle, pdMS_TO_TICKS(timeout_ms));
+}
+
+esp_err_t esp_cloud_param_txn_commit(esp_cloud_handle_t handle)
+{
+    if (!handle) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (int_handle->txn_owner != xTaskGetCurrentTaskHandle()) {
+        ESP_LOGE(TAG, "No transaction open");
+        return ESP_ERR_INVALID_STATE;
+    }
+    int word;
+    int words = ESP_CLOUD_BITMAP_WORDS(int_handle->cur_dynamic_params_count);
+    uint32_t changes = 0;
+    portENTER_CRITICAL(&int_handle->txn_lock);
+    for (word = 0; word < words; word++) {
+        uint32_t staged = int_handle->txn_bitmap[word];
+        if (staged) {
+            __atomic_fetch_or(&int_handle->local_change_bitmap[word], staged, __ATOMIC_RELEASE);
+            changes += __builtin_popcount(staged);
+            int_handle->txn_bitmap[word] = 0;
+        }
+    }
+    portEXIT_CRITICAL(&int_handle->txn_lock);
+    __atomic_fetch_add(&int_handle->coalesce.stats.changes_recorded, changes, __ATOMIC_RELAXED);
+    int_handle->txn_owner = NULL;
+    xSemaphoreGive(int_handle->txn_mutex);
+    if (changes) {
+        esp_cloud_platform_wakeup(int_handle);
+    }
+    return ESP_OK;
+}
+
+/* Read a consistent copy of the current value. For strings, val->val.s must point
+ * to a buffer of at least val->val_size bytes.
+ */
+esp_err_t esp_cloud_read_param_value(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, esp_cloud_param_val_t *val)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id(handle, id);
+    if (!param || !val || (param->val.type != val->type)) {
+        return ESP_FAIL;
+    }
+    switch (param->val.type) {
+        case CLOUD_PARAM_TYPE_BOOLEAN:
+            __atomic_load(&param->val.val.b, &val->val.b, __ATOMIC_RELAXED);
+            break;
+        case CLOUD_PARAM_TYPE_INTEGER:
+            __atomic_load(&param->val.val.i, &val->val.i, __ATOMIC_RELAXED);
+            break;
+        case CLOUD_PARAM_TYPE_FLOAT:
+            __atomic_load(&param->val.val.f, &val->val.f, __ATOMIC_RELAXED);
+            break;
+        case CLOUD_PARAM_TYPE_STRING:
+            if (!val->val.s || (val->val_size == 0)) {
+                return ESP_FAIL;
+            }
+            portENTER_CRITICAL(&handle->param_lock);
+            strlcpy(val->val.s, param->val.val.s, val->val_size);
+            portEXIT_CRITICAL(&handle->param_lock);
+            break;
+        default:
+            return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* Store a value taken from the cloud. Unlike the update APIs, this does not mark the param as changed */
+esp_err_t esp_cloud_write_param_value(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id,
+        const esp_cloud_param_val_t *val)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id(handle, id);
+    if (!param || !val || (param->val.type != val->type)) {
+        return ESP_FAIL;
+    }
+    switch (param->val.type) {
+        case CLOUD_PARAM_TYPE_BOOLEAN:
+            __atomic_store(&param->val.val.b, &val->val.b, __ATOMIC_RELAXED);
+            break;
+        case CLOUD_PARAM_TYPE_INTEGER:
+            __atomic_store(&param->val.val.i, &val->val.i, __ATOMIC_RELAXED);
+            break;
+        case CLOUD_PARAM_TYPE_FLOAT:
+            __atomic_store(&param->val.val.f, &val->val.f, __ATOMIC_RELAXED);
+            break;
+        case CLOUD_PARAM_TYPE_STRING:
+            if (!val->val.s) {
+                return ESP_FAIL;
+            }
+            portENTER_CRITICAL(&handle->param_lock);
+            strlcpy(param->val.val.s, val->val.s, param->val.val_size);
+            portEXIT_CRITICAL(&handle->param_lock);
+            break;
+        default:
+            return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_update_bool_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, bool val)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id_and_type(handle, id, CLOUD_PARAM_TYPE_BOOLEAN);
+    if (param) {
+        __atomic_store(&param->val.val.b, &val, __ATOMIC_RELAXED);
+        esp_cloud_param_local_change(handle, id);
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t esp_cloud_update_int_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, int val)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id_and_type(handle, id, CLOUD_PARAM_TYPE_INTEGER);
+    if (param) {
+        __atomic_store(&param->val.val.i, &val, __ATOMIC_RELAXED);
+        if (esp_cloud_param_report_filter(handle, id, val)) {
+            esp_cloud_param_local_change(handle, id);
+        }
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t esp_cloud_update_float_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, float val)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id_and_type(handle, id, CLOUD_PARAM_TYPE_FLOAT);
+    if (param) {
+        __atomic_store(&param->val.val.f, &val, __ATOMIC_RELAXED);
+        if (esp_cloud_param_report_filter(handle, id, val)) {
+            esp_cloud_param_local_change(handle, id);
+        }
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t esp_cloud_update_string_param_by_id(esp_cloud_handle_t handle, esp_cloud_param_id_t id, char *val)
+{
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id_and_type(handle, id, CLOUD_PARAM_TYPE_STRING);
+    if (!param || !val) {
+        return ESP_FAIL;
+    }
+    size_t len = strlen(val);
+    if (len >= param->val.val_size) {
+        ESP_LOGE(TAG, "Value of %s does not fit in %d bytes", param->name, param->val.val_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    /* Copy under the lock so that the cloud task never reads a partially written string */
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    portENTER_CRITICAL(&int_handle->param_lock);
+    memcpy(param->val.val.s, val, len + 1);
+    portEXIT_CRITICAL(&int_handle->param_lock);
+    esp_cloud_param_local_change(int_handle, id);
+    return ESP_OK;
+}
+
+/* The name based update APIs are thin wrappers over the identifier based ones */
+esp_err_t esp_cloud_update_bool_param(esp_cloud_handle_t handle, const char *name, bool val)
+{
+    return esp_cloud_update_bool_param_by_id(handle, esp_cloud_get_dynamic_param_id(handle, name), val);
+}
+
+esp_err_t esp_cloud_update_int_param(esp_cloud_handle_t handle, const char *name, int val)
+{
+    return esp_cloud_update_int_param_by_id(handle, esp_cloud_get_dynamic_param_id(handle, name), val);
+}
+
+esp_err_t esp_cloud_update_float_param(esp_cloud_handle_t handle, const char *name, float val)
+{
+    return esp_cloud_update_float_param_by_id(handle, esp_cloud_get_dynamic_param_id(handle, name), val);
+}
+
+esp_err_t esp_cloud_update_string_param(esp_cloud_handle_t handle, const char *name, char *val)
+{
+    return esp_cloud_update_string_param_by_id(handle, esp_cloud_get_dynamic_param_id(handle, name), val);
+}
@@ -0,0 +1,180 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <esp_log.h>
+#include <esp_cloud.h>
+#include <esp_cloud_mem.h>
+
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_platform";
+
+#ifdef CONFIG_ESP_CLOUD_OUTBOX_DEFAULT_TTL_S
+#define ESP_CLOUD_OUTBOX_DEFAULT_TTL_S  CONFIG_ESP_CLOUD_OUTBOX_DEFAULT_TTL_S
+#else
+#define ESP_CLOUD_OUTBOX_DEFAULT_TTL_S  3600
+#endif
+
+/* Longest topic copied for esp_cloud_platform_publish_id(), including the NUL */
+#define ESP_CLOUD_PUBLISH_TOPIC_MAX_LEN     128
+
+/* Thin wrappers dispatching to the backend chosen at esp_cloud_init() time */
+
+esp_err_t esp_cloud_platform_init(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->init(handle);
+}
+
+esp_err_t esp_cloud_platform_deinit(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->deinit(handle);
+}
+
+esp_err_t esp_cloud_platform_connect(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    /* Callers other than the platform must not bypass the backoff */
+    if (!handle->reconnect.connected && !esp_cloud_reconnect_due(handle, NULL)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return handle->platform->connect(handle);
+}
+
+esp_err_t esp_cloud_platform_disconnect(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->disconnect(handle);
+}
+
+esp_err_t esp_cloud_platform_wait(esp_cloud_internal_handle_t *handle, uint32_t timeout_ms)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->wait(handle, timeout_ms);
+}
+
+void esp_cloud_platform_wakeup(esp_cloud_internal_handle_t *handle)
+{
+    /* Producers may call this before the platform is up */
+    if (!handle || !handle->platform) {
+        return;
+    }
+    handle->platform->wakeup(handle);
+}
+
+void esp_cloud_notify(esp_cloud_handle_t handle)
+{
+    esp_cloud_platform_wakeup((esp_cloud_internal_handle_t *)handle);
+}
+
+esp_err_t esp_cloud_platform_report_changes(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->report_changes(handle);
+}
+
+esp_err_t esp_cloud_platform_report_state(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->report_state(handle);
+}
+
+esp_err_t esp_cloud_platform_register_dynamic_params(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->register_dynamic_params(handle);
+}
+
+static esp_err_t esp_cloud_platform_publish_len(esp_cloud_internal_handle_t *handle, const char *topic,
+        const char *data, size_t data_len, uint32_t ttl_s)
+{
+    /* Behind the older messages still waiting in the outbox, to keep the order.
+     * The cloud task replays them right away while the platform takes them.
+     */
+    if (esp_cloud_outbox_has_pending(handle)) {
+        esp_err_t err = esp_cloud_outbox_add(handle, topic, data, data_len, ttl_s);
+        esp_cloud_platform_wakeup(handle);
+        return err;
+    }
+    esp_err_t err = handle->platform->publish(handle, topic, data, data_len);
+    /* ESP_ERR_NO_MEM only means that the platform has too many messages in flight.
+     * That is left to the caller, rather than turning every message into a flash write.
+     */
+    if ((err != ESP_OK) && (err != ESP_ERR_NO_MEM) && handle->outbox &&
+            (esp_cloud_outbox_add(handle, topic, data, data_len, ttl_s) == ESP_OK)) {
+        ESP_LOGW(TAG, "Publish to %s failed. Queued for later", topic);
+        return ESP_OK;
+    }
+    return err;
+}
+
+void esp_cloud_platform_publish_failed(esp_cloud_internal_handle_t *handle, const char *topic, const char *data,
+        size_t data_len)
+{
+    if (!handle->outbox || (esp_cloud_outbox_add(handle, topic, data, data_len,
+                    ESP_CLOUD_OUTBOX_DEFAULT_TTL_S) != ESP_OK)) {
+        ESP_LOGW(TAG, "Message to %s lost", topic);
+        return;
+    }
+    ESP_LOGW(TAG, "Message to %s not delivered. Queued for later", topic);
+}
+
+esp_err_t esp_cloud_platform_publish_id(esp_cloud_internal_handle_t *handle, esp_cloud_topic_id_t id,
+        const char *data, size_t data_len)
+{
+    if (!handle || !handle->platform || !data) {
+        return ESP_FAIL;
+    }
+    char topic_buf[ESP_CLOUD_PUBLISH_TOPIC_MAX_LEN];
+    const char *topic = esp_cloud_topic_get(handle, id, topic_buf, sizeof(topic_buf));
+    if (!topic) {
+        ESP_LOGE(TAG, "No topic %d to publish to", id);
+        return ESP_FAIL;
+    }
+    return esp_cloud_platform_publish_len(handle, topic, data, data_len, ESP_CLOUD_OUTBOX_DEFAULT_TTL_S);
+}
+
+esp_err_t esp_cloud_platform_subscribe(esp_cloud_internal_handle_t *handle, const char *topic,
+        esp_cloud_platform_subscribe_cb_t cb, void *priv_data)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->subscribe(handle, topic, cb, priv_data);
+}
+
+esp_err_t esp_cloud_platform_unsubscribe(esp_cloud_internal_handle_t *handle, const char *topic)
+{
+    if (!handle || !handle->platform) {
+        return ESP_FAIL;
+    }
+    return handle->platform->unsubscribe(handle, topic);
+}
@@ -0,0 +1,232 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_system.h>
+
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_reconnect";
+
+/* Capped exponential backoff with full jitter: the wait before attempt n is
+ * picked uniformly from [0, min(cap, base * 2^n)], so that devices dropped
+ * together by a broker restart do not come back in lockstep.
+ */
+typedef struct {
+    uint32_t base_ms;
+    uint32_t cap_ms;
+} esp_cloud_backoff_t;
+
+static const esp_cloud_backoff_t esp_cloud_backoff[] = {
+    /* The device itself is offline. Retry quickly so that it is back soon after the network */
+    [ESP_CLOUD_CONN_ERR_NETWORK] = { .base_ms = 500, .cap_ms = 30 * 1000 },
+    [ESP_CLOUD_CONN_ERR_TRANSIENT] = { .base_ms = 1000, .cap_ms = 5 * 60 * 1000 },
+    /* Retrying soon will not fix the credentials */
+    [ESP_CLOUD_CONN_ERR_AUTH] = { .base_ms = 60 * 1000, .cap_ms = 60 * 60 * 1000 },
+};
+
+/* Beyond this, base * 2^n is past every cap anyway */
+#define ESP_CLOUD_BACKOFF_MAX_SHIFT     16
+
+uint32_t esp_cloud_backoff_delay(esp_cloud_conn_err_t err, uint16_t attempt)
+{
+    const esp_cloud_backoff_t *backoff = &esp_cloud_backoff[err];
+    uint16_t shift = (attempt < ESP_CLOUD_BACKOFF_MAX_SHIFT) ? attempt : ESP_CLOUD_BACKOFF_MAX_SHIFT;
+    uint64_t window = (uint64_t)backoff->base_ms << shift;
+    if (window > backoff->cap_ms) {
+        window = backoff->cap_ms;
+    }
+    return esp_random() % ((uint32_t)window + 1);
+}
+
+/* Called before the first connection attempt */
+void esp_cloud_reconnect_init(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_reconnect_t *reconnect = &handle->reconnect;
+    memset(reconnect, 0, sizeof(esp_cloud_reconnect_t));
+    reconnect->outage_start_ms = esp_cloud_time_ms();
+    reconnect->next_attempt_ms = reconnect->outage_start_ms;
+}
+
+/* Called by the platform when an established connection is lost */
+void esp_cloud_reconnect_lost(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_reconnect_t *reconnect = &handle->reconnect;
+    if (!reconnect->connected) {
+        return;
+    }
+    uint32_t now = esp_cloud_time_ms();
+    reconnect->connected = false;
+    reconnect->failures = 0;
+    reconnect->attempt = 0;
+    reconnect->outage_start_ms = now;
+    reconnect->resume_pending = false;
+    /* Jittered even the first time, as a broker restart drops everyone at once */
+    reconnect->next_attempt_ms = now + esp_cloud_backoff_delay(ESP_CLOUD_CONN_ERR_TRANSIENT, 0);
+    reconnect->stats.disconnects++;
+    ESP_LOGW(TAG, "Connection lost. Reconnecting in %u ms", reconnect->next_attempt_ms - now);
+}
+
+/* Whether the platform may make a connection attempt now. If not, *timeout_ms is
+ * reduced to the time left until it may.
+ */
+bool esp_cloud_reconnect_due(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    esp_cloud_reconnect_t *reconnect = &handle->reconnect;
+    if (reconnect->connected || reconnect->gave_up) {
+        return false;
+    }
+    int32_t wait_ms = (int32_t)(reconnect->next_attempt_ms - esp_cloud_time_ms());
+    if (wait_ms <= 0) {
+        return true;
+    }
+    if (timeout_ms && ((uint32_t)wait_ms < *timeout_ms)) {
+        *timeout_ms = wait_ms;
+    }
+    return false;
+}
+
+void esp_cloud_reconnect_attempt_started(esp_cloud_internal_handle_t *handle)
+{
+    handle->reconnect.attempt_start_ms = esp_cloud_time_ms();
+}
+
+/* Called by the platform after a failed connection attempt. Returns the time until
+ * the next attempt, or ESP_CLOUD_RECONNECT_GIVE_UP once the reconnect_attempts
+ * budget is used up, in which case the agent stops.
+ */
+uint32_t esp_cloud_reconnect_failed(esp_cloud_internal_handle_t *handle, esp_cloud_conn_err_t err)
+{
+    esp_cloud_reconnect_t *reconnect = &handle->reconnect;
+    reconnect->stats.attempts++;
+    switch (err) {
+        case ESP_CLOUD_CONN_ERR_NETWORK:
+            reconnect->stats.network_failures++;
+            break;
+        case ESP_CLOUD_CONN_ERR_AUTH:
+            reconnect->stats.auth_failures++;
+            break;
+        default:
+            err = ESP_CLOUD_CONN_ERR_TRANSIENT;
+            reconnect->stats.transient_failures++;
+            break;
+    }
+    /* Attempts made while the device is offline say nothing about the cloud, so they are not counted */
+    if (err != ESP_CLOUD_CONN_ERR_NETWORK) {
+        reconnect->failures++;
+    }
+    if (handle->reconnect_attempts && (reconnect->failures >= handle->reconnect_attempts)) {
+        ESP_LOGE(TAG, "Giving up after %u failed connection attempts", reconnect->failures);
+        reconnect->gave_up = true;
+        handle->cloud_stop = true;
+        return ESP_CLOUD_RECONNECT_GIVE_UP;
+    }
+    uint32_t delay_ms = esp_cloud_backoff_delay(err, reconnect->attempt);
+    if (reconnect->attempt < UINT16_MAX) {
+        reconnect->attempt++;
+    }
+    reconnect->next_attempt_ms = esp_cloud_time_ms() + delay_ms;
+    ESP_LOGW(TAG, "Connection attempt failed (%d). Retrying in %u ms", err, delay_ms);
+    return delay_ms;
+}
+
+/* Called by the platform once connected */
+void esp_cloud_reconnect_succeeded(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_reconnect_t *reconnect = &handle->reconnect;
+    if (reconnect->connected) {
+        return;
+    }
+    uint32_t now = esp_cloud_time_ms();
+    uint32_t connect_ms = now - reconnect->outage_start_ms;
+    reconnect->connected = true;
+    reconnect->failures = 0;
+    reconnect->attempt = 0;
+    reconnect->stats.attempts++;
+    reconnect->stats.connects++;
+    reconnect->total_connect_ms += connect_ms;
+    reconnect->stats.last_connect_ms = connect_ms;
+    reconnect->stats.avg_connect_ms = reconnect->total_connect_ms / reconnect->stats.connects;
+    if (connect_ms > reconnect->stats.max_connect_ms) {
+        reconnect->stats.max_connect_ms = connect_ms;
+    }
+    uint32_t handshake_ms = now - reconnect->attempt_start_ms;
+    reconnect->total_handshake_ms += handshake_ms;
+    reconnect->stats.last_handshake_ms = handshake_ms;
+    reconnect->stats.avg_handshake_ms = reconnect->total_handshake_ms / reconnect->stats.connects;
+    if (handshake_ms > reconnect->stats.max_handshake_ms) {
+        reconnect->stats.max_handshake_ms = handshake_ms;
+    }
+    ESP_LOGI(TAG, "Connected after %u ms, handshake %u ms", connect_ms, handshake_ms);
+    if (reconnect->stats.connects > 1) {
+        reconnect->resume_pending = true;
+        reconnect->connected_ms = now;
+        /* Nothing changed while offline, so there is nothing to wait for */
+        if (!esp_cloud_shadow_changes_pending(handle)) {
+            esp_cloud_reconnect_operational(handle);
+        }
+    }
+}
+
+/* Called once the first shadow update after a reconnection is accepted */
+void esp_cloud_reconnect_operational(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_reconnect_t *reconnect = &handle->reconnect;
+    if (!reconnect->resume_pending) {
+        return;
+    }
+    uint32_t resume_ms = esp_cloud_time_ms() - reconnect->connected_ms;
+    reconnect->resume_pending = false;
+    reconnect->stats.last_resume_ms = resume_ms;
+    if (resume_ms > reconnect->stats.max_resume_ms) {
+        reconnect->stats.max_resume_ms = resume_ms;
+    }
+    ESP_LOGI(TAG, "Operational %u ms after reconnecting", resume_ms);
+}
+
+bool esp_cloud_reconnect_gave_up(esp_cloud_internal_handle_t *handle)
+{
+    return handle->reconnect.gave_up;
+}
+
+/* Connect for the first time. Blocks until connected or the budget is used up */
+esp_err_t esp_cloud_reconnect_first(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_reconnect_init(handle);
+    while (!handle->cloud_stop) {
+        uint32_t wait_ms = UINT32_MAX;
+        if (!esp_cloud_reconnect_due(handle, &wait_ms)) {
+            vTaskDelay(pdMS_TO_TICKS(wait_ms));
+            continue;
+        }
+        /* The platform reports the outcome of the attempt */
+        if (esp_cloud_platform_connect(handle) == ESP_OK) {
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t esp_cloud_get_reconnect_stats(esp_cloud_handle_t handle, esp_cloud_reconnect_stats_t *stats)
+{
+    if (!handle || !stats) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    memcpy(stats, &int_handle->reconnect.stats, sizeof(esp_cloud_reconnect_stats_t));
+    return ESP_OK;
+}
@@ -0,0 +1,159 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <math.h>
+#include <esp_log.h>
+
+#include "esp_cloud_mem.h"
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_policy";
+
+static float esp_cloud_param_numeric_val(esp_cloud_dynamic_param_t *param)
+{
+    if (param->val.type == CLOUD_PARAM_TYPE_INTEGER) {
+        return (float)__atomic_load_n(&param->val.val.i, __ATOMIC_RELAXED);
+    }
+    float val;
+    __atomic_load(&param->val.val.f, &val, __ATOMIC_RELAXED);
+    return val;
+}
+
+esp_err_t esp_cloud_set_param_report_policy(esp_cloud_handle_t handle, esp_cloud_param_id_t id,
+        const esp_cloud_report_policy_t *policy)
+{
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    esp_cloud_dynamic_param_t *param = esp_cloud_get_dynamic_param_by_id(int_handle, id);
+    if (!param) {
+        return ESP_FAIL;
+    }
+    if ((param->val.type != CLOUD_PARAM_TYPE_INTEGER) && (param->val.type != CLOUD_PARAM_TYPE_FLOAT)) {
+        ESP_LOGE(TAG, "Reporting policy not supported for %s", param->name);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    /* The state is never freed, as producers may be reading it from other tasks.
+     * Removing a policy just clears it.
+     */
+    if (!param->report) {
+        if (!policy) {
+            return ESP_OK;
+        }
+        esp_cloud_param_report_t *report = esp_cloud_mem_calloc(1, sizeof(esp_cloud_param_report_t));
+        if (!report) {
+            ESP_LOGE(TAG, "Failed to allocate memory");
+            return ESP_ERR_NO_MEM;
+        }
+        report->last_report_ms = esp_cloud_time_ms();
+        __atomic_store_n(&param->report, report, __ATOMIC_RELEASE);
+        int_handle->report_policy_count++;
+    }
+    if (policy) {
+        param->report->policy = *policy;
+    } else {
+        memset(&param->report->policy, 0, sizeof(esp_cloud_report_policy_t));
+    }
+    return ESP_OK;
+}
+
+/* Called by producers after storing a new value. Returns true if the change should be reported */
+bool esp_cloud_param_report_filter(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id, float val)
+{
+    esp_cloud_param_report_t *report = __atomic_load_n(&handle->dynamic_cloud_params[id].report, __ATOMIC_ACQUIRE);
+    if (!report) {
+        return true;
+    }
+    esp_cloud_report_policy_t *policy = &report->policy;
+    if (report->acked_valid) {
+        float diff = fabsf(val - report->acked_val);
+        if ((diff < policy->abs_deadband) || (diff < policy->rel_deadband * fabsf(report->acked_val))) {
+            return false;
+        }
+    }
+    if (policy->min_interval_ms && report->reported &&
+            ((esp_cloud_time_ms() - report->last_report_ms) < policy->min_interval_ms)) {
+        /* The cloud task reports it once the interval has elapsed */
+        report->held = true;
+        return false;
+    }
+    return true;
+}
+
+/* Mark held back changes and heartbeats which are due. If nothing is due yet,
+ * *timeout_ms is reduced to the time left until the next one. Called from the cloud task.
+ */
+void esp_cloud_param_report_poll(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    if (handle->report_policy_count == 0) {
+        return;
+    }
+    uint32_t now = esp_cloud_time_ms();
+    int i;
+    for (i = 0; i < handle->cur_dynamic_params_count; i++) {
+        esp_cloud_param_report_t *report = handle->dynamic_cloud_params[i].report;
+        if (!report) {
+            continue;
+        }
+        uint32_t since_report = now - report->last_report_ms;
+        uint32_t due_in = UINT32_MAX;
+        if (report->held) {
+            due_in = (since_report < report->policy.min_interval_ms) ?
+                    (report->policy.min_interval_ms - since_report) : 0;
+        }
+        if (report->policy.heartbeat_ms) {
+            uint32_t heartbeat_in = (since_report < report->policy.heartbeat_ms) ?
+                    (report->policy.heartbeat_ms - since_report) : 0;
+            due_in = (heartbeat_in < due_in) ? heartbeat_in : due_in;
+        }
+        if (due_in == 0) {
+            report->held = false;
+            /* Restart the timers here, so that an update still waiting for the
+             * coalescing window does not mark the param again
+             */
+            report->last_report_ms = now;
+            esp_cloud_mark_param_changed(handle, i, CLOUD_PARAM_FLAG_LOCAL_CHANGE);
+        } else if (due_in < *timeout_ms) {
+            *timeout_ms = due_in;
+        }
+    }
+}
+
+/* Called by the platform for every param included in a published update */
+void esp_cloud_param_report_sent(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+    esp_cloud_shadow_snapshot_sent(handle, id);
+    if (!param->report) {
+        return;
+    }
+    param->report->sent_val = esp_cloud_param_numeric_val(param);
+    param->report->last_report_ms = esp_cloud_time_ms();
+    param->report->reported = true;
+    param->report->held = false;
+}
+
+/* Called by the platform for every param of an update the cloud accepted. If
+ * the param was sent again in the meantime, the newer value is taken as acknowledged,
+ * which only makes the next deadband check slightly stricter.
+ */
+void esp_cloud_param_report_acked(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    esp_cloud_param_report_t *report = handle->dynamic_cloud_params[id].report;
+    esp_cloud_shadow_snapshot_acked(handle, id);
+    if (!report) {
+        return;
+    }
+    report->acked_val = report->sent_val;
+    report->acked_valid = true;
+}
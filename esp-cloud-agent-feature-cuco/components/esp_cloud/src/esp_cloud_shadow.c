@@ -0,0 +1,473 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+#include <json_parser.h>
+#include <json_generator.h>
+
+#include "esp_cloud_mem.h"
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_shadow";
+
+uint32_t esp_cloud_time_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static bool esp_cloud_has_changed_params(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle->local_change_bitmap || !handle->remote_change_bitmap) {
+        return false;
+    }
+    int word;
+    for (word = 0; word < ESP_CLOUD_BITMAP_WORDS(handle->cur_dynamic_params_count); word++) {
+        if (__atomic_load_n(&handle->local_change_bitmap[word], __ATOMIC_RELAXED) ||
+                __atomic_load_n(&handle->remote_change_bitmap[word], __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Check whether pending changes should be reported now. If not, *timeout_ms is
+ * reduced to the time left until they must be. Called only from the cloud task.
+ */
+bool esp_cloud_shadow_flush_due(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    esp_cloud_shadow_coalesce_t *coalesce = &handle->coalesce;
+    /* Explicitly requested, so not held back */
+    if (coalesce->full_report) {
+        return true;
+    }
+    if (!esp_cloud_has_changed_params(handle)) {
+        coalesce->pending = false;
+        return false;
+    }
+    uint32_t now = esp_cloud_time_ms();
+    if (!coalesce->pending) {
+        /* Producers wake the task up on every change, so this is close to the actual change time */
+        coalesce->pending = true;
+        coalesce->pending_since_ms = now;
+    }
+    uint32_t wait_ms = 0;
+    uint32_t since_update = now - coalesce->last_update_ms;
+    if (coalesce->published && (since_update < coalesce->min_update_interval_ms)) {
+        wait_ms = coalesce->min_update_interval_ms - since_update;
+    }
+    if (coalesce->max_update_latency_ms) {
+        uint32_t waited = now - coalesce->pending_since_ms;
+        uint32_t latency_left = (waited < coalesce->max_update_latency_ms) ?
+                (coalesce->max_update_latency_ms - waited) : 0;
+        if (latency_left < wait_ms) {
+            wait_ms = latency_left;
+        }
+    }
+    if (wait_ms == 0) {
+        return true;
+    }
+    if (wait_ms < *timeout_ms) {
+        *timeout_ms = wait_ms;
+    }
+    return false;
+}
+
+/* Called by the platform after flushing the pending changes as doc_count
+ * documents, carrying param_count params in all
+ */
+void esp_cloud_shadow_update_sent(esp_cloud_internal_handle_t *handle, int doc_count, int param_count)
+{
+    esp_cloud_shadow_coalesce_t *coalesce = &handle->coalesce;
+    uint32_t now = esp_cloud_time_ms();
+    uint32_t latency = coalesce->pending ? (now - coalesce->pending_since_ms) : 0;
+
+    coalesce->last_update_ms = now;
+    coalesce->published = true;
+    coalesce->pending = false;
+    coalesce->total_latency_ms += latency;
+    coalesce->flush_count++;
+    coalesce->stats.updates_published += doc_count;
+    coalesce->stats.params_reported += param_count;
+    coalesce->stats.last_latency_ms = latency;
+    coalesce->stats.avg_latency_ms = coalesce->total_latency_ms / coalesce->flush_count;
+    if (latency > coalesce->stats.max_latency_ms) {
+        coalesce->stats.max_latency_ms = latency;
+    }
+}
+
+/* Called by the platform once the fate of a published update is known. ack_ms is
+ * the time the cloud took to accept it
+ */
+void esp_cloud_shadow_update_done(esp_cloud_internal_handle_t *handle, bool accepted, uint32_t ack_ms)
+{
+    esp_cloud_shadow_coalesce_t *coalesce = &handle->coalesce;
+    if (!accepted) {
+        coalesce->stats.updates_failed++;
+        return;
+    }
+    coalesce->stats.updates_accepted++;
+    esp_cloud_reconnect_operational(handle);
+    coalesce->total_ack_ms += ack_ms;
+    coalesce->stats.avg_ack_ms = coalesce->total_ack_ms / coalesce->stats.updates_accepted;
+    if (ack_ms > coalesce->stats.max_ack_ms) {
+        coalesce->stats.max_ack_ms = ack_ms;
+    }
+}
+
+/* Put the changes of ids from start onwards back into the core bitmaps, after an
+ * update carrying them failed or could not be sent
+ */
+void esp_cloud_shadow_requeue(esp_cloud_internal_handle_t *handle, const uint32_t *local, const uint32_t *remote,
+        int start)
+{
+    int i;
+    for (i = start; i < handle->cur_dynamic_params_count; i++) {
+        uint32_t mask = (uint32_t)1 << (i % 32);
+        if (local[i / 32] & mask) {
+            esp_cloud_mark_param_changed(handle, i, CLOUD_PARAM_FLAG_LOCAL_CHANGE);
+        } else if (remote[i / 32] & mask) {
+            esp_cloud_mark_param_changed(handle, i, CLOUD_PARAM_FLAG_REMOTE_CHANGE);
+        }
+    }
+}
+
+/* Largest size a param can take in a shadow document, as "name":value, */
+size_t esp_cloud_shadow_param_max_len(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+    size_t len = strlen(param->name) + 4;
+    switch (param->val.type) {
+        case CLOUD_PARAM_TYPE_BOOLEAN:
+            return len + strlen("false");
+        case CLOUD_PARAM_TYPE_INTEGER:
+            return len + strlen("-2147483648");
+        case CLOUD_PARAM_TYPE_FLOAT:
+            return len + ESP_CLOUD_SHADOW_FLOAT_MAX_LEN;
+        case CLOUD_PARAM_TYPE_STRING:
+            return len + param->val.val_size + 2;
+        default:
+            return len;
+    }
+}
+
+/* Add the latest local value of a param to the object being generated. Strings
+ * are read through the param's platform buffer, so this is for the cloud task only.
+ */
+esp_err_t esp_cloud_shadow_add_param(esp_cloud_internal_handle_t *handle, json_str_t *jstr, esp_cloud_param_id_t id)
+{
+    esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+    esp_cloud_param_val_t val = {
+        .type = param->val.type,
+        .val_size = param->val.val_size,
+    };
+    if (val.type == CLOUD_PARAM_TYPE_STRING) {
+        val.val.s = param->platform_buf;
+    }
+    esp_err_t err = esp_cloud_read_param_value(handle, id, &val);
+    if (err != ESP_OK) {
+        return err;
+    }
+    switch (val.type) {
+        case CLOUD_PARAM_TYPE_BOOLEAN:
+            json_obj_set_bool(jstr, param->name, val.val.b);
+            break;
+        case CLOUD_PARAM_TYPE_INTEGER:
+            json_obj_set_int(jstr, param->name, val.val.i);
+            break;
+        case CLOUD_PARAM_TYPE_FLOAT:
+            json_obj_set_float(jstr, param->name, val.val.f);
+            break;
+        case CLOUD_PARAM_TYPE_STRING:
+            json_obj_set_string(jstr, param->name, val.val.s);
+            break;
+        default:
+            return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* Read the value of a param from the current object. Strings go into str_buf */
+static int esp_cloud_shadow_get_val(jparse_ctx_t *jctx, esp_cloud_dynamic_param_t *param,
+        esp_cloud_param_val_t *val, char *str_buf)
+{
+    val->type = param->val.type;
+    val->val_size = param->val.val_size;
+    switch (val->type) {
+        case CLOUD_PARAM_TYPE_BOOLEAN:
+            return json_obj_get_bool(jctx, param->name, &val->val.b);
+        case CLOUD_PARAM_TYPE_INTEGER:
+            return json_obj_get_int(jctx, param->name, &val->val.i);
+        case CLOUD_PARAM_TYPE_FLOAT:
+            return json_obj_get_float(jctx, param->name, &val->val.f);
+        case CLOUD_PARAM_TYPE_STRING:
+            val->val.s = str_buf;
+            return json_obj_get_string(jctx, param->name, val->val.s, val->val_size);
+        default:
+            return -1;
+    }
+}
+
+/* Pass the values in the current object to the callbacks of the read-write params.
+ * With str_buf set, strings are read into it, and accepted values are also stored
+ * as the params' own, so that whichever way the platform builds its report, the
+ * new values are the ones reported.
+ */
+static int esp_cloud_shadow_apply_obj(esp_cloud_internal_handle_t *handle, jparse_ctx_t *jctx, char *str_buf)
+{
+    int applied = 0;
+    esp_cloud_param_id_t id;
+    for (id = 0; id < handle->cur_dynamic_params_count; id++) {
+        esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+        if (!param->cb) {
+            continue;
+        }
+        esp_cloud_param_val_t new_val;
+        if (esp_cloud_shadow_get_val(jctx, param, &new_val, str_buf ? str_buf : param->platform_buf) != OS_SUCCESS) {
+            continue;
+        }
+        if (param->cb(param->name, &new_val, param->priv_data) != ESP_OK) {
+            continue;
+        }
+        if (str_buf) {
+            esp_cloud_write_param_value(handle, id, &new_val);
+            esp_cloud_mark_param_changed(handle, id, CLOUD_PARAM_FLAG_LOCAL_CHANGE);
+        }
+        esp_cloud_mark_param_changed(handle, id, CLOUD_PARAM_FLAG_REMOTE_CHANGE);
+        applied++;
+    }
+    return applied;
+}
+
+/* Apply a shadow delta, either {"state":{"name":value,...},...} or just
+ * {"name":value,...}, through the callbacks of the read-write params
+ */
+esp_err_t esp_cloud_shadow_apply_delta(esp_cloud_internal_handle_t *handle, char *doc, int doc_len)
+{
+    jparse_ctx_t jctx;
+    if (json_parse_start(&jctx, doc, doc_len) != OS_SUCCESS) {
+        ESP_LOGE(TAG, "Invalid delta document");
+        return ESP_FAIL;
+    }
+    bool in_state = (json_obj_get_object(&jctx, "state") == OS_SUCCESS);
+    esp_cloud_shadow_apply_obj(handle, &jctx, NULL);
+    if (in_state) {
+        json_obj_leave_object(&jctx);
+    }
+    json_parse_end(&jctx);
+    return ESP_OK;
+}
+
+/* FNV-1a hash of a value as it appears in a shadow document, never 0 */
+static uint32_t esp_cloud_shadow_val_hash(const esp_cloud_param_val_t *val)
+{
+    char buf[ESP_CLOUD_SHADOW_FLOAT_MAX_LEN];
+    const uint8_t *data = (const uint8_t *)buf;
+    size_t len;
+    switch (val->type) {
+        case CLOUD_PARAM_TYPE_BOOLEAN:
+            buf[0] = val->val.b;
+            len = 1;
+            break;
+        case CLOUD_PARAM_TYPE_INTEGER:
+            data = (const uint8_t *)&val->val.i;
+            len = sizeof(val->val.i);
+            break;
+        case CLOUD_PARAM_TYPE_FLOAT:
+            /* Printed the way json_generator does, so that the cloud's copy hashes the same */
+            len = snprintf(buf, sizeof(buf), "%.*f", JSON_FLOAT_PRECISION, val->val.f);
+            break;
+        case CLOUD_PARAM_TYPE_STRING:
+            data = (const uint8_t *)val->val.s;
+            len = strlen(val->val.s);
+            break;
+        default:
+            return 0;
+    }
+    uint32_t hash = 2166136261U ^ val->type;
+    while (len--) {
+        hash ^= *data++;
+        hash *= 16777619U;
+    }
+    return hash ? hash : 1;
+}
+
+/* Hash of the local value of a param. Strings are read into str_buf */
+static uint32_t esp_cloud_shadow_local_hash(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id,
+        char *str_buf)
+{
+    esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+    esp_cloud_param_val_t val = {
+        .type = param->val.type,
+        .val_size = param->val.val_size,
+    };
+    if (val.type == CLOUD_PARAM_TYPE_STRING) {
+        val.val.s = str_buf;
+    }
+    if (esp_cloud_read_param_value(handle, id, &val) != ESP_OK) {
+        return 0;
+    }
+    return esp_cloud_shadow_val_hash(&val);
+}
+
+/* Called through esp_cloud_param_report_sent(). The platform has just copied the
+ * value, so for strings its copy is hashed, being exactly what went out.
+ */
+void esp_cloud_shadow_snapshot_sent(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    esp_cloud_shadow_snapshot_t *snapshot = &handle->snapshot;
+    if (!snapshot->sent_hash) {
+        return;
+    }
+    esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+    if (param->val.type == CLOUD_PARAM_TYPE_STRING) {
+        esp_cloud_param_val_t val = {
+            .type = CLOUD_PARAM_TYPE_STRING,
+            .val.s = param->platform_buf,
+        };
+        snapshot->sent_hash[id] = esp_cloud_shadow_val_hash(&val);
+    } else {
+        snapshot->sent_hash[id] = esp_cloud_shadow_local_hash(handle, id, NULL);
+    }
+}
+
+/* Called through esp_cloud_param_report_acked() */
+void esp_cloud_shadow_snapshot_acked(esp_cloud_internal_handle_t *handle, esp_cloud_param_id_t id)
+{
+    esp_cloud_shadow_snapshot_t *snapshot = &handle->snapshot;
+    if (snapshot->acked_hash) {
+        snapshot->acked_hash[id] = snapshot->sent_hash[id];
+    }
+}
+
+/* Called by the platform with the version of every accepted update */
+void esp_cloud_shadow_set_version(esp_cloud_internal_handle_t *handle, uint32_t version)
+{
+    if (version > handle->snapshot.version) {
+        handle->snapshot.version = version;
+    }
+}
+
+/* Compare the shadow document returned by a GET against the local values, on
+ * connection. Params whose reported value differs are marked for reporting and the
+ * pending desired values are applied, all before the next report, so that they go
+ * out together. If the shadow was not written since the last update this device
+ * had accepted, the snapshot is compared against instead of parsing every value.
+ */
+esp_err_t esp_cloud_shadow_resync(esp_cloud_internal_handle_t *handle, char *doc, int doc_len)
+{
+    esp_cloud_shadow_snapshot_t *snapshot = &handle->snapshot;
+    if (!snapshot->acked_hash) {
+        return ESP_FAIL;
+    }
+    jparse_ctx_t jctx;
+    if (json_parse_start(&jctx, doc, doc_len) != OS_SUCCESS) {
+        ESP_LOGE(TAG, "Invalid shadow document");
+        return ESP_FAIL;
+    }
+    size_t str_size = 1;
+    esp_cloud_param_id_t id;
+    for (id = 0; id < handle->cur_dynamic_params_count; id++) {
+        esp_cloud_dynamic_param_t *param = &handle->dynamic_cloud_params[id];
+        if ((param->val.type == CLOUD_PARAM_TYPE_STRING) && (param->val.val_size > str_size)) {
+            str_size = param->val.val_size;
+        }
+    }
+    char *str_buf = esp_cloud_mem_malloc(str_size);
+    if (!str_buf) {
+        json_parse_end(&jctx);
+        return ESP_ERR_NO_MEM;
+    }
+    int version = 0;
+    json_obj_get_int(&jctx, "version", &version);
+    bool unchanged = snapshot->version && ((uint32_t)version == snapshot->version);
+    bool in_state = (json_obj_get_object(&jctx, "state") == OS_SUCCESS);
+    bool in_reported = !unchanged && in_state && (json_obj_get_object(&jctx, "reported") == OS_SUCCESS);
+    int differ = 0;
+    for (id = 0; id < handle->cur_dynamic_params_count; id++) {
+        if (!unchanged) {
+            esp_cloud_param_val_t cloud_val;
+            snapshot->acked_hash[id] = (in_reported &&
+                    (esp_cloud_shadow_get_val(&jctx, &handle->dynamic_cloud_params[id], &cloud_val, str_buf) == OS_SUCCESS)) ?
+                    esp_cloud_shadow_val_hash(&cloud_val) : 0;
+        }
+        if (esp_cloud_shadow_local_hash(handle, id, str_buf) != snapshot->acked_hash[id]) {
+            esp_cloud_mark_param_changed(handle, id, CLOUD_PARAM_FLAG_LOCAL_CHANGE);
+            differ++;
+        }
+    }
+    if (in_reported) {
+        json_obj_leave_object(&jctx);
+    }
+    int applied = 0;
+    if (in_state) {
+        if (json_obj_get_object(&jctx, "delta") == OS_SUCCESS) {
+            applied = esp_cloud_shadow_apply_obj(handle, &jctx, str_buf);
+            json_obj_leave_object(&jctx);
+        }
+        json_obj_leave_object(&jctx);
+    }
+    json_parse_end(&jctx);
+    free(str_buf);
+    if (version > 0) {
+        snapshot->version = version;
+    }
+    handle->coalesce.stats.resyncs++;
+    handle->coalesce.stats.resync_params += differ;
+    ESP_LOGI(TAG, "Shadow version %d%s: %d param(s) differ, %d desired applied", version,
+            unchanged ? " unchanged" : "", differ, applied);
+    return ESP_OK;
+}
+
+void esp_cloud_shadow_request_full_report(esp_cloud_internal_handle_t *handle)
+{
+    handle->coalesce.full_report = true;
+}
+
+bool esp_cloud_shadow_take_full_report(esp_cloud_internal_handle_t *handle)
+{
+    bool full_report = handle->coalesce.full_report;
+    handle->coalesce.full_report = false;
+    return full_report;
+}
+
+/* Whether anything is waiting to be reported */
+bool esp_cloud_shadow_changes_pending(esp_cloud_internal_handle_t *handle)
+{
+    return handle->coalesce.full_report || esp_cloud_has_changed_params(handle);
+}
+
+esp_err_t esp_cloud_get_shadow_stats(esp_cloud_handle_t handle, esp_cloud_shadow_stats_t *stats)
+{
+    if (!handle || !stats) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    memcpy(stats, &int_handle->coalesce.stats, sizeof(esp_cloud_shadow_stats_t));
+    return ESP_OK;
+}
+
+void esp_cloud_reset_shadow_stats(esp_cloud_handle_t handle)
+{
+    if (!handle) {
+        return;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    int_handle->coalesce.total_latency_ms = 0;
+    int_handle->coalesce.flush_count = 0;
+    int_handle->coalesce.total_ack_ms = 0;
+    memset(&int_handle->coalesce.stats, 0, sizeof(esp_cloud_shadow_stats_t));
+}
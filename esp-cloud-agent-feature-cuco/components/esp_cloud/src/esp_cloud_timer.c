@@ -0,0 +1,350 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+
+#include "esp_cloud.h"
+#include "esp_cloud_mem.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_timer";
+
+/* Resolution of the timer wheel */
+#define ESP_CLOUD_TIMER_TICK_MS     100
+/* Timers due within this much of an expiring timer are run along with it, so
+ * that they share a single wakeup and network burst
+ */
+#define ESP_CLOUD_TIMER_GROUP_MS    2000
+
+#define TIMER_SLOT_MASK             (ESP_CLOUD_TIMER_WHEEL_SLOTS - 1)
+#define TIMER_LEVEL_SHIFT(level)    ((level) * ESP_CLOUD_TIMER_WHEEL_BITS)
+#define TIMER_LEVEL_SPAN(level)     (1UL << TIMER_LEVEL_SHIFT(level))
+#define TIMER_MAX_TICKS             (TIMER_LEVEL_SPAN(ESP_CLOUD_TIMER_WHEEL_LEVELS) - 1)
+
+typedef enum {
+    TIMER_STATE_PENDING,
+    /* Queued on the work queue, or being run from there */
+    TIMER_STATE_RUNNING,
+    TIMER_STATE_CANCELLED,
+} esp_cloud_timer_state_t;
+
+struct esp_cloud_timer {
+    esp_cloud_work_fn_t work_fn;
+    void *priv_data;
+    esp_cloud_work_prio_t prio;
+    /* 0 for one shot timers */
+    uint32_t period_ticks;
+    uint32_t expires;
+    esp_cloud_timer_state_t state;
+    struct esp_cloud_timer *next;
+    struct esp_cloud_timer *prev;
+    /* Wheel slot holding the timer, NULL while it is running */
+    struct esp_cloud_timer **slot;
+};
+
+static uint32_t esp_cloud_timer_now_ticks(void)
+{
+    return (uint32_t)(esp_timer_get_time() / (1000 * ESP_CLOUD_TIMER_TICK_MS));
+}
+
+static uint32_t esp_cloud_timer_ms_to_ticks(uint32_t ms)
+{
+    uint32_t ticks = (ms + ESP_CLOUD_TIMER_TICK_MS - 1) / ESP_CLOUD_TIMER_TICK_MS;
+    return ticks ? ticks : 1;
+}
+
+/* Must be called with the wheel lock held */
+static void esp_cloud_timer_link(esp_cloud_timer_wheel_t *wheel, struct esp_cloud_timer *timer)
+{
+    uint32_t expires = timer->expires;
+    int32_t delta = (int32_t)(expires - wheel->cur_tick);
+    if (delta < 0) {
+        /* Already due. Goes into the slot processed next */
+        expires = wheel->cur_tick;
+        delta = 0;
+    } else if (delta > (int32_t)TIMER_MAX_TICKS) {
+        /* Beyond the range of the wheel. Parked in the farthest slot and
+         * re-inserted from there when it gets cascaded
+         */
+        expires = wheel->cur_tick + TIMER_MAX_TICKS;
+        delta = TIMER_MAX_TICKS;
+    }
+    int level;
+    for (level = 0; level < ESP_CLOUD_TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (int32_t)TIMER_LEVEL_SPAN(level + 1)) {
+            break;
+        }
+    }
+    struct esp_cloud_timer **slot =
+            &wheel->slots[level][(expires >> TIMER_LEVEL_SHIFT(level)) & TIMER_SLOT_MASK];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->state = TIMER_STATE_PENDING;
+    wheel->count++;
+}
+
+/* Must be called with the wheel lock held */
+static void esp_cloud_timer_unlink(esp_cloud_timer_wheel_t *wheel, struct esp_cloud_timer *timer)
+{
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = timer->prev = NULL;
+    timer->slot = NULL;
+    wheel->count--;
+}
+
+/* Move all timers of a higher level slot down to the levels below it */
+static void esp_cloud_timer_cascade(esp_cloud_timer_wheel_t *wheel, int level, int index)
+{
+    struct esp_cloud_timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer) {
+        struct esp_cloud_timer *next = timer->next;
+        wheel->count--;
+        esp_cloud_timer_link(wheel, timer);
+        timer = next;
+    }
+}
+
+/* Move the timers of a level 0 slot to the expired list. Must be called with the wheel lock held */
+static void esp_cloud_timer_expire_slot(esp_cloud_timer_wheel_t *wheel, int index,
+        struct esp_cloud_timer **expired)
+{
+    while (wheel->slots[0][index]) {
+        struct esp_cloud_timer *timer = wheel->slots[0][index];
+        esp_cloud_timer_unlink(wheel, timer);
+        timer->state = TIMER_STATE_RUNNING;
+        timer->next = *expired;
+        *expired = timer;
+    }
+}
+
+void esp_cloud_timer_init(esp_cloud_internal_handle_t *handle)
+{
+    esp_cloud_timer_wheel_t *wheel = &handle->timer_wheel;
+    vPortCPUInitializeMutex(&wheel->lock);
+    wheel->cur_tick = esp_cloud_timer_now_ticks();
+}
+
+static esp_err_t esp_cloud_timer_add(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio, uint32_t delay_ms,
+        uint32_t period_ms, esp_cloud_work_fn_t work_fn, void *priv_data, esp_cloud_timer_handle_t *timer_handle)
+{
+    if (!handle || !work_fn || (prio >= ESP_CLOUD_WORK_PRIO_MAX)) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    esp_cloud_timer_wheel_t *wheel = &int_handle->timer_wheel;
+    struct esp_cloud_timer *timer = esp_cloud_mem_calloc(1, sizeof(struct esp_cloud_timer));
+    if (!timer) {
+        ESP_LOGE(TAG, "Failed to allocate timer");
+        return ESP_ERR_NO_MEM;
+    }
+    timer->work_fn = work_fn;
+    timer->priv_data = priv_data;
+    timer->prio = prio;
+    timer->period_ticks = period_ms ? esp_cloud_timer_ms_to_ticks(period_ms) : 0;
+    timer->expires = esp_cloud_timer_now_ticks() + esp_cloud_timer_ms_to_ticks(delay_ms);
+
+    portENTER_CRITICAL(&wheel->lock);
+    esp_cloud_timer_link(wheel, timer);
+    portEXIT_CRITICAL(&wheel->lock);
+    if (timer_handle) {
+        *timer_handle = timer;
+    }
+    /* The cloud task may have to wake up earlier than it planned to */
+    esp_cloud_platform_wakeup(int_handle);
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_schedule_once(esp_cloud_handle_t handle, uint32_t delay_ms,
+        esp_cloud_work_fn_t work_fn, void *priv_data)
+{
+    return esp_cloud_timer_add(handle, ESP_CLOUD_WORK_PRIO_NORMAL, delay_ms, 0, work_fn, priv_data, NULL);
+}
+
+esp_err_t esp_cloud_schedule_periodic_with_prio(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio,
+        uint32_t period_ms, esp_cloud_work_fn_t work_fn, void *priv_data, esp_cloud_timer_handle_t *timer)
+{
+    if (period_ms == 0) {
+        return ESP_FAIL;
+    }
+    return esp_cloud_timer_add(handle, prio, period_ms, period_ms, work_fn, priv_data, timer);
+}
+
+esp_err_t esp_cloud_schedule_periodic(esp_cloud_handle_t handle, uint32_t period_ms,
+        esp_cloud_work_fn_t work_fn, void *priv_data, esp_cloud_timer_handle_t *timer)
+{
+    return esp_cloud_schedule_periodic_with_prio(handle, ESP_CLOUD_WORK_PRIO_NORMAL, period_ms, work_fn,
+            priv_data, timer);
+}
+
+esp_err_t esp_cloud_cancel_periodic(esp_cloud_handle_t handle, esp_cloud_timer_handle_t timer)
+{
+    if (!handle || !timer) {
+        return ESP_FAIL;
+    }
+    esp_cloud_timer_wheel_t *wheel = &((esp_cloud_internal_handle_t *)handle)->timer_wheel;
+    bool free_timer = false;
+    portENTER_CRITICAL(&wheel->lock);
+    if (timer->state == TIMER_STATE_PENDING) {
+        esp_cloud_timer_unlink(wheel, timer);
+        free_timer = true;
+    } else {
+        /* Queued or running right now. The cloud task frees it instead of running it again */
+        timer->state = TIMER_STATE_CANCELLED;
+    }
+    portEXIT_CRITICAL(&wheel->lock);
+    if (free_timer) {
+        free(timer);
+    }
+    return ESP_OK;
+}
+
+/* Time until the next timer expiry, in ms. Must be called with the wheel lock held */
+static uint32_t esp_cloud_timer_next_expiry_ms(esp_cloud_timer_wheel_t *wheel)
+{
+    uint32_t tick = wheel->cur_tick;
+    uint32_t ticks;
+    /* Level 0 holds the exact expiry of everything due within its span */
+    for (ticks = 0; ticks < ESP_CLOUD_TIMER_WHEEL_SLOTS; ticks++) {
+        if (wheel->slots[0][(tick + ticks) & TIMER_SLOT_MASK]) {
+            break;
+        }
+        /* Timers in the higher levels come down at the next level 0 wrap */
+        if (((tick + ticks + 1) & TIMER_SLOT_MASK) == 0) {
+            ticks++;
+            break;
+        }
+    }
+    uint64_t expiry_ms = (uint64_t)(tick + ticks) * ESP_CLOUD_TIMER_TICK_MS;
+    uint64_t now_ms = esp_timer_get_time() / 1000;
+    return (expiry_ms > now_ms) ? (uint32_t)(expiry_ms - now_ms) : 0;
+}
+
+/* Work queue entry of an expired timer */
+static void esp_cloud_timer_run(esp_cloud_handle_t handle, void *priv_data)
+{
+    struct esp_cloud_timer *timer = (struct esp_cloud_timer *)priv_data;
+    esp_cloud_timer_wheel_t *wheel = &((esp_cloud_internal_handle_t *)handle)->timer_wheel;
+    portENTER_CRITICAL(&wheel->lock);
+    bool cancelled = (timer->state == TIMER_STATE_CANCELLED);
+    portEXIT_CRITICAL(&wheel->lock);
+    if (!cancelled) {
+        timer->work_fn(handle, timer->priv_data);
+    }
+
+    bool free_timer = true;
+    portENTER_CRITICAL(&wheel->lock);
+    if (timer->period_ticks && (timer->state != TIMER_STATE_CANCELLED)) {
+        /* Periods are counted from the deadline, so that grouping does not make them drift */
+        timer->expires += timer->period_ticks;
+        esp_cloud_timer_link(wheel, timer);
+        free_timer = false;
+    }
+    portEXIT_CRITICAL(&wheel->lock);
+    if (free_timer) {
+        free(timer);
+    }
+}
+
+/* Queue the expired timers at their priority, so that they share the work time
+ * budget with everything else, and reduce *timeout_ms to the time until the next
+ * expiry. Called only from the cloud task.
+ */
+void esp_cloud_timer_process(esp_cloud_internal_handle_t *handle, uint32_t *timeout_ms)
+{
+    esp_cloud_timer_wheel_t *wheel = &handle->timer_wheel;
+    struct esp_cloud_timer *expired = NULL;
+    uint32_t now = esp_cloud_timer_now_ticks();
+
+    portENTER_CRITICAL(&wheel->lock);
+    if (wheel->count == 0) {
+        wheel->cur_tick = now + 1;
+        portEXIT_CRITICAL(&wheel->lock);
+        return;
+    }
+    while ((int32_t)(now - wheel->cur_tick) >= 0) {
+        int index = wheel->cur_tick & TIMER_SLOT_MASK;
+        if (index == 0) {
+            int level;
+            /* Cascade from the top, so that level 1 gets refilled before it is cascaded */
+            for (level = ESP_CLOUD_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+                uint32_t lower = wheel->cur_tick & (TIMER_LEVEL_SPAN(level) - 1);
+                if (lower == 0) {
+                    esp_cloud_timer_cascade(wheel, level,
+                            (wheel->cur_tick >> TIMER_LEVEL_SHIFT(level)) & TIMER_SLOT_MASK);
+                }
+            }
+        }
+        esp_cloud_timer_expire_slot(wheel, index, &expired);
+        wheel->cur_tick++;
+    }
+    if (expired) {
+        /* Pull in the timers due shortly, instead of waking up again for them */
+        uint32_t ticks;
+        for (ticks = 0; ticks < ESP_CLOUD_TIMER_GROUP_MS / ESP_CLOUD_TIMER_TICK_MS; ticks++) {
+            uint32_t tick = wheel->cur_tick + ticks;
+            if (ticks && ((tick & TIMER_SLOT_MASK) == 0)) {
+                /* Not cascaded yet */
+                break;
+            }
+            esp_cloud_timer_expire_slot(wheel, tick & TIMER_SLOT_MASK, &expired);
+        }
+    }
+    portEXIT_CRITICAL(&wheel->lock);
+
+    while (expired) {
+        struct esp_cloud_timer *timer = expired;
+        expired = timer->next;
+        timer->next = NULL;
+        if (esp_cloud_queue_work_with_prio((esp_cloud_handle_t)handle, timer->prio, esp_cloud_timer_run,
+                    timer) == ESP_OK) {
+            continue;
+        }
+        /* Queue full. A periodic timer skips this run, a one shot one is tried again on the next tick */
+        bool free_timer = false;
+        portENTER_CRITICAL(&wheel->lock);
+        if (timer->state == TIMER_STATE_CANCELLED) {
+            free_timer = true;
+        } else {
+            timer->expires = timer->period_ticks ? timer->expires + timer->period_ticks : wheel->cur_tick;
+            esp_cloud_timer_link(wheel, timer);
+        }
+        portEXIT_CRITICAL(&wheel->lock);
+        if (free_timer) {
+            free(timer);
+        }
+    }
+
+    portENTER_CRITICAL(&wheel->lock);
+    if (wheel->count) {
+        uint32_t next_ms = esp_cloud_timer_next_expiry_ms(wheel);
+        if (next_ms < *timeout_ms) {
+            *timeout_ms = next_ms;
+        }
+    }
+    portEXIT_CRITICAL(&wheel->lock);
+}
@@ -0,0 +1,355 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <esp_log.h>
+
+#include <esp_cloud_mem.h>
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_router";
+
+typedef struct esp_cloud_topic_handler {
+    esp_cloud_platform_subscribe_cb_t cb;
+    void *priv_data;
+    struct esp_cloud_topic_handler *next;
+} esp_cloud_topic_handler_t;
+
+/* One topic level. Filters are paths from the root, so "a/+/c" is the node "c"
+ * under "+" under "a". The full filter is kept only at nodes with handlers, and
+ * at retired ones.
+ */
+struct esp_cloud_topic_node {
+    struct esp_cloud_topic_node *parent;
+    struct esp_cloud_topic_node *children;
+    struct esp_cloud_topic_node *next;
+    esp_cloud_topic_handler_t *handlers;
+    char *filter;
+    char level[];
+};
+
+static bool esp_cloud_topic_level_is(const esp_cloud_topic_node_t *node, const char *level, size_t level_len)
+{
+    return (strncmp(node->level, level, level_len) == 0) && (node->level[level_len] == '\0');
+}
+
+static esp_cloud_topic_node_t *esp_cloud_topic_node_find(esp_cloud_topic_node_t *parent, const char *level,
+        size_t level_len)
+{
+    esp_cloud_topic_node_t *child;
+    for (child = parent->children; child; child = child->next) {
+        if (esp_cloud_topic_level_is(child, level, level_len)) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+static esp_cloud_topic_node_t *esp_cloud_topic_node_new(esp_cloud_topic_node_t *parent, const char *level,
+        size_t level_len)
+{
+    esp_cloud_topic_node_t *node = esp_cloud_mem_calloc(1, sizeof(esp_cloud_topic_node_t) + level_len + 1);
+    if (!node) {
+        return NULL;
+    }
+    memcpy(node->level, level, level_len);
+    if (parent) {
+        node->parent = parent;
+        node->next = parent->children;
+        parent->children = node;
+    }
+    return node;
+}
+
+/* Free nodes from this one up which no longer lead to any filter */
+static void esp_cloud_topic_node_prune(esp_cloud_topic_router_t *router, esp_cloud_topic_node_t *node)
+{
+    while (node && (node != router->root) && !node->filter && !node->children) {
+        esp_cloud_topic_node_t *parent = node->parent;
+        esp_cloud_topic_node_t **link = &parent->children;
+        while (*link != node) {
+            link = &(*link)->next;
+        }
+        *link = node->next;
+        free(node->filter);
+        free(node);
+        node = parent;
+    }
+}
+
+bool esp_cloud_topic_filter_is_valid(const char *filter)
+{
+    if (!filter || !filter[0]) {
+        return false;
+    }
+    const char *level = filter;
+    while (1) {
+        const char *end = strchr(level, '/');
+        size_t level_len = end ? (size_t)(end - level) : strlen(level);
+        const char *wildcard = strpbrk(level, "+#");
+        if (wildcard && (wildcard < level + level_len)) {
+            /* A wildcard takes up a whole level, and '#' can only be the last one */
+            if (level_len != 1) {
+                return false;
+            }
+            if ((*wildcard == '#') && end) {
+                return false;
+            }
+        }
+        if (!end) {
+            return true;
+        }
+        level = end + 1;
+    }
+}
+
+esp_err_t esp_cloud_topic_router_add(esp_cloud_topic_router_t *router, const char *filter,
+        esp_cloud_platform_subscribe_cb_t cb, void *priv_data, esp_cloud_topic_node_t **node_out, bool *new_filter)
+{
+    if (!router || !cb || !esp_cloud_topic_filter_is_valid(filter)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (router->dispatching) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!router->root) {
+        router->root = esp_cloud_topic_node_new(NULL, "", 0);
+        if (!router->root) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    esp_cloud_topic_node_t *node = router->root;
+    const char *level = filter;
+    while (1) {
+        const char *end = strchr(level, '/');
+        size_t level_len = end ? (size_t)(end - level) : strlen(level);
+        esp_cloud_topic_node_t *child = esp_cloud_topic_node_find(node, level, level_len);
+        if (!child) {
+            child = esp_cloud_topic_node_new(node, level, level_len);
+            if (!child) {
+                esp_cloud_topic_node_prune(router, node);
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        node = child;
+        if (!end) {
+            break;
+        }
+        level = end + 1;
+    }
+    bool added = false;
+    esp_cloud_topic_handler_t *handler;
+    for (handler = node->handlers; handler; handler = handler->next) {
+        if ((handler->cb == cb) && (handler->priv_data == priv_data)) {
+            break;
+        }
+    }
+    if (!handler) {
+        handler = esp_cloud_mem_calloc(1, sizeof(esp_cloud_topic_handler_t));
+        if (!handler) {
+            esp_cloud_topic_node_prune(router, node);
+            return ESP_ERR_NO_MEM;
+        }
+        if (!node->filter) {
+            node->filter = strdup(filter);
+            if (!node->filter) {
+                free(handler);
+                esp_cloud_topic_node_prune(router, node);
+                return ESP_ERR_NO_MEM;
+            }
+            added = true;
+            router->filter_count++;
+        }
+        handler->cb = cb;
+        handler->priv_data = priv_data;
+        handler->next = node->handlers;
+        node->handlers = handler;
+    }
+    if (new_filter) {
+        *new_filter = added;
+    }
+    if (node_out) {
+        *node_out = node;
+    }
+    return ESP_OK;
+}
+
+static esp_cloud_topic_node_t *esp_cloud_topic_router_find(esp_cloud_topic_router_t *router, const char *filter)
+{
+    esp_cloud_topic_node_t *node = router->root;
+    const char *level = filter;
+    while (node) {
+        const char *end = strchr(level, '/');
+        size_t level_len = end ? (size_t)(end - level) : strlen(level);
+        node = esp_cloud_topic_node_find(node, level, level_len);
+        if (!end) {
+            break;
+        }
+        level = end + 1;
+    }
+    return (node && node->filter) ? node : NULL;
+}
+
+static void esp_cloud_topic_node_drop_handlers(esp_cloud_topic_node_t *node)
+{
+    while (node->handlers) {
+        esp_cloud_topic_handler_t *handler = node->handlers;
+        node->handlers = handler->next;
+        free(handler);
+    }
+}
+
+esp_err_t esp_cloud_topic_router_remove(esp_cloud_topic_router_t *router, const char *filter)
+{
+    if (!router || !filter) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (router->dispatching) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_cloud_topic_node_t *node = esp_cloud_topic_router_find(router, filter);
+    if (!node) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_cloud_topic_node_drop_handlers(node);
+    free(node->filter);
+    node->filter = NULL;
+    router->filter_count--;
+    esp_cloud_topic_node_prune(router, node);
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_topic_router_retire(esp_cloud_topic_router_t *router, const char *filter)
+{
+    if (!router || !filter) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (router->dispatching) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_cloud_topic_node_t *node = esp_cloud_topic_router_find(router, filter);
+    if (!node) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_cloud_topic_node_drop_handlers(node);
+    return ESP_OK;
+}
+
+int esp_cloud_topic_router_deliver(esp_cloud_topic_node_t *node, const char *topic, void *payload,
+        size_t payload_len)
+{
+    int count = 0;
+    esp_cloud_topic_handler_t *handler;
+    for (handler = node->handlers; handler; handler = handler->next) {
+        handler->cb(topic, payload, payload_len, handler->priv_data);
+        count++;
+    }
+    return count;
+}
+
+static int esp_cloud_topic_router_match(esp_cloud_topic_node_t *node, const char *level, const char *topic,
+        void *payload, size_t payload_len)
+{
+    const char *end = strchr(level, '/');
+    size_t level_len = end ? (size_t)(end - level) : strlen(level);
+    /* Wildcards at the first level do not match the reserved "$..." topics */
+    bool reserved = (level == topic) && (level[0] == '$');
+    int count = 0;
+    esp_cloud_topic_node_t *child;
+    for (child = node->children; child; child = child->next) {
+        bool multi = esp_cloud_topic_level_is(child, "#", 1);
+        bool single = esp_cloud_topic_level_is(child, "+", 1);
+        if ((multi || single) && reserved) {
+            continue;
+        }
+        if (multi) {
+            count += esp_cloud_topic_router_deliver(child, topic, payload, payload_len);
+        } else if (single || esp_cloud_topic_level_is(child, level, level_len)) {
+            if (end) {
+                count += esp_cloud_topic_router_match(child, end + 1, topic, payload, payload_len);
+                continue;
+            }
+            count += esp_cloud_topic_router_deliver(child, topic, payload, payload_len);
+            /* "a/#" also matches "a" */
+            esp_cloud_topic_node_t *parent_multi = esp_cloud_topic_node_find(child, "#", 1);
+            if (parent_multi) {
+                count += esp_cloud_topic_router_deliver(parent_multi, topic, payload, payload_len);
+            }
+        }
+    }
+    return count;
+}
+
+int esp_cloud_topic_router_dispatch(esp_cloud_topic_router_t *router, const char *topic, void *payload,
+        size_t payload_len)
+{
+    if (!router || !router->root || !topic) {
+        return 0;
+    }
+    router->dispatching = true;
+    int count = esp_cloud_topic_router_match(router->root, topic, topic, payload, payload_len);
+    router->dispatching = false;
+    if (count == 0) {
+        ESP_LOGD(TAG, "No subscription for %s", topic);
+    }
+    return count;
+}
+
+const char *esp_cloud_topic_router_node_filter(const esp_cloud_topic_node_t *node)
+{
+    return node ? node->filter : NULL;
+}
+
+static void esp_cloud_topic_node_foreach(esp_cloud_topic_node_t *node, esp_cloud_topic_router_foreach_cb_t fn,
+        void *priv_data)
+{
+    esp_cloud_topic_node_t *child;
+    for (child = node->children; child; child = child->next) {
+        if (child->filter) {
+            fn(child->filter, child, priv_data);
+        }
+        esp_cloud_topic_node_foreach(child, fn, priv_data);
+    }
+}
+
+void esp_cloud_topic_router_foreach(esp_cloud_topic_router_t *router, esp_cloud_topic_router_foreach_cb_t fn,
+        void *priv_data)
+{
+    if (!router || !router->root || !fn) {
+        return;
+    }
+    esp_cloud_topic_node_foreach(router->root, fn, priv_data);
+}
+
+static void esp_cloud_topic_node_free(esp_cloud_topic_node_t *node)
+{
+    while (node->children) {
+        esp_cloud_topic_node_t *child = node->children;
+        node->children = child->next;
+        esp_cloud_topic_node_free(child);
+    }
+    esp_cloud_topic_node_drop_handlers(node);
+    free(node->filter);
+    free(node);
+}
+
+void esp_cloud_topic_router_clear(esp_cloud_topic_router_t *router)
+{
+    if (!router || !router->root) {
+        return;
+    }
+    esp_cloud_topic_node_free(router->root);
+    router->root = NULL;
+    router->filter_count = 0;
+}
@@ -0,0 +1,113 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+#include "app_prov_handlers.h"
+
+static const char *TAG = "esp_cloud_topics";
+
+static const char *esp_cloud_device_topic_suffix[] = {
+    [ESP_CLOUD_TOPIC_INFO] = "device/info",
+    [ESP_CLOUD_TOPIC_OTA_STATUS] = "device/otastatus",
+    [ESP_CLOUD_TOPIC_DIAGNOSTICS] = "device/diagnostics",
+    [ESP_CLOUD_TOPIC_USER_ASSOC] = "device/user/mapping",
+};
+
+/* Called by esp_cloud_init(), once the arena is there */
+esp_err_t esp_cloud_topics_init(esp_cloud_internal_handle_t *handle)
+{
+    size_t device_id_len = strlen(handle->device_id);
+    int id;
+    for (id = 0; id < ESP_CLOUD_TOPIC_APP; id++) {
+        size_t suffix_len = strlen(esp_cloud_device_topic_suffix[id]);
+        esp_cloud_topic_t *topic = &handle->topics[id];
+        topic->len = device_id_len + 1 + suffix_len;
+        topic->str = esp_cloud_mem_arena_alloc(handle->arena, topic->len + 1);
+        if (!topic->str) {
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(topic->str, handle->device_id, device_id_len);
+        topic->str[device_id_len] = '/';
+        memcpy(topic->str + device_id_len + 1, esp_cloud_device_topic_suffix[id], suffix_len + 1);
+    }
+    handle->app_topic_stale = true;
+    return ESP_OK;
+}
+
+/* Reads the app topic from storage, unless the one held is still current. Only
+ * the cloud task calls this. The topic swapped out, if any, is handed back in
+ * *old_topic, for the caller to unsubscribe from and free.
+ */
+esp_err_t esp_cloud_topics_load_app(esp_cloud_internal_handle_t *handle, char **old_topic)
+{
+    esp_cloud_topic_t *topic = &handle->topics[ESP_CLOUD_TOPIC_APP];
+    *old_topic = NULL;
+    if (topic->str && !handle->app_topic_stale) {
+        return ESP_OK;
+    }
+    /* A failed read keeps whatever topic there was. The cloud task marks it stale
+     * again when it retries the subscription.
+     */
+    handle->app_topic_stale = false;
+    char *str = custom_config_storage_get("app_topic");
+    if (!str) {
+        return ESP_FAIL;
+    }
+    size_t len = strlen(str);
+    portENTER_CRITICAL(&handle->param_lock);
+    char *old = topic->str;
+    topic->str = str;
+    topic->len = len;
+    portEXIT_CRITICAL(&handle->param_lock);
+    *old_topic = old;
+    ESP_LOGI(TAG, "App topic %s", str);
+    return ESP_OK;
+}
+
+/* The device topics are returned as they are. The app topic may be replaced at
+ * any time, so it is copied to buf.
+ */
+const char *esp_cloud_topic_get(esp_cloud_internal_handle_t *handle, esp_cloud_topic_id_t id, char *buf,
+        size_t buf_size)
+{
+    if (id < ESP_CLOUD_TOPIC_APP) {
+        return handle->topics[id].str;
+    }
+    if (id != ESP_CLOUD_TOPIC_APP) {
+        return NULL;
+    }
+    const char *ret = NULL;
+    esp_cloud_topic_t *topic = &handle->topics[ESP_CLOUD_TOPIC_APP];
+    portENTER_CRITICAL(&handle->param_lock);
+    if (topic->str && (topic->len < buf_size)) {
+        memcpy(buf, topic->str, topic->len + 1);
+        ret = buf;
+    }
+    portEXIT_CRITICAL(&handle->param_lock);
+    return ret;
+}
+
+void esp_cloud_app_topic_changed(esp_cloud_handle_t handle)
+{
+    if (!handle) {
+        return;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    int_handle->app_topic_stale = true;
+    esp_cloud_notify(handle);
+}
@@ -0,0 +1,142 @@
+// Copyright 2019 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <esp_log.h>
+
+#include "esp_cloud.h"
+#include "esp_cloud_platform.h"
+
+static const char *TAG = "esp_cloud_work";
+
+/* Time after which the cloud task stops running work and goes back to servicing
+ * MQTT. Urgent work queued meanwhile is still picked before the remaining bulk work.
+ */
+#define ESP_CLOUD_WORK_BUDGET_MS    20
+
+static const UBaseType_t esp_cloud_work_queue_size[ESP_CLOUD_WORK_PRIO_MAX] = {
+    [ESP_CLOUD_WORK_PRIO_URGENT] = 4,
+    [ESP_CLOUD_WORK_PRIO_NORMAL] = 8,
+    [ESP_CLOUD_WORK_PRIO_BULK] = 8,
+};
+
+esp_err_t esp_cloud_work_queue_init(esp_cloud_internal_handle_t *handle)
+{
+    int prio;
+    for (prio = 0; prio < ESP_CLOUD_WORK_PRIO_MAX; prio++) {
+        handle->work_queues[prio] = xQueueCreate(esp_cloud_work_queue_size[prio],
+                sizeof(esp_cloud_work_queue_entry_t));
+        if (!handle->work_queues[prio]) {
+            esp_cloud_work_queue_deinit(handle);
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+void esp_cloud_work_queue_deinit(esp_cloud_internal_handle_t *handle)
+{
+    int prio;
+    for (prio = 0; prio < ESP_CLOUD_WORK_PRIO_MAX; prio++) {
+        if (handle->work_queues[prio]) {
+            vQueueDelete(handle->work_queues[prio]);
+            handle->work_queues[prio] = NULL;
+        }
+    }
+}
+
+esp_err_t esp_cloud_queue_work_with_prio(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio,
+        esp_cloud_work_fn_t work_fn, void *priv_data)
+{
+    if (!handle || !work_fn || (prio >= ESP_CLOUD_WORK_PRIO_MAX)) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *) handle;
+    esp_cloud_work_queue_entry_t work_queue_entry = {
+        .work_fn = work_fn,
+        .priv_data = priv_data,
+        .queued_ms = esp_cloud_time_ms(),
+    };
+    esp_cloud_work_stats_t *stats = &int_handle->work_stats[prio];
+    if (xQueueSend(int_handle->work_queues[prio], &work_queue_entry, 0) != pdTRUE) {
+        __atomic_fetch_add(&stats->dropped, 1, __ATOMIC_RELAXED);
+        ESP_LOGW(TAG, "Work queue %d full. Dropping work", prio);
+        return ESP_ERR_NO_MEM;
+    }
+    __atomic_fetch_add(&stats->enqueued, 1, __ATOMIC_RELAXED);
+    esp_cloud_platform_wakeup(int_handle);
+    return ESP_OK;
+}
+
+esp_err_t esp_cloud_queue_work(esp_cloud_handle_t handle, esp_cloud_work_fn_t work_fn, void *priv_data)
+{
+    return esp_cloud_queue_work_with_prio(handle, ESP_CLOUD_WORK_PRIO_NORMAL, work_fn, priv_data);
+}
+
+/* Run queued work, highest priority first, until the queues are empty or the
+ * time budget is used up. Returns true if work is still pending.
+ */
+bool esp_cloud_handle_work_queue(esp_cloud_internal_handle_t *handle)
+{
+    if (!handle) {
+        return false;
+    }
+    uint32_t start_ms = esp_cloud_time_ms();
+    while (1) {
+        esp_cloud_work_queue_entry_t work_queue_entry;
+        int prio;
+        /* Checked again after every item, so that urgent work queued by the
+         * previous item does not wait behind bulk work
+         */
+        for (prio = 0; prio < ESP_CLOUD_WORK_PRIO_MAX; prio++) {
+            if (xQueueReceive(handle->work_queues[prio], &work_queue_entry, 0) == pdTRUE) {
+                break;
+            }
+        }
+        if (prio == ESP_CLOUD_WORK_PRIO_MAX) {
+            return false;
+        }
+        uint32_t now = esp_cloud_time_ms();
+        uint32_t wait_ms = now - work_queue_entry.queued_ms;
+        esp_cloud_work_stats_t *stats = &handle->work_stats[prio];
+        stats->executed++;
+        handle->work_total_wait_ms[prio] += wait_ms;
+        stats->avg_wait_ms = handle->work_total_wait_ms[prio] / stats->executed;
+        if (wait_ms > stats->max_wait_ms) {
+            stats->max_wait_ms = wait_ms;
+        }
+        work_queue_entry.work_fn((esp_cloud_handle_t)handle, work_queue_entry.priv_data);
+
+        if ((esp_cloud_time_ms() - start_ms) >= ESP_CLOUD_WORK_BUDGET_MS) {
+            for (prio = 0; prio < ESP_CLOUD_WORK_PRIO_MAX; prio++) {
+                if (uxQueueMessagesWaiting(handle->work_queues[prio])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+}
+
+esp_err_t esp_cloud_get_work_stats(esp_cloud_handle_t handle, esp_cloud_work_prio_t prio,
+        esp_cloud_work_stats_t *stats)
+{
+    if (!handle || !stats || (prio >= ESP_CLOUD_WORK_PRIO_MAX)) {
+        return ESP_FAIL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *) handle;
+    memcpy(stats, &int_handle->work_stats[prio], sizeof(esp_cloud_work_stats_t));
+    return ESP_OK;
+}
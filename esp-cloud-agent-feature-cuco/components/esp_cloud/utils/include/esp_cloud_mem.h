@@ -23,3 +23,19 @@ char *esp_cloud_mem_strdup(const char *str);
 void *esp_cloud_mem_alloc_dma(int n, int size);
 
 void esp_cloud_mem_free(void *ptr);
+
+/* Arena for allocations which live as long as the ESP Cloud handle.
+ * Allocations are carved out of large chunks and are released together when
+ * the arena is destroyed. Not thread safe.
+ */
+typedef struct esp_cloud_mem_arena esp_cloud_mem_arena_t;
+
+esp_cloud_mem_arena_t *esp_cloud_mem_arena_create(size_t size);
+void *esp_cloud_mem_arena_alloc(esp_cloud_mem_arena_t *arena, size_t size);
+char *esp_cloud_mem_arena_strdup(esp_cloud_mem_arena_t *arena, const char *str);
+/* Bytes handed out, including alignment padding */
+size_t esp_cloud_mem_arena_used(esp_cloud_mem_arena_t *arena);
+/* Bytes taken from the heap, including the chunk headers */
+size_t esp_cloud_mem_arena_size(esp_cloud_mem_arena_t *arena);
+int esp_cloud_mem_arena_chunks(esp_cloud_mem_arena_t *arena);
+void esp_cloud_mem_arena_destroy(esp_cloud_mem_arena_t *arena);
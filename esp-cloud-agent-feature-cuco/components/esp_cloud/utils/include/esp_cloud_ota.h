@@ -75,6 +75,26 @@ esp_err_t esp_cloud_enable_ota(esp_cloud_handle_t handle, esp_cloud_ota_callback
  * @return error on failure
  */
 esp_err_t esp_cloud_report_ota_status(esp_cloud_ota_handle_t ota_handle, ota_status_t status, char *additional_info);
+/** Get the OTA Server Certificate
+ *
+ * Returns the "ota_server_cert" read from the ESP Cloud storage by esp_cloud_init(),
+ * so that the OTA callback need not read and free its own copy.
+ * The certificate stays valid until esp_cloud_ota_release_server_cert() is called, even if
+ * the credentials are reloaded in the meantime.
+ *
+ * @param[in] handle The ESP Cloud handle
+ *
+ * @return NULL terminated PEM certificate, owned by ESP Cloud. Do not free it.
+ * @return NULL if the certificate is absent
+ */
+const char *esp_cloud_ota_get_server_cert(esp_cloud_handle_t handle);
+/** Release the OTA Server Certificate
+ *
+ * To be called once the OTA is done with a certificate returned by esp_cloud_ota_get_server_cert().
+ *
+ * @param[in] handle The ESP Cloud handle
+ */
+void esp_cloud_ota_release_server_cert(esp_cloud_handle_t handle);
 esp_err_t esp_cloud_ota_check(esp_cloud_handle_t handle, void *priv_data);
 esp_err_t app_publish_ota(char *url,int file_size,char * ota_version);
 void user_ota_cb(void *payload, size_t payload_len);
@@ -12,14 +12,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <stdint.h>
+#include <string.h>
 #include <json_parser.h>
 #include <json_generator.h>
 #include <esp_log.h>
 #include <esp_system.h>
 #include <esp_cloud.h>
 #include <esp_cloud_ota.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/timers.h>
 
 #include "esp_cloud_mem.h"
 #include "esp_cloud_internal.h"
@@ -27,12 +26,10 @@
 
 static const char *TAG = "esp_cloud_diagnostics";
 
-#define DIAGNOSTICS_TOPIC_SUFFIX     "device/diagnostics"
-
 typedef struct esp_cloud_diag_entry {
     esp_cloud_work_fn_t work_fn;
     uint32_t period_seconds;
-    TimerHandle_t timer;
+    esp_cloud_timer_handle_t timer;
     void *priv_data;
     struct esp_cloud_diag_entry *next;
 } esp_cloud_diag_entry_t;
@@ -51,9 +48,15 @@ static void esp_cloud_diagnostics_first_call(esp_cloud_handle_t handle, void *pr
         return;
     }
     esp_cloud_diag_entry_t *entry = (esp_cloud_diag_entry_t *)priv_data;
-    esp_cloud_queue_work(handle, entry->work_fn, entry->priv_data);
-    /* Start timer here so that the function is called periodically */
-    xTimerStart(entry->timer, 0);
+    entry->work_fn(handle, entry->priv_data);
+    /* Start timer here so that the function is called periodically. Handlers with
+     * close deadlines are queued together by the cloud task's timer wheel, as bulk
+     * work so that they do not hold up command handling.
+     */
+    if (esp_cloud_schedule_periodic_with_prio(handle, ESP_CLOUD_WORK_PRIO_BULK, entry->period_seconds * 1000,
+                entry->work_fn, entry->priv_data, &entry->timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to schedule periodic diagnostics handler");
+    }
 }
 
 static esp_err_t esp_cloud_diagnostics_add_entry(esp_cloud_diag_entry_t *new_entry)
@@ -61,13 +64,15 @@ static esp_err_t esp_cloud_diagnostics_add_entry(esp_cloud_diag_entry_t *new_ent
     esp_cloud_diag_entry_t *entry = esp_cloud_diag_first_entry;
     if (!entry) {
         esp_cloud_diag_first_entry = new_entry;
-        return esp_cloud_queue_work(esp_cloud_get_handle(), esp_cloud_diagnostics_first_call, (void *)new_entry);
+        return esp_cloud_queue_work_with_prio(esp_cloud_get_handle(), ESP_CLOUD_WORK_PRIO_BULK,
+                esp_cloud_diagnostics_first_call, (void *)new_entry);
     }
     while (entry->next) {
         entry = entry->next;
     }
     entry->next = new_entry;
-    return esp_cloud_queue_work(esp_cloud_get_handle(), esp_cloud_diagnostics_first_call, (void *)new_entry);
+    return esp_cloud_queue_work_with_prio(esp_cloud_get_handle(), ESP_CLOUD_WORK_PRIO_BULK,
+            esp_cloud_diagnostics_first_call, (void *)new_entry);
 }
 
 esp_err_t esp_cloud_diagnostics_send_data(esp_cloud_handle_t handle, char *data)
@@ -76,10 +81,8 @@ esp_err_t esp_cloud_diagnostics_send_data(esp_cloud_handle_t handle, char *data)
         return ESP_FAIL;
     }
     esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
-    char publish_topic[100];
 
-    snprintf(publish_topic, sizeof(publish_topic), "%s/%s", int_handle->device_id, DIAGNOSTICS_TOPIC_SUFFIX);
-    esp_err_t err = esp_cloud_platform_publish(int_handle, publish_topic, data);
+    esp_err_t err = esp_cloud_platform_publish_id(int_handle, ESP_CLOUD_TOPIC_DIAGNOSTICS, data, strlen(data));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_cloud_platform_publish_data returned error %d", err);
     }
@@ -112,21 +115,15 @@ esp_err_t esp_cloud_diagnostics_add_data(esp_cloud_handle_t handle, char *data,
     if (diag_data) {
         diag_data->data = data;
         diag_data->free_on_report = free_on_report;
-        if (esp_cloud_queue_work(handle, esp_cloud_diagnostics_send_data_queue_fn, diag_data) == ESP_OK) {
+        if (esp_cloud_queue_work_with_prio(handle, ESP_CLOUD_WORK_PRIO_BULK,
+                    esp_cloud_diagnostics_send_data_queue_fn, diag_data) == ESP_OK) {
             return ESP_OK;
         }
+        free(diag_data);
     }
     return ESP_FAIL;
 }
 
-static void esp_cloud_diagnostics_common_cb(TimerHandle_t handle)
-{
-    esp_cloud_diag_entry_t *entry = (esp_cloud_diag_entry_t *)pvTimerGetTimerID(handle);
-    if (entry) {
-        esp_cloud_queue_work(esp_cloud_get_handle(), entry->work_fn, entry->priv_data);
-    }
-}
-
 esp_err_t esp_cloud_diagnostics_register_periodic_handler(esp_cloud_handle_t handle,
         esp_cloud_work_fn_t work_fn, uint32_t period_seconds, void *priv_data)
 {
@@ -140,11 +137,6 @@ esp_err_t esp_cloud_diagnostics_register_periodic_handler(esp_cloud_handle_t han
     diag_entry->work_fn = work_fn;
     diag_entry->period_seconds = period_seconds;
     diag_entry->priv_data = priv_data;
-    diag_entry->timer = xTimerCreate("test", (period_seconds * 1000)/ portTICK_PERIOD_MS, pdTRUE, (void *)diag_entry, esp_cloud_diagnostics_common_cb);
-    if (!diag_entry->timer) {
-        free(diag_entry);
-        return ESP_FAIL;
-    }
     return esp_cloud_diagnostics_add_entry(diag_entry);
 }
 
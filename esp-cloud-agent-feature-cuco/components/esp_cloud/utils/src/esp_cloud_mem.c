@@ -17,6 +17,7 @@
 #include <string.h>
 #include <sdkconfig.h>
 #include <esp_heap_caps.h>
+#include "esp_cloud_mem.h"
 
 void *esp_cloud_mem_malloc(int size)
 {
@@ -81,3 +82,121 @@ void esp_cloud_mem_free(void *ptr)
 {
     free(ptr);
 }
+
+#if CONFIG_ESP_CLOUD_ARENA_USE_SPIRAM
+#define ESP_CLOUD_ARENA_CAPS    (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define ESP_CLOUD_ARENA_CAPS    (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+#ifdef CONFIG_ESP_CLOUD_ARENA_CHUNK_SIZE
+#define ESP_CLOUD_ARENA_CHUNK_SIZE  CONFIG_ESP_CLOUD_ARENA_CHUNK_SIZE
+#else
+#define ESP_CLOUD_ARENA_CHUNK_SIZE  1024
+#endif
+#define ESP_CLOUD_ARENA_ALIGN       8
+#define ESP_CLOUD_ARENA_ROUND(x)    (((x) + ESP_CLOUD_ARENA_ALIGN - 1) & ~(ESP_CLOUD_ARENA_ALIGN - 1))
+
+typedef struct esp_cloud_mem_arena_chunk {
+    struct esp_cloud_mem_arena_chunk *next;
+    size_t size;
+    size_t used;
+} esp_cloud_mem_arena_chunk_t;
+
+#define ESP_CLOUD_ARENA_CHUNK_HDR   ESP_CLOUD_ARENA_ROUND(sizeof(esp_cloud_mem_arena_chunk_t))
+
+struct esp_cloud_mem_arena {
+    /* Most recently added chunk first. Only that one is allocated from */
+    esp_cloud_mem_arena_chunk_t *chunks;
+    size_t used;
+    size_t size;
+    int chunk_count;
+};
+
+static esp_cloud_mem_arena_chunk_t *esp_cloud_mem_arena_add_chunk(esp_cloud_mem_arena_t *arena, size_t size)
+{
+    esp_cloud_mem_arena_chunk_t *chunk = heap_caps_calloc(1, ESP_CLOUD_ARENA_CHUNK_HDR + size, ESP_CLOUD_ARENA_CAPS);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->size += ESP_CLOUD_ARENA_CHUNK_HDR + size;
+    arena->chunk_count++;
+    return chunk;
+}
+
+esp_cloud_mem_arena_t *esp_cloud_mem_arena_create(size_t size)
+{
+    esp_cloud_mem_arena_t *arena = esp_cloud_mem_calloc(1, sizeof(esp_cloud_mem_arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    if (!esp_cloud_mem_arena_add_chunk(arena, ESP_CLOUD_ARENA_ROUND(size))) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+/* Returns zeroed memory. If the initial size was underestimated, the arena
+ * grows by another chunk instead of failing.
+ */
+void *esp_cloud_mem_arena_alloc(esp_cloud_mem_arena_t *arena, size_t size)
+{
+    if (!arena) {
+        return NULL;
+    }
+    size = ESP_CLOUD_ARENA_ROUND(size);
+    esp_cloud_mem_arena_chunk_t *chunk = arena->chunks;
+    if ((chunk->size - chunk->used) < size) {
+        chunk = esp_cloud_mem_arena_add_chunk(arena,
+                (size > ESP_CLOUD_ARENA_CHUNK_SIZE) ? size : ESP_CLOUD_ARENA_CHUNK_SIZE);
+        if (!chunk) {
+            return NULL;
+        }
+    }
+    void *ptr = (uint8_t *)chunk + ESP_CLOUD_ARENA_CHUNK_HDR + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return ptr;
+}
+
+char *esp_cloud_mem_arena_strdup(esp_cloud_mem_arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = esp_cloud_mem_arena_alloc(arena, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+size_t esp_cloud_mem_arena_used(esp_cloud_mem_arena_t *arena)
+{
+    return arena ? arena->used : 0;
+}
+
+size_t esp_cloud_mem_arena_size(esp_cloud_mem_arena_t *arena)
+{
+    return arena ? arena->size : 0;
+}
+
+int esp_cloud_mem_arena_chunks(esp_cloud_mem_arena_t *arena)
+{
+    return arena ? arena->chunk_count : 0;
+}
+
+void esp_cloud_mem_arena_destroy(esp_cloud_mem_arena_t *arena)
+{
+    if (!arena) {
+        return;
+    }
+    esp_cloud_mem_arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        esp_cloud_mem_arena_chunk_t *next = chunk->next;
+        heap_caps_free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
@@ -33,7 +33,6 @@ static const char *TAG = "esp_cloud_ota";
 
 #define OTAURL_TOPIC_SUFFIX     "device/otaurl"
 #define OTAFETCH_TOPIC_SUFFIX   "device/otafetch"
-#define OTASTATUS_TOPIC_SUFFIX  "device/otastatus"
 
 typedef struct {
     esp_cloud_handle_t handle;
@@ -63,6 +62,30 @@ static char *ota_status_to_string(ota_status_t status)
     return "invalid";
 }
 
+const char *esp_cloud_ota_get_server_cert(esp_cloud_handle_t handle)
+{
+    if (!handle) {
+        return NULL;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (!int_handle->creds.ota_server_cert) {
+        return NULL;
+    }
+    __atomic_add_fetch(&int_handle->ota_cert_users, 1, __ATOMIC_SEQ_CST);
+    return int_handle->creds.ota_server_cert;
+}
+
+void esp_cloud_ota_release_server_cert(esp_cloud_handle_t handle)
+{
+    if (!handle) {
+        return;
+    }
+    esp_cloud_internal_handle_t *int_handle = (esp_cloud_internal_handle_t *)handle;
+    if (__atomic_load_n(&int_handle->ota_cert_users, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&int_handle->ota_cert_users, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
 esp_err_t esp_cloud_report_ota_status(esp_cloud_ota_handle_t ota_handle, ota_status_t status, char *additional_info)
 {
     if (!ota_handle) {
@@ -81,9 +104,8 @@ esp_err_t esp_cloud_report_ota_status(esp_cloud_ota_handle_t ota_handle, ota_sta
     json_end_object(&jstr);
     json_str_end(&jstr);
 
-    char publish_topic[100];
-    snprintf(publish_topic, sizeof(publish_topic), "%s/%s", int_handle->device_id, OTASTATUS_TOPIC_SUFFIX);
-    esp_err_t err = esp_cloud_platform_publish(int_handle, publish_topic, publish_payload);
+    esp_err_t err = esp_cloud_platform_publish_id(int_handle, ESP_CLOUD_TOPIC_OTA_STATUS, publish_payload,
+            strlen(publish_payload));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_cloud_platform_publish_data returned error %d",err);
         return ESP_FAIL;
@@ -23,8 +23,6 @@
 
 static const char *TAG = "esp_cloud_ota";
 
-#define USER_ASSOC_TOPIC_SUFFIX "device/user/mapping"
-
 typedef struct {
     char *user_id;
     char *secret_key;
@@ -42,9 +40,8 @@ void esp_cloud_report_user_assoc(esp_cloud_handle_t handle, void *priv_data)
     json_obj_set_string(&jstr, "secret_key", data->secret_key);
     json_end_object(&jstr);
     json_str_end(&jstr);
-    char publish_topic[100];
-    snprintf(publish_topic, sizeof(publish_topic), "%s/%s", int_handle->device_id, USER_ASSOC_TOPIC_SUFFIX);
-    esp_err_t err = esp_cloud_platform_publish(int_handle, publish_topic, publish_payload);
+    esp_err_t err = esp_cloud_platform_publish_id(int_handle, ESP_CLOUD_TOPIC_USER_ASSOC, publish_payload,
+            strlen(publish_payload));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "User Assoc Publish Error %d", err);
     }
@@ -97,7 +94,8 @@ int esp_cloud_user_assoc_handler(uint32_t session_id, const uint8_t *inbuf, ssiz
                         ESP_LOGI(TAG, "Sending status SUCCESS");
                         payload.status = CLOUD__CLOUD_CONFIG_STATUS__Success;
                         payload.devicesecret = esp_cloud_get_device_id(esp_cloud_get_handle());
-                        esp_cloud_queue_work(esp_cloud_get_handle(), esp_cloud_report_user_assoc, user_assoc_data);
+                        esp_cloud_queue_work_with_prio(esp_cloud_get_handle(), ESP_CLOUD_WORK_PRIO_URGENT,
+                                esp_cloud_report_user_assoc, user_assoc_data);
                     }
                 }
             }